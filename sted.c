@@ -35,9 +35,10 @@
  * プロセス。また、仮想 ハブからのデータをローカルの ste
  * デバイスドライバに渡す。
  *
- *    gcc sted.c sted_socket.o -lsocket -lnsl -o sted
+ *    gcc sted.c sted_socket.o sted_dev.o sted_flow.o -lsocket -lnsl -lpthread -o sted
  *
  *  Usage: sted [ -i instance] [-h hub[:port]] [ -p proxy[:port]] [-d level]
+ *              [-n network] [-b backend] [-T] [-c connections]
  *
  *  引数:
  *
@@ -58,6 +59,35 @@
  *                    で実行され、標準エラー出力にデバッグ情報が
  *                    出力される。デフォルトは 0。
  *
+ *    -n network      参加する仮想ハブ内のネットワークの ID。仮想ハブは
+ *                    同じ ID のポート同士でだけフレームを転送する。
+ *                    指定されなければ ID を知らせず、仮想ハブは
+ *                    ネットワーク 0 として扱う。
+ *
+ *    -b backend[:arg]
+ *                    仮想 NIC デバイスのバックエンド。Solaris の ste ドライバ
+ *                    を使う ste、Linux の TAP デバイスを使う tap のうち、
+ *                    コンパイルした環境で使えるもの。デフォルトは先頭のもの。
+ *                    tap の場合は ste<instance> というインターフェースを作る。
+ *                    性能測定用に、カーネルの NIC を使わず、pcap ファイル
+ *                    か生成したフレームを読み込ませる loop も選べる。
+ *                    コロン(:)の後の arg はバックエンドに渡される。loop の
+ *                    arg は source[:rate[:count]]（sted_dev.c 参照）。
+ *
+ *    -T              HUB から仮想 NIC デバイスへの転送を別のスレッドで
+ *                    行う。デバイスから HUB への転送はメインスレッドが
+ *                    行うので、双方向に大量のデータが流れる時に 2 つの
+ *                    CPU を使える。片方向の送信や書き込みが遅くても、
+ *                    逆方向は待たされない。
+ *
+ *    -c connections  HUB との間に張る TCP 接続の数（最大 MAX_CONNS）。
+ *                    デフォルトは 1。デバイスから読み込んだフレームは、
+ *                    L2/L3/L4 のヘッダから求めたフローのハッシュ
+ *                    （sted_flow.c の flow_hash()）で接続に振り分けるので、
+ *                    同じフローのフレームの順序は変わらない。tap では
+ *                    マルチキューの TAP デバイスを作って接続毎にキューを
+ *                    開け、キューと接続の組毎に別のスレッドで処理する。
+ *
  * 変更履歴：
  *
  *  2004/12/15
@@ -95,55 +125,127 @@
  *   o sock_stat と driver_stat を統一し、sted_stat とした。
  *  2006/04/04
  *   o DLPI 関連の関数を独立させ、dlpiutil.c に記述するすることにした。
+ *  2026/10/17
+ *   o 仮想ハブ内のネットワーク ID を指定できるようにした（-n オプション）。
+ *   o デバイスの読み書きを sted_dev.c のバックエンドに分け、Linux の
+ *     TAP デバイスを使えるようにした（-b オプション）。
+ *   o 性能測定用の loop バックエンドを追加した。
+ *   o select() で SELECT_TIMEOUT（0.4 秒）毎に起きるのをやめ、poll() で
+ *     待つようにした。送信バッファに残したデータは FLUSH_TIMEOUT
+ *     （200 マイクロ秒）後に送信し、Linux では timerfd で時刻を計る。
+ *   o 送信バッファに溜める量と時間を、フレームの到着間隔と socket の
+ *     詰まり具合から決めるようにした（coalesce()）。SENDBUF_THRESHOLD
+ *     は溜める量の最小値になった。
+ *   o 送信バッファをリングにし、send() が EWOULDBLOCK になったり一部
+ *     しか送れなかった時に、捨てずに socket が書き込めるようになって
+ *     から続きを送るようにした。リングに空きが無い間はデバイスから
+ *     読み込まない。
+ *   o 仮想ハブから受信したフレームを、コピーせずに受信バッファから直接
+ *     デバイスに書き込むようにした。
+ *   o 1 回の起床でデバイスから DEV_BUDGET フレームまで続けて読み込み、
+ *     まとめて送信するようにした。また、HUB からのデータとデバイスからの
+ *     データを同じ周回で処理するようにした。
+ *   o HUB からデバイスへの転送を別スレッドで行うモードを追加した（-T オプション）。
+ *   o HUB との間に複数の TCP 接続を張り、フレームをフロー毎に振り分けられる
+ *     ようにした（-c オプション）。main() のループは接続のグループ毎の
+ *     group_main() になった。
  ***********************************************************/
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
-#include <stropts.h>
-#include <sys/stream.h>
-#include <sys/dlpi.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
 #include <string.h>
 #include <errno.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <signal.h>
 #include <stdarg.h>
+#if defined(__sun)
 #include <sys/ethernet.h>
+#endif
+#include <poll.h>
+#include <time.h>
+#include <sys/time.h>
+#include <inttypes.h>
+#if defined(__linux__)
+#include <sys/timerfd.h>
+#define  HAVE_TIMERFD
+#endif
 #include <strings.h>
 #include <syslog.h>
 #include <libgen.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <pthread.h>
 #include "sted.h"
 #include "ste.h"
-#include "dlpiutil.h"
 
 int debuglevel = 0;   /* デバッグレベル。1 以上にした場合は フォアグランドで実行される */
 int use_syslog = 0;  /* メッセージを STDERR でなく、syslog に出力する */
 
-int open_ste(stedstat_t *, char *, int);
-int read_ste(stedstat_t *);
-int write_ste(stedstat_t *);
+/*
+ * HUB との接続のグループ。グループは 1 つのスレッドが受け持ち、仮想 NIC
+ * デバイスの 1 つの fd（キュー）を共有する。デバイスがマルチキューなら
+ * 接続毎に 1 つ、そうでなければ全接続で 1 つのグループになる。
+ *
+ * スレッドモード（-T）では、グループ毎に受信スレッドを作る。socket の
+ * 障害を見つけた受信スレッドは、wake_fd に書き込んでから broken と
+ * rx_parked をセットし、グループのスレッドが新しい接続を開いて rx_parked
+ * をクリアするのを待つ。
+ */
+typedef struct group
+{
+    stedstat_t  **lanes;       /* このグループの接続 */
+    int           nlanes;      /* lanes の要素数 */
+    pthread_t     thread;      /* グループを受け持つスレッド（グループ 0 はメインスレッド）*/
+    pthread_t     rx_thread;   /* 受信スレッド */
+    int           rx_parked;   /* 受信スレッドが再接続を待っている */
+    int           broken;      /* 受信スレッドが障害を見つけた接続（lanes 中の位置のビット）*/
+    int           wake_fd[2];  /* 受信スレッドが障害を知らせるパイプ */
+} group_t;
+
+int open_ste(stedstat_t *, int);
+int read_ste(stedstat_t **, int);
+int write_ste(stedstat_t *, unsigned char *, int);
+void close_ste(stedstat_t *);
 int become_daemon();
+int flush_timeout(stedstat_t *);
+int coalesce(stedstat_t *, int);
+int group_main(group_t *);
+void *group_thread(void *);
+int reconnect(group_t *, int);
+void *rx_main(void *);
+void stop_sted();
+
+char *hub = NULL;                    /* -h で指定された仮想ハブ */
+char *proxy = NULL;                  /* -p で指定されたプロキシーサーバ */
+int threaded = 0;                    /* HUB → デバイスを受信スレッドで処理する */
+int mq = 0;                          /* 接続毎にデバイスのキューを開けている */
+stedstat_t *lanes[MAX_CONNS];        /* HUB との接続毎の sted 管理構造体 */
+int nlanes = 1;                      /* HUB との接続の数 */
+group_t groups[MAX_CONNS];           /* 接続のグループ */
+int ngroups = 1;                     /* グループの数 */
+pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER; /* rx_parked、broken を保護する */
+pthread_cond_t  conn_cond = PTHREAD_COND_INITIALIZER;  /* rx_parked が変わったことを知らせる */
+pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER; /* open_socket() を 1 つずつ呼ぶ */
+pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER; /* stop_sted() を 1 回だけ実行する */
 
 int
 main(int argc, char *argv[])
 {
-    int  ste_fd, sock_fd;
-    int c, ret;
-    struct fd_set fds;
+    int c, i;
     int instance = 0;  /* インターフェースのインスタンス番号。*/
-    int hub_port = 0;  /* 仮想ハブのポート番号 */
-    char *hub = NULL;
-    char *proxy= NULL;
+    int network = -1;  /* 仮想ハブに知らせるネットワーク ID */
+    char *backend = NULL; /* 仮想 NIC デバイスのバックエンド */
+    char *devarg = NULL;
     char localhost[] = "localhost:80";
-    char dummy;
-    struct timeval timeout;
-    stedstat_t stedstat[1];
-    
-    while ((c = getopt(argc, argv, "d:i:h:p:")) != EOF){
+    uint32_t bundle;
+    stedev_t *dev;
+    stedstat_t *stedstat;
+
+    while ((c = getopt(argc, argv, "d:i:h:p:n:b:Tc:")) != EOF){
         switch (c) {
             case 'i':
                 instance = atoi(optarg);                
@@ -157,6 +259,21 @@ main(int argc, char *argv[])
             case 'd':
                 debuglevel = atoi(optarg);
                 break;
+            case 'n':
+                if((network = atoi(optarg)) < 0)
+                    print_usage(argv[0]);
+                break;
+            case 'b':
+                backend = optarg;
+                break;
+            case 'T':
+                threaded = 1;
+                break;
+            case 'c':
+                nlanes = atoi(optarg);
+                if(nlanes < 1 || nlanes > MAX_CONNS)
+                    print_usage(argv[0]);
+                break;
             default:
                 print_usage(argv[0]);
         }
@@ -165,19 +282,63 @@ main(int argc, char *argv[])
     if(hub == NULL)
         hub = localhost;
 
+    if(backend != NULL && (devarg = strchr(backend, ':')) != NULL)
+        *devarg++ = '\0';
+    if((dev = dev_find(backend)) == NULL){
+        fprintf(stderr, "unknown backend: %s\n", backend);
+        print_usage(argv[0]);
+    }
+    mq = (nlanes > 1 && dev->mq);
+
     /* syslog のための設定。Facility は　LOG_USER とする */
     openlog(basename(argv[0]),LOG_PID,LOG_USER);
 
-    /* ste の stream  をオープン */
-    if ((ste_fd = open_ste(stedstat, STEPATH, instance)) < 0){
-        print_err(LOG_ERR,"Failed to open %s(instance:%d)\n",STEPATH, instance);
-        goto err;
+    /*
+     * 仮想ハブが同じ sted からの接続をまとめるための ID。再起動した
+     * sted とは別のものになるよう、プロセス ID と時刻から作る。
+     */
+    bundle = ((uint32_t)getpid() << 16) ^ (uint32_t)sted_nsec();
+    if(bundle == 0)
+        bundle = 1;
+    for(i = 0 ; i < nlanes ; i++){
+        if((stedstat = (stedstat_t *)calloc(1, sizeof(stedstat_t))) == NULL){
+            print_err(LOG_ERR,"calloc:%s\n", strerror(errno));
+            goto err;
+        }
+        stedstat->sock_fd = -1;
+        stedstat->ste_fd = -1;
+        stedstat->timer_fd = -1;
+        stedstat->network = network;
+        stedstat->lane = i;
+        stedstat->nlanes = nlanes;
+        stedstat->bundle = bundle;
+        stedstat->gap_avg = COALESCE_IDLE * 1000ULL;
+        stedstat->dev = dev;
+        stedstat->devarg = devarg;
+        lanes[i] = stedstat;
+    }
+
+    /*
+     * 仮想 NIC デバイスをオープン。マルチキューのデバイスなら接続毎に
+     * キューを開け、そうでなければ全接続で 1 つの fd を共有する。
+     */
+    for(i = 0 ; i < nlanes ; i++){
+        if(i > 0 && !mq){
+            lanes[i]->ste_fd = lanes[0]->ste_fd;
+            continue;
+        }
+        if (open_ste(lanes[i], instance) < 0){
+            print_err(LOG_ERR,"Failed to open %s(instance:%d)\n", dev->path, instance);
+            goto err;
+        }
     }
     
     /* HUB との間の Connection をオープン */
-    if ((sock_fd = open_socket(stedstat, hub, proxy)) < 0){
-        print_err(LOG_ERR,"failed to open connection with hub\n");
-        goto err;
+    for(i = 0 ; i < nlanes ; i++){
+        if (open_socket(lanes[i], hub, proxy) < 0){
+            print_err(LOG_ERR,"failed to open connection with hub\n");
+            goto err;
+        }
     }
 
     /*
@@ -193,65 +354,212 @@ main(int argc, char *argv[])
         }
     }
 
-    FD_ZERO(&fds);
-    
+#ifdef HAVE_TIMERFD
+    for(i = 0 ; i < nlanes ; i++){
+        if((lanes[i]->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0){
+            print_err(LOG_ERR,"timerfd_create:%s\n", strerror(errno));
+            goto err;
+        }
+    }
+#endif
+
+    /*
+     * グループ 0 はメインスレッドが、それ以外はグループ毎のスレッドが
+     * 受け持つ。
+     */
+    ngroups = mq ? nlanes : 1;
+    for(i = 0 ; i < ngroups ; i++){
+        groups[i].lanes = lanes + i;
+        groups[i].nlanes = mq ? 1 : nlanes;
+        groups[i].wake_fd[0] = groups[i].wake_fd[1] = -1;
+    }
+    for(i = 1 ; i < ngroups ; i++){
+        if((errno = pthread_create(&groups[i].thread, NULL, group_thread, (void *)&groups[i])) != 0){
+            print_err(LOG_ERR,"pthread_create:%s\n", strerror(errno));
+            goto err;
+        }
+    }
+    group_main(&groups[0]);
+
+  err:
+    stop_sted();
+    return(1);
+}
+
+/*****************************************************************************
+ * group_main()
+ * 
+ * 接続のグループのメインループ。グループの接続と仮想 NIC デバイスの
+ * fd を poll() で待ち、HUB からのデータをデバイスに、デバイスからの
+ * データを HUB に転送する。スレッドモードでは、HUB からのデータは受信
+ * スレッドが処理する。socket に障害が発生したら再接続する。
+ *
+ *  引数：
+ *           g : グループ
+ *
+ * 戻り値：
+ *          障害時 : -1（再接続できなかった場合だけ戻る）
+ *****************************************************************************/
+int
+group_main(group_t *g)
+{
+    int n = g->nlanes;
+    int i, ret, timeout, room, flush;
+    struct pollfd pfds[2 * MAX_CONNS + 2];
+    uint64_t expirations;
+    stedstat_t *stedstat;
+
+    /*
+     * スレッドモードでは、HUB からのデータは受信スレッドが読み込んで
+     * デバイスに書き込む。socket の受信側と受信バッファは受信スレッドだけ
+     * が、送信側と送信リングはこのスレッドだけが使うので、フレームを
+     * スレッド間で受け渡す必要は無い。
+     */
+    if(threaded){
+        if(pipe(g->wake_fd) < 0){
+            print_err(LOG_ERR,"pipe:%s\n", strerror(errno));
+            return(-1);
+        }
+        fcntl(g->wake_fd[0], F_SETFL, O_NONBLOCK);
+        if((errno = pthread_create(&g->rx_thread, NULL, rx_main, (void *)g)) != 0){
+            print_err(LOG_ERR,"pthread_create:%s\n", strerror(errno));
+            return(-1);
+        }
+    }
+
+    /*
+     * 送信バッファにデータを残している間だけタイマーを使い、それ以外は
+     * 送受信があるまで待ち続ける。fd が -1 のエントリは poll() が無視する。
+     * pfds は接続毎の socket、接続毎のタイマー、デバイス、wake_fd の順。
+     */
     while(1){
-        FD_SET(ste_fd, &fds );
-        FD_SET(sock_fd, &fds);
-        timeout.tv_sec = 0;
-        timeout.tv_usec = SELECT_TIMEOUT;
+        /*
+         * 送信リングに残りがあれば socket が書き込めるようになるのを待ち、
+         * どれかの接続の送信リングに空きが無い間はデバイスから読み込まない。
+         */
+        room = 1;
+        timeout = -1;
+        for(i = 0 ; i < n ; i++){
+            stedstat = g->lanes[i];
+            pfds[i].fd = stedstat->sock_fd;
+            pfds[i].events = (threaded ? 0 : POLLIN) | (stedstat->sock_blocked ? POLLOUT : 0);
+            pfds[n + i].fd = stedstat->timer_fd;
+            pfds[n + i].events = POLLIN;
+            if(SENDRING_SIZE - stedstat->sendbuflen < FRAME_MAX)
+                room = 0;
+            ret = flush_timeout(stedstat);
+            if(ret >= 0 && (timeout < 0 || ret < timeout))
+                timeout = ret;
+        }
+        pfds[2 * n].fd = g->lanes[0]->ste_fd;
+        pfds[2 * n].events = room ? POLLIN : 0;
+        pfds[2 * n + 1].fd = g->wake_fd[0];
+        pfds[2 * n + 1].events = POLLIN;
         
-        if( (ret = select(FD_SETSIZE, &fds, NULL, NULL, &timeout)) < 0){
-            print_err(LOG_ERR,"select:%s\n", strerror(errno));
-            goto err;
-        } else if ( ret == 0 && stedstat->sendbuflen > 0 ){
-            /*
-             * SELECT_TIMEOUT 間に送受信がなければ、送信バッファーのデータを
-             * 送信する。
-             */
-            if(debuglevel > 1){
-                print_err(LOG_DEBUG, "select timeout(sendbuflen = %d)\n", stedstat->sendbuflen);
-            }
-            if (write_socket(stedstat) < 0){
-                    goto err;
-            }
+        if( (ret = poll(pfds, 2 * n + 2, timeout)) < 0){
+            if(errno == EINTR)
+                continue;
+            print_err(LOG_ERR,"poll:%s\n", strerror(errno));
+            return(-1);
+        }
+        if(pfds[2 * n + 1].revents & POLLIN){
+            /* 受信スレッドが socket の障害を見つけた。再接続に行く */
+            if (reconnect(g, -1) < 0)
+                return(-1);
             continue;
         }
-        /* HUB からのデータ */
-        if(FD_ISSET(sock_fd, &fds)){
-            if(read_socket(stedstat) < 0){
-                /* socket にエラーが発生した模様。再接続に行く */                
-                close(sock_fd);
-                stedstat->sock_fd = -1;
-                if ((sock_fd = open_socket(stedstat, hub, proxy)) < 0){
-                    print_err(LOG_ERR,"failed to re-open connection with hub\n");
-                    goto err;
+
+        for(i = 0 ; i < n ; i++){
+            stedstat = g->lanes[i];
+            if(pfds[n + i].revents & POLLIN)
+                read(stedstat->timer_fd, &expirations, sizeof(expirations));
+            if(stedstat->flush_at != 0 && sted_nsec() >= stedstat->flush_at){
+                /*
+                 * 次のフレームが来ないまま送信する時刻になった送信バッファーの
+                 * データを送信する。
+                 */
+                if(debuglevel > 1){
+                    print_err(LOG_DEBUG, "flush timeout(sendbuflen = %d)\n", stedstat->sendbuflen);
+                }
+                if (write_socket(stedstat) < 0){
+                    if (reconnect(g, i) < 0)
+                        return(-1);
+                    continue;
+                }
+            }
+            /*
+             * 送信リングの残りを送信する。エラーは、続く read_socket() で
+             * （スレッドモードでは受信スレッドが）検出して再接続する。
+             */
+            if(pfds[i].revents & POLLOUT)
+                write_socket(stedstat);
+            /*
+             * HUB からのデータと、仮想 NIC デバイスからのデータを、同じ周回で
+             * 両方処理する。どちらも 1 回で読む量に上限があるので、片方が
+             * もう片方を待たせ続けることはない。
+             */
+            if(!threaded && (pfds[i].revents & (POLLIN | POLLERR | POLLHUP))){
+                if(read_socket(stedstat) < 0){
+                    /* socket にエラーが発生した模様。再接続に行く */                
+                    if (reconnect(g, i) < 0)
+                        return(-1);
                 }
             }
-            continue;
         }
-        /* ste ドライバからのデータ */
-        if(FD_ISSET(ste_fd, &fds)){
-            if(read_ste(stedstat) < 0){
-                /* socket にエラーが発生した模様。再接続に行く */
-                close(sock_fd);
-                stedstat->sock_fd = -1;                
-                if ((sock_fd = open_socket(stedstat, hub, proxy)) < 0){
-                    print_err(LOG_ERR,"failed to re-open connection with hub\n");
-                    goto err;
-                }                
+
+        if(pfds[2 * n].revents & (POLLIN | POLLERR | POLLHUP)){
+            flush = read_ste(g->lanes, n);
+            for(i = 0 ; i < n ; i++){
+                if((flush & (1 << i)) && write_socket(g->lanes[i]) < 0){
+                    /* socket にエラーが発生した模様。再接続に行く */
+                    if (reconnect(g, i) < 0)
+                        return(-1);
+                }
             }
-            continue;
         }
     } /* main loop end */
+}
 
-  err:
+/*****************************************************************************
+ * group_thread()
+ * 
+ * グループ 0 以外のグループを受け持つスレッド。group_main() が戻ったら
+ * sted を終了する。
+ *
+ *  引数：
+ *           arg : グループ
+ *
+ * 戻り値：
+ *          常に NULL（戻らない）
+ *****************************************************************************/
+void *
+group_thread(void *arg)
+{
+    group_main((group_t *)arg);
+    stop_sted();
+    return(NULL);
+}
+
+/*****************************************************************************
+ * stop_sted()
+ * 
+ * 仮想 NIC デバイスをクローズし、sted を終了する。複数のスレッドが
+ * 呼んだ場合は、最初に呼んだスレッドが終了させる。
+ *****************************************************************************/
+void
+stop_sted()
+{
+    int i;
+
+    pthread_mutex_lock(&stop_lock);
     /*
-     * もし /dev/ste をまだオープンしているなら、まず登録解除してから
+     * もし仮想 NIC デバイスをまだオープンしているなら、まず登録解除してから
      * 終了する。
      */
-    if(ste_fd > 0)
-        strioctl(ste_fd, UNREGSVC, -1, sizeof(int), (char *)&dummy);
+    for(i = 0 ; i < nlanes ; i++){
+        if(lanes[i] != NULL && lanes[i]->ste_fd >= 0 && (i == 0 || mq))
+            close_ste(lanes[i]);
+    }
     print_err(LOG_ERR,"Stopped\n");
     exit(1);
 }
@@ -259,138 +567,381 @@ main(int argc, char *argv[])
 /*****************************************************************************
  * read_ste()
  * 
- * ste ドライバからのデータを読み込み、HUB(stehub) に転送する。
+ * 仮想 NIC デバイスからのデータを読み込み、HUB(stehub) への送信リングに
+ * 書く。デバイスが空になるか、DEV_BUDGET フレーム読み込むか、どれかの
+ * 接続の送信リングに空きが無くなるまで続けて読み込む。接続が複数なら、
+ * フレーム毎に flow_hash() で接続を選ぶので、同じフローのフレームは
+ * 同じ接続を順に通る。送信は呼び出し側がまとめて行う。
  *
  *  引数：
- *           stedstat : sted 管理構造体
+ *           lanes  : デバイスを共有する接続の sted 管理構造体の配列
+ *           nlanes : lanes の要素数
  *
  * 戻り値：
- *          正常時 : 0
- *          障害時 : -1
+ *          すぐに送信する接続の、lanes 中の位置のビットマスク
  *****************************************************************************/
 int
-read_ste(stedstat_t *stedstat)
+read_ste(stedstat_t **lanes, int nlanes)
 {
-    struct strbuf rdata;
     stehead_t steh;
-    int flags = 0;    
-    int pad = 0;    /* パディング */
-    int remain = 0; /* 全データ長を 4 で割った余り */
-    int ret;
-    uchar_t *sendbuf  = stedstat->sendbuf;    /* Socket 送信バッファ*/
-    uchar_t *rdatabuf = stedstat->rdatabuf; /* ドライバからの読み込み用バッファ */
-    int ste_fd        = stedstat->ste_fd;   /* 仮想 NIC デバイスをオープンした FD */
-    uchar_t *sendp;   /* Socket 送信バッファの書き込み位置ポインタ */
+    int pad;        /* パディング */
+    int remain;     /* 全データ長を 4 で割った余り */
+    stedstat_t *devstat = lanes[0]; /* デバイスを読み込む接続 */
+    stedstat_t *stedstat;           /* フレームを送る接続 */
+    unsigned char *rdatabuf = devstat->rdatabuf; /* ドライバからの読み込み用バッファ */
+    static unsigned char zero[3];
     int readsize;
+    int nframes;    /* この呼び出しで読み込んだフレーム数 */
+    int flush = 0;  /* すぐに送信する接続 */
+    int i;
 
-    sendp = sendbuf + stedstat->sendbuflen;    
-    rdata.buf = (char *)rdatabuf;        
-    rdata.maxlen = STRBUFSIZE;
-    rdata.len = 0;
-
-    ret = getmsg(ste_fd, NULL, &rdata, &flags);
-
-    if ((ret & (MORECTL | MOREDATA)) == (MORECTL | MOREDATA))        
-        print_err(LOG_NOTICE, "getmsg() returns MOREDATA or MORECTL\n");
+    for(nframes = 0 ; nframes < DEV_BUDGET ; nframes++){
+        /*
+         * 送信リングに空きが無ければ読み込まない。デバイスのキューが溜まり、
+         * 送信元に背圧がかかる。どの接続に送るかは読み込むまでわからない
+         * ので、すべての接続に空きが必要。
+         */
+        for(i = 0 ; i < nlanes ; i++){
+            if(SENDRING_SIZE - lanes[i]->sendbuflen < FRAME_MAX)
+                break;
+        }
+        if(i < nlanes)
+            break;
 
-    readsize = rdata.len;
+        /*
+         * デバイスのエラーは接続の障害ではないので、フレームが無かったものとする。
+         */
+        if((readsize = devstat->dev->read(devstat, rdatabuf, STRBUFSIZE)) <= 0)
+            break;
+        if(readsize > ETHERMAX){
+            print_err(LOG_NOTICE, "frame too large (%d bytes), dropped\n", readsize);
+            continue;
+        }
 
-    if (debuglevel > 1){
-        print_err(LOG_DEBUG,"========= from ste %d bytes ==================\n",readsize);
-        if(debuglevel > 2){
-            int i;
-            for (i = 0; i < readsize; i++){
-                if((i)%16 == 0){
-                    print_err(LOG_DEBUG,"\n%04d: ", i);                    
+        if (debuglevel > 1){
+            print_err(LOG_DEBUG,"========= from ste %d bytes ==================\n",readsize);
+            if(debuglevel > 2){
+                int i;
+                for (i = 0; i < readsize; i++){
+                    if((i)%16 == 0){
+                        print_err(LOG_DEBUG,"\n%04d: ", i);                    
+                    }
+                    print_err(LOG_DEBUG, "%02x ", rdatabuf[i] & 0xff);                
                 }
-                print_err(LOG_DEBUG, "%02x ", rdatabuf[i] & 0xff);                
+                print_err(LOG_DEBUG, "\n\n");
             }
-            print_err(LOG_DEBUG, "\n\n");
         }
-    }
+
+        i = nlanes > 1 ? flow_hash(rdatabuf, readsize) % nlanes : 0;
+        stedstat = lanes[i];
             
-    if( remain = ( sizeof(stehead_t) + readsize ) % 4 )
-        pad = 4 - remain;
-    steh.len = htonl(readsize + pad);
-    steh.orglen = htonl(readsize);
-    if(debuglevel > 1){
-        print_err(LOG_DEBUG, "stehead.len    = %d\n", ntohl(steh.len));
-        print_err(LOG_DEBUG, "stehead.pad    = %d\n", pad);                                    
-        print_err(LOG_DEBUG, "stehead.orglen = %d\n", ntohl(steh.orglen));
+        pad = 0;
+        if( (remain = ( sizeof(stehead_t) + readsize ) % 4) )
+            pad = 4 - remain;
+        steh.len = htonl(readsize + pad);
+        steh.orglen = htonl(readsize);
+        if(debuglevel > 1){
+            print_err(LOG_DEBUG, "stehead.len    = %d\n", ntohl(steh.len));
+            print_err(LOG_DEBUG, "stehead.pad    = %d\n", pad);                                    
+            print_err(LOG_DEBUG, "stehead.orglen = %d\n", ntohl(steh.orglen));
+            print_err(LOG_DEBUG, "connection     = %d\n", stedstat->lane);
+        }
+        sendring_put(stedstat, &steh, sizeof(stehead_t));
+        sendring_put(stedstat, rdatabuf, readsize);
+        sendring_put(stedstat, zero, pad);
+
+        /*
+         * すぐに送信するか、送信バッファに溜めておくかを決める。送信は
+         * 続けて読めるフレームを読み終わってからまとめて行う。
+         */
+        if( coalesce(stedstat, sizeof(stehead_t) + readsize + pad) )
+            flush |= 1 << i;
     }
-    memcpy(sendp, &steh, sizeof(stehead_t));
-    memcpy(sendp + sizeof(stehead_t), rdata.buf, readsize);
-    memset(sendp + sizeof(stehead_t) + readsize, 0x0, pad);
-    stedstat->sendbuflen += sizeof(stehead_t) + readsize + pad;
 
-    /*
-     * ste から受け取ったサイズが ETHERMAX(1514byte)より小さいか、
-     * 送信バッファへの書き込み済みサイズが SENDBUF_THRESHOLD 以上になったら送信する
-     */
-    if( readsize < ETHERMAX || stedstat->sendbuflen > SENDBUF_THRESHOLD){
-        if(debuglevel > 1){        
-            print_err(LOG_DEBUG, "readsize = %d, sendbuflen = %d\n",
-                      readsize, stedstat->sendbuflen);
-        }
-        if ( write_socket(stedstat) < 0){
+    if(debuglevel > 1 && flush){        
+        print_err(LOG_DEBUG, "nframes = %d, flush = 0x%x\n", nframes, flush);
+    }
+    return(flush);
+}
+
+/*****************************************************************************
+ * reconnect()
+ * 
+ * グループの接続を閉じ、開き直す。lane が -1 なら、受信スレッドが障害を
+ * 見つけた接続だけを開き直す。スレッドモードでは、まず socket を
+ * shutdown() して受信スレッドに障害を気づかせ、受信スレッドが古い
+ * socket を使わなくなってから閉じる。新しい接続を開いたら受信スレッド
+ * を再開させる。
+ *
+ *  引数：
+ *           g    : グループ
+ *           lane : 開き直す接続の lanes 中の位置。または -1
+ *
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+int
+reconnect(group_t *g, int lane)
+{
+    char buf[16];
+    int  broken = 0, i, ret;
+    stedstat_t *stedstat;
+
+    if(lane >= 0)
+        broken = 1 << lane;
+    if(threaded){
+        if(lane >= 0)
+            shutdown(g->lanes[lane]->sock_fd, SHUT_RDWR);
+        pthread_mutex_lock(&conn_lock);
+        while(!g->rx_parked)
+            pthread_cond_wait(&conn_cond, &conn_lock);
+        broken |= g->broken;
+        pthread_mutex_unlock(&conn_lock);
+        /* 受信スレッドは rx_parked をセットする前に wake_fd に書いている */
+        while(read(g->wake_fd[0], buf, sizeof(buf)) > 0)
+            ;
+    }
+    for(i = 0 ; i < g->nlanes ; i++){
+        if(!(broken & (1 << i)))
+            continue;
+        stedstat = g->lanes[i];
+        close(stedstat->sock_fd);
+        stedstat->sock_fd = -1;
+        /* open_socket() は gethostbyname() の結果を static な領域に持つ */
+        pthread_mutex_lock(&open_lock);
+        ret = open_socket(stedstat, hub, proxy);
+        pthread_mutex_unlock(&open_lock);
+        if (ret < 0){
+            print_err(LOG_ERR,"failed to re-open connection with hub\n");
             return(-1);
         }
     }
+    if(threaded){
+        pthread_mutex_lock(&conn_lock);
+        g->rx_parked = 0;
+        g->broken = 0;
+        pthread_cond_broadcast(&conn_cond);
+        pthread_mutex_unlock(&conn_lock);
+    }
+    return(0);
+}
+
+/*****************************************************************************
+ * rx_main()
+ * 
+ * スレッドモードの受信スレッド。グループの接続の HUB からのデータを
+ * 読み込み、仮想 NIC デバイスに書き込む。socket に障害が発生したら、
+ * グループのスレッドに知らせて再接続を待つ。
+ *
+ *  引数：
+ *           arg : グループ
+ *
+ * 戻り値：
+ *          常に NULL（戻らない）
+ *****************************************************************************/
+void *
+rx_main(void *arg)
+{
+    group_t      *g = (group_t *)arg;
+    struct pollfd pfds[MAX_CONNS];
+    char          one = 0;
+    int           i, broken;
+
+    while(1){
+        pthread_mutex_lock(&conn_lock);
+        while(g->rx_parked)
+            pthread_cond_wait(&conn_cond, &conn_lock);
+        for(i = 0 ; i < g->nlanes ; i++){
+            pfds[i].fd = g->lanes[i]->sock_fd;
+            pfds[i].events = POLLIN;
+        }
+        pthread_mutex_unlock(&conn_lock);
+
+        broken = 0;
+        while(broken == 0){
+            if(poll(pfds, g->nlanes, -1) < 0){
+                if(errno == EINTR)
+                    continue;
+                print_err(LOG_ERR,"poll:%s\n", strerror(errno));
+                broken = (1 << g->nlanes) - 1;
+                break;
+            }
+            for(i = 0 ; i < g->nlanes ; i++){
+                if((pfds[i].revents & (POLLIN | POLLERR | POLLHUP)) &&
+                   read_socket(g->lanes[i]) < 0)
+                    broken |= 1 << i;
+            }
+        }
+
+        write(g->wake_fd[1], &one, 1);
+        pthread_mutex_lock(&conn_lock);
+        g->broken |= broken;
+        g->rx_parked = 1;
+        pthread_cond_broadcast(&conn_cond);
+        pthread_mutex_unlock(&conn_lock);
+    }
+    return(NULL);
+}
+
+/*****************************************************************************
+ * coalesce()
+ * 
+ * 送信バッファにフレームを書いた後に呼び、すぐに送信するかどうかを決める。
+ * 前のフレームから COALESCE_IDLE 以上空いていれば、遅延を増やさないよう
+ * すぐに送信する。フレームが続けて到着している間は、到着間隔とフレーム
+ * サイズの移動平均から FLUSH_TIMEOUT の間に届く量を見積もり、それを
+ * しきい値（SENDBUF_THRESHOLD 以上 COALESCE_MAX 以下）として溜める。
+ * socket が詰まっている間は、書き込めるようになるまで溜める。
+ * それ以外で溜めた場合は、平均の到着間隔の COALESCE_GAPS 倍（最大 FLUSH_TIMEOUT）
+ * 後に送信するようタイマーをセットする。
+ *
+ *  引数：
+ *           stedstat : sted 管理構造体
+ *           len      : 書いたフレームのサイズ（stehead、パディングを含む）
+ * 戻り値：
+ *          すぐに送信する : 1
+ *          溜めておく     : 0
+ *****************************************************************************/
+int
+coalesce(stedstat_t *stedstat, int len)
+{
+    uint64_t now = sted_nsec();
+    uint64_t gap = now - stedstat->last_read;
+    uint64_t threshold, delay;
+
+    stedstat->last_read = now;
+    stedstat->size_avg = (stedstat->size_avg * 7 + len) / 8;
+    if(gap >= COALESCE_IDLE * 1000ULL){
+        stedstat->gap_avg = COALESCE_IDLE * 1000ULL;
+        return(1);
+    }
+    stedstat->gap_avg = (stedstat->gap_avg * 7 + gap) / 8;
+
+    /* socket が書き込めるようになったら、main() が送信する */
+    if(stedstat->sock_blocked)
+        return(0);
+
+    threshold = FLUSH_TIMEOUT * 1000ULL * stedstat->size_avg / (stedstat->gap_avg + 1);
+    if(threshold < SENDBUF_THRESHOLD)
+        threshold = SENDBUF_THRESHOLD;
+    if(threshold > COALESCE_MAX)
+        threshold = COALESCE_MAX;
+    if(stedstat->sendbuflen >= threshold)
+        return(1);
+
+    delay = stedstat->gap_avg * COALESCE_GAPS;
+    if(delay > FLUSH_TIMEOUT * 1000ULL)
+        delay = FLUSH_TIMEOUT * 1000ULL;
+    set_flush_timer(stedstat, delay);
     return(0);
 }
 
 /*****************************************************************************
  * open_ste()
  * 
- * /dev/ste をオープンし、PPA（インスタンス番号）にアタッチする。
- * また、オープンされた stream を ste ドライバ内で保持するために
- * IOCTL コマンドの REGSVC（ste オリジナル）を発行する。
+ * stedstat の dev が指す仮想 NIC デバイスのバックエンドで、インスタンス
+ * 番号 ppa のデバイスをオープンする。
  *
  *  引数：
  *           stedstat :  sted 管理構造体
- *           devname    : デバイス名(/dev/ste)
- *           ppa        : PPA（仮想 NIC のインスタンス番号）
+ *           ppa      : PPA（仮想 NIC のインスタンス番号）
  * 戻り値：
  *         正常時   : ファイルディスクリプタ
  *         エラー時 :  -1
  *****************************************************************************/
 int
-open_ste(stedstat_t *stedstat, char *devname, int ppa)
+open_ste(stedstat_t *stedstat, int ppa)
 {
-    int ste_fd;
-    char dummy;
-    uchar_t *rdatabuf = stedstat->rdatabuf; /* ドライバからの読み込み用バッファ*/
-    
-    ste_fd = open(devname, O_RDWR, 0666);
-    if ( ste_fd < 0){
-        print_err(LOG_ERR, "open: %s\n", strerror(errno));                            
-        return(-1);
-    }
+    if(debuglevel > 0)
+        print_err(LOG_DEBUG, "opening %s backend (instance:%d)\n", stedstat->dev->name, ppa);
+    return(stedstat->dev->open(stedstat, ppa));
+}
 
-    stedstat->ste_fd = ste_fd;
-    
-    if(dlattachreq(ste_fd, ppa, (char *)rdatabuf) < 0){
-        close(ste_fd);
-        print_err(LOG_ERR, "dlattach:error\n");//todo
-        return(-1);
-    }
+/*****************************************************************************
+ * close_ste()
+ * 
+ * 仮想 NIC デバイスをクローズする。ste ドライバの場合は登録解除も行う。
+ *****************************************************************************/
+void
+close_ste(stedstat_t *stedstat)
+{
+    stedstat->dev->close(stedstat);
+}
 
-    /*
-     * read queue を flash するよう要求。
-     */
-    if (ioctl(ste_fd, I_FLUSH, FLUSHR) < 0){
-        close(ste_fd);
-        print_err(LOG_ERR, "ioctl:I_FLUSH:%s\n", strerror(errno));
-        return(-1);
+
+/*****************************************************************************
+ * set_flush_timer()
+ * 
+ * 送信バッファにデータを残した時に呼び、delay 後に送信されるようにする。
+ * 既に送信する時刻が決まっていれば、それを変えない。
+ * タイマーは送信しても止めないので、満了した時に flush_at が 0 なら
+ * 何もしない。
+ *
+ *  引数：
+ *           stedstat : sted 管理構造体
+ *           delay    : 送信するまでの時間（ナノ秒）
+ *****************************************************************************/
+void
+set_flush_timer(stedstat_t *stedstat, uint64_t delay)
+{
+    if(stedstat->flush_at != 0)
+        return;
+    stedstat->flush_at = sted_nsec() + delay;
+#ifdef HAVE_TIMERFD
+    if(stedstat->timer_fd >= 0){
+        struct itimerspec its;
+
+        memset(&its, 0x0, sizeof(its));
+        its.it_value.tv_sec = delay / 1000000000ULL;
+        its.it_value.tv_nsec = delay % 1000000000ULL;
+        timerfd_settime(stedstat->timer_fd, 0, &its, NULL);
     }
+#endif
+}
+
+/*****************************************************************************
+ * flush_timeout()
+ * 
+ * poll() のタイムアウト（ミリ秒）を返す。timerfd を使う場合や、送信
+ * バッファにデータが無い場合は、送受信があるまで待つので -1。
+ * timerfd が無い環境ではミリ秒に切り上げる。
+ *
+ *  引数：
+ *           stedstat : sted 管理構造体
+ * 戻り値：
+ *          poll() のタイムアウト
+ *****************************************************************************/
+int
+flush_timeout(stedstat_t *stedstat)
+{
+    uint64_t now;
 
-    if (strioctl(ste_fd, REGSVC, -1, sizeof(int), (char *)&dummy) < 0 ){
-        close(ste_fd);
+    if(stedstat->flush_at == 0 || stedstat->timer_fd >= 0)
         return(-1);
-    }
-    return(ste_fd);
+    if((now = sted_nsec()) >= stedstat->flush_at)
+        return(0);
+    return((int)((stedstat->flush_at - now + 999999) / 1000000));
 }
 
+/*****************************************************************************
+ * sted_nsec()
+ * 
+ * 単調増加する時計の現在時刻（ナノ秒）を返す。
+ *****************************************************************************/
+uint64_t
+sted_nsec()
+{
+    struct timeval  tv;
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if(clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+#endif
+    gettimeofday(&tv, NULL);
+    return((uint64_t)tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL);
+}
 
 /***********************************************************
  * print_err()
@@ -422,11 +973,21 @@ print_err(int level, char *format, ...)
 void
 print_usage(char *argv)
 {
+    int i;
+
     printf ("Usage: %s [ -i instance] [-h hub[:port]] [ -p proxy[:port]] [-d level]\n",argv);
+    printf ("\t\t[-n network] [-b backend[:arg]] [-T] [-c connections]\n");
     printf ("\t-i instance     : Instance number of the ste device\n");
     printf ("\t-h hub[:port]   : Virtual HUB and its port number\n");
     printf ("\t-p proxy[:port] : Proxy server and its port number\n");
     printf ("\t-d level        : Debug level[0-3]\n");
+    printf ("\t-n network      : Network ID to join on the HUB\n");
+    printf ("\t-b backend[:arg]: Device backend (");
+    for (i = 0; stedevs[i] != NULL; i++)
+        printf ("%s%s", i > 0 ? ", " : "", stedevs[i]->name);
+    printf (")\n");
+    printf ("\t-T              : Forward HUB to device traffic in its own thread\n");
+    printf ("\t-c connections  : Number of connections to the HUB (1-%d)\n", MAX_CONNS);
     exit(0);
 }
  
@@ -459,28 +1020,19 @@ become_daemon()
 /*****************************************************************************
  * write_ste()
  * 
- * ste ドライバにデータを書き込む
+ * 仮想 NIC デバイスに 1 フレームを書き込む
  *
  *  引数：
  *           stedstat : sted 管理構造体
+ *           buf      : フレーム（受信バッファ中を直接指す）
+ *           len      : フレームのサイズ
  *
  * 戻り値：
  *          正常時 : 0
  *          障害時 : -1
  *****************************************************************************/
 int
-write_ste(stedstat_t *stedstat)
+write_ste(stedstat_t *stedstat, unsigned char *buf, int len)
 {
-    struct strbuf wdata;
-    int ste_fd = stedstat->ste_fd;
-    int flags = 0;
-    
-    wdata.buf = (char *)stedstat->wdatabuf;
-    wdata.maxlen = 0;
-    wdata.len = stedstat->orgdatalen;
-    if (putmsg(ste_fd, NULL, &wdata, flags) < 0 ){
-        perror("putmsg:");
-        return(-1);
-    }    
-    return(0);
+    return(stedstat->dev->write(stedstat, buf, len));
 }
@@ -64,10 +64,16 @@
  *  CONNECT_REQ_TIMEOUT  Proxy から CONNECT のレスポンスを受け取るタイムアウト
  *  STRBUFSIZE           getmsg(9F),putmsg(9F) 用のバッファのサイズ 
  *  PORT_NO              デフォルトの仮想ハブのポート番号
- *  SOCKBUFSIZE          recv(), send() 用のバッファのサイズ                
+ *  SOCKBUFSIZE          recv() の 1 回の最大サイズ
+ *  SENDRING_SIZE        send() 用のリングのサイズ（2 のべき乗）
  *  ERR_MSG_MAX          syslog や、STDERR に出力するメッセージのサイズ   
- *  SENDBUF_THRESHOLD    送信一時バッファのデータを送信するしきい値。
- *  SELECT_TIMEOUT       select() 用のタイムアウト（Solaris 用)
+ *  SENDBUF_THRESHOLD    送信一時バッファのデータを送信するしきい値の最小値。
+ *  FLUSH_TIMEOUT        送信バッファに残したデータを送信するまでの最大の時間（マイクロ秒）
+ *  COALESCE_IDLE        前のフレームからこれ以上空いたフレームはすぐに送信する（マイクロ秒）
+ *  COALESCE_GAPS        平均の到着間隔の何倍次のフレームが来なければ送信するか
+ *  COALESCE_MAX         送信一時バッファのデータを送信するしきい値の最大値。
+ *  DEV_BUDGET           1 回の起床でデバイスから読み込む最大フレーム数
+ *  MAX_CONNS            HUB との間に張る接続の最大数（-c）
  *  HTTP_STAT_OK         HTTP のステータスコード OK
  *  MAXHOSTNAME          ホスト名（HUBやProxy）の最大長 
  *  GETMSG_MAXWAIT       getmsg(9F) のタイムアウト値（Solaris 用)
@@ -77,14 +83,24 @@
 #define  STRBUFSIZE               32768       
 #define  PORT_NO                  80            
 #define  SOCKBUFSIZE              32768     
+#define  SENDRING_SIZE            (4 * SOCKBUFSIZE)
 #define  ERR_MSG_MAX              300         
 #define  SENDBUF_THRESHOLD        3028    // ETHERMAX(1514) x 2
-#define  SELECT_TIMEOUT           400000  // 400m sec = 0.4 sec
+#define  FLUSH_TIMEOUT            200     // 200 usec
+#define  COALESCE_IDLE            50      // 50 usec
+#define  COALESCE_GAPS            4
+#define  COALESCE_MAX             (SOCKBUFSIZE - 2 * (ETHERMAX + 12))
+#define  DEV_BUDGET               64
+#define  MAX_CONNS                8
 #define  HTTP_STAT_OK             200        
 #define  MAXHOSTNAME              30          
 #define  GETMSG_MAXWAIT           15
 #define  STE_MAX_DEVICE_NAME      30
 
+#ifndef  ETHERMAX
+#define  ETHERMAX                 1514
+#endif
+
 /*
  * 仮想 NIC デーモン sted と、仮想ハブデーモン stehub が通信を
  * 行う際、送受信する Ethernet フレームのデータに付加されるヘッダ。
@@ -95,6 +111,26 @@ typedef struct stehead
     int           orglen; /* パディングする前のサイズ。*/
 } stehead_t;
 
+#define  FRAME_MAX                (sizeof(stehead_t) + ETHERMAX + 3) /* stehead を付けたフレームの最大サイズ */
+
+/*
+ * stehead の orglen が 0 のものは Ethernet フレームではなく、制御メッセージ。
+ * len は続く stectl のサイズで、値はすべてネットワークバイトオーダー。
+ * 接続直後に送り、仮想ハブは他のポートには転送しない。
+ */
+typedef struct stectl
+{
+    int           type;   /* 制御メッセージの種類 */
+    int           arg;    /* 種類毎の引数 */
+} stectl_t;
+
+#define  STECTL_TRUNK     1    /* 接続元は他の仮想ハブ（トランク）。arg は未使用 */
+#define  STECTL_NETWORK   2    /* 参加するネットワークの ID。arg がネットワーク ID */
+#define  STECTL_BUNDLE    3    /* 同じ sted からの複数の接続の 1 つ。arg は sted が選んだ ID */
+#define  STECTL_LANE      4    /* STECTL_BUNDLE の接続の番号。arg は (番号 << 16) | 接続の数 */
+
+struct stedev;
+
 /*
  * sted デーモンが使う sted の管理用構造体
  * HUB との通信の情報や、仮想 NIC ドライバの情報を持っている。
@@ -107,25 +143,50 @@ typedef struct sted_stat
     int           hub_port;                /* 仮想ハブのポート番号 */
     char          proxy_name[MAXHOSTNAME]; /* プロキシーサーバ名   */ 
     int           proxy_port;              /* プロキシーサーバのポート番号  */
-    int           sendbuflen;              /* 送信バッファへの現在の書き込みサイズ  */
-    int           datalen;                 /* パッドを含む Ethernet フレームのサイズ*/
-    int           orgdatalen;              /* 元の Ethernet フレームのサイズ        */
-    int           dataleft;                /* 未受信の Ethernet フレームのサイズ    */
-    stehead_t     dummyhead;               /* 受信途中の stehead のコピー           */
-    int           dummyheadlen;            /* 受信済みの stehead のサイズ           */
+    int           sendbuflen;              /* 送信リング中の未送信データのサイズ    */
+    int           sendhead;                /* 送信リング中の未送信データの先頭      */
+    int           rxlen;                   /* recvbuf に残した未完成のフレームのサイズ */
     int           use_syslog;              /* メッセージを STDERR でなく、syslog に出力する */
-    unsigned char sendbuf[SOCKBUFSIZE];    /* Socket 送信用バッファ */
-    unsigned char recvbuf[SOCKBUFSIZE];    /* Socket 受信用バッファ */
+    int           network;                 /* 仮想ハブに知らせるネットワーク ID。-1 なら知らせない */
+    int           lane;                    /* HUB との複数の接続（-c）の中での番号 */
+    int           nlanes;                  /* HUB との接続の数 */
+    uint32_t      bundle;                  /* 複数の接続をまとめる ID。仮想ハブに知らせる */
+    uint64_t      flush_at;                /* sendbuf を送信する時刻（ナノ秒）。0 なら未設定 */
+    int           timer_fd;                /* flush_at に満了する timerfd。無ければ -1 */
+    uint64_t      last_read;               /* 最後にデバイスからフレームを読んだ時刻（ナノ秒）*/
+    uint64_t      gap_avg;                 /* フレームの到着間隔の移動平均（ナノ秒）*/
+    int           size_avg;                /* 送信バッファに書くフレームのサイズの移動平均 */
+    int           sock_blocked;            /* send() が EWOULDBLOCK になり、書き込めるのを待っている */
+    unsigned char sendbuf[SENDRING_SIZE];  /* Socket 送信用リング */
+    unsigned char recvbuf[FRAME_MAX + 4 * SOCKBUFSIZE]; /* Socket 受信用バッファ（read_socket() 参照）*/
     /* ste ドライバ用情報 */
+    struct stedev *dev;                    /* 仮想 NIC デバイスのバックエンド */
+    char         *devarg;                  /* -b でバックエンド名の後に指定された引数 */
 #ifdef STE_WINDOWS
     HANDLE        ste_handle;              /* 仮想 NIC デバイスをオープンしたファイルハンドル */
 #else    
     int           ste_fd;                  /* 仮想 NIC デバイスをオープンした FD */
 #endif    
-    unsigned char wdatabuf[STRBUFSIZE]; /* ドライバへの書き込み用バッファ  */
     unsigned char rdatabuf[STRBUFSIZE]; /* ドライバからの読み込み用バッファ*/    
 } stedstat_t;
 
+/*
+ * 仮想 NIC デバイスのバックエンド（sted_dev.c）。
+ * read は 1 フレームを読み込んでそのサイズを返し、読み込めるフレームが
+ * 無ければ 0 を返す。mq が 0 でないバックエンドは、HUB との接続毎に
+ * open を呼んで別々のキューを開ける。
+ */
+typedef struct stedev
+{
+    char         *name;                                  /* -b で指定する名前 */
+    char         *path;                                  /* オープンするデバイス */
+    int         (*open)(stedstat_t *, int);              /* fd を返す */
+    int         (*read)(stedstat_t *, unsigned char *, int);
+    int         (*write)(stedstat_t *, unsigned char *, int);
+    void        (*close)(stedstat_t *);
+    int           mq;                                    /* 接続毎にキューを開ける */
+} stedev_t;
+
 /*
  * sted の内部関数のプロトタイプ
  */
@@ -133,12 +194,19 @@ extern void     print_err(int, char *, ...);
 extern int      open_socket(stedstat_t *, char *, char *);
 extern int      read_socket(stedstat_t *);
 extern int      write_socket(stedstat_t *);
-extern u_char  *read_socket_header(stedstat_t *, int *, unsigned char *);
+extern void     sendring_put(stedstat_t *, void *, int);
 extern int      send_connect_req(stedstat_t *);
+extern int      send_ctl(stedstat_t *, int, int);
+extern void     set_flush_timer(stedstat_t *, uint64_t);
+extern uint64_t sted_nsec();
 extern char    *stat2string(int);
 extern void     print_usage(char *);
-extern int      open_ste(stedstat_t *, char *, int);
-extern int      write_ste(stedstat_t *);
-extern int      read_ste(stedstat_t *);
+extern int      open_ste(stedstat_t *, int);
+extern int      write_ste(stedstat_t *, unsigned char *, int);
+extern int      read_ste(stedstat_t **, int);
+extern void     close_ste(stedstat_t *);
+extern stedev_t *dev_find(char *);
+extern stedev_t *stedevs[];
+extern uint32_t flow_hash(unsigned char *, int);
 
 #endif /* #ifndef __STED_H */
@@ -0,0 +1,832 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright (c) 1986, 2010, Oracle and/or its affiliates. All rights reserved.
+ */
+
+/*
+ * Copright (c) 2004-2010  Kazuyoshi Aizawa <admin2@whiteboard.ne.jp>
+ * All rights reserved.
+ */
+/****************************************************************************
+ * sted_dev.c
+ *
+ * 仮想 NIC のユーザプロセスのデーモン（sted）が使うデバイスのバックエンド。
+ * sted は stedstat の dev を通して Ethernet フレームを読み書きし、
+ * 以下のバックエンドのどれか一つを起動時に選択する。
+ *
+ *   ste  : Solaris の ste ドライバ。STREAMS の getmsg(2)、putmsg(2) で
+ *          読み書きし、DL_ATTACH_REQ と REGSVC で sted を登録する。
+ *   tap  : Linux の TAP デバイス（/dev/net/tun）。インスタンス番号 N に
+ *          対して ste<N> という名前のインターフェースを作り、read(2)、
+ *          write(2) で 1 フレームずつ読み書きする。インターフェースの
+ *          アドレスの設定、up は ste ドライバと同様に利用者が行う。
+ *          HUB との接続が複数（-c）なら、マルチキューの TAP デバイスに
+ *          して接続毎にキューを開ける。カーネルがフロー毎にキューを選ぶ
+ *          ので、キューとその接続の組は他の組と独立に動ける。
+ *   loop : カーネルの NIC を使わない、sted の性能測定用のデバイス。
+ *          -b loop[:source[:rate[:count]]] の形で指定する。source が
+ *          pcap ファイルならそのフレームを、数字ならそのサイズのフレームを
+ *          繰り返し読み込ませる（デフォルトは 60 byte）。rate は 1 秒
+ *          あたりのフレーム数で、0 なら読めるだけ読ませる。count を読ませ
+ *          終わると止まる。書き込まれたフレームは数えて捨てる。
+ *          LOOP_REPORT 秒毎に、読み書きしたフレーム数と、1 フレーム
+ *          あたりの CPU 時間を表示する。
+ *
+ * sted の -T オプションでは、read と write は別々のスレッドから同時に
+ * 呼ばれる。どのバックエンドも、読み込みと書き込みで共有する状態は
+ * 持たない（loop の統計の表示は loop_report_lock で保護する）。
+ *
+ *    gcc -c sted_dev.c
+ *
+ *****************************************************************************/
+
+#if defined(__sun)
+#include <stropts.h>
+#include <sys/stream.h>
+#include <sys/dlpi.h>
+#define  HAVE_STREAMS
+#endif
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+#define  HAVE_TAP
+#define  TUNPATH    "/dev/net/tun"   /* TAP デバイスを作るためのクローンデバイス */
+#endif
+#if defined(__linux__)
+#include <sys/timerfd.h>
+#define  HAVE_TIMERFD
+#endif
+#include <unistd.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include "sted.h"
+#include "ste.h"
+#ifdef HAVE_STREAMS
+#include "dlpiutil.h"
+#endif
+
+/*
+ * o loop バックエンドが利用する各種パラメータ
+ *
+ *  LOOP_REPORT    統計を表示する間隔（秒）
+ *  LOOP_MINFRAME  pcap ファイルから読み込むフレームの最小サイズ
+ *  LOOP_TYPE      生成したフレームの Ethernet タイプ（IEEE 802 の実験用）
+ */
+#define  LOOP_REPORT     1
+#define  LOOP_MINFRAME   14
+#define  LOOP_TYPE       0x88b5
+
+/*
+ * loop バックエンドの状態。sted は 1 つのデバイスしか開かない。
+ */
+typedef struct loopdev
+{
+    unsigned char **frames;      /* 読み込ませるフレーム */
+    int            *lens;        /* frames の各フレームのサイズ */
+    int             nframes;     /* frames の要素数 */
+    int             next;        /* 次に読み込ませるフレーム */
+    uint64_t        rate;        /* 1 秒あたりのフレーム数。0 なら無制限 */
+    uint64_t        count;       /* 読み込ませるフレーム数。0 なら無制限 */
+    uint64_t        rx_frames;   /* sted が読み込んだフレーム数 */
+    uint64_t        rx_bytes;
+    uint64_t        tx_frames;   /* sted が書き込んだフレーム数 */
+    uint64_t        tx_bytes;
+    uint64_t        start;       /* 読み込ませ始めた時刻（ナノ秒）*/
+    uint64_t        report;      /* 最後に統計を表示した時刻 */
+    uint64_t        last_frames; /* 最後に統計を表示した時の rx_frames + tx_frames */
+    uint64_t        last_cpu;    /* 最後に統計を表示した時の CPU 時間（ナノ秒）*/
+    int             pipefd[2];   /* rate が 0 の時に、常に読み込み可能にするパイプ */
+    int             timerfd;     /* rate を守るための timerfd。無ければ -1 */
+} loopdev_t;
+
+extern int debuglevel;
+
+#ifdef HAVE_STREAMS
+static int  dev_ste_open(stedstat_t *, int);
+static int  dev_ste_read(stedstat_t *, unsigned char *, int);
+static int  dev_ste_write(stedstat_t *, unsigned char *, int);
+static void dev_ste_close(stedstat_t *);
+
+static stedev_t dev_ste = {
+    "ste", STEPATH, dev_ste_open, dev_ste_read, dev_ste_write, dev_ste_close, 0
+};
+#endif
+
+static int  dev_loop_open(stedstat_t *, int);
+static int  dev_loop_read(stedstat_t *, unsigned char *, int);
+static int  dev_loop_write(stedstat_t *, unsigned char *, int);
+static void dev_loop_close(stedstat_t *);
+static int  loop_load_pcap(char *);
+static int  loop_synth(int);
+static void loop_arm(uint64_t);
+static void loop_report(uint64_t, int);
+static uint64_t loop_cpu();
+
+static stedev_t dev_loop = {
+    "loop", "loop", dev_loop_open, dev_loop_read, dev_loop_write, dev_loop_close, 0
+};
+
+static loopdev_t loop;
+static pthread_mutex_t loop_report_lock = PTHREAD_MUTEX_INITIALIZER; /* 統計の表示を保護する */
+
+#ifdef HAVE_TAP
+static int  dev_tap_open(stedstat_t *, int);
+static int  dev_tap_read(stedstat_t *, unsigned char *, int);
+static int  dev_tap_write(stedstat_t *, unsigned char *, int);
+static void dev_tap_close(stedstat_t *);
+
+static stedev_t dev_tap = {
+    "tap", TUNPATH, dev_tap_open, dev_tap_read, dev_tap_write, dev_tap_close, 1
+};
+#endif
+
+/*
+ * 利用できるバックエンド。先頭のものがデフォルト。
+ */
+stedev_t *stedevs[] = {
+#ifdef HAVE_STREAMS
+    &dev_ste,
+#endif
+#ifdef HAVE_TAP
+    &dev_tap,
+#endif
+    &dev_loop,
+    NULL
+};
+
+/*****************************************************************************
+ * dev_find()
+ *
+ * 名前からバックエンドを探す。
+ *
+ *  引数：
+ *           name : バックエンドの名前。NULL ならデフォルトのバックエンド
+ * 戻り値：
+ *          正常時 : バックエンド
+ *          見つからない : NULL
+ *****************************************************************************/
+stedev_t *
+dev_find(char *name)
+{
+    int i;
+
+    if(name == NULL)
+        return(stedevs[0]);
+    for(i = 0 ; stedevs[i] != NULL ; i++){
+        if(strcmp(stedevs[i]->name, name) == 0)
+            return(stedevs[i]);
+    }
+    return(NULL);
+}
+
+#ifdef HAVE_STREAMS
+/*****************************************************************************
+ * dev_ste_open()
+ * 
+ * /dev/ste をオープンし、PPA（インスタンス番号）にアタッチする。
+ * また、オープンされた stream を ste ドライバ内で保持するために
+ * IOCTL コマンドの REGSVC（ste オリジナル）を発行する。
+ *
+ *  引数：
+ *           stedstat : sted 管理構造体
+ *           ppa      : PPA（仮想 NIC のインスタンス番号）
+ * 戻り値：
+ *         正常時   : ファイルディスクリプタ
+ *         エラー時 :  -1
+ *****************************************************************************/
+static int
+dev_ste_open(stedstat_t *stedstat, int ppa)
+{
+    int ste_fd;
+    char dummy;
+    unsigned char *rdatabuf = stedstat->rdatabuf; /* ドライバからの読み込み用バッファ*/
+    
+    ste_fd = open(STEPATH, O_RDWR, 0666);
+    if ( ste_fd < 0){
+        print_err(LOG_ERR, "open: %s\n", strerror(errno));                            
+        return(-1);
+    }
+
+    stedstat->ste_fd = ste_fd;
+    
+    if(dlattachreq(ste_fd, ppa, (char *)rdatabuf) < 0){
+        close(ste_fd);
+        print_err(LOG_ERR, "dlattach:error\n");//todo
+        return(-1);
+    }
+
+    /*
+     * read queue を flash するよう要求。
+     */
+    if (ioctl(ste_fd, I_FLUSH, FLUSHR) < 0){
+        close(ste_fd);
+        print_err(LOG_ERR, "ioctl:I_FLUSH:%s\n", strerror(errno));
+        return(-1);
+    }
+
+    if (strioctl(ste_fd, REGSVC, -1, sizeof(int), (char *)&dummy) < 0 ){
+        close(ste_fd);
+        return(-1);
+    }
+
+    /*
+     * read_ste() はデバイスが空になるまで読み込むので、getmsg() で
+     * ブロックしないようにする。
+     */
+    if (fcntl(ste_fd, F_SETFL, O_NONBLOCK) < 0){
+        print_err(LOG_ERR, "Failed to set nonblock: %s\n", strerror(errno));
+        close(ste_fd);
+        return(-1);
+    }
+    return(ste_fd);
+}
+
+/*****************************************************************************
+ * dev_ste_read()
+ * 
+ * getmsg(2) で ste ドライバから 1 フレームを読み込む。
+ *
+ *  引数：
+ *           stedstat : sted 管理構造体
+ *           buf      : 読み込み用バッファ
+ *           size     : buf のサイズ
+ * 戻り値：
+ *          正常時 : 読み込んだフレームのサイズ。読み込めるフレームが無ければ 0
+ *          障害時 : -1
+ *****************************************************************************/
+static int
+dev_ste_read(stedstat_t *stedstat, unsigned char *buf, int size)
+{
+    struct strbuf rdata;
+    int flags = 0;    
+    int ret;
+
+    rdata.buf = (char *)buf;        
+    rdata.maxlen = size;
+    rdata.len = 0;
+
+    if((ret = getmsg(stedstat->ste_fd, NULL, &rdata, &flags)) < 0){
+        if(errno == EINTR || errno == EAGAIN)
+            return(0);
+        print_err(LOG_ERR, "getmsg: %s\n", strerror(errno));
+        return(-1);
+    }
+    if ((ret & (MORECTL | MOREDATA)) == (MORECTL | MOREDATA))        
+        print_err(LOG_NOTICE, "getmsg() returns MOREDATA or MORECTL\n");
+
+    return(rdata.len < 0 ? 0 : rdata.len);
+}
+
+/*****************************************************************************
+ * dev_ste_write()
+ * 
+ * putmsg(2) で ste ドライバに 1 フレームを書き込む。
+ *
+ *  引数：
+ *           stedstat : sted 管理構造体
+ *           buf      : フレーム
+ *           len      : フレームのサイズ
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+static int
+dev_ste_write(stedstat_t *stedstat, unsigned char *buf, int len)
+{
+    struct strbuf wdata;
+    int flags = 0;
+    
+    wdata.buf = (char *)buf;
+    wdata.maxlen = 0;
+    wdata.len = len;
+    if (putmsg(stedstat->ste_fd, NULL, &wdata, flags) < 0 ){
+        print_err(LOG_ERR, "putmsg: %s\n", strerror(errno));
+        return(-1);
+    }    
+    return(0);
+}
+
+/*****************************************************************************
+ * dev_ste_close()
+ * 
+ * ste ドライバから sted を登録解除してクローズする。
+ *****************************************************************************/
+static void
+dev_ste_close(stedstat_t *stedstat)
+{
+    char dummy;
+
+    strioctl(stedstat->ste_fd, UNREGSVC, -1, sizeof(int), (char *)&dummy);
+    close(stedstat->ste_fd);
+}
+#endif /* HAVE_STREAMS */
+
+#ifdef HAVE_TAP
+/*****************************************************************************
+ * dev_tap_open()
+ * 
+ * TAP デバイス ste<ppa> を作り（既にあればそれに）、アタッチする。
+ * フレームの前に packet information を付けないよう IFF_NO_PI を指定する。
+ * read_ste() はデバイスが空になるまで読み込むので、non-blocking にする。
+ * HUB との接続が複数なら IFF_MULTI_QUEUE を指定し、接続毎に呼ばれる
+ * たびに同じインターフェースの新しいキューを開ける。
+ *
+ *  引数：
+ *           stedstat : sted 管理構造体
+ *           ppa      : 仮想 NIC のインスタンス番号
+ * 戻り値：
+ *         正常時   : ファイルディスクリプタ
+ *         エラー時 :  -1
+ *****************************************************************************/
+static int
+dev_tap_open(stedstat_t *stedstat, int ppa)
+{
+    struct ifreq ifr;
+    int          tap_fd;
+
+    if((tap_fd = open(TUNPATH, O_RDWR)) < 0){
+        print_err(LOG_ERR, "open: %s: %s\n", TUNPATH, strerror(errno));
+        return(-1);
+    }
+
+    memset(&ifr, 0x0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    if(stedstat->nlanes > 1)
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    snprintf(ifr.ifr_name, IFNAMSIZ, "ste%d", ppa);
+    if(ioctl(tap_fd, TUNSETIFF, (void *)&ifr) < 0){
+        print_err(LOG_ERR, "ioctl:TUNSETIFF:%s\n", strerror(errno));
+        close(tap_fd);
+        return(-1);
+    }
+
+    if(fcntl(tap_fd, F_SETFL, O_NONBLOCK) < 0){
+        print_err(LOG_ERR, "Failed to set nonblock: %s\n", strerror(errno));
+        close(tap_fd);
+        return(-1);
+    }
+    stedstat->ste_fd = tap_fd;
+    if(debuglevel > 0)
+        print_err(LOG_NOTICE, "attached to %s (queue %d)\n", ifr.ifr_name, stedstat->lane);
+    return(tap_fd);
+}
+
+/*****************************************************************************
+ * dev_tap_read()
+ * 
+ * TAP デバイスから 1 フレームを読み込む。
+ *
+ *  引数：
+ *           stedstat : sted 管理構造体
+ *           buf      : 読み込み用バッファ
+ *           size     : buf のサイズ
+ * 戻り値：
+ *          正常時 : 読み込んだフレームのサイズ。読み込めるフレームが無ければ 0
+ *          障害時 : -1
+ *****************************************************************************/
+static int
+dev_tap_read(stedstat_t *stedstat, unsigned char *buf, int size)
+{
+    int len;
+
+    if((len = read(stedstat->ste_fd, buf, size)) < 0){
+        if(errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN)
+            return(0);
+        print_err(LOG_ERR, "read: %s\n", strerror(errno));
+        return(-1);
+    }
+    return(len);
+}
+
+/*****************************************************************************
+ * dev_tap_write()
+ * 
+ * TAP デバイスに 1 フレームを書き込む。
+ *
+ *  引数：
+ *           stedstat : sted 管理構造体
+ *           buf      : フレーム
+ *           len      : フレームのサイズ
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+static int
+dev_tap_write(stedstat_t *stedstat, unsigned char *buf, int len)
+{
+    if(write(stedstat->ste_fd, buf, len) < 0){
+        /*
+         * インターフェースが down している間は EIO になるが、ste ドライバ
+         * と同じく、フレームを捨てるだけにする。
+         */
+        if(errno != EIO && debuglevel > 0)
+            print_err(LOG_NOTICE, "write: %s\n", strerror(errno));
+        return(-1);
+    }
+    return(0);
+}
+
+/*****************************************************************************
+ * dev_tap_close()
+ * 
+ * TAP デバイスをクローズする。永続化していないので、インターフェースも
+ * 削除される。
+ *****************************************************************************/
+static void
+dev_tap_close(stedstat_t *stedstat)
+{
+    close(stedstat->ste_fd);
+}
+#endif /* HAVE_TAP */
+
+/*****************************************************************************
+ * dev_loop_open()
+ * 
+ * stedstat の devarg（source[:rate[:count]]）を解釈し、読み込ませる
+ * フレームを用意する。poll() で待てるように、読み込ませるフレームが
+ * ある間だけ読み込み可能になる fd を返す。rate が指定されていれば
+ * timerfd を、そうでなければ 1 byte を書いたままにしたパイプを使う。
+ * timerfd が無い環境で rate を指定した場合、fd は常に読み込み可能で、
+ * 送る時刻になるまで dev_loop_read() が 0 を返す（CPU を使い続ける）。
+ *
+ *  引数：
+ *           stedstat : sted 管理構造体
+ *           ppa      : 使わない
+ * 戻り値：
+ *         正常時   : ファイルディスクリプタ
+ *         エラー時 :  -1
+ *****************************************************************************/
+static int
+dev_loop_open(stedstat_t *stedstat, int ppa)
+{
+    char *source = NULL, *p;
+    char  one = 0;
+    int   ret;
+
+    memset(&loop, 0x0, sizeof(loop));
+    loop.timerfd = -1;
+    if(stedstat->devarg != NULL){
+        source = stedstat->devarg;
+        if((p = strchr(source, ':')) != NULL){
+            *p++ = '\0';
+            loop.rate = strtoull(p, NULL, 10);
+            if((p = strchr(p, ':')) != NULL)
+                loop.count = strtoull(p + 1, NULL, 10);
+        }
+    }
+    if(source != NULL && *source != '\0' && strspn(source, "0123456789") != strlen(source))
+        ret = loop_load_pcap(source);
+    else
+        ret = loop_synth(source != NULL && *source != '\0' ? atoi(source) : 60);
+    if(ret < 0)
+        return(-1);
+
+    if(pipe(loop.pipefd) < 0){
+        print_err(LOG_ERR, "pipe: %s\n", strerror(errno));
+        return(-1);
+    }
+    fcntl(loop.pipefd[0], F_SETFL, O_NONBLOCK);
+    write(loop.pipefd[1], &one, 1);
+    stedstat->ste_fd = loop.pipefd[0];
+
+#ifdef HAVE_TIMERFD
+    if(loop.rate > 0){
+        if((loop.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0){
+            print_err(LOG_ERR, "timerfd_create: %s\n", strerror(errno));
+            return(-1);
+        }
+        stedstat->ste_fd = loop.timerfd;
+    }
+#endif
+    loop.start = loop.report = sted_nsec();
+    loop.last_cpu = loop_cpu();
+    loop_arm(loop.start);
+    print_err(LOG_NOTICE, "loop: %d frames, rate %" PRIu64 " fps, count %" PRIu64 "\n",
+              loop.nframes, loop.rate, loop.count);
+    return(stedstat->ste_fd);
+}
+
+/*****************************************************************************
+ * dev_loop_read()
+ * 
+ * 送る時刻になっていれば、次のフレームを buf にコピーする。
+ *
+ *  引数：
+ *           stedstat : sted 管理構造体
+ *           buf      : 読み込み用バッファ
+ *           size     : buf のサイズ
+ * 戻り値：
+ *          正常時 : フレームのサイズ。送る時刻になっていなければ 0
+ *****************************************************************************/
+static int
+dev_loop_read(stedstat_t *stedstat, unsigned char *buf, int size)
+{
+    uint64_t now = sted_nsec();
+    uint64_t due = 0;
+    int      len;
+
+    if(loop.count > 0 && loop.rx_frames >= loop.count)
+        return(0);
+    if(loop.rate > 0){
+        due = (now - loop.start) * loop.rate / 1000000000ULL;
+        if(loop.rx_frames >= due){
+            loop_arm(loop.start + (loop.rx_frames + 1) * 1000000000ULL / loop.rate);
+            return(0);
+        }
+    }
+
+    len = loop.lens[loop.next];
+    if(len > size)
+        len = size;
+    memcpy(buf, loop.frames[loop.next], len);
+    loop.next = (loop.next + 1) % loop.nframes;
+    loop.rx_frames++;
+    loop.rx_bytes += len;
+
+    if(loop.count > 0 && loop.rx_frames >= loop.count){
+        loop_arm(0);
+        loop_report(now, 1);
+    } else if(loop.rate > 0){
+        loop_arm(loop.rx_frames < due ? now : loop.start + (loop.rx_frames + 1) * 1000000000ULL / loop.rate);
+    }
+    loop_report(now, 0);
+    return(len);
+}
+
+/*****************************************************************************
+ * dev_loop_write()
+ * 
+ * 書き込まれたフレームを数えて捨てる。
+ *****************************************************************************/
+static int
+dev_loop_write(stedstat_t *stedstat, unsigned char *buf, int len)
+{
+    loop.tx_frames++;
+    loop.tx_bytes += len;
+    if((loop.tx_frames & 0x3ff) == 0)
+        loop_report(sted_nsec(), 0);
+    return(0);
+}
+
+/*****************************************************************************
+ * dev_loop_close()
+ * 
+ * 最後の統計を表示し、fd を閉じる。
+ *****************************************************************************/
+static void
+dev_loop_close(stedstat_t *stedstat)
+{
+    loop_report(sted_nsec(), 1);
+    close(loop.pipefd[0]);
+    close(loop.pipefd[1]);
+    if(loop.timerfd >= 0)
+        close(loop.timerfd);
+}
+
+/*****************************************************************************
+ * loop_arm()
+ * 
+ * 時刻 when に fd が読み込み可能になるようにする。when が 0 なら
+ * 読み込み可能でなくする。timerfd を使わない場合は、読み込ませ終わった
+ * 時にパイプを空にするだけ。
+ *
+ *  引数：
+ *           when : 読み込み可能にする時刻（ナノ秒）
+ *****************************************************************************/
+static void
+loop_arm(uint64_t when)
+{
+    char buf[16];
+
+    if(loop.timerfd < 0){
+        if(when == 0)
+            while(read(loop.pipefd[0], buf, sizeof(buf)) > 0)
+                ;
+        return;
+    }
+#ifdef HAVE_TIMERFD
+    {
+        struct itimerspec its;
+        uint64_t          expirations;
+        int               flags = 0;
+
+        /* 溜まった満了回数を読み捨てて、読み込み可能でなくする */
+        read(loop.timerfd, &expirations, sizeof(expirations));
+        memset(&its, 0x0, sizeof(its));
+        if(when > sted_nsec()){
+            its.it_value.tv_sec = when / 1000000000ULL;
+            its.it_value.tv_nsec = when % 1000000000ULL;
+            flags = TFD_TIMER_ABSTIME;
+        } else if(when > 0){
+            /* it_value が 0 だとタイマーの停止になるので、最小でも 1 ナノ秒 */
+            its.it_value.tv_nsec = 1;
+        }
+        timerfd_settime(loop.timerfd, flags, &its, NULL);
+    }
+#endif
+}
+
+/*****************************************************************************
+ * loop_report()
+ * 
+ * 前回の表示から LOOP_REPORT 秒以上たっていれば（force なら常に）、
+ * その間に読み書きしたフレーム数と、1 フレームあたりの CPU 時間を表示する。
+ *
+ *  引数：
+ *           now   : 現在時刻（ナノ秒）
+ *           force : 間隔に関わらず表示する
+ *****************************************************************************/
+static void
+loop_report(uint64_t now, int force)
+{
+    uint64_t frames, cpu, elapsed;
+
+    elapsed = now - loop.report;
+    if(!force && elapsed < LOOP_REPORT * 1000000000ULL)
+        return;
+    /* 読み込み側と書き込み側が同時に表示しないよう、ロックして確かめ直す */
+    pthread_mutex_lock(&loop_report_lock);
+    elapsed = now > loop.report ? now - loop.report : 0;
+    if(!force && elapsed < LOOP_REPORT * 1000000000ULL){
+        pthread_mutex_unlock(&loop_report_lock);
+        return;
+    }
+    frames = loop.rx_frames + loop.tx_frames;
+    if(frames == loop.last_frames || elapsed == 0){
+        loop.report = now;
+        pthread_mutex_unlock(&loop_report_lock);
+        return;
+    }
+    cpu = loop_cpu();
+    print_err(LOG_NOTICE, "loop: read %" PRIu64 " frames %" PRIu64 " bytes, "
+              "written %" PRIu64 " frames %" PRIu64 " bytes, "
+              "%.0f fps, %.0f ns cpu/frame\n",
+              loop.rx_frames, loop.rx_bytes, loop.tx_frames, loop.tx_bytes,
+              (frames - loop.last_frames) * 1e9 / elapsed,
+              (double)(cpu - loop.last_cpu) / (frames - loop.last_frames));
+    loop.report = now;
+    loop.last_frames = frames;
+    loop.last_cpu = cpu;
+    pthread_mutex_unlock(&loop_report_lock);
+}
+
+/*****************************************************************************
+ * loop_load_pcap()
+ * 
+ * pcap ファイルの Ethernet フレームをすべてメモリに読み込む。ETHERMAX
+ * より大きいフレームは切り詰め、LOOP_MINFRAME より小さいものは捨てる。
+ *
+ *  引数：
+ *           file : pcap ファイルのパス
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+static int
+loop_load_pcap(char *file)
+{
+    FILE          *fp;
+    uint32_t       ghdr[6], rhdr[4], magic, caplen;
+    int            swap, size = 0;
+    unsigned char *data;
+
+    if((fp = fopen(file, "rb")) == NULL){
+        print_err(LOG_ERR, "%s: %s\n", file, strerror(errno));
+        return(-1);
+    }
+    if(fread(ghdr, sizeof(ghdr), 1, fp) != 1)
+        ghdr[0] = 0;
+    /* マイクロ秒、ナノ秒のどちらの形式も、タイムスタンプは使わない */
+    magic = ghdr[0];
+    if(magic == 0xa1b2c3d4 || magic == 0xa1b23c4d)
+        swap = 0;
+    else if(magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1)
+        swap = 1;
+    else {
+        print_err(LOG_ERR, "%s: not a pcap file\n", file);
+        fclose(fp);
+        return(-1);
+    }
+#define SWAP32(x) (swap ? (((x) >> 24) | (((x) >> 8) & 0xff00) | (((x) << 8) & 0xff0000) | ((x) << 24)) : (x))
+    if(SWAP32(ghdr[5]) != 1){
+        print_err(LOG_ERR, "%s: link type is not Ethernet\n", file);
+        fclose(fp);
+        return(-1);
+    }
+    while(fread(rhdr, sizeof(rhdr), 1, fp) == 1){
+        caplen = SWAP32(rhdr[2]);
+        if(caplen > 262144 || (data = (unsigned char *)malloc(caplen + 1)) == NULL)
+            break;
+        if(fread(data, 1, caplen, fp) != caplen){
+            free(data);
+            break;
+        }
+        if(caplen < LOOP_MINFRAME){
+            free(data);
+            continue;
+        }
+        if(loop.nframes == size){
+            size = size ? size * 2 : 1024;
+            if((loop.frames = (unsigned char **)realloc(loop.frames, size * sizeof(unsigned char *))) == NULL ||
+               (loop.lens = (int *)realloc(loop.lens, size * sizeof(int))) == NULL){
+                print_err(LOG_ERR, "can't allocate frames\n");
+                fclose(fp);
+                return(-1);
+            }
+        }
+        loop.frames[loop.nframes] = data;
+        loop.lens[loop.nframes] = caplen > ETHERMAX ? ETHERMAX : caplen;
+        loop.nframes++;
+    }
+#undef SWAP32
+    fclose(fp);
+    if(loop.nframes == 0){
+        print_err(LOG_ERR, "%s: no Ethernet frames\n", file);
+        return(-1);
+    }
+    return(0);
+}
+
+/*****************************************************************************
+ * loop_synth()
+ * 
+ * 読み込ませるフレームを 1 つ生成する。宛先は仮想ハブが知らないローカル
+ * アドレスなので、仮想ハブは他のポートにフラッディングする。
+ *
+ *  引数：
+ *           len : フレームのサイズ
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+static int
+loop_synth(int len)
+{
+    static unsigned char dst[] = { 0x02, 0x53, 0x54, 0x4c, 0x00, 0x02 };
+    static unsigned char src[] = { 0x02, 0x53, 0x54, 0x4c, 0x00, 0x01 };
+    unsigned char       *data;
+
+    if(len < LOOP_MINFRAME || len > ETHERMAX){
+        print_err(LOG_ERR, "loop: frame size must be %d to %d\n", LOOP_MINFRAME, ETHERMAX);
+        return(-1);
+    }
+    if((loop.frames = (unsigned char **)malloc(sizeof(unsigned char *))) == NULL ||
+       (loop.lens = (int *)malloc(sizeof(int))) == NULL ||
+       (data = (unsigned char *)calloc(1, len)) == NULL){
+        print_err(LOG_ERR, "can't allocate frames\n");
+        return(-1);
+    }
+    memcpy(data, dst, sizeof(dst));
+    memcpy(data + sizeof(dst), src, sizeof(src));
+    data[12] = LOOP_TYPE >> 8;
+    data[13] = LOOP_TYPE & 0xff;
+    loop.frames[0] = data;
+    loop.lens[0] = len;
+    loop.nframes = 1;
+    return(0);
+}
+
+/*****************************************************************************
+ * loop_cpu()
+ * 
+ * プロセスが使った CPU 時間（ユーザ + システム、ナノ秒）を返す。
+ *****************************************************************************/
+static uint64_t
+loop_cpu()
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return((uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+           (uint64_t)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL);
+}
@@ -0,0 +1,131 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright (c) 1986, 2010, Oracle and/or its affiliates. All rights reserved.
+ */
+
+/*
+ * Copright (c) 2004-2010  Kazuyoshi Aizawa <admin2@whiteboard.ne.jp>
+ * All rights reserved.
+ */
+/****************************************************************************
+ * sted_flow.c
+ *
+ * Ethernet フレームのフローのハッシュ。sted が複数の接続（-c）のどれで
+ * フレームを送るかを決めるのと、仮想ハブ（stehub）が同じ sted の複数の
+ * 接続のどれにフレームを送るかを決めるのに使う。同じフローのフレームは
+ * 必ず同じ接続を通るので、フロー内の順序は入れ替わらない。
+ *
+ * IPv4、IPv6 のフレームは送信元と宛先の IP アドレス、プロトコル番号と、
+ * TCP、UDP、SCTP ならポート番号（L3/L4）から、それ以外のフレームは
+ * 宛先と送信元の MAC アドレスとタイプ（L2）から求める。VLAN タグは 1 つ
+ * まで読み飛ばす。フラグメントされた IPv4 のフレームは、先頭のものにしか
+ * ポート番号が無いので、ポート番号を使わない。
+ *
+ *    gcc -c sted_flow.c
+ *
+ *****************************************************************************/
+
+#include <sys/types.h>
+#include <inttypes.h>
+#include "sted.h"
+
+#define  FLOW_ETHERHEADERL  14      /* 宛先、送信元 MAC アドレスとタイプ */
+#define  FLOW_VLAN          0x8100
+#define  FLOW_IPV4          0x0800
+#define  FLOW_IPV6          0x86dd
+#define  FNV_BASIS          2166136261U
+#define  FNV_PRIME          16777619U
+
+static uint32_t fnv(uint32_t, unsigned char *, int);
+
+/*****************************************************************************
+ * flow_hash()
+ *
+ * フレームのフローのハッシュ値を返す。
+ *
+ *  引数：
+ *          etherp : Ethernet フレーム
+ *          len    : Ethernet フレームのサイズ
+ *  戻り値：
+ *          ハッシュ値
+ *****************************************************************************/
+uint32_t
+flow_hash(unsigned char *etherp, int len)
+{
+    unsigned char *ipp;
+    uint32_t       h = FNV_BASIS;
+    int            type, off = FLOW_ETHERHEADERL, hlen, ports = 0;
+
+    if(len < FLOW_ETHERHEADERL)
+        return(0);
+    type = (etherp[12] << 8) | etherp[13];
+    if(type == FLOW_VLAN && len >= FLOW_ETHERHEADERL + 4){
+        type = (etherp[16] << 8) | etherp[17];
+        off += 4;
+    }
+    ipp = etherp + off;
+
+    if(type == FLOW_IPV4 && len >= off + 20){
+        hlen = (ipp[0] & 0x0f) * 4;
+        h = fnv(h, ipp + 12, 8);       /* 送信元、宛先アドレス */
+        h = fnv(h, ipp + 9, 1);        /* プロトコル */
+        /* MF フラグもフラグメントオフセットも 0 の時だけポート番号を使う */
+        if(((ipp[6] & 0x3f) | ipp[7]) == 0)
+            ports = ipp[9];
+        ipp += hlen;
+        off += hlen;
+    } else if(type == FLOW_IPV6 && len >= off + 40){
+        h = fnv(h, ipp + 8, 32);       /* 送信元、宛先アドレス */
+        h = fnv(h, ipp + 6, 1);        /* 次ヘッダ。拡張ヘッダはたどらない */
+        ports = ipp[6];
+        ipp += 40;
+        off += 40;
+    } else {
+        h = fnv(h, etherp, FLOW_ETHERHEADERL);
+    }
+    /* TCP、UDP、SCTP の送信元、宛先ポート番号 */
+    if((ports == 6 || ports == 17 || ports == 132) && len >= off + 4)
+        h = fnv(h, ipp, 4);
+
+    /* 接続の数で割った余りを使うので、下位のビットまでよく混ぜる */
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return(h);
+}
+
+/*****************************************************************************
+ * fnv()
+ *
+ * h に data を FNV-1a で混ぜた値を返す。
+ *****************************************************************************/
+static uint32_t
+fnv(uint32_t h, unsigned char *data, int len)
+{
+    while(len-- > 0){
+        h ^= *data++;
+        h *= FNV_PRIME;
+    }
+    return(h);
+}
@@ -43,6 +43,16 @@
  *   2005/05/14
  *     o EAGAIN を EWOULDBLOCK に変更した。
  *     o Windows の為に sted_win.h に EWOULDBLOCK を define するようにした。
+ *   2026/10/17
+ *     o 接続直後に、仮想ハブにネットワーク ID を知らせるようにした。
+ *     o Linux でもコンパイルできるよう include ファイルを整理した。
+ *     o 送信バッファをリングにし、送れなかったデータを捨てないようにした。
+ *     o 受信したフレームをその場で解釈し、コピーせずにデバイスに渡す
+ *       ようにした。read_socket_header() は不要になった。
+ *     o HUB との複数の接続（-c）の 1 つであることを、接続直後に仮想ハブ
+ *       に知らせるようにした。send_network() は send_ctl() になった。
+ *     o 再接続や複数の接続で何度も呼べるよう、open_socket() が引数の
+ *       文字列を書き換えないようにした。
  *    
  *****************************************************************************/
 
@@ -56,7 +66,11 @@
 #include <sys/socket.h>   
 #include <netdb.h>        
 #include <syslog.h>       
+#if defined(__sun)
 #include <sys/ethernet.h>
+#endif
+#include <netinet/in.h>
+#include <sys/select.h>
 #include <sys/uio.h>
 #endif
 #include <stdlib.h>
@@ -68,6 +82,7 @@
 #include <stdarg.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <inttypes.h>
 #include "ste.h"
 #include "sted.h"
 
@@ -76,13 +91,14 @@ extern WSAEVENT   EventArray[2]; // socket と ste ドライバ用の 2 つの E
 #endif
 
 extern int debuglevel;
-extern int write_ste(stedstat_t *);
+extern int write_ste(stedstat_t *, unsigned char *, int);
 
 /*****************************************************************************
  * open_socket()
  * 
  * HUB(stehub) と TCP connection を確立し、Socket を返す。
  * Proxy サーバが指定されていれば、そちらと TCP connection を確立する。
+ * hub、proxy の文字列は書き換えないので、同じものを何度でも渡せる。
  *
  *  引数：
  *           stedstat: sted 管理用構造体
@@ -102,6 +118,9 @@ open_socket(stedstat_t *stedstat, char *hub, char *proxy)
     int hub_port, proxy_port;
     int   sock;
     char *temp;
+    char *last;
+    char  hub_buf[256];                 /* hub を strtok_r() で区切るためのコピー */
+    char  proxy_buf[256];               /* proxy を strtok_r() で区切るためのコピー */
     int nRtn;    
 
 #ifdef STE_WINDOWS    
@@ -110,11 +129,13 @@ open_socket(stedstat_t *stedstat, char *hub, char *proxy)
 #endif
 
     memset((char *) &sin,0,sizeof(sin));
-    if((hub_name = strtok(hub, ":")) == NULL){
+    strncpy(hub_buf, hub, sizeof(hub_buf) - 1);
+    hub_buf[sizeof(hub_buf) - 1] = '\0';
+    if((hub_name = strtok_r(hub_buf, ":", &last)) == NULL){
         print_err(LOG_ERR, "hub name was not given\n");
         return(-1);
     }
-    if((hub_port_string = strtok(NULL, ":")) == NULL){
+    if((hub_port_string = strtok_r(NULL, ":", &last)) == NULL){
         hub_port = PORT_NO;
     } else {
         hub_port = atoi(hub_port_string);
@@ -151,11 +172,13 @@ open_socket(stedstat_t *stedstat, char *hub, char *proxy)
          * proxy が指定されているので、proxy に接続しにいく必要がある。
          * proxy サーバの hostent 得る。
          */
-        if((proxy_name = strtok(proxy, ":")) == NULL){
+        strncpy(proxy_buf, proxy, sizeof(proxy_buf) - 1);
+        proxy_buf[sizeof(proxy_buf) - 1] = '\0';
+        if((proxy_name = strtok_r(proxy_buf, ":", &last)) == NULL){
             print_err(LOG_ERR,"proxy name was not given\n");
             return(-1);
         }
-        if((proxy_port_string = strtok(NULL, ":")) == NULL){
+        if((proxy_port_string = strtok_r(NULL, ":", &last)) == NULL){
             proxy_port = PORT_NO;
         } else {
             proxy_port = atoi(proxy_port_string);
@@ -212,6 +235,15 @@ open_socket(stedstat_t *stedstat, char *hub, char *proxy)
      */
     stedstat->sock_fd = sock;
 
+    /*
+     * 前の接続に途中まで送ったフレームの残りを送ると、仮想ハブが stehead
+     * の位置を見失うので、送信リングは空にする。受信途中のフレームも捨てる。
+     */
+    stedstat->sendbuflen = stedstat->sendhead = 0;
+    stedstat->sock_blocked = 0;
+    stedstat->flush_at = 0;
+    stedstat->rxlen = 0;
+
     /*
      * HUB 経由の場合CONNECT リクエストを作成。
      */
@@ -225,6 +257,26 @@ open_socket(stedstat_t *stedstat, char *hub, char *proxy)
             return(-1);
         }
     }
+
+    /*
+     * ネットワーク ID が指定されていれば、どのフレームよりも先に仮想ハブ
+     * に知らせる。
+     */
+    if(stedstat->network >= 0 &&
+       send_ctl(stedstat, STECTL_NETWORK, stedstat->network) < 0){
+        print_err(LOG_ERR, "failed to send network ID to HUB\n");
+        return(-1);
+    }
+    /*
+     * 複数の接続を張る場合は、同じ sted の他の接続にフレームを送り返さない
+     * よう、どの接続の何番目かを仮想ハブに知らせる。
+     */
+    if(stedstat->nlanes > 1 &&
+       (send_ctl(stedstat, STECTL_BUNDLE, stedstat->bundle) < 0 ||
+        send_ctl(stedstat, STECTL_LANE, (stedstat->lane << 16) | stedstat->nlanes) < 0)){
+        print_err(LOG_ERR, "failed to send connection ID to HUB\n");
+        return(-1);
+    }
     print_err(LOG_NOTICE, "Successfully connected with HUB\n");
     
     return(sock);
@@ -234,6 +286,10 @@ open_socket(stedstat_t *stedstat, char *hub, char *proxy)
  * read_socket()
  * 
  * HUB(stehub) からのデータを読み込み、 ste ドライバに転送する。
+ * recvbuf の先頭 FRAME_MAX byte は、前回の受信データの未完成のフレーム
+ * を受信データの直前に置くための領域で、recv() はその後ろに読み込む。
+ * stehead はその場で解釈し、フレームはコピーせずにデバイスに書き込む。
+ * コピーするのは、受信データの終わりで途切れたフレームだけ。
  *
  *  引数：
  *           stedstat   : sted 管理用構造体
@@ -245,20 +301,19 @@ open_socket(stedstat_t *stedstat, char *hub, char *proxy)
 int
 read_socket(stedstat_t *stedstat)
 {
-    stehead_t   *steh;
-    int          flags = 0;
+    stehead_t    steh;
     int          recvsize;  // recv() で実際に読み込んだサイズ        
-    int          cnt;       // recvsize の中で、未処理のデータサイズ
+    int          len, orglen, left;
     int          sock_fd = stedstat->sock_fd;
-    u_char      *recvbuf = stedstat->recvbuf;
-    u_char      *readp;
-    u_char      *wdatabuf = stedstat->wdatabuf;
+    u_char      *recvp = stedstat->recvbuf + FRAME_MAX; /* recv() で読み込む位置 */
+    u_char      *readp;     // 未処理のデータの先頭
+    u_char      *endp;      // 受信データの終わり
 
     if(debuglevel > 1){    
         print_err(LOG_DEBUG, "read_socket called\n");
     }
     
-    if( (recvsize = recv(sock_fd, recvbuf, SOCKBUFSIZE,0)) < 0)  {
+    if( (recvsize = recv(sock_fd, recvp, sizeof(stedstat->recvbuf) - FRAME_MAX, 0)) < 0)  {
         SET_ERRNO();
         if(errno == EINTR || errno == EWOULDBLOCK || errno == 0){
             if(debuglevel > 1){
@@ -283,172 +338,79 @@ read_socket(stedstat_t *stedstat)
     
     if(debuglevel > 1){
         print_err(LOG_DEBUG, "========= from hub %d bytes ===================\n", recvsize);
-        print_err(LOG_DEBUG, "datalen(Frame size)                   = %d\n", stedstat->datalen);        
-        print_err(LOG_DEBUG, "dataleft(needed to complete Frame)    = %d\n",stedstat->dataleft);
+        print_err(LOG_DEBUG, "rxlen(incomplete Frame from last recv) = %d\n", stedstat->rxlen);
         if (debuglevel > 2){
             int i;
             for (i = 0; i < recvsize; i++){
                 if((i)%16 == 0){
                     print_err(LOG_DEBUG, "\n%04d: ", i);                    
                 }
-                print_err(LOG_DEBUG, "%02x ", recvbuf[i] & 0xff);                
+                print_err(LOG_DEBUG, "%02x ", recvp[i] & 0xff);                
             }
             print_err(LOG_DEBUG, "\n\n");
         }
     }
 
-    /* 未処理データサイズをセット */
-    cnt = recvsize;
-    /* 処理用のポインタをセット */
-    readp = recvbuf;
+    readp = recvp - stedstat->rxlen;
+    endp = recvp + recvsize;
             
-    while(1){ 
-        if (stedstat->dataleft == 0){
-            /*
-             * 受信データの先頭部分。先頭部分は stehead なので、
-             * 読み込んで、フレームのサイズを得る。
-             */
-            u_char *newp;
-            if((newp = read_socket_header(stedstat, &cnt, readp)) == NULL){
-                /* stehead はまだ不完全。次のデータの到着を待つ */
-                break;
-            }
-            readp = newp;
-        }
+    while(endp - readp >= sizeof(stehead_t)){ 
+        /* stehead はアラインされているとは限らないのでコピーして読む */
+        memcpy(&steh, readp, sizeof(stehead_t));
+        len = ntohl(steh.len);
+        orglen = ntohl(steh.orglen);
         /*
          * 読み取った stehead から、オリジナルの Ethernet フレームのサイズを
-         * 確認し、 0 より大きく、ETHERMAX(1514bytes)以下であることを確かめる。
+         * 確認し、 0 より大きく、ETHERMAX(1514bytes)以下で、パディングが
+         * 3 byte 以下であることを確かめる。
          */
-        if( stedstat->orgdatalen <= 0 || stedstat->orgdatalen > ETHERMAX ){
+        if( orglen <= 0 || orglen > ETHERMAX || len < orglen || len - orglen > 3){
             /*
-             * stehead は壊れていると思われる。以降の受信データは無視し、ループを抜ける。
+             * stehead は壊れていると思われる。以降の受信データは無視する。
              * （仮想ハブが受信パケットをこちらに転送せずに破棄した可能性が高い）
-             *
-             * TODO: この方法だと、未読のデータをすべて破棄するしかなく、また次の受信データの
-             * 先頭が stehead であるという保証も無いため、一度ここに入り込むと、しばらく
-             * ここに来続ける可能性がある・・ヘッダーはデータの境界情報を持つ重要なもの
-             * なので、もっと確実・安全に取り出せる仕組みを検討する必要がある。
              */
-            stedstat->dataleft = stedstat->datalen = stedstat->dummyheadlen = 0;
             if (debuglevel > 0){            
                 print_err(LOG_NOTICE, "read_socket: header is broken\n");
             }
+            readp = endp;
             break;
         }
-        if (debuglevel > 1) {
-            print_err(LOG_DEBUG, "---------------------\n");                            
-            print_err(LOG_DEBUG, "cnt(data size not yet processed)      = %d\n", cnt);
-            print_err(LOG_DEBUG, "datalen(Frame size)                   = %d\n", stedstat->datalen);
-            print_err(LOG_DEBUG, "dataleft(needed to complete Frame)    = %d\n", stedstat->dataleft);
-        }
-        if(cnt < stedstat->dataleft){
+        if(endp - readp < sizeof(stehead_t) + len){
             /* この受信データだけでは元のフレームを再構成できない */
-            /* とりあえずコピーしておいて、次のデータの到着を待つ */
-            /* 書き込み位置は、書き込み済みの位置の次 */
-            memcpy(wdatabuf + (stedstat->datalen - stedstat->dataleft) , readp, cnt);
-            stedstat->dataleft = stedstat->dataleft - cnt;
             if (debuglevel > 1) {
-                print_err(LOG_DEBUG, "Need more %d bytes to complete a framed.\n", stedstat->dataleft);
+                print_err(LOG_DEBUG, "Need more %d bytes to complete a frame.\n",
+                          (int)(sizeof(stehead_t) + len - (endp - readp)));
             }            
             break;
         }
-        if (cnt == stedstat->dataleft){
-            /* この受信データで元のフレームを再構成できる */
-            /* 丁度１フレーム分しか含んでいない */
-            if (debuglevel > 1){
-                print_err(LOG_DEBUG, "Frame completed. And no unread data left.\n");
-            }
-            memcpy(wdatabuf + (stedstat->datalen - stedstat->dataleft), readp, cnt);
-
-            write_ste(stedstat);
-
-            if (debuglevel > 1){
-                print_err(LOG_DEBUG, "wrote %d bytes to driver completed.\n",stedstat->orgdatalen);
-            }            
-            stedstat->dataleft = stedstat->datalen = stedstat->dummyheadlen = 0;
-            break;
-        }
-        if (cnt > stedstat->dataleft){
-            /* この受信データだけで元のフレームを再構成できる */
-            /* さらに別のフレームのデータも含まれている */
-            memcpy(wdatabuf  + (stedstat->datalen - stedstat->dataleft), readp, stedstat->dataleft);
-            write_ste(stedstat);            
-            
-            readp = readp + stedstat->dataleft;
-            cnt = cnt - stedstat->dataleft;
-            stedstat->dataleft = stedstat->datalen = stedstat->dummyheadlen = 0;
-            if (debuglevel > 1){
-                print_err(LOG_DEBUG, "Frame completed. Still %d bytes of unread data.\n", cnt);
-                print_err(LOG_DEBUG, "wrote %d bytes to driver completed.\n",stedstat->orgdatalen);
-            }
-            /* while ループを続ける */
-            continue;
-        }
+        write_ste(stedstat, readp + sizeof(stehead_t), orglen);
+        if (debuglevel > 1){
+            print_err(LOG_DEBUG, "wrote %d bytes to driver completed.\n", orglen);
+        }            
+        readp += sizeof(stehead_t) + len;
     } /* while loop end */
 
+    /*
+     * 未完成のフレーム（FRAME_MAX 未満）を、次の受信データの直前に移す。
+     */
+    left = endp - readp;
+    if(left > 0)
+        memmove(recvp - left, readp, left);
+    stedstat->rxlen = left;
+
     if(debuglevel > 1){                    
         print_err(LOG_DEBUG, "read_socket returned\n");
     }
     return(recvsize);
 }
 
-/*****************************************************************************
- * read_socket_header()
- * 
- * ヘッダー（stehead 構造体）を読み取り、dummyhead にコピーする。
- * 受け取ったポインタにヘッダーの一部しかない場合は、受信部分だけを dummyhead
- * にコピーしておき、次のパケットの到着を待つ。
- *
- *  引数：
- *           stedstat : sted 管理用構造体
- *           cnt      : readp に含まれるデータのサイズ
- *           readp    : 受信データ（stehead 構造体を含むと思われる）
- * 戻り値：
- *          stehead 完成時  : stehead をとばしたデータの読み込み開始位置
- *          stehead 未完成時: NULL
- *****************************************************************************/
-u_char *
-read_socket_header(stedstat_t *stedstat, int *cnt, u_char *readp)
-{
-    int unreadlen; /* まだ recv されていない header の長さ */
-    
-    unreadlen = sizeof(stehead_t) - stedstat->dummyheadlen;
-    
-    if( *cnt >= unreadlen){
-        /* stehead の足りないところは無い */
-        memcpy((char *)&stedstat->dummyhead + stedstat->dummyheadlen, readp, unreadlen);
-        readp = readp + unreadlen;
-        *cnt = *cnt - unreadlen;
-        stedstat->dummyheadlen = sizeof(stehead_t);
-        stedstat->datalen = stedstat->dataleft = ntohl(stedstat->dummyhead.len);
-        stedstat->orgdatalen = ntohl(stedstat->dummyhead.orglen);
-        if (debuglevel > 1) {
-            print_err(LOG_DEBUG, "---------------------\n");            
-            print_err(LOG_DEBUG, "read_socket_header: ste header is completed\n");
-            print_err(LOG_DEBUG, "Data size = %d , Without PAD = %d\n",
-                      stedstat->datalen, stedstat->orgdatalen);
-        }
-        return(readp);
-    } else {
-        /*
-         * ヘッダー部を取得後でないとその後の
-         * 処理がはじめられないので、stehead の
-         * サイズ分が到着するまで recv を繰り返す
-         */
-        memcpy((char *)&stedstat->dummyhead + stedstat->dummyheadlen, readp, *cnt);
-        stedstat->dummyheadlen = stedstat->dummyheadlen + *cnt;
-        if (debuglevel > 1) {
-            print_err(LOG_DEBUG, "---------------------\n");            
-            print_err(LOG_DEBUG, "read_socket_header: Insuficient header.\n");
-        }
-        return((u_char *)NULL);
-    }
-}
-
 /*****************************************************************************
  * write_socket()
  * 
- * stedstat 構造体の sendbuf に溜まっているデータを HUB(stehub) へ転送する。
+ * stedstat 構造体の送信リングに溜まっているデータを HUB(stehub) へ転送する。
+ * send() が EWOULDBLOCK になるか一部しか送れなかった場合は、残りをリングに
+ * 残して sock_blocked をセットし、socket が書き込めるようになってから
+ * 続きを送る。
  *
  *  引数：
  *           stedstat   : sted 管理用構造体
@@ -460,39 +422,112 @@ read_socket_header(stedstat_t *stedstat, int *cnt, u_char *readp)
 int
 write_socket(stedstat_t *stedstat)
 {
+    int sent, len;
+
     if (debuglevel > 1) {        
         print_err(LOG_DEBUG,"write_socket called\n");
     }
     
-    if( stedstat->sendbuflen == 0){
-        if (debuglevel > 1) {
-            print_err(LOG_ERR,"sendbuflen == 0\n");
-            print_err(LOG_ERR,"write_socket returned\n");
-        }
-        return(0);
-    }
-    
-    if ( send(stedstat->sock_fd, stedstat->sendbuf, stedstat->sendbuflen, 0) < 0){
-        SET_ERRNO();
-        if(errno == EINTR || errno == EWOULDBLOCK || errno == 0){
-            if (debuglevel > 1) {            
-                print_err(LOG_NOTICE, "write_socket: send: %s\n", strerror(errno));
-            }                        
-        } else {
+    while(stedstat->sendbuflen > 0){
+        /* リングの終わりで折り返していれば、2 回に分けて送る */
+        len = SENDRING_SIZE - stedstat->sendhead;
+        if(len > stedstat->sendbuflen)
+            len = stedstat->sendbuflen;
+        if ( (sent = send(stedstat->sock_fd, (char *)stedstat->sendbuf + stedstat->sendhead, len, 0)) < 0){
+            SET_ERRNO();
+            if(errno == EINTR)
+                continue;
+            if(errno == EWOULDBLOCK || errno == 0){
+                if (debuglevel > 1) {            
+                    print_err(LOG_NOTICE, "write_socket: send: %s (%d bytes left)\n",
+                              strerror(errno), stedstat->sendbuflen);
+                }                        
+                stedstat->sock_blocked = 1;
+                break;
+            }
             print_err(LOG_ERR,"write_socket: send %s (%d)\n", strerror(errno), errno);
             if (debuglevel > 1) {
                 print_err(LOG_DEBUG,"write_socket returned\n");
             }            
             return(-1);
         }
+        stedstat->sendhead = (stedstat->sendhead + sent) & (SENDRING_SIZE - 1);
+        stedstat->sendbuflen -= sent;
+    }
+    if( stedstat->sendbuflen == 0){
+        /* 空になったら先頭から使い、折り返しを減らす */
+        stedstat->sendhead = 0;
+        stedstat->sock_blocked = 0;
     }
-    stedstat->sendbuflen = 0;  /* 書き込み済みサイズを 0 に戻す */
+    stedstat->flush_at = 0;    /* タイマーは止めず、満了しても何もしない */
     if (debuglevel > 1) {                        
         print_err(LOG_DEBUG,"write_socket returned\n");
     }    
     return(0);
 }
 
+/*****************************************************************************
+ * sendring_put()
+ * 
+ * 送信リングの未送信データの後ろに data を書く。呼び出し側は空きが
+ * あることを確認しておくこと。
+ *
+ *  引数：
+ *           stedstat : sted 管理用構造体
+ *           data     : 書くデータ
+ *           len      : data のサイズ
+ *****************************************************************************/
+void
+sendring_put(stedstat_t *stedstat, void *data, int len)
+{
+    int tail = (stedstat->sendhead + stedstat->sendbuflen) & (SENDRING_SIZE - 1);
+    int first = SENDRING_SIZE - tail;
+
+    if(first >= len){
+        memcpy(stedstat->sendbuf + tail, data, len);
+    } else {
+        memcpy(stedstat->sendbuf + tail, data, first);
+        memcpy(stedstat->sendbuf, (unsigned char *)data + first, len - first);
+    }
+    stedstat->sendbuflen += len;
+}
+
+/*****************************************************************************
+ * send_ctl()
+ *
+ * 制御メッセージを仮想ハブに送る。接続直後で socket のバッファは空なので、
+ * 一度に送れる。
+ *
+ *  引数：
+ *           stedstat : sted 管理用構造体
+ *           type     : 制御メッセージの種類（STECTL_*）
+ *           arg      : 種類毎の引数
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+int
+send_ctl(stedstat_t *stedstat, int type, int arg)
+{
+    unsigned char msg[sizeof(stehead_t) + sizeof(stectl_t)];
+    stehead_t     steh;
+    stectl_t      ctl;
+
+    steh.len = htonl(sizeof(stectl_t));
+    steh.orglen = 0;
+    ctl.type = htonl(type);
+    ctl.arg = htonl(arg);
+    memcpy(msg, &steh, sizeof(stehead_t));
+    memcpy(msg + sizeof(stehead_t), &ctl, sizeof(stectl_t));
+
+    if(send(stedstat->sock_fd, (char *)msg, sizeof(msg), 0) != sizeof(msg)){
+        SET_ERRNO();
+        print_err(LOG_ERR, "send_ctl: send %s (%d)\n", strerror(errno), errno);
+        return(-1);
+    }
+    return(0);
+}
+
 /*****************************************************************************
  * send_connect_req()
  * 
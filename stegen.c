@@ -0,0 +1,814 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright (c) 1986, 2010, Oracle and/or its affiliates. All rights reserved.
+ */
+
+/*
+ * Copright (c) 2004-2010  Kazuyoshi Aizawa <admin2@whiteboard.ne.jp>
+ * All rights reserved.
+ */
+/****************************************************************************
+ * stegen.c
+ *
+ * 仮想ハブ（stehub）の負荷生成ツール。
+ * 仮想 NIC デーモン（sted）の代わりに、複数のポートで仮想ハブに接続し、
+ * stehead を付けた Ethernet フレームを送信する。受信したフレームからは、
+ * 送信した時刻を取り出して片道の遅延を測る。ste ドライバや sted が無い
+ * 環境でも、1 台のホストのループバックで仮想ハブの性能を測れる。
+ *
+ *  gcc stegen.c stehub_hist.c -o stegen -lsocket -lnsl -lpthread
+ *
+ *  Usage: stegen [-h hub[:port]] [-n network] [-P ports] [-T threads]
+ *                [-r rate] [-t seconds] [-s size] [-b percent] [-f pcapfile]
+ *
+ *  引数:
+ *
+ *    -h hub[:port]   仮想ハブが動作するホスト。デフォルトは localhost:80。
+ *    -n network      各ポートが仮想ハブに知らせるネットワーク ID。
+ *                    指定されなければ知らせない。
+ *    -P ports        仮想ハブに接続するポートの数。デフォルトは 2。
+ *    -T threads      送受信を行うスレッドの数。ポートはスレッドに
+ *                    振り分けられる。ポートの数と -r のレートを超える
+ *                    場合はそれに合わせる。デフォルトは 1。
+ *    -r rate         全ポートの合計の送信レート（フレーム/秒）。
+ *                    0 なら送れるだけ送る。デフォルトは 0。
+ *    -t seconds      送信する時間（秒）。デフォルトは 10。
+ *    -s size         Ethernet フレームのサイズ（byte）。"min-max" なら
+ *                    その範囲の一様分布、"imix" なら 64、594、1514 byte を
+ *                    7:4:1 の割合で送る。デフォルトは 64。
+ *    -b percent      ブロードキャストにするフレームの割合（%）。残りは
+ *                    他のいづれかのポート宛のユニキャスト。デフォルトは 0。
+ *    -f pcapfile     pcap ファイルのフレームを順に繰り返し送る。-s は
+ *                    無視する。送信元 MAC アドレスは送信するポートのものに、
+ *                    ユニキャストの宛先は他のいづれかのポートのものに
+ *                    書き換え、ブロードキャスト、マルチキャストはそのまま
+ *                    送る。
+ *
+ * 各フレームの末尾 GEN_TAIL byte には、マジック、送信したポート、送信
+ * した時刻を入れる。受信したポートはこれを見て遅延を測り、マジックの
+ * 無いフレームは数えない。送信を始める前に各ポートから 1 回ずつ
+ * ブロードキャストを送り、仮想ハブに MAC アドレスを学習させる。
+ * 送信が終わってから GEN_DRAIN 秒間受信を続け、送信したフレーム数、
+ * 届くはずのフレーム数（ユニキャストは 1、ブロードキャストはポート数 - 1）、
+ * 受信したフレーム数、遅延のパーセンタイルを表示する。
+ *
+ *****************************************************************************/
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include "sted.h"
+#include "stehub.h"
+
+/*
+ * o 負荷生成ツールが利用する各種パラメータ
+ *
+ *  GEN_MAGIC     フレームの末尾に入れるマジック（"STEG"）
+ *  GEN_TYPE      生成したフレームの Ethernet タイプ（IEEE 802 の実験用）
+ *  GEN_TAIL      フレームの末尾に入れる情報のサイズ
+ *  GEN_BATCH     1 回のループで 1 スレッドが生成する最大フレーム数
+ *  GEN_SBUFSIZE  ポート毎の送信バッファのサイズ
+ *  GEN_DRAIN     送信を止めてから受信を続ける時間（秒）
+ *  GEN_WARMUP    MAC アドレスを学習させてから送信を始めるまでの時間（ミリ秒）
+ *  GEN_PORT_NO   デフォルトの仮想ハブのポート番号
+ */
+#define  GEN_MAGIC      0x53544547
+#define  GEN_TYPE       0x88b5
+#define  GEN_TAIL       16
+#define  GEN_BATCH      64
+#define  GEN_SBUFSIZE   (64 * 1024)
+#define  GEN_DRAIN      1
+#define  GEN_WARMUP     500
+#define  GEN_PORT_NO    80
+#define  GEN_MINSIZE    60
+
+/*
+ * シミュレートするポート
+ */
+struct gport {
+    int                 fd;
+    int                 id;                /* ポートの番号。MAC アドレスにも使う */
+    unsigned char       mac[ETHERADDRL];
+    unsigned char       sbuf[GEN_SBUFSIZE]; /* 送信バッファ */
+    int                 soff;              /* sbuf の送信済みのサイズ */
+    int                 slen;              /* sbuf 中のデータのサイズ */
+    unsigned char       rbuf[FRAME_MAX + SOCKBUFSIZE]; /* 受信バッファ */
+    int                 rlen;              /* rbuf 中の未完成のフレームのサイズ */
+};
+
+/*
+ * 送受信を行うスレッド。ports から nports 個のポートを受け持つ。
+ */
+struct gthread {
+    pthread_t           thread;
+    struct gport       *ports;
+    int                 nports;
+    int                 next;              /* 次にフレームを生成するポート */
+    unsigned int        seed;              /* rand_r() の種 */
+    uint64_t            rate;              /* このスレッドの送信レート */
+    uint64_t            tx_frames;         /* 送信したフレーム数 */
+    uint64_t            tx_bytes;          /* 送信したバイト数（Ethernet フレーム）*/
+    uint64_t            rx_frames;         /* 受信したフレーム数 */
+    uint64_t            rx_bytes;          /* 受信したバイト数（Ethernet フレーム）*/
+    uint64_t            expected;          /* 届くはずのフレーム数 */
+    uint64_t            blocked;           /* 送信が EWOULDBLOCK になった回数 */
+    uint64_t            pidx;              /* 次に送る pcap のフレーム */
+    hist_t              lat;               /* 遅延のヒストグラム */
+};
+
+/*
+ * pcap ファイルから読み込んだフレーム
+ */
+struct pframe {
+    int                 len;
+    unsigned char      *data;
+};
+
+int   parse_size(char *);
+int   load_pcap(char *);
+int   open_port(struct gport *, struct sockaddr_in *, int);
+void *gen_main(void *);
+int   gen_frame(struct gthread *, struct gport *, unsigned char *);
+int   gen_size(struct gthread *);
+int   flush_port(struct gthread *, struct gport *);
+int   recv_port(struct gthread *, struct gport *, uint64_t);
+uint64_t gen_nsec();
+void  print_usage(char *);
+
+struct gport      *ports;              /* 全ポートの配列 */
+int                nports = 2;         /* ポートの数 */
+int                size_min = 64;      /* フレームサイズの最小値 */
+int                size_max = 64;      /* フレームサイズの最大値 */
+int                size_imix = 0;      /* IMIX の分布でサイズを選ぶ */
+int                bcast_pct = 0;      /* ブロードキャストの割合（%）*/
+struct pframe     *pframes;            /* pcap ファイルのフレーム */
+int                npframes = 0;       /* pframes 中のフレーム数 */
+uint64_t           start_nsec;         /* 送信を始めた時刻 */
+uint64_t           stop_nsec;          /* 送信を止める時刻 */
+uint64_t           end_nsec;           /* 受信を止める時刻 */
+
+int
+main(int argc, char *argv[])
+{
+    struct sockaddr_in  sin;
+    struct hostent     *hep;
+    struct gthread     *threads, *t;
+    char                hub[MAXHOSTNAME + 8] = "localhost";
+    char               *p, *pcapfile = NULL;
+    int                 hub_port = GEN_PORT_NO;
+    int                 network = -1;
+    int                 nthreads = 1;
+    uint64_t            rate = 0;
+    int                 seconds = 10;
+    int                 c, i, n;
+    double              elapsed;
+    uint64_t            tx_frames = 0, tx_bytes = 0, rx_frames = 0, rx_bytes = 0;
+    uint64_t            expected = 0, blocked = 0, lost;
+    hist_t              lat;
+
+    while ((c = getopt(argc, argv, "h:n:P:T:r:t:s:b:f:")) != EOF){
+        switch (c) {
+            case 'h':
+                strncpy(hub, optarg, sizeof(hub) - 1);
+                if((p = strchr(hub, ':')) != NULL){
+                    *p = '\0';
+                    hub_port = atoi(p + 1);
+                }
+                break;
+            case 'n':
+                if((network = atoi(optarg)) < 0)
+                    print_usage(argv[0]);
+                break;
+            case 'P':
+                if((nports = atoi(optarg)) < 2)
+                    print_usage(argv[0]);
+                break;
+            case 'T':
+                if((nthreads = atoi(optarg)) < 1)
+                    print_usage(argv[0]);
+                break;
+            case 'r':
+                rate = strtoull(optarg, NULL, 10);
+                break;
+            case 't':
+                if((seconds = atoi(optarg)) < 1)
+                    print_usage(argv[0]);
+                break;
+            case 's':
+                if(parse_size(optarg) < 0)
+                    print_usage(argv[0]);
+                break;
+            case 'b':
+                bcast_pct = atoi(optarg);
+                if(bcast_pct < 0 || bcast_pct > 100)
+                    print_usage(argv[0]);
+                break;
+            case 'f':
+                pcapfile = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+        }
+    }
+    if(nthreads > nports)
+        nthreads = nports;
+    /* 送信レートの割り当てが 0（送れるだけ送る）になるスレッドは作らない */
+    if(rate > 0 && nthreads > rate)
+        nthreads = rate;
+    if(pcapfile != NULL && load_pcap(pcapfile) < 0)
+        exit(1);
+
+    if((hep = gethostbyname(hub)) == NULL){
+        fprintf(stderr, "%s: unknown host\n", hub);
+        exit(1);
+    }
+    memset(&sin, 0x0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(hub_port);
+    memcpy(&sin.sin_addr, hep->h_addr, hep->h_length);
+
+    /*
+     * ポートを接続し、仮想ハブに MAC アドレスを学習させる。
+     */
+    if((ports = (struct gport *)calloc(nports, sizeof(struct gport))) == NULL ||
+       (threads = (struct gthread *)calloc(nthreads, sizeof(struct gthread))) == NULL){
+        fprintf(stderr, "can't allocate ports\n");
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    for(i = 0 ; i < nports ; i++){
+        if(open_port(&ports[i], &sin, network) < 0)
+            exit(1);
+        ports[i].id = i;
+    }
+    usleep(GEN_WARMUP * 1000);
+
+    /*
+     * ポートをスレッドに振り分けて、送受信を始める。
+     */
+    start_nsec = gen_nsec();
+    stop_nsec = start_nsec + (uint64_t)seconds * 1000000000ULL;
+    end_nsec = stop_nsec + GEN_DRAIN * 1000000000ULL;
+    for(i = 0, n = 0 ; i < nthreads ; i++){
+        t = &threads[i];
+        t->ports = &ports[n];
+        t->nports = nports / nthreads + (i < nports % nthreads);
+        t->seed = i + 1;
+        t->rate = rate / nthreads + (i < rate % nthreads);
+        n += t->nports;
+        if(pthread_create(&t->thread, NULL, gen_main, (void *)t) != 0){
+            fprintf(stderr, "can't create thread %d\n", i);
+            exit(1);
+        }
+    }
+
+    memset(&lat, 0x0, sizeof(lat));
+    for(i = 0 ; i < nthreads ; i++){
+        t = &threads[i];
+        pthread_join(t->thread, NULL);
+        tx_frames += t->tx_frames;
+        tx_bytes += t->tx_bytes;
+        rx_frames += t->rx_frames;
+        rx_bytes += t->rx_bytes;
+        expected += t->expected;
+        blocked += t->blocked;
+        hist_merge(&lat, &t->lat);
+    }
+
+    elapsed = seconds;
+    lost = expected > rx_frames ? expected - rx_frames : 0;
+    printf("%d ports, %d thread%s, %d seconds\n", nports, nthreads, nthreads > 1 ? "s" : "", seconds);
+    printf("tx: %llu frames, %llu bytes (%.0f pps, %.2f Mbit/s), %llu blocked\n",
+           (unsigned long long)tx_frames, (unsigned long long)tx_bytes,
+           tx_frames / elapsed, tx_bytes * 8 / elapsed / 1000000, (unsigned long long)blocked);
+    printf("rx: %llu frames, %llu bytes (%.0f pps, %.2f Mbit/s)\n",
+           (unsigned long long)rx_frames, (unsigned long long)rx_bytes,
+           rx_frames / elapsed, rx_bytes * 8 / elapsed / 1000000);
+    printf("expected: %llu frames, lost: %llu (%.3f%%)\n",
+           (unsigned long long)expected, (unsigned long long)lost,
+           expected > 0 ? lost * 100.0 / expected : 0.0);
+    printf("latency (usec): p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n",
+           hist_value(&lat, 0.5) / 1000.0, hist_value(&lat, 0.99) / 1000.0,
+           hist_value(&lat, 0.999) / 1000.0, lat.max / 1000.0);
+    return(0);
+}
+
+/*****************************************************************************
+ * parse_size()
+ *
+ * -s の引数を解釈する。
+ *
+ *  引数：
+ *          arg : "size"、"min-max"、または "imix"
+ *  戻り値：
+ *          正常時 : 0
+ *          不正な指定 : -1
+ *****************************************************************************/
+int
+parse_size(char *arg)
+{
+    char *p;
+
+    if(strcmp(arg, "imix") == 0){
+        size_imix = 1;
+        return(0);
+    }
+    size_min = size_max = atoi(arg);
+    if((p = strchr(arg, '-')) != NULL)
+        size_max = atoi(p + 1);
+    if(size_min < GEN_MINSIZE || size_max > ETHERMAX || size_min > size_max)
+        return(-1);
+    return(0);
+}
+
+/*****************************************************************************
+ * load_pcap()
+ *
+ * pcap ファイルのフレームをすべてメモリに読み込む。ETHERMAX より大きい
+ * フレームは切り詰める。
+ *
+ *  引数：
+ *          file : pcap ファイルのパス
+ *  戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+int
+load_pcap(char *file)
+{
+    FILE          *fp;
+    uint32_t       ghdr[6], rhdr[4], magic;
+    int            swap, caplen, size = 0;
+    struct pframe *pf;
+
+    if((fp = fopen(file, "rb")) == NULL){
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        return(-1);
+    }
+    if(fread(ghdr, sizeof(ghdr), 1, fp) != 1){
+        fprintf(stderr, "%s: not a pcap file\n", file);
+        fclose(fp);
+        return(-1);
+    }
+    /* マイクロ秒、ナノ秒のどちらの形式も、タイムスタンプは使わない */
+    magic = ghdr[0];
+    if(magic == 0xa1b2c3d4 || magic == 0xa1b23c4d)
+        swap = 0;
+    else if(magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1)
+        swap = 1;
+    else {
+        fprintf(stderr, "%s: not a pcap file\n", file);
+        fclose(fp);
+        return(-1);
+    }
+#define SWAP32(x) (swap ? (((x) >> 24) | (((x) >> 8) & 0xff00) | (((x) << 8) & 0xff0000) | ((x) << 24)) : (x))
+    if(SWAP32(ghdr[5]) != 1){
+        fprintf(stderr, "%s: link type is not Ethernet\n", file);
+        fclose(fp);
+        return(-1);
+    }
+
+    while(fread(rhdr, sizeof(rhdr), 1, fp) == 1){
+        caplen = SWAP32(rhdr[2]);
+        if(caplen < 0 || caplen > 262144)
+            break;
+        if(npframes == size){
+            size = size ? size * 2 : 1024;
+            if((pf = (struct pframe *)realloc(pframes, size * sizeof(struct pframe))) == NULL)
+                break;
+            pframes = pf;
+        }
+        pf = &pframes[npframes];
+        if((pf->data = (unsigned char *)malloc(caplen > 0 ? caplen : 1)) == NULL ||
+           fread(pf->data, 1, caplen, fp) != caplen)
+            break;
+        if(caplen < ETHERHEADERL){
+            free(pf->data);
+            continue;
+        }
+        pf->len = caplen > ETHERMAX ? ETHERMAX : caplen;
+        npframes++;
+    }
+#undef SWAP32
+    fclose(fp);
+    if(npframes == 0){
+        fprintf(stderr, "%s: no Ethernet frames\n", file);
+        return(-1);
+    }
+    return(0);
+}
+
+/*****************************************************************************
+ * open_port()
+ *
+ * ポートを仮想ハブに接続する。ネットワーク ID が指定されていれば知らせ、
+ * MAC アドレスを学習させるためにブロードキャストを 1 つ送る。
+ * 接続した後は non-blocking にする。
+ *
+ *  引数：
+ *          gp      : ポート
+ *          sin     : 仮想ハブのアドレス
+ *          network : ネットワーク ID。-1 なら知らせない
+ *  戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+int
+open_port(struct gport *gp, struct sockaddr_in *sin, int network)
+{
+    unsigned char  buf[sizeof(stehead_t) + sizeof(stectl_t) + sizeof(stehead_t) + GEN_MINSIZE];
+    unsigned char *p = buf;
+    stehead_t      steh;
+    stectl_t       ctl;
+    int            id = gp - ports;
+    int            on = 1;
+
+    if((gp->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+       connect(gp->fd, (struct sockaddr *)sin, sizeof(*sin)) < 0){
+        fprintf(stderr, "port %d: connect: %s\n", id, strerror(errno));
+        return(-1);
+    }
+    /* 送信はスレッドがまとめて行うので、Nagle アルゴリズムで遅らせない */
+    setsockopt(gp->fd, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));
+    gp->mac[0] = 0x02;
+    gp->mac[1] = 0x53;
+    gp->mac[2] = 0x54;
+    gp->mac[3] = (id >> 16) & 0xff;
+    gp->mac[4] = (id >> 8) & 0xff;
+    gp->mac[5] = id & 0xff;
+
+    if(network >= 0){
+        steh.len = htonl(sizeof(stectl_t));
+        steh.orglen = 0;
+        ctl.type = htonl(STECTL_NETWORK);
+        ctl.arg = htonl(network);
+        memcpy(p, &steh, sizeof(steh));
+        memcpy(p + sizeof(steh), &ctl, sizeof(ctl));
+        p += sizeof(steh) + sizeof(ctl);
+    }
+    steh.len = steh.orglen = htonl(GEN_MINSIZE);
+    memcpy(p, &steh, sizeof(steh));
+    p += sizeof(steh);
+    memset(p, 0x0, GEN_MINSIZE);
+    memset(p, 0xff, ETHERADDRL);
+    memcpy(p + ETHERADDRL, gp->mac, ETHERADDRL);
+    p[12] = GEN_TYPE >> 8;
+    p[13] = GEN_TYPE & 0xff;
+    p += GEN_MINSIZE;
+    if(send(gp->fd, buf, p - buf, 0) != p - buf){
+        fprintf(stderr, "port %d: send: %s\n", id, strerror(errno));
+        return(-1);
+    }
+    return(fcntl(gp->fd, F_SETFL, O_NONBLOCK));
+}
+
+/*****************************************************************************
+ * gen_main()
+ *
+ * スレッドのメインループ。送信レートに合わせてフレームを生成して
+ * ポートの送信バッファに入れ、送信し、受信したフレームの遅延を測る。
+ * 送信バッファに空きの無いポートの分は生成しない（仮想ハブからの
+ * 背圧は、送信できたフレーム数の減少として現れる）。
+ *****************************************************************************/
+void *
+gen_main(void *arg)
+{
+    struct gthread *t = (struct gthread *)arg;
+    struct gport   *gp;
+    struct pollfd  *pfds;
+    uint64_t        now, due, generated = 0;
+    int             i, k, len, full, timeout;
+
+    if((pfds = (struct pollfd *)calloc(t->nports, sizeof(struct pollfd))) == NULL){
+        fprintf(stderr, "can't allocate pollfd\n");
+        exit(1);
+    }
+
+    for(;;){
+        now = gen_nsec();
+        if(now >= end_nsec)
+            break;
+
+        /*
+         * 送信するフレームを生成する。
+         */
+        full = 0;
+        if(now < stop_nsec){
+            if(t->rate > 0){
+                due = (now - start_nsec) * t->rate / 1000000000ULL;
+                due = due > generated ? due - generated : 0;
+                if(due > GEN_BATCH * t->nports)
+                    due = GEN_BATCH * t->nports;
+            } else {
+                due = GEN_BATCH;
+            }
+            while(due > 0 && full < t->nports){
+                gp = &t->ports[t->next];
+                t->next = (t->next + 1) % t->nports;
+                if(gp->slen + FRAME_MAX > GEN_SBUFSIZE){
+                    full++;
+                    continue;
+                }
+                full = 0;
+                len = gen_frame(t, gp, gp->sbuf + gp->slen);
+                gp->slen += len;
+                generated++;
+                due--;
+            }
+        }
+
+        for(i = 0 ; i < t->nports ; i++){
+            gp = &t->ports[i];
+            if(gp->slen > gp->soff && flush_port(t, gp) < 0)
+                exit(1);
+            pfds[i].fd = gp->fd;
+            pfds[i].events = POLLIN | (gp->slen > gp->soff ? POLLOUT : 0);
+            pfds[i].revents = 0;
+        }
+
+        /*
+         * 次のフレームを送る時刻まで、受信を待つ。
+         */
+        timeout = 10;
+        if(now < stop_nsec && !full){
+            if(t->rate == 0){
+                timeout = 0;
+            } else {
+                due = start_nsec + (generated + 1) * 1000000000ULL / t->rate;
+                due = due > now ? (due - now) / 1000000 : 0;
+                timeout = due < timeout ? due : timeout;
+            }
+        }
+        if(poll(pfds, t->nports, timeout) < 0 && errno != EINTR){
+            fprintf(stderr, "poll: %s\n", strerror(errno));
+            exit(1);
+        }
+        now = gen_nsec();
+        for(i = 0 ; i < t->nports ; i++){
+            if(pfds[i].revents & (POLLIN | POLLERR | POLLHUP)){
+                for(k = 0 ; k < 16 && recv_port(t, &t->ports[i], now) > 0 ; k++)
+                    ;
+            }
+        }
+    }
+    free(pfds);
+    return(NULL);
+}
+
+/*****************************************************************************
+ * gen_frame()
+ *
+ * 1 つのフレームを生成し、stehead を付けて buf に書き込む。
+ *
+ *  引数：
+ *          t   : スレッド
+ *          gp  : 送信するポート
+ *          buf : 書き込む位置（FRAME_MAX byte 以上の空きがあること）
+ *  戻り値：
+ *          書き込んだサイズ
+ *****************************************************************************/
+int
+gen_frame(struct gthread *t, struct gport *gp, unsigned char *buf)
+{
+    unsigned char *eth = buf + sizeof(stehead_t);
+    struct pframe *pf = NULL;
+    stehead_t      steh;
+    uint32_t       v;
+    uint64_t       ts;
+    int            len, pad, dst;
+
+    if(npframes > 0){
+        pf = &pframes[t->pidx++ % npframes];
+        len = pf->len < GEN_MINSIZE ? GEN_MINSIZE : pf->len;
+        memcpy(eth, pf->data, pf->len);
+        memset(eth + pf->len, 0x0, len - pf->len);
+    } else {
+        len = gen_size(t);
+        memset(eth, 0x0, len);
+        eth[12] = GEN_TYPE >> 8;
+        eth[13] = GEN_TYPE & 0xff;
+    }
+
+    /*
+     * 宛先を決める。ユニキャストは自分以外のいづれかのポート宛。
+     */
+    if(pf != NULL ? (pf->data[0] & 0x01) : (rand_r(&t->seed) % 100 < bcast_pct)){
+        if(pf == NULL)
+            memset(eth, 0xff, ETHERADDRL);
+        t->expected += nports - 1;
+    } else {
+        dst = rand_r(&t->seed) % (nports - 1);
+        if(dst >= gp->id)
+            dst++;
+        memcpy(eth, ports[dst].mac, ETHERADDRL);
+        t->expected++;
+    }
+    memcpy(eth + ETHERADDRL, gp->mac, ETHERADDRL);
+
+    /* 末尾にマジック、送信したポート、送信した時刻を入れる */
+    v = htonl(GEN_MAGIC);
+    memcpy(eth + len - GEN_TAIL, &v, sizeof(v));
+    v = htonl(gp->id);
+    memcpy(eth + len - GEN_TAIL + 4, &v, sizeof(v));
+    ts = gen_nsec();
+    memcpy(eth + len - GEN_TAIL + 8, &ts, sizeof(ts));
+
+    pad = (4 - len % 4) % 4;
+    memset(eth + len, 0x0, pad);
+    steh.len = htonl(len + pad);
+    steh.orglen = htonl(len);
+    memcpy(buf, &steh, sizeof(steh));
+
+    t->tx_frames++;
+    t->tx_bytes += len;
+    return(sizeof(stehead_t) + len + pad);
+}
+
+/*****************************************************************************
+ * gen_size()
+ *
+ * 生成するフレームのサイズを選ぶ。
+ *****************************************************************************/
+int
+gen_size(struct gthread *t)
+{
+    int r;
+
+    if(size_imix){
+        r = rand_r(&t->seed) % 12;
+        return(r < 7 ? 64 : r < 11 ? 594 : ETHERMAX);
+    }
+    if(size_min == size_max)
+        return(size_min);
+    return(size_min + rand_r(&t->seed) % (size_max - size_min + 1));
+}
+
+/*****************************************************************************
+ * flush_port()
+ *
+ * ポートの送信バッファのデータを送信する。送信しきれなかった分は残す。
+ *
+ *  戻り値：
+ *          正常時 : 0
+ *          切断された : -1
+ *****************************************************************************/
+int
+flush_port(struct gthread *t, struct gport *gp)
+{
+    int n;
+
+    while(gp->soff < gp->slen){
+        if((n = send(gp->fd, gp->sbuf + gp->soff, gp->slen - gp->soff, 0)) < 0){
+            if(errno == EINTR)
+                continue;
+            if(errno == EWOULDBLOCK || errno == EAGAIN){
+                t->blocked++;
+                return(0);
+            }
+            fprintf(stderr, "port %d: send: %s\n", gp->id, strerror(errno));
+            return(-1);
+        }
+        gp->soff += n;
+    }
+    gp->soff = gp->slen = 0;
+    return(0);
+}
+
+/*****************************************************************************
+ * recv_port()
+ *
+ * ポートからデータを読み込み、完成したフレームの遅延を記録する。
+ *
+ *  引数：
+ *          t   : スレッド
+ *          gp  : 読み込むポート
+ *          now : 受信した時刻（ナノ秒）
+ *  戻り値：
+ *          読み込んだ : 1
+ *          データが無い : 0
+ *****************************************************************************/
+int
+recv_port(struct gthread *t, struct gport *gp, uint64_t now)
+{
+    unsigned char *p, *eth;
+    stehead_t      steh;
+    uint32_t       magic;
+    uint64_t       ts;
+    int            n, len, orglen, left;
+
+    if((n = recv(gp->fd, gp->rbuf + gp->rlen, sizeof(gp->rbuf) - gp->rlen, 0)) < 0){
+        if(errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN)
+            return(0);
+        fprintf(stderr, "port %d: recv: %s\n", gp->id, strerror(errno));
+        exit(1);
+    }
+    if(n == 0){
+        fprintf(stderr, "port %d: connection closed by hub\n", gp->id);
+        exit(1);
+    }
+
+    p = gp->rbuf;
+    left = gp->rlen + n;
+    while(left >= sizeof(stehead_t)){
+        memcpy(&steh, p, sizeof(steh));
+        len = ntohl(steh.len);
+        orglen = ntohl(steh.orglen);
+        if(len < 0 || len > ETHERMAX + 3){
+            fprintf(stderr, "port %d: header is broken (len = %d)\n", gp->id, len);
+            exit(1);
+        }
+        if(left < sizeof(stehead_t) + len)
+            break;
+        eth = p + sizeof(stehead_t);
+        if(orglen >= ETHERHEADERL + GEN_TAIL){
+            memcpy(&magic, eth + orglen - GEN_TAIL, sizeof(magic));
+            if(ntohl(magic) == GEN_MAGIC){
+                memcpy(&ts, eth + orglen - GEN_TAIL + 8, sizeof(ts));
+                hist_record(&t->lat, now > ts ? now - ts : 0);
+                t->rx_frames++;
+                t->rx_bytes += orglen;
+            }
+        }
+        p += sizeof(stehead_t) + len;
+        left -= sizeof(stehead_t) + len;
+    }
+    memmove(gp->rbuf, p, left);
+    gp->rlen = left;
+    return(1);
+}
+
+/*****************************************************************************
+ * gen_nsec()
+ *
+ * 現在時刻（ナノ秒）を返す。遅延は送信と受信の時刻の差なので、
+ * 単調増加する時計を使う。
+ *****************************************************************************/
+uint64_t
+gen_nsec()
+{
+    struct timeval  tv;
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if(clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+#endif
+    gettimeofday(&tv, NULL);
+    return((uint64_t)tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL);
+}
+
+/*****************************************************************************
+ * print_usage()
+ *
+ * Usage を表示し、終了する。
+ *****************************************************************************/
+void
+print_usage(char *argv)
+{
+    printf ("Usage: %s [-h hub[:port]] [-n network] [-P ports] [-T threads]\n", argv);
+    printf ("\t\t[-r rate] [-t seconds] [-s size] [-b percent] [-f pcapfile]\n");
+    printf ("\t-h hub[:port] : Hub to connect to (default localhost:80)\n");
+    printf ("\t-n network    : Network ID to join\n");
+    printf ("\t-P ports      : Number of simulated ports (default 2)\n");
+    printf ("\t-T threads    : Number of sender/receiver threads (default 1)\n");
+    printf ("\t-r rate       : Total frames per second (0 = as fast as possible)\n");
+    printf ("\t-t seconds    : Duration of the test (default 10)\n");
+    printf ("\t-s size       : Frame size, min-max or imix (default 64)\n");
+    printf ("\t-b percent    : Percentage of broadcast frames (default 0)\n");
+    printf ("\t-f pcapfile   : Replay frames from a pcap file\n");
+    exit(0);
+}
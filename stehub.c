@@ -32,13 +32,69 @@
  * 仮想ハブ。仮想 NIC デーモンからの Ethernet フレームを受け取り、
  * 他の仮想 NIC デーモンへ転送する役割を持つユーザプロセス。
  *
- *  gcc stehub.c -o stehub -lsocket -lnsl
+ *  gcc stehub.c stehub_event.c stehub_fdb.c stehub_queue.c stehub_domain.c stehub_storm.c \
+ *      stehub_mdb.c stehub_stats.c stehub_hist.c stehub_bundle.c sted_flow.c -o stehub -lsocket -lnsl -lpthread
  *
- * Usage: stehub [ -p port] [-d level]
+ * Usage: stehub [ -p port] [-d level] [-e engine] [-a aging]
+ *               [-q frames[:bytes]] [-P policy] [-w workers] [-B iovecs[:bytes]]
+ *               [-t host[:port][/network]]... [-s kind=frames[:bytes]]...
+ *               [-S kind=frames[:bytes]]... [-m aging] [-A path] [-H]
  *
  *     引数:
  *        -p port  仮想 NIC デーモンからの接続を待ち受けるポート番号を指定する。
  *                 指定されなければ、デフォルトで 80 が使われる。
+ *        -e engine
+ *                 イベントエンジン（epoll, port, select, uring）を指定する。
+ *                 指定されなければ、利用可能なもののうち最良のものが使われる。
+ *                 uring は指定した場合だけ使われ、カーネルが対応していな
+ *                 ければ指定しなかった時と同じものが使われる。uring では
+ *                 ポートの受信と送信も io_uring で行う（Linux 6.0 以降）。
+ *        -a aging 学習した MAC アドレスのエージング時間（秒）。デフォルトは 300。
+ *                 0 を指定すると学習を行わず、全フレームを同じネットワーク ID
+ *                 の全ポートに送信する。
+ *        -q frames[:bytes]
+ *                 ポート毎の送信キューに保持する最大フレーム数とバイト数。
+ *                 デフォルトは 256 フレーム、256K バイト。
+ *        -P policy
+ *                 送信キューが一杯の時に捨てるフレーム。tail なら新しい
+ *                 フレーム、head なら古いフレームを捨てる。デフォルトは tail。
+ *        -w workers
+ *                 ワーカースレッドの数。コネクションはワーカーに振り分けられ、
+ *                 各ワーカーが自分のコネクションの送受信を行う。デフォルトは 1。
+ *        -B iovecs[:bytes]
+ *                 1 回の writev() でまとめて送信する最大 iovec 数とバイト数。
+ *                 デフォルトは 64 iovec、256K バイト。
+ *        -t host[:port][/network]
+ *                 他の仮想ハブにトランクを張る。複数指定できる。ポート番号が
+ *                 指定されなければ 80 が使われる。トランクは 1 つのネットワーク
+ *                 ID（デフォルトは 0）のフレームだけを運ぶ。トランクから受信したフレーム
+ *                 は他のトランクには転送しない（split horizon）ので、トランクで
+ *                 繋ぐ仮想ハブ同士はフルメッシュにし、2 つの仮想ハブの間の
+ *                 トランクは片側からだけ張ること。
+ *        -s kind=frames[:bytes]
+ *                 ポート毎のストーム制御。1 つのポートから受信して全ポートに
+ *                 送信するフレームを、1 秒あたり frames フレーム、bytes バイト
+ *                 までに制限する。kind はブロードキャスト（bcast）、マルチ
+ *                 キャスト（mcast）、未学習のユニキャスト（unknown）のいづれか
+ *                 で、種類毎に指定する。デフォルトは無制限。トランクには
+ *                 適用しない。
+ *        -S kind=frames[:bytes]
+ *                 ドメイン（ネットワーク ID）毎のストーム制御。ドメインの
+ *                 全ポートから受信して全ポートに送信するフレームの合計を
+ *                 制限する。指定の形式は -s と同じ。
+ *        -m aging IGMP/MLD snooping で覚えたマルチキャストグループのメンバーと
+ *                 ルータのエージング時間（秒）。デフォルトは 260。メンバーの
+ *                 いるグループ宛のフレームは、メンバーとルータのポートにだけ
+ *                 送信する。Report と Leave はルータのポートにだけ送信する。
+ *                 0 を指定すると snooping を行わず、マルチキャストは
+ *                 全ポートに送信する。
+ *        -A path  統計情報を返す UNIX ドメインソケットのパス。ポート毎、
+ *                 ドメイン毎、ワーカー毎の送受信数、理由別の破棄数、送信
+ *                 キューの長さを、テキストか JSON（最初の 1 行で "json" を
+ *                 送った場合）で返す。指定されなければ待ち受けない。
+ *                 フレームを受信してから送信するまでの遅延のパーセンタイル
+ *                 （p50、p99、p999）も、ポート毎と全体について返す。
+ *        -H       遅延のヒストグラムを取らない。
  *
  * 変更履歴 :
  *    o recv() の バッファサイズを 500byte から 32K bytes に変更。
@@ -64,6 +120,75 @@
  *  2005/03/27
  *   o Windows 上でも利用可能なように修正した（まだ未使用）
  *   o recv() のエラー処理が間違っていたので修正した。
+ *  2026/10/17
+ *   o select() をやめ、stehub_event.c のイベントエンジン（epoll, event port,
+ *     select）を使うようにした。FD_SETSIZE の制限が無くなった。
+ *   o 1 回の起床で 1 コネクションから recv() する回数に上限を設け、読み残した
+ *     コネクションは ready リストで管理するようにした。
+ *   o accept() を EWOULDBLOCK になるまでループで行うようにし、listen() の
+ *     バックログを 5 から LISTEN_BACKLOG に増やした。
+ *   o recv() したデータをそのまま転送するのをやめ、stehead で区切られた
+ *     フレーム単位で転送するようにした。送信できない場合もフレームの途中
+ *     で止めることはせず、破棄はフレーム単位で行う。
+ *   o 送信元 MAC アドレスを学習し（stehub_fdb.c）、学習済みの宛先への
+ *     ユニキャストはそのポートにだけ送信するようにした。
+ *   o ポート毎に上限付きの送信キュー（stehub_queue.c）を持つようにした。
+ *     すぐに送信できないフレームは捨てずにキューに入れ、書き込み可能に
+ *     なった時に送信する。キューが一杯の場合の破棄はフレーム単位で行い、
+ *     破棄したフレーム数を数える。
+ *   o 複数のワーカースレッドで動作できるようにした（-w オプション）。
+ *     コネクションはワーカーに振り分け（SO_REUSEPORT が使えればカーネル
+ *     が、使えなければ先に accept() したワーカーが受け持つ）、他のワーカー
+ *     のコネクションへのフレームはロックを使わないリングで渡す。
+ *     MAC アドレステーブルは全ワーカーで共有する。
+ *   o 受信バッファを参照カウント付きにし（stehub_queue.c）、送信キューと
+ *     ワーカー間のリングはフレームをコピーせずに受信バッファを参照する
+ *     ようにした。ブロードキャストを多数のポートに送る場合も、受信
+ *     バッファは 1 つで済む。rxbuf に残した未完成のフレームは、次の
+ *     受信データの直前に置いて続けて処理する。
+ *   o 送信はフレーム毎、受信データ毎に send() するのをやめ、1 回の起床の間
+ *     ポート毎に溜めて writev() でまとめて行うようにした（-B オプション）。
+ *   o Linux の io_uring を使うイベントエンジン（-e uring）を追加した。
+ *     ポートの受信と送信も io_uring で行う。
+ *   o conn_stat のリンクリストをやめ、ワーカー毎に全コネクションを詰めて
+ *     並べた active 配列で管理するようにした。イベントは conn_stat を
+ *     直接指すので、fd から引く表は持たない。追加、削除はリストをたどらずに
+ *     行い、全ポートへの送信は active 配列を順に見る。conn_stat はキャッシュラインの境界に置き、
+ *     ポート毎の受信、送信のカウンタを持つようにした。
+ *   o 同じ送信元からのフレームが続く間は、MAC アドレスの学習を 1 秒に
+ *     1 回だけ行うようにした。
+ *   o 他の仮想ハブとのトランク（-t オプション）を追加した。トランクは
+ *     接続直後に制御メッセージ（STECTL_TRUNK）を送って相手に知らせ、
+ *     切断されたら TRUNK_RETRY 秒後に再接続する。トランクから受信した
+ *     フレームは他のトランクには転送しない。
+ *   o 1 つの stehub の中に、ネットワーク ID 毎に独立した仮想スイッチ
+ *     （ドメイン、stehub_domain.c）を持てるようにした。ポートは接続直後の
+ *     制御メッセージ（STECTL_NETWORK）でネットワーク ID を名乗り、
+ *     ドメイン毎の MAC アドレステーブルを使い、同じドメインのポートにだけ
+ *     フレームを転送する。名乗らないポートは、最初のフレームを受信した
+ *     時か JOIN_WAIT 秒後にネットワーク 0 に参加する。
+ *   o 全ポートに送信するフレームのストーム制御（stehub_storm.c、-s、-S
+ *     オプション）を追加した。上限を超えたフレームは全ポートに送信する前に
+ *     破棄し、ポート毎、ドメイン毎に破棄したフレーム数を数える。
+ *   o IGMP/MLD snooping（stehub_mdb.c、-m オプション）を追加した。
+ *     ドメイン毎にマルチキャストグループのメンバーとルータのポートを覚え、
+ *     メンバーのいるグループ宛のフレームはそれらのポートにだけ送信する。
+ *     Report と Leave はルータのポートにだけ送信する。
+ *   o 統計情報を UNIX ドメインソケットで返すようにした（stehub_stats.c、
+ *     -A オプション）。ポート毎の送信フレーム数、ユニキャストと全ポート
+ *     への送信の内訳、writev() が詰まった回数、ワーカー毎の壊れた
+ *     stehead とリングでの破棄の数を数えるようにした。
+ *   o フレームに受信した時刻を付け、送信キューから送信し終わるまでの遅延を
+ *     ポート毎のヒストグラム（stehub_hist.c）に記録するようにした。
+ *     パーセンタイルは統計情報で返す。-H で無効にできる。
+ *   o 1 つの sted が張る複数の接続（sted の -c オプション）を、接続直後の
+ *     制御メッセージ（STECTL_BUNDLE、STECTL_LANE）でまとめて扱うように
+ *     した。同じ sted の接続から受信したフレームは、その sted の他の接続
+ *     には送信しない。全ポートに送信するフレームは、flow_hash()
+ *     （sted_flow.c）で選んだ 1 つの接続にだけ送信する。送信元 MAC アドレス
+ *     は接続ではなく sted（bundle）として学習し、その MAC アドレス宛の
+ *     フレームも、ドメイン毎の bundle の表（stehub_bundle.c）から
+ *     flow_hash() で選んだ接続に送信する。
  * 
  ***********************************************************/
 
@@ -87,46 +212,208 @@
 #include <libgen.h>     /* for solaris */
 #include <arpa/inet.h>  /* for solaris */
 #include <sys/time.h>   /* for solaris */
+#include <sys/resource.h> /* for solaris */
+#include <sys/uio.h>    /* for solaris */
+#include <limits.h>     /* for solaris */
+#include <inttypes.h>   /* for solaris */
 #endif
+#include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <signal.h>
 #include <errno.h>
 #include <stdarg.h> 
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include "sted.h"
+#include "stehub.h"
 
 #define PORT_NO        80     /* 接続を待ち受けるデフォルトのポート番号 */
-#define SOCKBUFSIZE    32768  /* recv(), send() 用のバッファのサイズ  */
-
-#ifdef  FD_SETSIZE
-#undef  FD_SETSIZE
-#endif
-#define FD_SETSIZE     1024
-
 
 #ifdef  STE_WINDOWS
 HANDLE  hStedLog;          /* デバッグログ用のファイルハンドル */
 #define STEHUB_LOG_FILE   "C:\\stehub.log" /* ログファイル */
 #endif
 
+/*
+ * ポート（コネクション）毎の情報。キャッシュラインの境界から置き、
+ * フレームを転送するたびに参照するものを先頭にまとめる。
+ */
 struct conn_stat {
-    struct conn_stat *next;
     int fd;
+    int slot;                      /* ワーカーの active 配列中の位置 */
+    struct worker *worker;         /* このコネクションを受け持つワーカー */
+    int ready;                     /* ready リストに繋がっている */
+    int closed;                    /* close 済み */
+    int trunk;                     /* 他の仮想ハブとのトランク */
+    uint32_t bundle;               /* 同じ sted からの接続をまとめる ID。0 ならまとめない */
+    int lane;                      /* bundle の接続の中での番号 */
+    int nlanes;                    /* bundle の接続の数 */
+    domain_t *domain;              /* 参加しているドメイン。NULL ならまだ */
+    int dslot;                     /* ドメインの ports 配列中の位置 */
+    int wantwrite;                 /* 書き込み可能の通知を待っている */
+    int pending;                   /* pend リストに繋がっている */
+    struct conn_stat *ready_next;  /* 読み残しのあるコネクションのリスト */
+    struct conn_stat *pend_next;   /* 送信キューにフレームを入れたコネクションのリスト */
+    unsigned char learn_src[ETHERADDRL]; /* 最後に学習した送信元 MAC アドレス */
+    uint32_t learn_time;           /* learn_src を学習した時刻 */
+    txq_t txq;                     /* 送信キュー */
+    struct iovec *iov;             /* イベントエンジンに送信を依頼する iovec の配列 */
+    int tx_inflight;               /* 依頼してまだ終わっていない送信の数 */
+    int tx_done;                   /* 今回依頼したうち、終わった送信の数 */
+    int tx_len[TX_LINKS];          /* 依頼した各送信のサイズ */
+    uint64_t rx_frames;            /* 受信したフレーム数 */
+    uint64_t rx_bytes;             /* 受信したバイト数（stehead を含む）*/
+    uint64_t tx_bytes;             /* 送信したバイト数（stehead を含む）*/
+    uint64_t tx_frames;            /* 送信したフレーム数 */
+    uint64_t tx_blocked;           /* writev() が EWOULDBLOCK、または一部しか書けなかった回数 */
+    uint64_t rx_unicast;           /* 受信して学習済みのポートにだけ送信したフレーム数 */
+    uint64_t rx_flood;             /* 受信して全ポートに送信したフレーム数 */
+    hist_t *lat;                   /* 受信から送信までの遅延のヒストグラム。NULL なら測らない */
+    uint64_t storm_tat[STORM_KINDS][2]; /* ポートのストーム制御の状態 */
+    uint64_t storm_drops[STORM_KINDS];  /* ストーム制御で破棄したフレーム数 */
+    struct conn_stat *dead_next;   /* close 済みで free() 待ちのリスト */
+    struct trunk *peer;            /* こちらから張ったトランクなら、その設定 */
+    int connecting;                /* トランクの connect() の完了を待っている */
+    uint32_t join_time;            /* 接続した時刻 */
     struct in_addr addr;
+    void *mem;                     /* malloc() した領域（free() 用）*/
+    int rxlen;                     /* rxbuf 中の未完成フレームのサイズ */
+    unsigned char rxbuf[FRAME_MAX];  /* 受信途中のフレーム */
+};
+
+/*
+ * ワーカー。コネクションはいづれか 1 つのワーカーが受け持ち、そのワーカー
+ * のスレッドだけが読み書きする。他のワーカーのコネクションへのフレームは
+ * リング（inq）で渡す。
+ */
+struct worker {
+    int                id;
+    pthread_t          thread;
+    ev_stat_t         *evp;                /* イベントエンジン */
+    int                listener_fd;        /* 接続を待ち受ける socket */
+    int                listener_ready;     /* accept() し残した接続要求がある */
+    struct conn_stat **active;             /* 全コネクションを詰めて並べた配列 */
+    int                nactive;            /* active 中のコネクション数 */
+    int                activesize;         /* active の要素数 */
+    struct conn_stat  *ready_head;         /* 読み残しのあるコネクションのリストの先頭 */
+    struct conn_stat  *ready_tail;         /* 同、末尾 */
+    struct conn_stat  *dead_head;          /* free() 待ちのコネクションのリスト */
+    struct conn_stat  *pend_head;          /* 送信を溜めているコネクションのリスト */
+    struct iovec      *iov;                /* writev() 用の iovec の配列 */
+    spsc_t           **inq;                /* inq[i] はワーカー i からのリング */
+    char              *wake;               /* wake[i] はワーカー i を起こす必要がある */
+    int                shard_ready;        /* リングに取り出し残したフレームがある */
+    int                wakeup_fd[2];       /* 起床用の pipe */
+    uint32_t           wakeup_pending;     /* 起床用の pipe に書き込み済み */
+    uint32_t           now;                /* 今回の起床の時刻（秒）*/
+    uint64_t           nsec;               /* 今回の起床の時刻（ナノ秒）*/
+    uint32_t           aged;               /* 最後にエージングを行った時刻 */
+    int                trunks_down;        /* 接続していないトランクがある */
+    int                njoining;           /* ドメインに参加していないコネクションの数 */
+    uint32_t           join_scan;          /* 最後に njoining のコネクションを確認した時刻 */
+    void             **mports;             /* マルチキャストの送信先のポートの配列 */
+    int                mportsize;          /* mports の要素数 */
+    wstat_t           *stats;              /* ポートに属さないカウンタ */
+    int                stats_req;          /* 統計情報の要求がある */
+    pstat_t           *snap;               /* 要求に対して作ったポートの統計情報 */
+    int                nsnap;              /* snap 中のポート数 */
+    hist_t            *snap_lat;           /* 要求に対して作った全ポートの遅延のヒストグラム */
+    hist_t            *lat_closed;         /* close したポートの遅延のヒストグラムの合計 */
+    uint64_t           rx_nsec;            /* 最後に recv() した時刻（ナノ秒）*/
+    fpool_t            pool;               /* 受信バッファのプール */
+    fbuf_t            *rxb;                /* recv() 用の受信バッファ */
+    int                aio;                /* 受信と送信をイベントエンジンで行う（ev_io_start()）*/
+};
+
+/*
+ * -t で指定されたトランク。トランクはすべてワーカー 0 が受け持つ。
+ */
+struct trunk {
+    char               *host;              /* 相手の仮想ハブのホスト名 */
+    int                 port;              /* 相手の仮想ハブのポート番号 */
+    struct sockaddr_in  sin;               /* 相手の仮想ハブのアドレス */
+    struct conn_stat   *conn;              /* 接続中のコネクション。無ければ NULL */
+    uint32_t            retry;             /* 次に接続を試みる時刻 */
+    uint32_t            network;           /* トランクで運ぶネットワーク ID */
 };
 
-void  add_conn_stat(int, struct in_addr);
-void  delete_conn_stat(int);
-struct conn_stat *find_conn_stat(int);
+struct conn_stat *add_conn_stat(struct worker *, int, struct in_addr);
+void  delete_conn_stat(struct conn_stat *);
+void  free_conn_stat(struct worker *);
+int   grow_active(struct worker *);
+int   init_worker(struct worker *, int, char *);
+void *worker_main(void *);
+int   open_listener(int, int);
+int   accept_conn(struct worker *);
+int   recv_conn(struct conn_stat *);
+void  recv_done(struct conn_stat *, fbuf_t *, int);
+int   input_recv(struct conn_stat *, fbuf_t *, int);
+int   input_data(struct conn_stat *, fbuf_t *, unsigned char *, int);
+int   input_ctl(struct conn_stat *, unsigned char *);
+int   frame_size(struct conn_stat *, unsigned char *);
+void  close_conn(struct conn_stat *);
+void  forward_data(struct worker *, struct conn_stat *, frame_t *);
+struct conn_stat *lookup_dest(struct worker *, struct conn_stat *, domain_t *, unsigned char *,
+                              int, int *);
+void  output_data(struct worker *, struct conn_stat *, struct conn_stat *, int, frame_t *);
+void  output_mcast(struct worker *, struct conn_stat *, frame_t *);
+void  print_route(struct worker *, struct conn_stat *, struct conn_stat *);
+void  forward_shard(struct worker *, int, frame_t *);
+int   join_domain(struct conn_stat *, uint32_t);
+void  leave_domain(struct conn_stat *);
+int   join_bundle(struct conn_stat *);
+void  join_idle(struct worker *);
+void  snap_stats(struct worker *);
+int   storm_drop(struct worker *, struct conn_stat *, domain_t *, unsigned char *, int);
+int   add_trunk(char *);
+int   open_trunks(struct worker *);
+void  connect_trunk(struct worker *, struct trunk *);
+void  finish_trunk(struct conn_stat *);
+void  wakeup_shards(struct worker *);
+int   recv_shards(struct worker *);
+void  send_data(struct conn_stat *, frame_t *);
+void  send_bundle(struct conn_stat *, frame_t *);
+int   flush_conn(struct conn_stat *);
+int   write_conn(struct conn_stat *);
+void  set_pending(struct conn_stat *);
+int   submit_conn(struct conn_stat *);
+void  send_done(struct conn_stat *, int);
+void  want_write(struct conn_stat *, int);
+void  flush_pending(struct worker *);
+void  set_ready(struct conn_stat *);
+int   set_nonblock(int);
+void  raise_fd_limit();
+uint32_t hub_time();
+uint64_t hub_nsec();
 int   become_daemon();
 void  print_err(int, char *, ...);
 void  print_usage(char *);
 extern char *basename(char *); /* for Interix */
 
-struct conn_stat   conn_stat_head[1];
+struct worker     *workers;            /* ワーカーの配列 */
+wstat_t           *wstats;             /* ワーカー毎のカウンタの配列 */
+int                nworkers = 1;       /* ワーカーの数 */
+dtab_t            *dtab;               /* ドメインの表 */
+int                aging = FDB_AGING;  /* MAC アドレスのエージング時間。0 なら学習しない */
+int                mdb_aging = MDB_AGING; /* マルチキャストグループのエージング時間。0 なら snooping しない */
+int                txq_maxframes = TXQ_MAXFRAMES; /* 送信キューの最大フレーム数 */
+int                txq_maxbytes = TXQ_MAXBYTES;   /* 送信キューの最大バイト数 */
+int                txq_policy = TXQ_DROP_TAIL;    /* 送信キューの破棄のポリシー */
+int                tx_batch_iov = TX_BATCH_IOV;     /* 1 回の writev() の最大 iovec 数 */
+int                tx_batch_bytes = TX_BATCH_BYTES; /* 1 回の writev() の最大バイト数 */
+struct trunk       trunks[MAX_TRUNKS]; /* -t で指定されたトランク */
+int                ntrunks = 0;        /* トランクの数 */
+storm_t            storm_port;         /* ポート毎のストーム制御の上限 */
+storm_t            storm_domain;       /* ドメイン毎のストーム制御の上限 */
+int                storm_on = 0;       /* ストーム制御の上限が設定されている */
+int                lat_on = 1;         /* 受信から送信までの遅延を測る */
+pthread_mutex_t    stats_lock = PTHREAD_MUTEX_INITIALIZER; /* 統計情報の要求を保護する */
+pthread_cond_t     stats_cond = PTHREAD_COND_INITIALIZER;  /* 全ワーカーが応えたことを知らせる */
+int                stats_waiting;      /* 統計情報の要求にまだ応えていないワーカーの数 */
 int           use_log = 0;      /* メッセージを STDERR でなく、syslog に出力する */
 static int    debuglevel = 0;   /* デバッグレベル。 1 以上ならフォアグラウンドで実行 */
 extern char  *optarg;
@@ -138,21 +425,23 @@ extern int    optreset;
 int WINAPIV
 main(int argc,char *argv[])
 {
-    int                 listener_fd, new_fd;
-    int                 remotelen;
     int                 port = 0;
-    int                 c, on;
-    struct sockaddr_in  local_sin, remote_sin;
-    static              fd_set  fdset, fdset_saved;
-    struct conn_stat   *rconn, *wconn;
+    int                 c, i;
+    int                 reuseport = 0;       /* ワーカー毎に listen する */
+    int                 shared_fd = -1;      /* ワーカーが共有する listen socket */
+    char               *engine = NULL;       /* イベントエンジン名 */
+    char               *stats_path = NULL;   /* 統計情報を返す UNIX ドメインソケット */
+    int                 stats_fd = -1;
+    char               *p;
+    void               *mem;
+    struct worker      *w;
 #ifdef STE_WINDOWS
-    u_long              param = 0; /* FIONBIO コマンドのパラメータ Non-Blocking ON*/
     int                 nRtn;
     WSADATA             wsaData;
     nRtn = WSAStartup(MAKEWORD(1, 1), &wsaData);        
 #endif
 
-    while ((c = getopt(argc, argv, "p:d:")) != EOF){
+    while ((c = getopt(argc, argv, "p:d:e:a:q:P:w:B:t:s:S:m:A:H")) != EOF){
         switch (c) {
             case 'p':
                 port = atoi(optarg);
@@ -160,63 +449,111 @@ main(int argc,char *argv[])
             case 'd':
                 debuglevel = atoi(optarg);
                 break;
+            case 'e':
+                engine = optarg;
+                break;
+            case 'a':
+                aging = atoi(optarg);
+                break;
+            case 'q':
+                txq_maxframes = atoi(optarg);
+                if((p = strchr(optarg, ':')) != NULL)
+                    txq_maxbytes = atoi(p + 1);
+                if(txq_maxframes <= 0 || txq_maxbytes <= 0)
+                    print_usage(argv[0]);
+                break;
+            case 'P':
+                if(strcmp(optarg, "tail") == 0)
+                    txq_policy = TXQ_DROP_TAIL;
+                else if(strcmp(optarg, "head") == 0)
+                    txq_policy = TXQ_DROP_HEAD;
+                else
+                    print_usage(argv[0]);
+                break;
+            case 'B':
+                tx_batch_iov = atoi(optarg);
+                if((p = strchr(optarg, ':')) != NULL)
+                    tx_batch_bytes = atoi(p + 1);
+                if(tx_batch_iov <= 0 || tx_batch_bytes <= 0)
+                    print_usage(argv[0]);
+#ifdef IOV_MAX
+                if(tx_batch_iov > IOV_MAX)
+                    tx_batch_iov = IOV_MAX;
+#endif
+                break;
+            case 'w':
+                nworkers = atoi(optarg);
+                if(nworkers < 1 || nworkers > MAX_WORKERS)
+                    print_usage(argv[0]);
+                break;
+            case 't':
+                if(add_trunk(optarg) < 0)
+                    exit(1);
+                break;
+            case 's':
+                if(storm_parse(&storm_port, optarg) < 0)
+                    print_usage(argv[0]);
+                break;
+            case 'S':
+                if(storm_parse(&storm_domain, optarg) < 0)
+                    print_usage(argv[0]);
+                break;
+            case 'm':
+                mdb_aging = atoi(optarg);
+                break;
+            case 'A':
+                stats_path = optarg;
+                break;
+            case 'H':
+                lat_on = 0;
+                break;
             default:
                 print_usage(argv[0]);
         }
     }    
 
-    conn_stat_head->next = NULL;
-    conn_stat_head->fd = 0;
-
-    if(( listener_fd = socket( AF_INET, SOCK_STREAM,0 )) < 0 ) {
-        SET_ERRNO();
-        print_err(LOG_ERR,"socket: %s (%d)\n", strerror(errno), errno);
-        exit(1);
-    }
-
-    on = 1;
-    if((setsockopt(listener_fd, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on))) <0){
-        SET_ERRNO();        
-        print_err(LOG_ERR,"setsockopt:%s\n", strerror(errno));                
-        exit(1);
-    }
+    raise_fd_limit();
 
+    storm_on = storm_enabled(&storm_port) || storm_enabled(&storm_domain);
     if(port == 0)
         port = PORT_NO;
-    memset((char *)&remote_sin, 0x0, sizeof(struct sockaddr_in));
-    memset((char *)&local_sin, 0x0, sizeof(struct sockaddr_in));
-    local_sin.sin_port   = htons((short)port);
-    local_sin.sin_family = AF_INET;
-    local_sin.sin_addr.s_addr = htonl(INADDR_ANY);
 
-    if(bind(listener_fd,(struct sockaddr *)&local_sin,sizeof(struct sockaddr_in)) < 0 ){
-        SET_ERRNO();
-        print_err(LOG_ERR,"bind:%s\n", strerror(errno));                        
+    if((workers = (struct worker *)calloc(nworkers, sizeof(struct worker))) == NULL){
+        print_err(LOG_ERR,"can't allocate workers\n");
         exit(1);
     }
-
+    if((mem = malloc(nworkers * sizeof(wstat_t) + CACHE_LINE)) == NULL){
+        print_err(LOG_ERR,"can't allocate workers\n");
+        exit(1);
+    }
+    wstats = (wstat_t *)(((uintptr_t)mem + CACHE_LINE - 1) & ~(uintptr_t)(CACHE_LINE - 1));
+    memset(wstats, 0x0, nworkers * sizeof(wstat_t));
+    for(i = 0 ; i < nworkers ; i++)
+        workers[i].stats = &wstats[i];
 
     /*
-     * accept() でブロックされるのを防ぐため、non-blocking mode に設定
+     * SO_REUSEPORT が使える場合は、ワーカー毎に listen socket を作り、
+     * 接続をカーネルに振り分けさせる。使えない場合は 1 つの listen socket
+     * を全ワーカーのイベントエンジンに登録し、先に accept() したワーカーが
+     * そのコネクションを受け持つ。
      */
-#ifndef STE_WINDOWS            
-    if( fcntl (listener_fd, F_SETFL, O_NONBLOCK) < 0) {
-#else
-    if( ioctlsocket(listener_fd, FIONBIO, &param) < 0){
-#endif                
-        SET_ERRNO();
-        print_err(LOG_ERR, "Failed to set nonblock: %s (%d)\n",strerror(errno), errno);
-        exit(1);
+#ifdef SO_REUSEPORT
+    reuseport = (nworkers > 1);
+    /*
+     * SO_REUSEPORT を設定した socket 同士は同じポートに bind() できて
+     * しまうので、他の stehub が既に動いていないか先に確かめる。
+     */
+    if(reuseport)
+        CLOSE(open_listener(port, 0));
+#endif
+    for(i = 0 ; i < nworkers ; i++){
+        if(i == 0 || reuseport)
+            shared_fd = open_listener(port, reuseport);
+        workers[i].listener_fd = shared_fd;
     }
-
-    if(listen(listener_fd, 5) < 0) {
-        SET_ERRNO();
-        print_err(LOG_ERR,"listen:%s\n", strerror(errno));                                
+    /* 相対パスでも良いように、カレントディレクトリを変える前に作る */
+    if(stats_path != NULL && (stats_fd = stats_open(stats_path)) < 0)
         exit(1);
-    }
-
-    FD_ZERO(&fdset_saved);
-    FD_SET(listener_fd, &fdset_saved);
 
     /*
      * syslog のための設定。Facility は　LOG_USER とする
@@ -233,6 +570,8 @@ main(int argc,char *argv[])
     SetFilePointer(hStedLog, 0, NULL, FILE_END);
 #else
      openlog(basename(argv[0]),LOG_PID,LOG_USER);
+     /* 切断されたコネクションへの send() で終了しないように */
+     signal(SIGPIPE, SIG_IGN);
 #endif
      
     /*
@@ -254,215 +593,2156 @@ main(int argc,char *argv[])
         use_log = 1;
 #endif    
     }
-    print_err(LOG_NOTICE,"Started\n");        
 
     /*
-     * メインループ
-     * 仮想 NIC デーモンからの接続要求を待ち、接続後は仮想 NIC デーモン
-     * からのデータを待つ。１つの仮想デーモンからのデータを他方に転送する。
+     * エージング時間が 0 なら MAC アドレスを学習せず、すべてのフレームを
+     * 同じドメインの全ポートに送信する（従来の動作）。
+     */
+    if(aging < 0)
+        aging = 0;
+    if(mdb_aging < 0)
+        mdb_aging = 0;
+    if((dtab = dtab_create(nworkers, aging, mdb_aging)) == NULL){
+        print_err(LOG_ERR,"can't create network table\n");
+        exit(1);
+    }
+
+    /*
+     * ワーカーを準備する。event port は fork() 後の子プロセスに引き継がれ
+     * ないので、イベントエンジンはバックグラウンドに移行した後で作成する。
+     */
+    for(i = 0 ; i < nworkers ; i++){
+        if(init_worker(&workers[i], i, engine) < 0){
+            print_err(LOG_ERR,"can't initialize worker %d\n", i);
+            exit(1);
+        }
+    }
+    if(stats_fd >= 0 && stats_start(stats_fd, dtab) < 0)
+        exit(1);
+    print_err(LOG_NOTICE,"Started (event engine: %s%s, %d worker%s)\n",
+              ev_name(workers[0].evp), workers[0].aio ? " recv/send" : "",
+              nworkers, nworkers > 1 ? "s" : "");
+
+    for(i = 1 ; i < nworkers ; i++){
+        w = &workers[i];
+        if(pthread_create(&w->thread, NULL, worker_main, (void *)w) != 0){
+            print_err(LOG_ERR,"can't create worker thread %d\n", i);
+            exit(1);
+        }
+    }
+    worker_main((void *)&workers[0]);
+    return(-1);
+}
+
+/*****************************************************************************
+ * init_worker()
+ *
+ * ワーカーのイベントエンジン、起床用の pipe、他のワーカーからのリングを
+ * 作成する。起床用の pipe は統計情報の要求にも使うので、ワーカーが 1 つ
+ * でも作成する。
+ *
+ *  引数：
+ *          w      : ワーカー
+ *          id     : ワーカーの番号
+ *          engine : イベントエンジン名
+ *  戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+int
+init_worker(struct worker *w, int id, char *engine)
+{
+    int i;
+
+    w->id = id;
+    if((w->evp = ev_create(engine, MAX_EVENTS)) == NULL)
+        return(-1);
+    w->aio = (ev_io_start(w->evp, &w->pool) == 0);
+    if((w->iov = (struct iovec *)malloc(tx_batch_iov * sizeof(struct iovec))) == NULL)
+        return(-1);
+    if(lat_on && (w->lat_closed = (hist_t *)calloc(1, sizeof(hist_t))) == NULL)
+        return(-1);
+    if(ev_add(w->evp, w->listener_fd, EV_READ, (void *)&w->listener_fd) < 0)
+        return(-1);
+
+    /*
+     * 他のワーカーがリングにフレームを入れたことや、統計情報の要求が
+     * あることを知らせてもらう pipe。
+     */
+    if(pipe(w->wakeup_fd) < 0){
+        SET_ERRNO();
+        print_err(LOG_ERR,"pipe: %s\n", strerror(errno));
+        return(-1);
+    }
+    if(set_nonblock(w->wakeup_fd[0]) < 0 || set_nonblock(w->wakeup_fd[1]) < 0)
+        return(-1);
+    if(ev_add(w->evp, w->wakeup_fd[0], EV_READ, (void *)w->wakeup_fd) < 0)
+        return(-1);
+    if(nworkers == 1)
+        return(0);
+
+    /*
+     * 他のワーカーからフレームを受け取るリング。
      */
+    if((w->inq = (spsc_t **)calloc(nworkers, sizeof(spsc_t *))) == NULL ||
+       (w->wake = (char *)calloc(nworkers, sizeof(char))) == NULL)
+        return(-1);
+    for(i = 0 ; i < nworkers ; i++){
+        if(i != id && (w->inq[i] = spsc_create(SHARD_RING_SIZE)) == NULL)
+            return(-1);
+    }
+    return(0);
+}
+
+/*****************************************************************************
+ * worker_main()
+ *
+ * ワーカーのメインループ。
+ * 仮想 NIC デーモンからの接続要求を待ち、接続後は仮想 NIC デーモン
+ * からのデータを待つ。１つの仮想デーモンからのデータを他方に転送する。
+ * 他のワーカーのコネクションへのフレームは、リング経由でそのワーカーに
+ * 渡す。各ポートへの送信は 1 回の起床の間溜めておき、最後にポート毎に
+ * まとめて writev() する。
+ *
+ * イベントエンジンは edge-triggered の場合があるので、1 回の起床で
+ * 読み切れなかったコネクション（と listener、リング）は ready として残し、
+ * その間は ev_wait() をブロックさせずに処理を続ける。
+ * イベントエンジンが受信と送信も行う場合（w->aio）は、受信データが
+ * EV_RECV で届き、送信は ev_writev() に依頼して EV_SENT で終わる。
+ * ドメインがある間（MAC アドレスを学習する場合）と、接続していない
+ * トランクがある間は、ワーカー 0 がエージングと再接続のために 1 秒毎に
+ * 起床する。ドメインに参加していないコネクションがあるワーカーも、
+ * JOIN_WAIT を確認するために 1 秒毎に起床する。
+ *
+ *  引数：
+ *          arg : ワーカー
+ *  戻り値：
+ *          戻らない
+ *****************************************************************************/
+void *
+worker_main(void *arg)
+{
+    struct worker      *w = (struct worker *)arg;
+    struct conn_stat   *conn;
+    ev_event_t          evs[MAX_EVENTS];
+    int                 i, nev, timeout;
+
     for(;;){
-        fdset = fdset_saved;
-        if( select(FD_SETSIZE, &fdset, NULL, NULL, NULL) < 0){
+        if(w->id == 0 && ntrunks > 0)
+            w->trunks_down = open_trunks(w);
+        if(w->listener_ready || w->ready_head != NULL || w->shard_ready)
+            timeout = 0;
+        else if(w->id == 0 && (((aging > 0 || mdb_aging > 0) && dtab_count(dtab) > 0) ||
+                                 w->trunks_down))
+            timeout = 1000;
+        else if(w->njoining > 0)
+            timeout = 1000;
+        else
+            timeout = -1;
+        nev = ev_wait(w->evp, evs, MAX_EVENTS, timeout);
+        if(nev < 0){
             SET_ERRNO();
-            print_err(LOG_ERR,"select:%s\n", strerror(errno));
-        }
-
-        if(FD_ISSET(listener_fd, &fdset)){
-            remotelen = sizeof(struct sockaddr_in);
-            if((new_fd = accept(listener_fd,(struct sockaddr *)&remote_sin, &remotelen)) < 0){
-                SET_ERRNO();
-                if(errno == EINTR || errno == EWOULDBLOCK || errno == ECONNABORTED){
-                    print_err(LOG_NOTICE, "accept: %s\n", strerror(errno));
-                    continue;
-                } else {
-                    print_err(LOG_ERR, "accept: %s\n", strerror(errno));                    
-                    return(-1);
-                }
+            if(errno != EINTR)
+                print_err(LOG_ERR,"ev_wait:%s\n", strerror(errno));
+            continue;
+        }
+        w->now = hub_time();
+        if(storm_on)
+            w->nsec = hub_nsec();
+
+        /*
+         * 送信が終わったポートは、受信データを送信キューに入れる前に
+         * 空けておく。
+         */
+        for(i = 0 ; w->aio && i < nev ; i++){
+            if(evs[i].events & EV_SENT)
+                send_done((struct conn_stat *)evs[i].data, evs[i].res);
+        }
+
+        for(i = 0 ; i < nev ; i++){
+            if(evs[i].data == (void *)&w->listener_fd){
+                w->listener_ready = 1;
+                continue;
             }
-            
-            FD_SET(new_fd, &fdset_saved);
-            print_err(LOG_NOTICE,"fd%d: connection from %s\n",new_fd, inet_ntoa(remote_sin.sin_addr));
-            add_conn_stat(new_fd, remote_sin.sin_addr);
-            /*
-             * recv() でブロックされるのを防ぐため、non-blocking mode に設定
-             */
-#ifndef STE_WINDOWS            
-            if (fcntl(new_fd, F_SETFL, O_NONBLOCK) < 0 ) {
-#else
-                if(ioctlsocket(new_fd, FIONBIO, &param) < 0){
-#endif                
-                    SET_ERRNO();
-                    print_err(LOG_ERR, "fd%d: Failed to set nonblock: %s (%d)\n",
-                              new_fd,strerror(errno),errno);
-                    return(-1);
-                }
+            if(evs[i].data == (void *)w->wakeup_fd){
+                w->shard_ready = 1;
+                continue;
+            }
+            conn = (struct conn_stat *)evs[i].data;
+            if(evs[i].events & EV_RECV){
+                recv_done(conn, evs[i].buf, evs[i].res);
+                continue;
+            }
+            if(evs[i].events & EV_SENT)
+                continue;
+            if((evs[i].events & EV_WRITE) && !conn->closed){
+                if(conn->connecting)
+                    finish_trunk(conn);
+                else
+                    flush_conn(conn);
+            }
+            if(evs[i].events & EV_READ)
+                set_ready(conn);
+        }
+
+        if(w->listener_ready){
+            if((w->listener_ready = accept_conn(w)) < 0)
+                exit(1);
+        }
+
+        /*
+         * ready リストのコネクションを処理する。処理中に再度
+         * ready になったものは新しいリストに繋がれ、次回処理される。
+         */
+        conn = w->ready_head;
+        w->ready_head = w->ready_tail = NULL;
+        while(conn != NULL){
+            struct conn_stat *next = conn->ready_next;
+
+            conn->ready = 0;
+            conn->ready_next = NULL;
+            if(!conn->closed && recv_conn(conn) > 0)
+                set_ready(conn);
+            conn = next;
+        }
+
+        if(w->shard_ready)
+            w->shard_ready = recv_shards(w);
+        flush_pending(w);
+        if(nworkers > 1)
+            wakeup_shards(w);
+
+        free_conn_stat(w);
+
+        if(w->njoining > 0 && w->now != w->join_scan){
+            join_idle(w);
+            w->join_scan = w->now;
+        }
+        if(w->id == 0 && w->now != w->aged){
+            dtab_age(dtab, w->now);
+            w->aged = w->now;
+        }
+        if(LOAD_ACQUIRE(&w->stats_req))
+            snap_stats(w);
+    } /* End of main loop */
+    return(NULL);
+}
+
+/*****************************************************************************
+ * open_listener()
+ *
+ * 仮想 NIC デーモンからの接続を待ち受ける socket を作成する。
+ * 失敗した場合は終了する。
+ *
+ *  引数：
+ *          port      : 待ち受けるポート番号
+ *          reuseport : 1 なら SO_REUSEPORT を設定する
+ *  戻り値：
+ *          listen している socket 番号
+ *****************************************************************************/
+int
+open_listener(int port, int reuseport)
+{
+    int                 fd, on;
+    struct sockaddr_in  local_sin;
+
+    if(( fd = socket( AF_INET, SOCK_STREAM,0 )) < 0 ) {
+        SET_ERRNO();
+        print_err(LOG_ERR,"socket: %s (%d)\n", strerror(errno), errno);
+        exit(1);
+    }
+
+    on = 1;
+    if((setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on))) <0){
+        SET_ERRNO();        
+        print_err(LOG_ERR,"setsockopt:%s\n", strerror(errno));                
+        exit(1);
+    }
+#ifdef SO_REUSEPORT
+    if(reuseport && (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *)&on, sizeof(on))) <0){
+        SET_ERRNO();        
+        print_err(LOG_ERR,"setsockopt(SO_REUSEPORT):%s\n", strerror(errno));                
+        exit(1);
+    }
+#endif
+
+    memset((char *)&local_sin, 0x0, sizeof(struct sockaddr_in));
+    local_sin.sin_port   = htons((short)port);
+    local_sin.sin_family = AF_INET;
+    local_sin.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if(bind(fd,(struct sockaddr *)&local_sin,sizeof(struct sockaddr_in)) < 0 ){
+        SET_ERRNO();
+        print_err(LOG_ERR,"bind:%s\n", strerror(errno));                        
+        exit(1);
+    }
+
+    /*
+     * accept() でブロックされるのを防ぐため、non-blocking mode に設定
+     */
+    if(set_nonblock(fd) < 0) {
+        SET_ERRNO();
+        print_err(LOG_ERR, "Failed to set nonblock: %s (%d)\n",strerror(errno), errno);
+        exit(1);
+    }
+
+    /*
+     * 多数の仮想 NIC デーモンが同時に接続してきても取りこぼさないよう、
+     * バックログは大きめにとる。
+     */
+    if(listen(fd, LISTEN_BACKLOG) < 0) {
+        SET_ERRNO();
+        print_err(LOG_ERR,"listen:%s\n", strerror(errno));                                
+        exit(1);
+    }
+    return(fd);
+}
+
+/*****************************************************************************
+ * accept_conn()
+ *
+ * 仮想 NIC デーモンからの接続要求を、EWOULDBLOCK になるか ACCEPT_BUDGET
+ * に達するまで accept() する。accept() したコネクションはこのワーカーが
+ * 受け持つ。
+ *
+ *  引数：
+ *          w : ワーカー
+ *  戻り値：
+ *          接続要求がもう無い : 0
+ *          まだ残っている     : 1
+ *          致命的なエラー     : -1
+ *****************************************************************************/
+int
+accept_conn(struct worker *w)
+{
+    int                 new_fd, n;
+    int                 remotelen;
+    struct sockaddr_in  remote_sin;
+    struct conn_stat   *conn;
+
+    for(n = 0 ; n < ACCEPT_BUDGET ; n++){
+        remotelen = sizeof(struct sockaddr_in);
+        if((new_fd = accept(w->listener_fd,(struct sockaddr *)&remote_sin, &remotelen)) < 0){
+            SET_ERRNO();
+            if(errno == EINTR || errno == ECONNABORTED){
+                print_err(LOG_NOTICE, "accept: %s\n", strerror(errno));
                 continue;
             }
+            if(errno == EWOULDBLOCK)
+                return(0);
+            if(errno == EMFILE || errno == ENFILE){
+                /*
+                 * fd を使い切った。接続要求は backlog に残るので、
+                 * 次の接続要求が来たときに再度 accept() する。
+                 */
+                print_err(LOG_ERR, "accept: %s\n", strerror(errno));
+                return(0);
+            }
+            print_err(LOG_ERR, "accept: %s\n", strerror(errno));
+            return(-1);
+        }
+
+        /*
+         * recv() でブロックされるのを防ぐため、non-blocking mode に設定
+         */
+        if(set_nonblock(new_fd) < 0){
+            SET_ERRNO();
+            print_err(LOG_ERR, "fd%d: Failed to set nonblock: %s (%d)\n",
+                      new_fd,strerror(errno),errno);
+            CLOSE(new_fd);
+            continue;
+        }
 
-            for( rconn = conn_stat_head->next ; rconn != NULL ; rconn = rconn->next){
-                int rfd, wfd;
-
-                rfd = rconn->fd;
-            
-                if (FD_ISSET(rfd, &fdset)){
-                    int   rsize;
-                    char  databuf[SOCKBUFSIZE];
-                    char *bufp;
-                    int   datalen;
-
-                    bufp = (char *)databuf;
-                    rsize = recv(rfd, bufp, SOCKBUFSIZE,0);
-                    if(rsize == 0){
-                        /*
-                         * コネクションが切断されたようだ。
-                         * socket を close してループを抜ける
-                         */
-                        print_err(LOG_ERR,"fd%d: Connection closed by %s\n", rfd, inet_ntoa(rconn->addr));
-                        CLOSE(rfd);
-                        print_err(LOG_ERR,"fd%d: closed\n", rfd);
-                        FD_CLR(rfd, &fdset_saved);
-                        delete_conn_stat(rfd);
-                        break;
-                    }
-                    if(rsize < 0){
-                        SET_ERRNO();                    
-                        /*
-                         * 致命的でない error の場合は無視してループを継続
-                         */
-                        if(errno == EINTR || errno == EWOULDBLOCK){
-                            print_err(LOG_NOTICE, "fd%d: recv: %s\n", rfd, strerror(errno));
-                            continue;
-                        }
-                        /*
-                         * エラーが発生したようだ。
-                         * socket を close して forループを抜ける
-                         */
-                        print_err(LOG_ERR,"fd%d: recv: %s\n", rfd,strerror(errno));
-                        CLOSE(rfd);
-                        print_err(LOG_ERR,"fd%d: closed\n", rfd);
-                        FD_CLR(rfd, &fdset_saved);
-                        delete_conn_stat(rfd);
-                        break;
-                    }
-                    /*
-                     * 他の仮想 NIC にパケットを転送する。
-                     * 「待ち」が発生すると、パフォーマンスに影響があるので、EWOULDBLOCK
-                     *  の場合は配送をあきらめる。
-                     */
-                    for(wconn = conn_stat_head->next ; wconn != NULL ; wconn = wconn->next){
-                    
-                        wfd = wconn->fd;
-
-                        if (rfd == wfd)
-                            continue;
-
-                        if( debuglevel > 1){
-                            print_err(LOG_ERR,"fd%d(%s) ==> ", rfd, inet_ntoa(rconn->addr));
-                            print_err(LOG_ERR,"fd%d(%s)\n", wfd,inet_ntoa(wconn->addr));
-                        }
-                
-                        if ( send(wfd, bufp, rsize, 0) < 0){
-                            SET_ERRNO();                    
-                            if(errno == EINTR || errno == EWOULDBLOCK ){
-                                print_err(LOG_NOTICE,"fd%d: send: %s\n", wfd ,strerror(errno));
-                                continue;
-                            } else {
-                                print_err(LOG_ERR,"fd%d: send: %s (%d)\n",wfd,strerror(errno), errno);
-                                CLOSE(wfd);
-                                print_err(LOG_ERR,"fd%d: closed\n", wfd);
-                                FD_CLR(wfd, &fdset_saved);
-                                delete_conn_stat(wfd);
-                                break;                            
-                            }
-                        }                    
-                    } /* End of loop for send()ing */
-                }
-            } /* End of loop for each connection */
-        } /* End of main loop */
+        conn = add_conn_stat(w, new_fd, remote_sin.sin_addr);
+        if(conn == NULL ||
+           ev_add(w->evp, new_fd, w->aio ? EV_RECV : EV_READ, (void *)conn) < 0){
+            print_err(LOG_ERR,"fd%d: can't register connection\n", new_fd);
+            if(conn != NULL)
+                delete_conn_stat(conn);
+            CLOSE(new_fd);
+            continue;
+        }
+        print_err(LOG_NOTICE,"fd%d: connection from %s (worker%d)\n",new_fd,
+                  inet_ntoa(remote_sin.sin_addr), w->id);
+    }
+    return(1);
 }
 
 /*****************************************************************************
- * add_conn_stat()
+ * add_trunk()
  *
- * conn_stat 構造体のリンクリストに新規 conn_stat を追加する。
+ * -t で指定されたトランクの相手（host[:port][/network]）を登録する。
  *
  *  引数：
- *          fd: 新規コネクションの socket 番号
- *          addr: 接続してきたホストのアドレス
- * 戻り値：
- *          無し
+ *          arg : 相手の仮想ハブのホスト名（と「:」でくぎられたポート番号、
+ *                「/」でくぎられたネットワーク ID）
+ *  戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
  *****************************************************************************/
-void
-add_conn_stat(int fd, struct in_addr addr)
+int
+add_trunk(char *arg)
 {
-    struct conn_stat *conn, *conn_stat_new;
+    struct trunk   *t;
+    struct hostent *hp;
+    char           *p;
 
-    int i = 0;
-    
-    for( conn = conn_stat_head ; conn->next != NULL ; conn = conn->next);
-    
-    conn_stat_new = (struct conn_stat *)malloc(sizeof(struct conn_stat));
-    conn_stat_new->fd = fd;
-    conn_stat_new->addr = addr;
-    conn_stat_new->next = NULL;
+    if(ntrunks >= MAX_TRUNKS){
+        print_err(LOG_ERR,"too many trunks (max %d)\n", MAX_TRUNKS);
+        return(-1);
+    }
+    t = &trunks[ntrunks];
+    t->host = arg;
+    t->port = PORT_NO;
+    t->network = 0;
+    if((p = strchr(arg, '/')) != NULL){
+        *p = '\0';
+        t->network = strtoul(p + 1, NULL, 10);
+    }
+    if((p = strchr(arg, ':')) != NULL){
+        *p = '\0';
+        t->port = atoi(p + 1);
+    }
+    if((hp = gethostbyname(t->host)) == NULL){
+        print_err(LOG_ERR,"hostname %s not found.\n", t->host);
+        return(-1);
+    }
+    memset((char *)&t->sin, 0x0, sizeof(struct sockaddr_in));
+    memcpy((char *)&t->sin.sin_addr, hp->h_addr, hp->h_length);
+    t->sin.sin_family = AF_INET;
+    t->sin.sin_port = htons((short)t->port);
+    ntrunks++;
+    return(0);
+}
 
-    conn->next = conn_stat_new;
+/*****************************************************************************
+ * open_trunks()
+ *
+ * 接続していないトランクのうち、再接続の時刻になったものに接続する。
+ * ワーカー 0 だけが呼ぶ。
+ *
+ *  引数：
+ *          w : ワーカー 0
+ *  戻り値：
+ *          接続していないトランクの数
+ *****************************************************************************/
+int
+open_trunks(struct worker *w)
+{
+    struct trunk *t;
+    int           i, down = 0;
+
+    for(i = 0 ; i < ntrunks ; i++){
+        t = &trunks[i];
+        if(t->conn == NULL && (int32_t)(w->now - t->retry) >= 0)
+            connect_trunk(w, t);
+        if(t->conn == NULL)
+            down++;
+    }
+    return(down);
 }
 
 /*****************************************************************************
- * delete_conn_stat()
+ * connect_trunk()
  *
- * conn_stat 構造体のリンクリストから指定された conn_stat を削除する
+ * トランクの相手に non-blocking で connect() する。connect() の完了は
+ * 書き込み可能の通知で知り、finish_trunk() で処理する。それまでに
+ * 送信キューに入れられたフレームは、完了後に送信する。
  *
  *  引数：
- *          fd: 削除する conn_stat 構造体に含まれる socket 番号
+ *          w : ワーカー 0
+ *          t : 接続するトランク
  *  戻り値：
  *          無し
  *****************************************************************************/
 void
-delete_conn_stat(int fd)
+connect_trunk(struct worker *w, struct trunk *t)
 {
-    struct conn_stat *conn, *conn_stat_delete;
-    int i = 0;
-
-    conn = conn_stat_head;
+    struct conn_stat *conn;
+    int               fd;
 
-    while( conn != NULL){
-        if(conn->next->fd == fd){
-            conn_stat_delete = conn->next;
-            conn->next = conn_stat_delete->next;
-            free(conn_stat_delete);
+    t->retry = w->now + TRUNK_RETRY;
+    if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0){
+        SET_ERRNO();
+        print_err(LOG_ERR,"socket: %s\n", strerror(errno));
+        return;
+    }
+    if(set_nonblock(fd) < 0){
+        SET_ERRNO();
+        print_err(LOG_ERR, "fd%d: Failed to set nonblock: %s (%d)\n", fd, strerror(errno), errno);
+        CLOSE(fd);
+        return;
+    }
+    if(connect(fd, (struct sockaddr *)&t->sin, sizeof(struct sockaddr_in)) < 0){
+        SET_ERRNO();
+        if(errno != EINPROGRESS && errno != EWOULDBLOCK){
+            print_err(LOG_ERR,"trunk %s:%d: connect: %s\n", t->host, t->port, strerror(errno));
+            CLOSE(fd);
             return;
         }
-        conn = conn->next;
     }
+
+    conn = add_conn_stat(w, fd, t->sin.sin_addr);
+    if(conn == NULL || ev_add(w->evp, fd, EV_READ|EV_WRITE, (void *)conn) < 0){
+        print_err(LOG_ERR,"fd%d: can't register connection\n", fd);
+        if(conn != NULL)
+            delete_conn_stat(conn);
+        CLOSE(fd);
+        return;
+    }
+    conn->trunk = 1;
+    conn->peer = t;
+    conn->connecting = 1;
+    conn->wantwrite = 1;
+    t->conn = conn;
+    if(join_domain(conn, t->network) < 0)
+        close_conn(conn);
 }
+
 /*****************************************************************************
- * find_conn_stat()
+ * finish_trunk()
  *
- * fd によって指定された conn_stat 構造体のを探し、return する。
+ * トランクの connect() が完了した時に呼ばれる。相手にトランクであることと
+ * ネットワーク ID を知らせる制御メッセージを送り、溜まっているフレームを
+ * 送信する。制御メッセージは送信キューのどのフレームよりも先に送る。
  *
  *  引数：
- *          fd: 検索する conn_stat 構造体に含まれる socket 番号
+ *          conn: トランクの conn_stat 構造体
  *  戻り値：
- *          conn_stat 構造体のポインタ
+ *          無し
  *****************************************************************************/
-struct conn_stat *
-find_conn_stat(int fd)
+void
+finish_trunk(struct conn_stat *conn)
 {
-    struct conn_stat *conn;
-    int i = 0;
+    struct trunk  *t = conn->peer;
+    unsigned char  hello[2 * (sizeof(stehead_t) + sizeof(stectl_t))];
+    stehead_t      steh;
+    stectl_t       ctl;
+    int            err = 0;
+    socklen_t      errlen = sizeof(err);
 
-    conn = conn_stat_head;
+    if(getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, (char *)&err, &errlen) < 0){
+        SET_ERRNO();
+        err = errno;
+    }
+    if(err != 0){
+        print_err(LOG_ERR,"trunk %s:%d: connect: %s\n", t->host, t->port, strerror(err));
+        close_conn(conn);
+        return;
+    }
 
-    while( conn != NULL){
-        if(conn->next->fd == fd){
-            return(conn->next);
+    steh.len = htonl(sizeof(stectl_t));
+    steh.orglen = 0;
+    ctl.type = htonl(STECTL_TRUNK);
+    ctl.arg = 0;
+    memcpy(hello, &steh, sizeof(stehead_t));
+    memcpy(hello + sizeof(stehead_t), &ctl, sizeof(stectl_t));
+    ctl.type = htonl(STECTL_NETWORK);
+    ctl.arg = htonl(t->network);
+    memcpy(hello + sizeof(hello) / 2, &steh, sizeof(stehead_t));
+    memcpy(hello + sizeof(hello) / 2 + sizeof(stehead_t), &ctl, sizeof(stectl_t));
+    /* 接続直後で socket のバッファは空なので、一度に送れる */
+    if(send(conn->fd, (char *)hello, sizeof(hello), 0) != sizeof(hello)){
+        SET_ERRNO();
+        print_err(LOG_ERR,"trunk %s:%d: send: %s\n", t->host, t->port, strerror(errno));
+        close_conn(conn);
+        return;
+    }
+    conn->connecting = 0;
+    print_err(LOG_NOTICE,"fd%d: trunk link to %s:%d\n", conn->fd, t->host, t->port);
+    if(conn->worker->aio){
+        /* 以後の受信はイベントエンジンが行い、書き込み可能になるのは待たない */
+        conn->wantwrite = 0;
+        if(ev_mod(conn->worker->evp, conn->fd, EV_RECV, (void *)conn) < 0){
+            close_conn(conn);
+            return;
         }
-        conn = conn->next;
     }
-    return((struct conn_stat *)NULL);
+    flush_conn(conn);
+}
+
+/*****************************************************************************
+ * recv_conn()
+ *
+ * コネクションからデータを読み込み、他の仮想 NIC デーモンに転送する。
+ * 1 つのコネクションが他を待たせないよう、recv() は RECV_BUDGET 回までとする。
+ *
+ * データはワーカーの受信バッファに読み込む。前回のバッファが送信キュー
+ * などからまだ参照されている場合は、新しいバッファを使う。
+ *
+ *  引数：
+ *          rconn: 読み込むコネクションの conn_stat 構造体
+ *  戻り値：
+ *          読み切った、または close した : 0
+ *          まだデータが残っている        : 1
+ *****************************************************************************/
+int
+recv_conn(struct conn_stat *rconn)
+{
+    struct worker *w = rconn->worker;
+    fbuf_t       *buf;
+    int          rfd = rconn->fd;
+    int          rsize;
+    int          n;
+
+    for(n = 0 ; n < RECV_BUDGET ; n++){
+        if(w->rxb != NULL && LOAD_ACQUIRE(&w->rxb->refcnt) > 1){
+            /* 溜めている送信を済ませれば、まだ同じバッファを使えるかもしれない */
+            flush_pending(w);
+        }
+        if(w->rxb != NULL && LOAD_ACQUIRE(&w->rxb->refcnt) > 1){
+            fbuf_put(&w->pool, w->rxb);
+            w->rxb = NULL;
+        }
+        if(w->rxb == NULL && (w->rxb = fbuf_get(&w->pool)) == NULL){
+            /* 送信キューのバッファが解放されれば読み込めるようになる */
+            print_err(LOG_ERR,"fd%d: can't allocate receive buffer\n", rfd);
+            return(1);
+        }
+        buf = w->rxb;
+
+        rsize = recv(rfd, (char *)buf->data + FRAME_MAX, SOCKBUFSIZE, 0);
+        if(rsize == 0){
+            /*
+             * コネクションが切断されたようだ。
+             */
+            print_err(LOG_ERR,"fd%d: Connection closed by %s\n", rfd, inet_ntoa(rconn->addr));
+            close_conn(rconn);
+            return(0);
+        }
+        if(rsize < 0){
+            SET_ERRNO();                    
+            /*
+             * 致命的でない error の場合は無視する
+             */
+            if(errno == EINTR)
+                continue;
+            if(errno == EWOULDBLOCK)
+                return(0);
+            /*
+             * エラーが発生したようだ。
+             */
+            print_err(LOG_ERR,"fd%d: recv: %s\n", rfd,strerror(errno));
+            close_conn(rconn);
+            return(0);
+        }
+
+        if(input_recv(rconn, buf, rsize) < 0)
+            return(0);
+    }
+    return(1);
+}
+
+/*****************************************************************************
+ * recv_done()
+ *
+ * イベントエンジンが受信した時（EV_RECV）に呼ばれる。受信データを他の
+ * 仮想 NIC デーモンに転送し、受信バッファの参照を外す。
+ *
+ *  引数：
+ *          rconn: 受信したコネクションの conn_stat 構造体
+ *          buf  : 受信データを含む受信バッファ。データは FRAME_MAX から始まる
+ *          res  : 受信したサイズ。0 なら切断、負ならエラー（-errno）
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+recv_done(struct conn_stat *rconn, fbuf_t *buf, int res)
+{
+    struct worker *w = rconn->worker;
+
+    if(rconn->closed){
+        /* 同じ起床の中で、既に close した */
+    } else if(res == 0){
+        print_err(LOG_ERR,"fd%d: Connection closed by %s\n", rconn->fd, inet_ntoa(rconn->addr));
+        close_conn(rconn);
+    } else if(res < 0){
+        print_err(LOG_ERR,"fd%d: recv: %s\n", rconn->fd, strerror(-res));
+        close_conn(rconn);
+    } else {
+        input_recv(rconn, buf, res);
+    }
+    if(buf != NULL)
+        fbuf_put(&w->pool, buf);
+}
+
+/*****************************************************************************
+ * input_recv()
+ *
+ * 受信バッファに recv() したデータを転送する。前回の受信データで未完成
+ * だったフレームを受信データの直前に置き、すべてのフレームがバッファ中で
+ * 連続するようにしてから input_data() に渡す。
+ *
+ *  引数：
+ *          rconn: 受信したコネクションの conn_stat 構造体
+ *          buf  : 受信バッファ。受信データは FRAME_MAX から始まる
+ *          rsize: 受信したサイズ
+ *  戻り値：
+ *          正常時 : 0
+ *          stehead が壊れていて close した : -1
+ *****************************************************************************/
+int
+input_recv(struct conn_stat *rconn, fbuf_t *buf, int rsize)
+{
+    if(lat_on)
+        rconn->worker->rx_nsec = hub_nsec();
+
+    memcpy(buf->data + FRAME_MAX - rconn->rxlen, rconn->rxbuf, rconn->rxlen);
+    if(input_data(rconn, buf, buf->data + FRAME_MAX - rconn->rxlen, rconn->rxlen + rsize) < 0){
+        close_conn(rconn);
+        return(-1);
+    }
+    return(0);
+}
+
+/*****************************************************************************
+ * input_data()
+ *
+ * 受信データを stehead で区切られたフレームに分け、完成したフレームだけを
+ * 他の仮想 NIC デーモンに転送する。完成しているフレームはコピーせずに
+ * まとめて転送し、最後の未完成のフレームだけを rxbuf に残す。
+ * 制御メッセージは転送せず、input_ctl() で処理する。
+ * まだドメインに参加していないポートは、最初のフレームを受信した時に
+ * ネットワーク 0 に参加する。
+ *
+ *  引数：
+ *          rconn : 受信したコネクションの conn_stat 構造体
+ *          buf   : 受信データを含む受信バッファ
+ *          bufp  : 受信データ（前回の未完成のフレームを含む）
+ *          rsize : 受信データのサイズ
+ *  戻り値：
+ *          正常時 : 0
+ *          stehead が壊れている : -1
+ *****************************************************************************/
+int
+input_data(struct conn_stat *rconn, fbuf_t *buf, unsigned char *bufp, int rsize)
+{
+    struct worker *w = rconn->worker;
+    unsigned char *startp = bufp;
+    stehead_t      steh;
+    frame_t        run;
+    int            framelen;
+
+    run.buf = buf;
+    run.ts = w->rx_nsec;
+    while(rsize >= sizeof(stehead_t)){
+        if((framelen = frame_size(rconn, bufp)) < 0)
+            return(-1);
+        if(framelen > rsize)
+            break;
+        memcpy(&steh, bufp, sizeof(stehead_t));
+        if(steh.orglen == 0){
+            /* 制御メッセージ。手前までのフレームを先に転送する */
+            if(bufp > startp){
+                run.data = startp;
+                run.len = bufp - startp;
+                run.flags = rconn->trunk ? FRAME_TRUNK : 0;
+                run.bundle = rconn->bundle;
+                run.domain = rconn->domain;
+                forward_data(w, rconn, &run);
+            }
+            if(input_ctl(rconn, bufp + sizeof(stehead_t)) < 0)
+                return(-1);
+            startp = bufp + framelen;
+        } else {
+            if(rconn->domain == NULL && join_domain(rconn, 0) < 0)
+                return(-1);
+            rconn->rx_frames++;
+            rconn->rx_bytes += framelen;
+            rconn->domain->shard[w->id].rx_frames++;
+            rconn->domain->shard[w->id].rx_bytes += framelen;
+        }
+        bufp += framelen;
+        rsize -= framelen;
+    }
+    if(bufp > startp){
+        run.data = startp;
+        run.len = bufp - startp;
+        run.flags = rconn->trunk ? FRAME_TRUNK : 0;
+        run.bundle = rconn->bundle;
+        run.domain = rconn->domain;
+        forward_data(w, rconn, &run);
+    }
+
+    /*
+     * 残りは未完成のフレームなので、次の受信データを待つ。
+     */
+    memcpy(rconn->rxbuf, bufp, rsize);
+    rconn->rxlen = rsize;
+    return(0);
+}
+
+/*****************************************************************************
+ * input_ctl()
+ *
+ * 制御メッセージを処理する。知らない種類のものは無視する。
+ * ネットワーク ID は、ドメインに参加した後では変えられない。
+ * STECTL_BUNDLE と STECTL_LANE も、STECTL_LANE を受け付けた後では
+ * 変えられない（bundle の表に登録した位置が分からなくなる）。
+ *
+ *  引数：
+ *          conn : 受信したコネクションの conn_stat 構造体
+ *          ctlp : 制御メッセージ（stectl）の先頭
+ *  戻り値：
+ *          正常時 : 0
+ *          このコネクションを切断する : -1
+ *****************************************************************************/
+int
+input_ctl(struct conn_stat *conn, unsigned char *ctlp)
+{
+    stectl_t ctl;
+    uint32_t id, arg;
+
+    memcpy(&ctl, ctlp, sizeof(stectl_t));
+    switch(ntohl(ctl.type)){
+        case STECTL_TRUNK:
+            if(!conn->trunk)
+                print_err(LOG_NOTICE,"fd%d: trunk link from %s\n", conn->fd, inet_ntoa(conn->addr));
+            conn->trunk = 1;
+            break;
+        case STECTL_BUNDLE:
+        case STECTL_LANE:
+            if(conn->nlanes != 0){
+                print_err(LOG_ERR,"fd%d: can't change connection group\n", conn->fd);
+                return(-1);
+            }
+            if(ntohl(ctl.type) == STECTL_BUNDLE){
+                conn->bundle = ntohl(ctl.arg);
+                break;
+            }
+            arg = ntohl(ctl.arg);
+            if((arg & 0xffff) == 0 || (arg >> 16) >= (arg & 0xffff)){
+                print_err(LOG_ERR,"fd%d: bad connection number %u/%u\n",
+                          conn->fd, arg >> 16, arg & 0xffff);
+                return(-1);
+            }
+            conn->lane = arg >> 16;
+            conn->nlanes = arg & 0xffff;
+            return(join_bundle(conn));
+        case STECTL_NETWORK:
+            id = ntohl(ctl.arg);
+            if(conn->domain == NULL)
+                return(join_domain(conn, id));
+            if(conn->domain->id != id){
+                print_err(LOG_ERR,"fd%d: can't move from network %u to %u\n",
+                          conn->fd, conn->domain->id, id);
+                return(-1);
+            }
+            break;
+        default:
+            print_err(LOG_NOTICE,"fd%d: unknown control message (type = %d)\n",
+                      conn->fd, ntohl(ctl.type));
+            break;
+    }
+    return(0);
+}
+
+/*****************************************************************************
+ * frame_size()
+ *
+ * stehead を読み取り、stehead とパディングを含めたフレームのサイズを返す。
+ * Ethernet フレームのサイズが 0 より大きく ETHERMAX 以下で、パディングが
+ * 3 byte 以下であることを確かめる。orglen が 0 のものは制御メッセージで、
+ * len が stectl のサイズであることを確かめる。
+ *
+ *  引数：
+ *          conn  : コネクションの conn_stat 構造体
+ *          headp : stehead の先頭
+ *  戻り値：
+ *          正常時 : フレームのサイズ
+ *          stehead が壊れている : -1
+ *****************************************************************************/
+int
+frame_size(struct conn_stat *conn, unsigned char *headp)
+{
+    stehead_t steh;
+    int       len, orglen;
+
+    memcpy(&steh, headp, sizeof(stehead_t));
+    len = ntohl(steh.len);
+    orglen = ntohl(steh.orglen);
+
+    if(orglen == 0 && len == sizeof(stectl_t))
+        return(sizeof(stehead_t) + len);
+    if(orglen <= 0 || orglen > ETHERMAX || len < orglen || len - orglen > 3){
+        /*
+         * stehead が壊れている。TCP のストリーム中で次のフレームの先頭を
+         * 見つける確実な方法は無いので、このコネクションは切断する。
+         */
+        print_err(LOG_ERR,"fd%d: header is broken (len = %d, orglen = %d)\n",
+                  conn->fd, len, orglen);
+        conn->worker->stats->rx_malformed++;
+        return(-1);
+    }
+    return(sizeof(stehead_t) + len);
+}
+
+/*****************************************************************************
+ * forward_data()
+ *
+ * 他の仮想 NIC にフレームを転送する。
+ * 送信元 MAC アドレスを学習し、宛先 MAC アドレスが学習済みのユニキャスト
+ * であればそのポートにだけ送信する。ブロードキャスト、マルチキャスト、
+ * 未学習のユニキャストは同じドメインの受信したポート以外のすべての
+ * ポートに送信する。ただし、ストーム制御の上限を超えるものは破棄する。
+ * 送信先が同じフレームが続いている間は、まとめて送信する。
+ *
+ *  引数：
+ *          w    : ワーカー
+ *          rconn: 受信したコネクションの conn_stat 構造体。
+ *                 他のワーカーから渡されたフレームなら NULL
+ *          fp   : 1 つ以上の完成したフレーム
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+forward_data(struct worker *w, struct conn_stat *rconn, frame_t *fp)
+{
+    unsigned char    *framep, *etherp;
+    struct conn_stat *dconn, *rundconn = NULL;
+    stehead_t         steh;
+    frame_t           run, one;
+    int               framelen, skip;
+    int               shard, runshard = -1;
+
+    run = *fp;
+    run.len = 0;
+    for(framep = fp->data ; framep < fp->data + fp->len ; framep += framelen){
+        memcpy(&steh, framep, sizeof(stehead_t));
+        framelen = sizeof(stehead_t) + ntohl(steh.len);
+        etherp = framep + sizeof(stehead_t);
+        dconn = lookup_dest(w, rconn, fp->domain, etherp, ntohl(steh.orglen), &shard);
+        /* 送信元と同じポート（同じ sted の他の接続も）にいる宛先なら転送しない */
+        skip = (dconn != NULL &&
+                (dconn == rconn || (dconn->bundle != 0 && dconn->bundle == fp->bundle)));
+        if(rconn != NULL && dconn == NULL && shard < 0){
+            if(storm_on && storm_drop(w, rconn, fp->domain, etherp, framelen)){
+                skip = 1;
+            } else {
+                fp->domain->shard[w->id].flood_frames++;
+                rconn->rx_flood++;
+            }
+        } else if(rconn != NULL && !skip){
+            fp->domain->shard[w->id].unicast_frames++;
+            rconn->rx_unicast++;
+        }
+
+        /*
+         * IP マルチキャストと IGMP/MLD の Report、Leave は、グループの
+         * メンバーかルータを引いてフレーム毎に送信する
+         */
+        if(!skip && dconn == NULL && shard < 0 && fp->domain->mdb != NULL &&
+           (mdb_snoopable(etherp) || mdb_report(etherp, ntohl(steh.orglen)))){
+            if(run.len > 0)
+                output_data(w, rconn, rundconn, runshard, &run);
+            run.len = 0;
+            one = *fp;
+            one.data = framep;
+            one.len = framelen;
+            output_mcast(w, rconn, &one);
+            continue;
+        }
+
+        if(!skip && run.len > 0 && dconn == rundconn && shard == runshard){
+            run.len += framelen;
+            continue;
+        }
+        if(run.len > 0)
+            output_data(w, rconn, rundconn, runshard, &run);
+        run.len = 0;
+        if(skip)
+            continue;
+        run.data = framep;
+        run.len = framelen;
+        rundconn = dconn;
+        runshard = shard;
+    }
+    if(run.len > 0)
+        output_data(w, rconn, rundconn, runshard, &run);
+}
+
+/*****************************************************************************
+ * storm_drop()
+ *
+ * 全ポートに送信するフレームが、受信したポートとドメインのストーム制御の
+ * 上限を超えるかどうかを確かめる。ポートの上限はトランクには適用しない。
+ * ドメインの状態は全ワーカーで共有する。
+ *
+ *  引数：
+ *          w      : ワーカー
+ *          rconn  : 受信したコネクションの conn_stat 構造体
+ *          dom    : フレームのドメイン
+ *          etherp : Ethernet フレーム
+ *          len    : stehead を含むフレームのサイズ
+ *  戻り値：
+ *          破棄する   : 1
+ *          送信する   : 0
+ *****************************************************************************/
+int
+storm_drop(struct worker *w, struct conn_stat *rconn, domain_t *dom, unsigned char *etherp, int len)
+{
+    int kind = storm_kind(etherp);
+
+    if(!rconn->trunk &&
+       !storm_allow(&storm_port, kind, rconn->storm_tat[kind], w->nsec, len, 0)){
+        rconn->storm_drops[kind]++;
+        return(1);
+    }
+    if(!storm_allow(&storm_domain, kind, dom->storm_tat[kind], w->nsec, len, 1)){
+        dom->shard[w->id].storm_drops[kind]++;
+        return(1);
+    }
+    return(0);
+}
+
+/*****************************************************************************
+ * lookup_dest()
+ *
+ * 送信元 MAC アドレスを学習し、宛先 MAC アドレスから送信先のポートを引く。
+ * 宛先が sted の複数の接続の先なら、フレームのフローで接続を選ぶ。
+ * マルチキャストのフレームは、IGMP/MLD のメッセージならマルチキャスト
+ * グループの表を更新する。他のワーカーから渡されたフレームでは学習しない。
+ *
+ *  引数：
+ *          w     : ワーカー
+ *          rconn : 受信したコネクションの conn_stat 構造体、または NULL
+ *          dom   : フレームのドメイン
+ *          etherp: Ethernet フレーム
+ *          len   : Ethernet フレームのサイズ
+ *          shardp: 送信先のポートを持っているワーカーの番号を返す。
+ *                  全ポートに送信する場合は -1
+ *  戻り値：
+ *          このワーカーのポートへのユニキャスト : 送信先の conn_stat 構造体
+ *          それ以外                             : NULL
+ *****************************************************************************/
+struct conn_stat *
+lookup_dest(struct worker *w, struct conn_stat *rconn, domain_t *dom, unsigned char *etherp,
+            int len, int *shardp)
+{
+    unsigned char    *dst = etherp;
+    unsigned char    *src = etherp + ETHERADDRL;
+    struct conn_stat *dconn;
+    void             *lane;
+    uint32_t          bundle;
+    int               shard;
+
+    *shardp = -1;
+    if(len < ETHERHEADERL)
+        return(NULL);
+
+    /*
+     * 送信元がマルチキャストアドレスのフレームは不正なので学習しない。
+     * 同じ送信元からのフレームが続く間は、テーブルを引くのは 1 秒に 1 回
+     * でよい。
+     */
+    if(dom->fdb != NULL && rconn != NULL && (src[0] & 0x01) == 0 &&
+       (rconn->learn_time != w->now || memcmp(rconn->learn_src, src, ETHERADDRL) != 0)){
+        /*
+         * sted は同じ送信元からのフレームもフロー毎に別の接続で送るので、
+         * まとめられた接続では bundle として学習し、どの接続から受信しても
+         * 学習したポートは付け替えない。
+         */
+        fdb_learn(dom->fdb, src, (void *)rconn, w->id, rconn->nlanes > 1 ? rconn->bundle : 0);
+        memcpy(rconn->learn_src, src, ETHERADDRL);
+        rconn->learn_time = w->now;
+    }
+
+    if(dst[0] & 0x01){
+        /* ブロードキャスト、マルチキャスト */
+        if(dom->mdb != NULL && rconn != NULL)
+            mdb_snoop(dom->mdb, etherp, len, (void *)rconn, w->id, rconn->trunk, w->now);
+        return(NULL);
+    }
+    if(dom->fdb == NULL)
+        return(NULL);
+    dconn = (struct conn_stat *)fdb_lookup(dom->fdb, dst, shardp, &bundle);
+    /*
+     * sted の複数の接続の先にいる宛先なら、sted と同じようにフロー毎に
+     * 接続を選ぶ。
+     */
+    if(bundle != 0 &&
+       (lane = btab_lane(dom->btab, bundle, flow_hash(etherp, len), &shard)) != NULL){
+        dconn = (struct conn_stat *)lane;
+        *shardp = shard;
+    }
+    /* 他のワーカーのポートは参照できない（close されているかもしれない）*/
+    if(*shardp != w->id)
+        return(NULL);
+    return(dconn);
+}
+
+/*****************************************************************************
+ * output_data()
+ *
+ * フレームを送信先のポートに送信する。送信先が他のワーカーのポートなら、
+ * そのワーカーに渡す。送信先が無い（shard が -1）なら、このワーカーの
+ * 同じドメインの受信したポート以外のすべてのポートに送信し、そのドメインの
+ * ポートを持つ他のすべてのワーカーにも渡す。他のワーカーから渡された
+ * フレームは、他のワーカーには渡さない。
+ * トランクから受信したフレームは、他のトランクには送信しない（split horizon）。
+ * 同じ sted の接続から受信したフレームは、その sted の他の接続には送信しない。
+ *
+ *  引数：
+ *          w    : ワーカー
+ *          rconn: 受信したコネクションの conn_stat 構造体、または NULL
+ *          dconn: 送信先のコネクションの conn_stat 構造体、または NULL
+ *          shard: 送信先のポートを持っているワーカーの番号、または -1
+ *          fp   : 1 つ以上の完成したフレーム
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+output_data(struct worker *w, struct conn_stat *rconn, struct conn_stat *dconn, int shard,
+            frame_t *fp)
+{
+    struct conn_stat *wconn;
+    dshard_t         *ds = &fp->domain->shard[w->id];
+    int               trunk = fp->flags & FRAME_TRUNK;
+    int               i;
+
+    if(dconn != NULL){
+        if(trunk && dconn->trunk)
+            return;
+        if( debuglevel > 1)
+            print_route(w, rconn, dconn);
+        send_data(dconn, fp);
+        return;
+    }
+
+    if(shard >= 0){
+        /*
+         * 他のワーカーのポート宛。他のワーカーから渡されたフレームなら
+         * その後にテーブルが変わったということなので、捨てる。
+         */
+        if(rconn != NULL)
+            forward_shard(w, shard, fp);
+        return;
+    }
+
+    /*
+     * 送信に失敗して close したコネクションの位置には ports の末尾の
+     * コネクションが移ってくるので、末尾から順に送信する。
+     */
+    for(i = ds->nports - 1 ; i >= 0 ; i--){
+        wconn = (struct conn_stat *)ds->ports[i];
+
+        if (wconn == rconn || (trunk && wconn->trunk) ||
+            (wconn->bundle != 0 && wconn->bundle == fp->bundle))
+            continue;
+
+        if( debuglevel > 1)
+            print_route(w, rconn, wconn);
+        if (wconn->nlanes > 1)
+            send_bundle(wconn, fp);
+        else
+            send_data(wconn, fp);
+    }
+
+    if(rconn != NULL){
+        for(i = 0 ; i < nworkers ; i++){
+            /* 他のワーカーの nports は古い値かもしれないが、参照はしない */
+            if(i != w->id && LOAD_ACQUIRE(&fp->domain->shard[i].nports) > 0)
+                forward_shard(w, i, fp);
+        }
+    }
+}
+
+/*****************************************************************************
+ * output_mcast()
+ *
+ * IP マルチキャストのフレームを、グループのメンバーとルータのポートに
+ * 送信する。他のワーカーのポートなら、そのワーカーに渡す。渡された
+ * ワーカーは、自分のポートをもう一度表から引いて送信する。メンバーの
+ * いないグループなら、全ポートに送信する。
+ * IGMP/MLD の Report と Leave はルータのポートにだけ送信し、メンバーには
+ * 送信しない（他のメンバーの Report を止めてしまう）。ルータがいなければ
+ * 全ポートに送信する。
+ * 同じ sted からの複数の接続では、IGMP/MLD のメッセージはフロー毎に
+ * 決まった接続を通るので、メンバーになるのはその 1 つの接続だけで、
+ * 送信する接続を選び直す必要は無い。
+ *
+ *  引数：
+ *          w    : ワーカー
+ *          rconn: 受信したコネクションの conn_stat 構造体、または NULL
+ *          fp   : 1 つの完成したフレーム
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+output_mcast(struct worker *w, struct conn_stat *rconn, frame_t *fp)
+{
+    struct conn_stat *wconn;
+    unsigned char    *etherp = fp->data + sizeof(stehead_t);
+    stehead_t         steh;
+    int               trunk = fp->flags & FRAME_TRUNK;
+    uint64_t          mask;
+    int               i, n;
+
+    memcpy(&steh, fp->data, sizeof(stehead_t));
+    n = mdb_lookup(fp->domain->mdb, etherp, mdb_report(etherp, ntohl(steh.orglen)), w->id,
+                   &w->mports, &w->mportsize, &mask);
+    if(n < 0){
+        output_data(w, rconn, NULL, -1, fp);
+        return;
+    }
+
+    /*
+     * mports はロックを外した後のコピーだが、このワーカーのポートは
+     * このワーカーしか close せず、close したポートの解放はループの
+     * 最後なので、参照してよい。
+     */
+    for(i = 0 ; i < n ; i++){
+        wconn = (struct conn_stat *)w->mports[i];
+
+        if (wconn == rconn || (trunk && wconn->trunk) ||
+            (wconn->bundle != 0 && wconn->bundle == fp->bundle))
+            continue;
+
+        if( debuglevel > 1)
+            print_route(w, rconn, wconn);
+        send_data(wconn, fp);
+    }
+
+    if(rconn != NULL){
+        for(i = 0 ; i < nworkers ; i++){
+            if(i != w->id && (mask & ((uint64_t)1 << i)))
+                forward_shard(w, i, fp);
+        }
+    }
+}
+
+/*****************************************************************************
+ * print_route()
+ *
+ * デバッグ用に、フレームの転送元と転送先を表示する。
+ *****************************************************************************/
+void
+print_route(struct worker *w, struct conn_stat *rconn, struct conn_stat *wconn)
+{
+    if(rconn != NULL)
+        print_err(LOG_ERR,"fd%d(%s) ==> ", rconn->fd, inet_ntoa(rconn->addr));
+    else
+        print_err(LOG_ERR,"worker%d ==> ", w->id);
+    print_err(LOG_ERR,"fd%d(%s)\n", wconn->fd,inet_ntoa(wconn->addr));
+}
+
+/*****************************************************************************
+ * forward_shard()
+ *
+ * フレームを他のワーカーへのリングに入れる。フレームはコピーせず、
+ * 受信バッファの参照を渡す。リングが一杯なら捨てる。相手のワーカーは、
+ * このワーカーのループの最後に wakeup_shards() でまとめて起こす。
+ *
+ *  引数：
+ *          w    : ワーカー
+ *          shard: 渡す相手のワーカーの番号
+ *          fp   : 1 つ以上の完成したフレーム
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+forward_shard(struct worker *w, int shard, frame_t *fp)
+{
+    fbuf_hold(fp->buf);
+    if(spsc_push(workers[shard].inq[w->id], fp) < 0){
+        if(debuglevel > 0)
+            print_err(LOG_NOTICE,"worker%d: ring to worker%d is full, frames dropped (%d bytes)\n",
+                      w->id, shard, fp->len);
+        w->stats->ring_drops++;
+        fbuf_put(&w->pool, fp->buf);
+        return;
+    }
+    w->wake[shard] = 1;
+}
+
+/*****************************************************************************
+ * wakeup_shards()
+ *
+ * このループでフレームを渡したワーカーを起こす。相手がまだ起床用の
+ * pipe を読んでいなければ、書き込みは省略する。
+ *****************************************************************************/
+void
+wakeup_shards(struct worker *w)
+{
+    struct worker *dw;
+    int            i;
+
+    for(i = 0 ; i < nworkers ; i++){
+        if(!w->wake[i])
+            continue;
+        w->wake[i] = 0;
+        dw = &workers[i];
+        if(ATOMIC_SWAP(&dw->wakeup_pending, 1) == 0)
+            write(dw->wakeup_fd[1], "", 1);
+    }
+}
+
+/*****************************************************************************
+ * recv_shards()
+ *
+ * 他のワーカーから渡されたフレームを、このワーカーのポートに送信する。
+ * 1 つのリングから取り出すのは SHARD_BUDGET 個までとする。
+ *
+ *  引数：
+ *          w : ワーカー
+ *  戻り値：
+ *          リングが空になった       : 0
+ *          まだフレームが残っている : 1
+ *****************************************************************************/
+int
+recv_shards(struct worker *w)
+{
+    char     buf[64];
+    frame_t  frame;
+    int      i, n, more = 0;
+
+    /*
+     * 先に wakeup_pending を戻してからリングを見るので、この後に
+     * 入れられたフレームについては、もう一度起こされる。
+     */
+    while(read(w->wakeup_fd[0], buf, sizeof(buf)) > 0)
+        ;
+    ATOMIC_SWAP(&w->wakeup_pending, 0);
+
+    for(i = 0 ; i < nworkers ; i++){
+        if(i == w->id)
+            continue;
+        for(n = 0 ; n < SHARD_BUDGET ; n++){
+            if(spsc_pop(w->inq[i], &frame) < 0)
+                break;
+            forward_data(w, NULL, &frame);
+            fbuf_put(&w->pool, frame.buf);
+        }
+        if(n == SHARD_BUDGET)
+            more = 1;
+    }
+    return(more);
+}
+
+/*****************************************************************************
+ * send_data()
+ *
+ * フレームを 1 つのコネクションの送信キューに入れる。
+ * 送信キューにはフレームをコピーせず、受信バッファの参照を入れるので、
+ * 同じフレームを多数のポートの送信キューに入れても受信バッファは 1 つで
+ * 済む。送信キューのフレームは、ワーカーのループの最後に flush_pending()
+ * でまとめて送信される。送信キューが一杯になる場合は、先に送信する。
+ *
+ *  引数：
+ *          wconn: 送信先のコネクションの conn_stat 構造体
+ *          fp   : 1 つ以上の完成したフレーム
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+send_data(struct conn_stat *wconn, frame_t *fp)
+{
+    stehead_t steh;
+    frame_t   frame;
+    int       off, framelen;
+
+    for(off = 0 ; off < fp->len ; off += framelen){
+        memcpy(&steh, fp->data + off, sizeof(stehead_t));
+        framelen = sizeof(stehead_t) + ntohl(steh.len);
+
+        if(txq_full(&wconn->txq, framelen) && !wconn->wantwrite && wconn->tx_inflight == 0)
+            write_conn(wconn);
+        if(wconn->closed)
+            return;
+
+        frame.buf = fp->buf;
+        frame.data = fp->data + off;
+        frame.len = framelen;
+        frame.flags = 0;
+        frame.ts = fp->ts;
+        fbuf_hold(fp->buf);
+        if(txq_enqueue(&wconn->txq, &frame) < 0 && debuglevel > 0)
+            print_err(LOG_NOTICE,"fd%d: queue full, frame dropped (%d bytes)\n", wconn->fd, framelen);
+    }
+
+    set_pending(wconn);
+}
+
+/*****************************************************************************
+ * set_pending()
+ *
+ * 送信キューにフレームを入れたコネクションを pend リストに繋ぐ。
+ * 起床の最後に flush_pending() で送信する。
+ *****************************************************************************/
+void
+set_pending(struct conn_stat *wconn)
+{
+    struct worker *w = wconn->worker;
+
+    if(wconn->pending)
+        return;
+    wconn->pending = 1;
+    wconn->pend_next = w->pend_head;
+    w->pend_head = wconn;
+}
+
+/*****************************************************************************
+ * send_bundle()
+ *
+ * 同じ sted からの複数の接続の 1 つに、全ポートに送信するフレームを
+ * 送る。フレーム毎に flow_hash() で bundle の表から選んだ 1 つの接続に
+ * だけ送るので、その sted にはフレームが 1 度だけ届き、同じフローは
+ * 同じ接続を通る。選ばれる接続が切断されていても、他の接続が代わりに
+ * 送る。
+ *
+ *  引数：
+ *          wconn: 送信先のコネクションの conn_stat 構造体
+ *          fp   : 1 つ以上の完成したフレーム
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+send_bundle(struct conn_stat *wconn, frame_t *fp)
+{
+    stehead_t steh;
+    frame_t   one;
+    int       off, framelen, shard;
+
+    one = *fp;
+    for(off = 0 ; off < fp->len ; off += framelen){
+        memcpy(&steh, fp->data + off, sizeof(stehead_t));
+        framelen = sizeof(stehead_t) + ntohl(steh.len);
+        if(btab_lane(fp->domain->btab, wconn->bundle,
+                     flow_hash(fp->data + off + sizeof(stehead_t), ntohl(steh.orglen)),
+                     &shard) != (void *)wconn)
+            continue;
+        one.data = fp->data + off;
+        one.len = framelen;
+        send_data(wconn, &one);
+    }
+}
+
+/*****************************************************************************
+ * flush_pending()
+ *
+ * 送信キューにフレームを入れたコネクションの送信を行う。
+ * 書き込み可能になるのを待っているコネクションは、その時に送信する。
+ *****************************************************************************/
+void
+flush_pending(struct worker *w)
+{
+    struct conn_stat *conn;
+
+    while((conn = w->pend_head) != NULL){
+        w->pend_head = conn->pend_next;
+        conn->pending = 0;
+        conn->pend_next = NULL;
+        if(!conn->closed && !conn->wantwrite)
+            flush_conn(conn);
+    }
+}
+
+/*****************************************************************************
+ * flush_conn()
+ *
+ * 送信キューのフレームを送信する。イベントエンジンが送信も行う場合は
+ * submit_conn() で依頼し、そうでなければ write_conn() で送信する。
+ *
+ *  引数：
+ *          wconn: 送信先のコネクションの conn_stat 構造体
+ *  戻り値：
+ *          すべて送信した : 0
+ *          まだ残っている、または close した : 1
+ *****************************************************************************/
+int
+flush_conn(struct conn_stat *wconn)
+{
+    if(wconn->worker->aio)
+        return(submit_conn(wconn));
+    return(write_conn(wconn));
+}
+
+/*****************************************************************************
+ * write_conn()
+ *
+ * 送信キューのフレームを、送信キューが空になるか socket のバッファが一杯
+ * になるまで送信する。フレームは tx_batch_iov 個の iovec、tx_batch_bytes
+ * バイトまでまとめて 1 回の writev() で送信する。
+ * イベントエンジンが送信も行う場合でも、送信キューが一杯になった時は、
+ * 依頼中の送信が無ければこれで送信する。socket のバッファが一杯なら、
+ * 残りは flush_pending() で依頼する。
+ *
+ *  引数：
+ *          wconn: 送信先のコネクションの conn_stat 構造体
+ *  戻り値：
+ *          すべて送信した : 0
+ *          まだ残っている、または close した : 1
+ *****************************************************************************/
+int
+write_conn(struct conn_stat *wconn)
+{
+    struct iovec *iov = wconn->worker->iov;
+    txq_t        *txq = &wconn->txq;
+    int           niov, i, total, ssize, pos;
+
+    for(;;){
+        pos = -1;
+        if((niov = txq_iov(txq, &pos, iov, tx_batch_iov, tx_batch_bytes)) == 0)
+            break;
+        for(total = 0, i = 0 ; i < niov ; i++)
+            total += iov[i].iov_len;
+        if((ssize = writev(wconn->fd, iov, niov)) < 0){
+            SET_ERRNO();
+            if(errno == EINTR)
+                continue;
+            if(errno == EWOULDBLOCK){
+                wconn->tx_blocked++;
+                want_write(wconn, 1);
+                return(1);
+            }
+            print_err(LOG_ERR,"fd%d: writev: %s (%d)\n",wconn->fd,strerror(errno), errno);
+            close_conn(wconn);
+            return(1);
+        }
+        wconn->tx_frames += txq_consume(txq, ssize, wconn->lat,
+                                        wconn->lat != NULL ? hub_nsec() : 0);
+        wconn->tx_bytes += ssize;
+        if(ssize < total){
+            /* socket のバッファが一杯になった */
+            wconn->tx_blocked++;
+            want_write(wconn, 1);
+            return(1);
+        }
+    }
+    want_write(wconn, 0);
+    return(0);
+}
+
+/*****************************************************************************
+ * submit_conn()
+ *
+ * 送信キューのフレームの送信を、イベントエンジンに依頼する（w->aio）。
+ * tx_batch_iov 個の iovec、tx_batch_bytes バイト毎の writev() に分け、
+ * TX_LINKS 個まで続けて依頼する。依頼したフレームは送信が終わるまで
+ * 破棄されない。前に依頼した送信が終わっていなければ何もしない。
+ *
+ *  引数：
+ *          wconn: 送信先のコネクションの conn_stat 構造体
+ *  戻り値：
+ *          送信するものが無い : 0
+ *          依頼した、または送信中、close した : 1
+ *****************************************************************************/
+int
+submit_conn(struct conn_stat *wconn)
+{
+    struct iovec *iov = wconn->iov;
+    txq_t        *txq = &wconn->txq;
+    int           niovs[TX_LINKS];
+    int           n, i, nbatch, pos = -1;
+
+    if(wconn->tx_inflight > 0 || wconn->closed)
+        return(1);
+    for(nbatch = 0 ; nbatch < TX_LINKS ; nbatch++){
+        if((n = txq_iov(txq, &pos, iov, tx_batch_iov, tx_batch_bytes)) == 0)
+            break;
+        for(wconn->tx_len[nbatch] = 0, i = 0 ; i < n ; i++)
+            wconn->tx_len[nbatch] += iov[i].iov_len;
+        niovs[nbatch] = n;
+        iov += n;
+    }
+    if(nbatch == 0)
+        return(0);
+    if(ev_writev(wconn->worker->evp, wconn->fd, wconn->iov, niovs, nbatch, (void *)wconn) < 0){
+        close_conn(wconn);
+        return(1);
+    }
+    txq->busy = pos;
+    wconn->tx_inflight = nbatch;
+    wconn->tx_done = 0;
+    return(1);
+}
+
+/*****************************************************************************
+ * send_done()
+ *
+ * イベントエンジンに依頼した送信が 1 つ終わった時（EV_SENT）に呼ばれる。
+ * 送信できた分を送信キューから取り除く。依頼した送信がすべて終われば、
+ * 残りのフレームはこの起床の最後に flush_pending() で依頼する。
+ *
+ *  引数：
+ *          wconn: 送信先のコネクションの conn_stat 構造体
+ *          res  : 送信したサイズ。負ならエラー（-errno）
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+send_done(struct conn_stat *wconn, int res)
+{
+    int len = wconn->tx_len[wconn->tx_done++];
+
+    wconn->tx_inflight--;
+    if(wconn->closed)
+        return;
+    if(res > 0){
+        wconn->tx_frames += txq_consume(&wconn->txq, res, wconn->lat,
+                                        wconn->lat != NULL ? hub_nsec() : 0);
+        wconn->tx_bytes += res;
+        if(res < len)
+            wconn->tx_blocked++;  /* 続けて依頼した送信は -ECANCELED で終わる */
+    } else if(res < 0 && res != -ECANCELED && res != -EINTR && res != -EAGAIN){
+        print_err(LOG_ERR,"fd%d: writev: %s (%d)\n", wconn->fd, strerror(-res), -res);
+        close_conn(wconn);
+        return;
+    }
+    if(wconn->tx_inflight == 0){
+        wconn->txq.busy = 0;
+        set_pending(wconn);
+    }
+}
+
+/*****************************************************************************
+ * want_write()
+ *
+ * 書き込み可能になったことの通知を受けるかどうかを切り替える。
+ * イベントエンジンが送信も行う場合は、カーネルが書き込めるのを待つので
+ * 何もしない。
+ *
+ *  引数：
+ *          conn: コネクションの conn_stat 構造体
+ *          on  : 1 なら通知を受ける、0 なら受けない
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+want_write(struct conn_stat *conn, int on)
+{
+    if(conn->wantwrite == on || conn->closed || conn->worker->aio)
+        return;
+    conn->wantwrite = on;
+    ev_mod(conn->worker->evp, conn->fd, on ? EV_READ|EV_WRITE : EV_READ, (void *)conn);
+}
+
+/*****************************************************************************
+ * close_conn()
+ *
+ * コネクションを close し、イベントエンジンと conn_stat のリストから外す。
+ * イベントの配列や ready リストから参照されている可能性があるので、
+ * conn_stat 構造体の free() はメインループの最後に行う。イベントエンジン
+ * に依頼した送信があれば、それが終わるまで free() しない。
+ * こちらから張ったトランクなら、TRUNK_RETRY 秒後に再接続する。
+ *
+ *  引数：
+ *          conn: close するコネクションの conn_stat 構造体
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+close_conn(struct conn_stat *conn)
+{
+    if(conn->closed)
+        return;
+    ev_del(conn->worker->evp, conn->fd);
+    if(conn->tx_inflight > 0){
+        /* カーネルが送信を待っていれば、エラーで終わらせる */
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    CLOSE(conn->fd);
+    print_err(LOG_ERR,"fd%d: closed (rx %llu frames, %llu bytes; tx %llu bytes; "
+              "%llu frames, %llu bytes dropped; %llu/%llu/%llu bcast/mcast/unknown storm drops)\n",
+              conn->fd,
+              (unsigned long long)conn->rx_frames,
+              (unsigned long long)conn->rx_bytes,
+              (unsigned long long)conn->tx_bytes,
+              (unsigned long long)conn->txq.drop_frames,
+              (unsigned long long)conn->txq.drop_bytes,
+              (unsigned long long)conn->storm_drops[STORM_BCAST],
+              (unsigned long long)conn->storm_drops[STORM_MCAST],
+              (unsigned long long)conn->storm_drops[STORM_UNKNOWN]);
+    if(conn->domain != NULL){
+        if(conn->nlanes > 1)
+            btab_leave(conn->domain->btab, conn->bundle, conn->lane, (void *)conn);
+        if(conn->domain->fdb != NULL)
+            fdb_flush_port(conn->domain->fdb, (void *)conn);
+        if(conn->domain->mdb != NULL)
+            mdb_flush_port(conn->domain->mdb, (void *)conn);
+        leave_domain(conn);
+    }
+    if(conn->peer != NULL){
+        conn->peer->conn = NULL;
+        conn->peer->retry = conn->worker->now + TRUNK_RETRY;
+    }
+    conn->worker->stats->closed++;
+    if(conn->lat != NULL)
+        hist_merge(conn->worker->lat_closed, conn->lat);
+    delete_conn_stat(conn);
+}
+
+/*****************************************************************************
+ * set_ready()
+ *
+ * 読み込むべきデータのあるコネクションを ready リストの末尾に繋ぐ。
+ *****************************************************************************/
+void
+set_ready(struct conn_stat *conn)
+{
+    struct worker *w = conn->worker;
+
+    if(conn->ready || conn->closed)
+        return;
+    conn->ready = 1;
+    conn->ready_next = NULL;
+    if(w->ready_tail == NULL)
+        w->ready_head = conn;
+    else
+        w->ready_tail->ready_next = conn;
+    w->ready_tail = conn;
+}
+
+/*****************************************************************************
+ * add_conn_stat()
+ *
+ * 新規コネクションの conn_stat 構造体を作成し、ワーカーの active 配列に
+ * 登録する。conn_stat 構造体はキャッシュラインの境界に
+ * 置く。ドメインにはまだ参加しない。
+ *
+ *  引数：
+ *          w : コネクションを受け持つワーカー
+ *          fd: 新規コネクションの socket 番号
+ *          addr: 接続してきたホストのアドレス
+ * 戻り値：
+ *          正常時 : 追加した conn_stat 構造体のポインタ
+ *          障害時 : NULL
+ *****************************************************************************/
+struct conn_stat *
+add_conn_stat(struct worker *w, int fd, struct in_addr addr)
+{
+    struct conn_stat *conn_stat_new;
+    void             *mem;
+
+    if(grow_active(w) < 0)
+        return(NULL);
+    if((mem = malloc(sizeof(struct conn_stat) + CACHE_LINE)) == NULL)
+        return(NULL);
+    conn_stat_new = (struct conn_stat *)(((uintptr_t)mem + CACHE_LINE - 1) & ~(uintptr_t)(CACHE_LINE - 1));
+    memset(conn_stat_new, 0x0, sizeof(struct conn_stat));
+    conn_stat_new->mem = mem;
+    if(lat_on && (conn_stat_new->lat = (hist_t *)calloc(1, sizeof(hist_t))) == NULL){
+        free(mem);
+        return(NULL);
+    }
+    if(w->aio &&
+       (conn_stat_new->iov = (struct iovec *)malloc(TX_LINKS * tx_batch_iov * sizeof(struct iovec))) == NULL){
+        free(conn_stat_new->lat);
+        free(mem);
+        return(NULL);
+    }
+    if(txq_init(&conn_stat_new->txq, txq_maxframes, txq_maxbytes, txq_policy, &w->pool) < 0){
+        free(conn_stat_new->iov);
+        free(conn_stat_new->lat);
+        free(mem);
+        return(NULL);
+    }
+    conn_stat_new->worker = w;
+    conn_stat_new->fd = fd;
+    conn_stat_new->addr = addr;
+    conn_stat_new->join_time = w->now;
+    w->njoining++;
+
+    conn_stat_new->slot = w->nactive;
+    w->active[w->nactive++] = conn_stat_new;
+    return(conn_stat_new);
+}
+
+/*****************************************************************************
+ * grow_active()
+ *
+ * active 配列を、コネクションがもう 1 つ入る大きさに広げる。
+ *
+ *  引数：
+ *          w : ワーカー
+ *  戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+int
+grow_active(struct worker *w)
+{
+    struct conn_stat **tab;
+    int                size;
+
+    if(w->nactive >= w->activesize){
+        size = w->activesize > 0 ? w->activesize * 2 : 64;
+        if((tab = (struct conn_stat **)realloc(w->active, size * sizeof(struct conn_stat *))) == NULL)
+            return(-1);
+        w->active = tab;
+        w->activesize = size;
+    }
+    return(0);
+}
+
+/*****************************************************************************
+ * delete_conn_stat()
+ *
+ * ワーカーの active 配列から指定された conn_stat を外し、
+ * free() 待ちのリストに繋ぐ。active 配列の空いた位置には末尾の
+ * コネクションを移す。ドメインに参加していなければ njoining を減らす。
+ *
+ *  引数：
+ *          conn_stat_delete: 削除する conn_stat 構造体
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+delete_conn_stat(struct conn_stat *conn_stat_delete)
+{
+    struct worker    *w = conn_stat_delete->worker;
+    struct conn_stat *last;
+
+    last = w->active[--w->nactive];
+    w->active[conn_stat_delete->slot] = last;
+    last->slot = conn_stat_delete->slot;
+    if(conn_stat_delete->domain == NULL)
+        w->njoining--;
+
+    conn_stat_delete->closed = 1;
+    conn_stat_delete->dead_next = w->dead_head;
+    w->dead_head = conn_stat_delete;
+}
+
+/*****************************************************************************
+ * free_conn_stat()
+ *
+ * ワーカーの free() 待ちのリストにある conn_stat 構造体を free() する。
+ * イベントエンジンに依頼した送信が終わっていないものはリストに残す。
+ * カーネルが送信キューのフレームと iov をまだ読むかもしれない。
+ *****************************************************************************/
+void
+free_conn_stat(struct worker *w)
+{
+    struct conn_stat *conn, *next;
+
+    conn = w->dead_head;
+    w->dead_head = NULL;
+    for( ; conn != NULL ; conn = next){
+        next = conn->dead_next;
+        if(conn->tx_inflight > 0){
+            conn->dead_next = w->dead_head;
+            w->dead_head = conn;
+            continue;
+        }
+        txq_destroy(&conn->txq);
+        free(conn->iov);
+        free(conn->lat);
+        free(conn->mem);
+    }
+}
+
+/*****************************************************************************
+ * join_domain()
+ *
+ * コネクションをネットワーク ID のドメインに参加させ、ワーカーのその
+ * ドメインの ports 配列に登録する。
+ *
+ *  引数：
+ *          conn: ドメインにまだ参加していないコネクションの conn_stat 構造体
+ *          id  : ネットワーク ID
+ *  戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+int
+join_domain(struct conn_stat *conn, uint32_t id)
+{
+    struct worker *w = conn->worker;
+    domain_t      *dom;
+    dshard_t      *ds;
+    void         **ports;
+    int            size;
+
+    if((dom = dtab_get(dtab, id, w->now)) == NULL)
+        return(-1);
+    ds = &dom->shard[w->id];
+    if(ds->nports >= ds->size){
+        size = ds->size > 0 ? ds->size * 2 : 16;
+        if((ports = (void **)realloc(ds->ports, size * sizeof(void *))) == NULL){
+            print_err(LOG_ERR,"fd%d: can't join network %u\n", conn->fd, id);
+            return(-1);
+        }
+        ds->ports = ports;
+        ds->size = size;
+    }
+    conn->dslot = ds->nports;
+    ds->ports[ds->nports] = (void *)conn;
+    STORE_RELEASE(&ds->nports, ds->nports + 1);
+    conn->domain = dom;
+    w->njoining--;
+    if(id != 0)
+        print_err(LOG_NOTICE,"fd%d: joined network %u\n", conn->fd, id);
+    return(join_bundle(conn));
+}
+
+/*****************************************************************************
+ * join_bundle()
+ *
+ * 同じ sted からの複数の接続の 1 つなら、ドメインの bundle の表に登録する。
+ * ドメインに参加した時と、STECTL_LANE を受信した時に呼ばれるので、
+ * どちらが先でも、両方が揃った時に登録される。
+ *
+ *  引数：
+ *          conn: コネクションの conn_stat 構造体
+ *  戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+int
+join_bundle(struct conn_stat *conn)
+{
+    if(conn->domain == NULL || conn->nlanes <= 1)
+        return(0);
+    if(btab_join(conn->domain->btab, conn->bundle, conn->nlanes, conn->lane,
+                 (void *)conn, conn->worker->id) < 0){
+        print_err(LOG_ERR,"fd%d: can't join connection group %u as %d/%d\n",
+                  conn->fd, conn->bundle, conn->lane, conn->nlanes);
+        return(-1);
+    }
+    return(0);
+}
+
+/*****************************************************************************
+ * leave_domain()
+ *
+ * コネクションをドメインの ports 配列から外す。空いた位置には末尾の
+ * コネクションを移す。
+ *****************************************************************************/
+void
+leave_domain(struct conn_stat *conn)
+{
+    dshard_t         *ds = &conn->domain->shard[conn->worker->id];
+    struct conn_stat *last;
+
+    last = (struct conn_stat *)ds->ports[ds->nports - 1];
+    ds->ports[conn->dslot] = (void *)last;
+    last->dslot = conn->dslot;
+    STORE_RELEASE(&ds->nports, ds->nports - 1);
+}
+
+/*****************************************************************************
+ * join_idle()
+ *
+ * 接続してから JOIN_WAIT 秒より長くネットワーク ID を知らせてこない
+ * コネクションを、ネットワーク 0 に参加させる。フレームを送ってこない
+ * 従来の仮想 NIC デーモンも、これでフレームを受け取れるようになる。
+ *****************************************************************************/
+void
+join_idle(struct worker *w)
+{
+    struct conn_stat *conn;
+    int               i;
+
+    /* close した位置には末尾のコネクションが移ってくるので、末尾から見る */
+    for(i = w->nactive - 1 ; i >= 0 ; i--){
+        conn = w->active[i];
+        if(conn->domain == NULL && (int32_t)(w->now - conn->join_time) > JOIN_WAIT &&
+           join_domain(conn, 0) < 0)
+            close_conn(conn);
+    }
+}
+
+/*****************************************************************************
+ * snap_stats()
+ *
+ * 統計情報の要求に応えて、このワーカーのポートのカウンタを snap に
+ * コピーする。遅延はパーセンタイルを求め、close したポートも含めた
+ * 合計のヒストグラムを snap_lat に作る。メモリが足りなければ、ポートは
+ * 0 個とする。
+ *****************************************************************************/
+void
+snap_stats(struct worker *w)
+{
+    struct conn_stat *conn;
+    pstat_t          *ps, *snap = NULL;
+    hist_t           *lat = NULL;
+    int               i, k, n = 0;
+
+    if(lat_on && (lat = (hist_t *)malloc(sizeof(hist_t))) != NULL)
+        memcpy(lat, w->lat_closed, sizeof(hist_t));
+
+    if(w->nactive > 0 && (snap = (pstat_t *)calloc(w->nactive, sizeof(pstat_t))) != NULL){
+        for(i = 0 ; i < w->nactive ; i++){
+            conn = w->active[i];
+            ps = &snap[n++];
+            ps->fd = conn->fd;
+            ps->worker = w->id;
+            ps->trunk = conn->trunk;
+            if(conn->domain != NULL){
+                ps->joined = 1;
+                ps->network = conn->domain->id;
+            }
+            strncpy(ps->addr, inet_ntoa(conn->addr), sizeof(ps->addr) - 1);
+            ps->rx_frames = conn->rx_frames;
+            ps->rx_bytes = conn->rx_bytes;
+            ps->tx_frames = conn->tx_frames;
+            ps->tx_bytes = conn->tx_bytes;
+            ps->rx_unicast = conn->rx_unicast;
+            ps->rx_flood = conn->rx_flood;
+            ps->drop_queue = conn->txq.drop_frames;
+            for(k = 0 ; k < STORM_KINDS ; k++)
+                ps->drop_storm += conn->storm_drops[k];
+            ps->tx_blocked = conn->tx_blocked;
+            ps->txq_frames = conn->txq.count + (conn->txq.cur.buf != NULL);
+            ps->txq_bytes = conn->txq.bytes + (conn->txq.cur.buf != NULL ?
+                                               conn->txq.cur.len - conn->txq.off : 0);
+            if(conn->lat != NULL){
+                ps->lat_count = conn->lat->total;
+                ps->lat_p50 = hist_value(conn->lat, 0.5);
+                ps->lat_p99 = hist_value(conn->lat, 0.99);
+                ps->lat_p999 = hist_value(conn->lat, 0.999);
+                ps->lat_max = conn->lat->max;
+                if(lat != NULL)
+                    hist_merge(lat, conn->lat);
+            }
+        }
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    w->snap = snap;
+    w->nsnap = n;
+    w->snap_lat = lat;
+    w->stats_req = 0;
+    if(--stats_waiting == 0)
+        pthread_cond_signal(&stats_cond);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/*****************************************************************************
+ * hub_stats()
+ *
+ * 全ワーカーのポートの統計情報を集める。ワーカーに要求を出して起こし、
+ * それぞれが snap_stats() でコピーし終わるのを待つ。stehub_stats.c の
+ * スレッドから呼ばれる。
+ *
+ *  引数：
+ *          portsp    : malloc() したポートの統計情報の配列を返す
+ *          wstatsp   : ワーカー毎のカウンタの配列を返す
+ *          nworkersp : ワーカーの数を返す
+ *          latp      : 全ポートの遅延のヒストグラムの合計を返す
+ *  戻り値：
+ *          正常時 : ポートの数
+ *          障害時 : -1
+ *****************************************************************************/
+int
+hub_stats(pstat_t **portsp, wstat_t **wstatsp, int *nworkersp, hist_t *latp)
+{
+    struct worker *w;
+    pstat_t       *ports;
+    int            i, n = 0;
+
+    pthread_mutex_lock(&stats_lock);
+    stats_waiting = nworkers;
+    for(i = 0 ; i < nworkers ; i++){
+        w = &workers[i];
+        STORE_RELEASE(&w->stats_req, 1);
+        if(ATOMIC_SWAP(&w->wakeup_pending, 1) == 0)
+            write(w->wakeup_fd[1], "", 1);
+    }
+    while(stats_waiting > 0)
+        pthread_cond_wait(&stats_cond, &stats_lock);
+    pthread_mutex_unlock(&stats_lock);
+
+    for(i = 0 ; i < nworkers ; i++)
+        n += workers[i].nsnap;
+    ports = (pstat_t *)malloc((n + 1) * sizeof(pstat_t));
+    memset(latp, 0x0, sizeof(hist_t));
+    for(n = 0, i = 0 ; i < nworkers ; i++){
+        w = &workers[i];
+        if(ports != NULL && w->nsnap > 0)
+            memcpy(ports + n, w->snap, w->nsnap * sizeof(pstat_t));
+        n += w->nsnap;
+        free(w->snap);
+        w->snap = NULL;
+        w->nsnap = 0;
+        if(w->snap_lat != NULL)
+            hist_merge(latp, w->snap_lat);
+        free(w->snap_lat);
+        w->snap_lat = NULL;
+    }
+    if(ports == NULL)
+        return(-1);
+    *portsp = ports;
+    *wstatsp = wstats;
+    *nworkersp = nworkers;
+    return(n);
+}
+
+/*****************************************************************************
+ * set_nonblock()
+ *
+ * socket を non-blocking mode に設定する。
+ *****************************************************************************/
+int
+set_nonblock(int fd)
+{
+#ifndef STE_WINDOWS            
+    return(fcntl(fd, F_SETFL, O_NONBLOCK));
+#else
+    u_long param = 0; /* FIONBIO コマンドのパラメータ Non-Blocking ON*/
+
+    return(ioctlsocket(fd, FIONBIO, &param));
+#endif                
+}
+
+/*****************************************************************************
+ * hub_time()
+ * 
+ * エージング等に使う現在時刻（秒）を返す。時計の変更の影響を受けない
+ * よう、使える環境では単調増加する時計を使う。
+ *****************************************************************************/
+uint32_t
+hub_time()
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if(clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return((uint32_t)ts.tv_sec);
+#endif
+    return((uint32_t)time(NULL));
+}
+
+/*****************************************************************************
+ * hub_nsec()
+ * 
+ * ストーム制御と遅延の測定に使う現在時刻（ナノ秒）を返す。
+ *****************************************************************************/
+uint64_t
+hub_nsec()
+{
+    struct timeval  tv;
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if(clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+#endif
+    gettimeofday(&tv, NULL);
+    return((uint64_t)tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL);
+}
+
+/*****************************************************************************
+ * raise_fd_limit()
+ * 
+ * 多数のコネクションを扱えるよう、オープンできる fd の数の制限を
+ * ハードリミットまで引き上げる。
+ *****************************************************************************/
+void
+raise_fd_limit()
+{
+#ifndef STE_WINDOWS
+    struct rlimit rl;
+
+    if(getrlimit(RLIMIT_NOFILE, &rl) < 0)
+        return;
+    if(rl.rlim_cur == rl.rlim_max)
+        return;
+    rl.rlim_cur = rl.rlim_max;
+    if(setrlimit(RLIMIT_NOFILE, &rl) < 0)
+        print_err(LOG_NOTICE, "setrlimit: %s\n", strerror(errno));
+#endif
 }
 
 #ifndef STE_WINDOWS
@@ -528,8 +2808,23 @@ print_err(int level, char *format, ...)
 void
 print_usage(char *argv)
 {
-    printf ("Usage: %s [ -p port] [-d level]\n",argv);    
+    printf ("Usage: %s [ -p port] [-d level] [-e engine] [-a aging]\n",argv);    
+    printf ("\t\t[-q frames[:bytes]] [-P policy] [-w workers] [-B iovecs[:bytes]]\n");
+    printf ("\t\t[-t host[:port][/network]]... [-s kind=frames[:bytes]]...\n");
+    printf ("\t\t[-S kind=frames[:bytes]]... [-m aging] [-A path] [-H]\n");
     printf ("\t-p port   : Port nubmer\n");
     printf ("\t-d level  : Debug level[0-2]\n");
+    printf ("\t-e engine : Event engine (epoll, port, select, uring)\n");
+    printf ("\t-a aging  : MAC address aging time in seconds (0 = no learning)\n");
+    printf ("\t-q frames[:bytes] : Per-port send queue limits\n");
+    printf ("\t-P policy : Drop policy when the send queue is full (tail, head)\n");
+    printf ("\t-w workers: Number of worker threads\n");
+    printf ("\t-B iovecs[:bytes] : Per-writev() batch limits\n");
+    printf ("\t-t host[:port][/network] : Open a trunk link to another hub (repeatable)\n");
+    printf ("\t-s kind=frames[:bytes] : Per-port storm control (kind: bcast, mcast, unknown)\n");
+    printf ("\t-S kind=frames[:bytes] : Per-network storm control\n");
+    printf ("\t-m aging  : Multicast group aging time in seconds (0 = no IGMP/MLD snooping)\n");
+    printf ("\t-A path   : UNIX domain socket to serve statistics on (text or json)\n");
+    printf ("\t-H        : Don't record ingress-to-send latency histograms\n");
     exit(0);
 }
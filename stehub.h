@@ -0,0 +1,431 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright (c) 1986, 2010, Oracle and/or its affiliates. All rights reserved.
+ */
+
+/*
+ * Copright (c) 2004-2010  Kazuyoshi Aizawa <admin2@whiteboard.ne.jp>
+ * All rights reserved.
+ */
+/************************************************************************
+ * stehub.h
+ *
+ * stehub を構成する各モジュール（stehub.c, stehub_event.c, stehub_fdb.c,
+ * stehub_queue.c, stehub_domain.c, stehub_storm.c, stehub_mdb.c,
+ * stehub_stats.c, stehub_hist.c, stehub_bundle.c）が使うヘッダーファイル。
+ *
+ *************************************************************************/
+
+#ifndef __STEHUB_H
+#define __STEHUB_H
+
+/*
+ * o 仮想ハブが利用する各種パラメータ
+ *
+ *  LISTEN_BACKLOG   listen() のバックログ
+ *  MAX_EVENTS       1 回の ev_wait() で受け取る最大イベント数
+ *  RECV_BUDGET      1 回の起床で 1 つのコネクションから recv() する最大回数
+ *  ACCEPT_BUDGET    1 回の起床で accept() する最大コネクション数
+ *  FDB_AGING        学習した MAC アドレスのデフォルトのエージング時間（秒）
+ *  TXQ_MAXFRAMES    送信キューに保持するデフォルトの最大フレーム数
+ *  TXQ_MAXBYTES     送信キューに保持するデフォルトの最大バイト数
+ *  MAX_WORKERS      ワーカースレッドの最大数
+ *  SHARD_RING_SIZE  ワーカー間のリングの要素数（2 のべき乗）
+ *  SHARD_BUDGET     1 回の起床で 1 つのリングから取り出す最大要素数
+ *  CACHE_LINE       キャッシュラインのサイズ
+ *  SOCKBUFSIZE      1 回の recv() で読み込む最大サイズ
+ *  FPOOL_MAX        ワーカー毎のプールに残しておく空き受信バッファの最大数
+ *  TX_BATCH_IOV     1 回の writev() にまとめるデフォルトの最大 iovec 数
+ *  TX_BATCH_BYTES   1 回の writev() にまとめるデフォルトの最大バイト数
+ *  TX_LINKS         io_uring で 1 つのポートに続けて依頼する writev() の最大数
+ *  MAX_TRUNKS       -t で指定できるトランクの最大数
+ *  TRUNK_RETRY      トランクの接続に失敗、または切断された時に再接続するまでの時間（秒）
+ *  JOIN_WAIT        ネットワーク ID を知らせてこないポートをネットワーク 0 に
+ *                   参加させるまでの時間（秒）
+ *  DTAB_BUCKETS     ドメインのハッシュ表のバケット数（2 のべき乗）
+ *  STORM_BURST      ストーム制御で、平均レートを超えて続けて受け付ける時間（ナノ秒）
+ *  MDB_AGING        マルチキャストグループのメンバーとルータのデフォルトの
+ *                   エージング時間（秒）。IGMP の Group Membership Interval
+ *  STATS_TIMEOUT    統計情報の要求の 1 行目を待つ時間（秒）
+ *  HIST_SUB_BITS    遅延のヒストグラムで、2 のべき乗毎の区間を分けるバケット数の bit 数
+ *  HIST_MAX_BITS    遅延のヒストグラムで区別する最大値の bit 数（ナノ秒）
+ */
+#define  LISTEN_BACKLOG    1024
+#define  MAX_EVENTS        256
+#define  RECV_BUDGET       16
+#define  ACCEPT_BUDGET     64
+
+#ifndef  ETHERMAX
+#define  ETHERMAX          1514
+#endif
+#define  FDB_AGING         300
+#define  TXQ_MAXFRAMES     256
+#define  TXQ_MAXBYTES      (256 * 1024)
+#define  MAX_WORKERS       64
+#define  SHARD_RING_SIZE   1024
+#define  SHARD_BUDGET      64
+#define  CACHE_LINE        64
+#define  SOCKBUFSIZE       32768
+#define  FPOOL_MAX         64
+#define  TX_BATCH_IOV      64
+#define  TX_BATCH_BYTES    (256 * 1024)
+#define  TX_LINKS          4
+#define  MAX_TRUNKS        16
+#define  TRUNK_RETRY       5
+#define  JOIN_WAIT         1
+#define  DTAB_BUCKETS      256
+#define  STORM_BURST       1000000000ULL
+#define  MDB_AGING         260
+#define  STATS_TIMEOUT     1
+#define  HIST_SUB_BITS     4
+#define  HIST_MAX_BITS     40
+#define  HIST_SUB          (1 << HIST_SUB_BITS)
+#define  HIST_BUCKETS      ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+#ifndef  ETHERADDRL
+#define  ETHERADDRL        6
+#endif
+#define  ETHERHEADERL      14   /* 宛先、送信元 MAC アドレスとタイプ */
+
+/*
+ * イベントエンジンに登録・通知されるイベントの種類
+ */
+#define  EV_READ       0x01     /* 読み込み可能 */
+#define  EV_WRITE      0x02     /* 書き込み可能 */
+#define  EV_ERROR      0x04     /* エラー、または切断 */
+#define  EV_RECV       0x08     /* 受信した。登録時は、受信をエンジンに任せる（ev_io_start() 参照）*/
+#define  EV_SENT       0x10     /* ev_writev() の送信が終わった */
+
+/*
+ * ev_wait() が返すイベント。data は ev_add()、ev_writev() で渡したポインタ。
+ * EV_RECV、EV_SENT の場合は、res に受信、送信したサイズ（エラーなら
+ * -errno）が入り、EV_RECV の buf は受信データを含む受信バッファ。
+ * 受信データは buf->data + FRAME_MAX から始まり、buf の参照は呼び出し側に移る。
+ */
+typedef struct ev_event
+{
+    void         *data;
+    int           events;
+    int           res;
+    struct fbuf  *buf;
+} ev_event_t;
+
+/*
+ * 送信キューが上限に達した時の破棄のポリシー
+ */
+#define  TXQ_DROP_TAIL     0    /* 新しいフレームを捨てる */
+#define  TXQ_DROP_HEAD     1    /* 古いフレームを捨てる */
+
+/*
+ * 受信バッファ。recv() したデータをそのまま保持し、参照カウントが 0 に
+ * なるまで解放しない。送信キューやワーカー間のリングは、バッファを
+ * コピーせずに参照する。
+ * 先頭の FRAME_MAX byte は、前回の受信データの未完成のフレームを
+ * 受信データの直前に置くための領域。
+ */
+typedef struct fbuf
+{
+    uint32_t      refcnt;         /* 参照カウント */
+    struct fbuf  *next;           /* プールの空きリスト */
+    unsigned char data[FRAME_MAX + SOCKBUFSIZE];
+} fbuf_t;
+
+/*
+ * 受信バッファのプール。ワーカー毎に持ち、そのワーカーのスレッドだけが
+ * 使う。最後の参照を外したワーカーのプールに戻る。
+ */
+typedef struct fpool
+{
+    fbuf_t       *free;           /* 空きバッファのリスト */
+    int           nfree;          /* 空きバッファの数 */
+} fpool_t;
+
+/*
+ * 受信バッファ中のフレーム（1 つ以上）を指す。data は stehead から始まる。
+ */
+typedef struct frame
+{
+    fbuf_t       *buf;      /* data を含む受信バッファ。参照を 1 つ持つ */
+    unsigned char *data;
+    int           len;      /* stehead、パディングを含むサイズ */
+    int           flags;    /* FRAME_TRUNK */
+    uint32_t      bundle;   /* 受信した接続の bundle（stehub.c の conn_stat 参照）。0 なら無し */
+    struct domain *domain;  /* 転送するドメイン */
+    uint64_t      ts;       /* 受信した時刻（ナノ秒）。0 なら遅延を測らない */
+} frame_t;
+
+#define  FRAME_TRUNK       0x01 /* トランクから受信したフレーム */
+
+/*
+ * ポート毎の送信キュー
+ */
+typedef struct txq
+{
+    frame_t       cur;         /* 送信途中のフレーム。cur.buf が NULL なら無し */
+    int           off;         /* cur の送信済みのサイズ */
+    frame_t      *ring;        /* 送信待ちのフレームのリングバッファ */
+    int           size;        /* ring の要素数（最大フレーム数）*/
+    int           head;        /* ring の先頭 */
+    int           count;       /* ring 中のフレーム数 */
+    int           bytes;       /* ring 中のバイト数 */
+    int           maxbytes;    /* ring に保持する最大バイト数 */
+    int           runs;        /* ring 中の、同じ受信バッファを参照するフレームの並びの数 */
+    fbuf_t       *pack;        /* 小さいフレームをコピーして詰めるバッファ。参照を 1 つ持つ */
+    int           packlen;     /* pack の使用済みのサイズ */
+    int           policy;      /* TXQ_DROP_TAIL, TXQ_DROP_HEAD */
+    int           busy;        /* ring の先頭からの、送信を依頼済みのフレーム数 */
+    uint64_t      drop_frames; /* 破棄したフレーム数 */
+    uint64_t      drop_bytes;  /* 破棄したバイト数 */
+    fpool_t      *pool;        /* 破棄したフレームのバッファを戻すプール */
+} txq_t;
+
+/*
+ * ワーカー間でフレームを渡すリング（single-producer, single-consumer）。
+ * 生産側だけが tail を、消費側だけが head を書き換えるのでロックは
+ * 要らない。お互いのキャッシュラインを汚さないよう、head と tail は
+ * 別のキャッシュラインに置く。
+ */
+typedef struct spsc
+{
+    volatile uint32_t head;    /* 次に取り出す位置（消費側が更新） */
+    char          pad1[CACHE_LINE - sizeof(uint32_t)];
+    volatile uint32_t tail;    /* 次に入れる位置（生産側が更新） */
+    char          pad2[CACHE_LINE - sizeof(uint32_t)];
+    uint32_t      mask;        /* 要素数 - 1 */
+    frame_t      *slot;
+} spsc_t;
+
+/*
+ * ストーム制御の対象になる、全ポートに送信するフレームの種類
+ */
+#define  STORM_BCAST       0    /* ブロードキャスト */
+#define  STORM_MCAST       1    /* マルチキャスト */
+#define  STORM_UNKNOWN     2    /* 未学習のユニキャスト */
+#define  STORM_KINDS       3
+
+/*
+ * ストーム制御の上限（種類毎の 1 秒あたりのフレーム数とバイト数）。
+ * 0 なら制限しない。
+ */
+typedef struct storm
+{
+    uint32_t      frames[STORM_KINDS];
+    uint32_t      bytes[STORM_KINDS];
+} storm_t;
+
+/*
+ * スレッド間の同期に使うアトミック操作
+ *
+ *  LOAD_ACQUIRE(p)      *p を読む。以降のメモリアクセスはこれより前に行われない
+ *  STORE_RELEASE(p, v)  *p に v を書く。以前のメモリアクセスはこれより後に行われない
+ *  ATOMIC_SWAP(p, v)    *p に v を書き、元の値を返す（フルバリア）
+ *  ATOMIC_INC(p)        *p に 1 を足す
+ *  ATOMIC_DEC_NV(p)     *p から 1 を引き、新しい値を返す
+ *  ATOMIC_CAS64(p, o, n) *p が o なら n に書き換える。書き換えたら 0 以外を返す
+ */
+#ifdef __GNUC__
+#define  LOAD_ACQUIRE(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define  STORE_RELEASE(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define  ATOMIC_SWAP(p, v)    __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define  ATOMIC_INC(p)        __atomic_add_fetch((p), 1, __ATOMIC_RELAXED)
+#define  ATOMIC_DEC_NV(p)     __atomic_sub_fetch((p), 1, __ATOMIC_ACQ_REL)
+#define  ATOMIC_CAS64(p, o, n) __sync_bool_compare_and_swap((p), (o), (n))
+#else
+#include <atomic.h>
+/* SPARC（TSO）と x86 では、読み込みが後のアクセスと入れ替わることは無い */
+#define  LOAD_ACQUIRE(p)      (*(p))
+#define  STORE_RELEASE(p, v)  (membar_producer(), *(p) = (v))
+#define  ATOMIC_SWAP(p, v)    atomic_swap_32((p), (v))
+#define  ATOMIC_INC(p)        atomic_inc_32(p)
+#define  ATOMIC_DEC_NV(p)     atomic_dec_32_nv(p)
+#define  ATOMIC_CAS64(p, o, n) (atomic_cas_64((p), (o), (n)) == (o))
+#endif
+
+typedef struct ev_stat ev_stat_t;
+struct iovec;
+typedef struct fdb fdb_t;
+typedef struct dtab dtab_t;
+typedef struct mdb mdb_t;
+typedef struct btab btab_t;
+
+/*
+ * ドメインのワーカー毎の情報。そのワーカーのスレッドだけが書き換える。
+ * 他のワーカーは、フレームを渡す必要があるかを nports で判断する。
+ */
+typedef struct dshard
+{
+    void        **ports;        /* このワーカーが受け持つドメインのポート */
+    int           nports;       /* ports 中のポート数 */
+    int           size;         /* ports の要素数 */
+    uint64_t      rx_frames;    /* ドメインのポートから受信したフレーム数 */
+    uint64_t      rx_bytes;     /* 同、バイト数（stehead を含む）*/
+    uint64_t      flood_frames; /* 全ポートに送信したフレーム数 */
+    uint64_t      unicast_frames; /* 学習済みのポートにだけ送信したフレーム数 */
+    uint64_t      storm_drops[STORM_KINDS]; /* ドメインのストーム制御で破棄したフレーム数 */
+    char          pad[2 * CACHE_LINE - sizeof(void *) - 2 * sizeof(int) -
+                      (4 + STORM_KINDS) * sizeof(uint64_t)];
+} dshard_t;
+
+/*
+ * ドメイン（独立した仮想スイッチ）。ネットワーク ID 毎に 1 つあり、
+ * MAC アドレステーブルと、フレームを全ポートに送信する時の送信先を
+ * 別々に持つ。一度作ったドメインは解放しない。
+ */
+typedef struct domain
+{
+    uint32_t      id;       /* ネットワーク ID */
+    fdb_t        *fdb;      /* MAC アドレステーブル。NULL なら学習しない */
+    mdb_t        *mdb;      /* マルチキャストグループの表。NULL なら snooping しない */
+    btab_t       *btab;     /* 同じ sted からの複数の接続の表 */
+    dshard_t     *shard;    /* shard[i] はワーカー i の情報 */
+    struct domain *next;    /* ハッシュ表の同じバケットのドメイン */
+    uint64_t      storm_tat[STORM_KINDS][2]; /* ドメインのストーム制御の状態（全ワーカーで共有）*/
+} domain_t;
+
+/*
+ * 遅延のヒストグラム（stehub_hist.c）。count[i] はバケット i に入った
+ * 値の数。
+ */
+typedef struct hist
+{
+    uint64_t      count[HIST_BUCKETS];
+    uint64_t      total;        /* 記録した値の数 */
+    uint64_t      max;          /* 記録した最大値 */
+} hist_t;
+
+/*
+ * ワーカー毎の、ポートに属さないカウンタ。そのワーカーのスレッドだけが
+ * 書き換える。他のワーカーのカウンタとキャッシュラインを共有しないよう、
+ * CACHE_LINE の境界に置く。
+ */
+typedef struct wstat
+{
+    uint64_t      rx_malformed; /* stehead が壊れていて切断したコネクション数 */
+    uint64_t      ring_drops;   /* 他のワーカーへのリングが一杯で破棄した回数 */
+    uint64_t      closed;       /* close したコネクション数 */
+    char          pad[CACHE_LINE - 3 * sizeof(uint64_t)];
+} wstat_t;
+
+/*
+ * ポートの統計情報のスナップショット。ワーカーが自分のポートについて
+ * 作り、stehub_stats.c が出力する。
+ */
+typedef struct pstat
+{
+    int           fd;
+    int           worker;       /* ポートを受け持つワーカーの番号 */
+    int           trunk;        /* 他の仮想ハブとのトランク */
+    int           joined;       /* ドメインに参加している */
+    uint32_t      network;      /* 参加しているネットワーク ID */
+    char          addr[16];     /* 相手のアドレス */
+    uint64_t      rx_frames;    /* 受信したフレーム数 */
+    uint64_t      rx_bytes;     /* 受信したバイト数（stehead を含む）*/
+    uint64_t      tx_frames;    /* 送信したフレーム数 */
+    uint64_t      tx_bytes;     /* 送信したバイト数（stehead を含む）*/
+    uint64_t      rx_unicast;   /* 受信して学習済みのポートにだけ送信したフレーム数 */
+    uint64_t      rx_flood;     /* 受信して全ポートに送信したフレーム数 */
+    uint64_t      drop_queue;   /* 送信キューが一杯で破棄したフレーム数 */
+    uint64_t      drop_storm;   /* ストーム制御で破棄したフレーム数 */
+    uint64_t      tx_blocked;   /* writev() が EWOULDBLOCK、または一部しか書けなかった回数 */
+    int           txq_frames;   /* 送信キュー中のフレーム数 */
+    int           txq_bytes;    /* 送信キュー中のバイト数 */
+    uint64_t      lat_count;    /* 遅延を測ったフレーム数 */
+    uint64_t      lat_p50;      /* 受信から送信までの遅延の中央値（ナノ秒）*/
+    uint64_t      lat_p99;      /* 同、99 パーセンタイル */
+    uint64_t      lat_p999;     /* 同、99.9 パーセンタイル */
+    uint64_t      lat_max;      /* 同、最大値 */
+} pstat_t;
+
+/*
+ * ドメインの統計情報。dshard のカウンタを全ワーカーについて合計したもの。
+ */
+typedef struct dstat
+{
+    uint32_t      id;           /* ネットワーク ID */
+    int           nports;       /* ポート数 */
+    int           nmacs;        /* 学習している MAC アドレスの数 */
+    uint64_t      rx_frames;
+    uint64_t      rx_bytes;
+    uint64_t      unicast_frames;
+    uint64_t      flood_frames;
+    uint64_t      storm_drops;
+} dstat_t;
+
+/*
+ * stehub の内部関数のプロトタイプ
+ */
+extern void       print_err(int, char *, ...);
+extern ev_stat_t *ev_create(char *, int);
+extern char      *ev_name(ev_stat_t *);
+extern int        ev_add(ev_stat_t *, int, int, void *);
+extern int        ev_mod(ev_stat_t *, int, int, void *);
+extern int        ev_del(ev_stat_t *, int);
+extern int        ev_wait(ev_stat_t *, ev_event_t *, int, int);
+extern int        ev_io_start(ev_stat_t *, fpool_t *);
+extern int        ev_writev(ev_stat_t *, int, struct iovec *, int *, int, void *);
+extern fdb_t     *fdb_create(int, uint32_t);
+extern void      *fdb_lookup(fdb_t *, unsigned char *, int *, uint32_t *);
+extern int        fdb_learn(fdb_t *, unsigned char *, void *, int, uint32_t);
+extern int        fdb_age(fdb_t *, uint32_t);
+extern void       fdb_flush_port(fdb_t *, void *);
+extern int        fdb_count(fdb_t *);
+extern fbuf_t    *fbuf_get(fpool_t *);
+extern void       fbuf_hold(fbuf_t *);
+extern void       fbuf_put(fpool_t *, fbuf_t *);
+extern int        txq_init(txq_t *, int, int, int, fpool_t *);
+extern void       txq_destroy(txq_t *);
+extern int        txq_enqueue(txq_t *, frame_t *);
+extern int        txq_dequeue(txq_t *, frame_t *);
+extern int        txq_full(txq_t *, int);
+extern int        txq_iov(txq_t *, int *, struct iovec *, int, int);
+extern int        txq_consume(txq_t *, int, hist_t *, uint64_t);
+extern spsc_t    *spsc_create(int);
+extern int        spsc_push(spsc_t *, frame_t *);
+extern int        spsc_pop(spsc_t *, frame_t *);
+extern dtab_t    *dtab_create(int, int, int);
+extern domain_t  *dtab_get(dtab_t *, uint32_t, uint32_t);
+extern int        dtab_age(dtab_t *, uint32_t);
+extern int        dtab_count(dtab_t *);
+extern int        dtab_stats(dtab_t *, dstat_t **);
+extern int        storm_parse(storm_t *, char *);
+extern int        storm_enabled(storm_t *);
+extern int        storm_kind(unsigned char *);
+extern int        storm_allow(storm_t *, int, uint64_t *, uint64_t, int, int);
+extern mdb_t     *mdb_create(int);
+extern int        mdb_snoopable(unsigned char *);
+extern int        mdb_report(unsigned char *, int);
+extern int        mdb_lookup(mdb_t *, unsigned char *, int, int, void ***, int *, uint64_t *);
+extern void       mdb_snoop(mdb_t *, unsigned char *, int, void *, int, int, uint32_t);
+extern void       mdb_age(mdb_t *, uint32_t);
+extern void       mdb_flush_port(mdb_t *, void *);
+extern btab_t    *btab_create(void);
+extern int        btab_join(btab_t *, uint32_t, int, int, void *, int);
+extern void       btab_leave(btab_t *, uint32_t, int, void *);
+extern void      *btab_lane(btab_t *, uint32_t, uint32_t, int *);
+extern int        stats_open(char *);
+extern int        stats_start(int, dtab_t *);
+extern int        hub_stats(pstat_t **, wstat_t **, int *, hist_t *);
+extern void       hist_record(hist_t *, uint64_t);
+extern void       hist_merge(hist_t *, hist_t *);
+extern uint64_t   hist_value(hist_t *, double);
+
+#endif /* #ifndef __STEHUB_H */
@@ -0,0 +1,255 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright (c) 1986, 2010, Oracle and/or its affiliates. All rights reserved.
+ */
+
+/*
+ * Copright (c) 2004-2010  Kazuyoshi Aizawa <admin2@whiteboard.ne.jp>
+ * All rights reserved.
+ */
+/****************************************************************************
+ * stehub_bundle.c
+ *
+ * 仮想ハブ（stehub）の、同じ sted からの複数の接続（bundle）の表。
+ * sted は -c で複数の接続を張ると、フレーム毎に flow_hash() で接続を
+ * 選ぶ。stehub もその sted に送るフレームを、同じ規則で選んだ接続で
+ * 送れば、フローの順序を保ったまま接続を使い分けられる。
+ *
+ * 表はドメイン毎に持ち、bundle の ID から、接続の番号（lane）毎の
+ * ポートとそれを持っているワーカーの番号を引く。接続はワーカーに
+ * 振り分けられるので、1 つの bundle の接続が別々のワーカーにあることも
+ * ある。表は stehub の複数のワーカースレッドから共有されるので、
+ * readers-writer ロックで保護する。引くのは学習済みの bundle 宛の
+ * ユニキャスト毎だが、更新は接続がドメインに参加した時と切断された
+ * 時だけなので、ほとんどの場合は読み込みロックだけで済む。
+ *
+ *****************************************************************************/
+
+#ifndef STE_WINDOWS
+#include <syslog.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "sted.h"
+#include "stehub.h"
+
+#define BTAB_BUCKETS     64     /* ハッシュ表のバケット数（2 のべき乗）*/
+
+/*
+ * bundle の接続
+ */
+typedef struct btab_lane
+{
+    void         *port;      /* 接続のポート。NULL ならまだ参加していない */
+    int           shard;     /* ポートを持っているワーカーの番号 */
+} btab_lane_t;
+
+/*
+ * bundle
+ */
+typedef struct btab_ent
+{
+    uint32_t      id;        /* sted が決めた bundle の ID */
+    int           nlanes;    /* 接続の数 */
+    int           nports;    /* 参加している接続の数 */
+    btab_lane_t  *lanes;     /* lanes[i] は i 番目の接続 */
+    struct btab_ent *next;   /* 同じバケットの bundle */
+} btab_ent_t;
+
+struct btab
+{
+    btab_ent_t   *bucket[BTAB_BUCKETS];
+    pthread_rwlock_t lock;   /* 表を保護するロック */
+};
+
+static btab_ent_t  *btab_find(btab_t *, uint32_t);
+
+/*****************************************************************************
+ * btab_create()
+ *
+ * bundle の表を作成する。
+ *
+ *  引数：
+ *          無し
+ *  戻り値：
+ *          正常時 : btab 構造体のポインタ
+ *          障害時 : NULL
+ *****************************************************************************/
+btab_t *
+btab_create(void)
+{
+    btab_t *btab;
+
+    if ((btab = (btab_t *)malloc(sizeof(btab_t))) == NULL)
+        return(NULL);
+    memset(btab, 0x0, sizeof(btab_t));
+    pthread_rwlock_init(&btab->lock, NULL);
+    return(btab);
+}
+
+/*****************************************************************************
+ * btab_find()
+ *
+ * ID の bundle を探す。ロックを取ってから呼ぶ。
+ *****************************************************************************/
+static btab_ent_t *
+btab_find(btab_t *btab, uint32_t id)
+{
+    btab_ent_t *ent;
+
+    for (ent = btab->bucket[id & (BTAB_BUCKETS - 1)] ; ent != NULL ; ent = ent->next){
+        if (ent->id == id)
+            return(ent);
+    }
+    return(NULL);
+}
+
+/*****************************************************************************
+ * btab_join()
+ *
+ * 接続を bundle の lane 番目の接続として登録する。bundle が無ければ作る。
+ * 同じ bundle の他の接続と接続の数が違う場合は登録しない。
+ *
+ *  引数：
+ *          btab   : bundle の表
+ *          id     : bundle の ID
+ *          nlanes : bundle の接続の数
+ *          lane   : 接続の番号
+ *          port   : 接続のポート
+ *          shard  : ポートを持っているワーカーの番号
+ *  戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+int
+btab_join(btab_t *btab, uint32_t id, int nlanes, int lane, void *port, int shard)
+{
+    btab_ent_t *ent;
+    int         h;
+
+    pthread_rwlock_wrlock(&btab->lock);
+    if ((ent = btab_find(btab, id)) == NULL){
+        if ((ent = (btab_ent_t *)malloc(sizeof(btab_ent_t))) == NULL ||
+            (ent->lanes = (btab_lane_t *)calloc(nlanes, sizeof(btab_lane_t))) == NULL){
+            pthread_rwlock_unlock(&btab->lock);
+            free(ent);
+            print_err(LOG_ERR, "btab_join: malloc failed\n");
+            return(-1);
+        }
+        ent->id = id;
+        ent->nlanes = nlanes;
+        ent->nports = 0;
+        h = id & (BTAB_BUCKETS - 1);
+        ent->next = btab->bucket[h];
+        btab->bucket[h] = ent;
+    }
+    if (ent->nlanes != nlanes){
+        pthread_rwlock_unlock(&btab->lock);
+        return(-1);
+    }
+    if (ent->lanes[lane].port == NULL)
+        ent->nports++;
+    ent->lanes[lane].port = port;
+    ent->lanes[lane].shard = shard;
+    pthread_rwlock_unlock(&btab->lock);
+    return(0);
+}
+
+/*****************************************************************************
+ * btab_leave()
+ *
+ * 接続を bundle から外す。接続がすべて外れた bundle は解放する。
+ * 接続が切断された時に呼ばれる。
+ *
+ *  引数：
+ *          btab   : bundle の表
+ *          id     : bundle の ID
+ *          lane   : 接続の番号
+ *          port   : 接続のポート
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+btab_leave(btab_t *btab, uint32_t id, int lane, void *port)
+{
+    btab_ent_t **epp, *ent;
+
+    pthread_rwlock_wrlock(&btab->lock);
+    for (epp = &btab->bucket[id & (BTAB_BUCKETS - 1)] ; (ent = *epp) != NULL ; epp = &ent->next){
+        if (ent->id != id)
+            continue;
+        if (lane < ent->nlanes && ent->lanes[lane].port == port){
+            ent->lanes[lane].port = NULL;
+            if (--ent->nports == 0){
+                *epp = ent->next;
+                free(ent->lanes);
+                free(ent);
+            }
+        }
+        break;
+    }
+    pthread_rwlock_unlock(&btab->lock);
+}
+
+/*****************************************************************************
+ * btab_lane()
+ *
+ * bundle 宛のフレームを送る接続を、フローのハッシュ値で選ぶ。sted が
+ * 接続を選ぶのと同じ規則（flow_hash() % 接続の数）なので、一方向の同じ
+ * フローのフレームは常に同じ接続を通り、順序が保たれる。flow_hash() は
+ * 送信元と宛先を区別するので、逆方向のフローは別の接続を通ることがある。
+ * 選んだ接続が参加していなければ、次の番号の参加している接続を選ぶ。
+ * ポートは別のワーカーのものである可能性があるので、呼び出し側は
+ * *shardp が自分の番号と一致する場合にだけ、ポートを参照してよい。
+ *
+ *  引数：
+ *          btab   : bundle の表
+ *          id     : bundle の ID
+ *          hash   : フレームの flow_hash() の値
+ *          shardp : ポートを持っているワーカーの番号を返す
+ *  戻り値：
+ *          正常時 : 選んだ接続のポート
+ *          bundle が無い : NULL
+ *****************************************************************************/
+void *
+btab_lane(btab_t *btab, uint32_t id, uint32_t hash, int *shardp)
+{
+    btab_ent_t *ent;
+    void       *port = NULL;
+    int         i, lane;
+
+    pthread_rwlock_rdlock(&btab->lock);
+    if ((ent = btab_find(btab, id)) != NULL){
+        /* 表にある bundle には、参加している接続が必ず 1 つはある */
+        lane = hash % ent->nlanes;
+        for (i = 1 ; i < ent->nlanes && ent->lanes[lane].port == NULL ; i++)
+            lane = (lane + 1) % ent->nlanes;
+        port = ent->lanes[lane].port;
+        *shardp = ent->lanes[lane].shard;
+    }
+    pthread_rwlock_unlock(&btab->lock);
+    return(port);
+}
@@ -0,0 +1,246 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright (c) 1986, 2010, Oracle and/or its affiliates. All rights reserved.
+ */
+
+/*
+ * Copright (c) 2004-2010  Kazuyoshi Aizawa <admin2@whiteboard.ne.jp>
+ * All rights reserved.
+ */
+/****************************************************************************
+ * stehub_domain.c
+ *
+ * 仮想ハブ（stehub）のドメインの表。
+ * 1 つの stehub の中に、ネットワーク ID で区別される複数の独立した
+ * 仮想スイッチ（ドメイン）を持つ。ドメイン毎に MAC アドレステーブル、
+ * マルチキャストグループの表、同じ sted からの複数の接続の表とワーカー毎の
+ * ポートの一覧を持ち、フレームは
+ * 同じドメインのポートにだけ転送される。
+ *
+ * 表はネットワーク ID をキーとしたチェイン法のハッシュ表で、ポートが
+ * 最初にそのネットワーク ID を名乗った時にドメインを作る。ドメインは
+ * ワーカー間のリングや送信キューから参照されている可能性があるので、
+ * ポートがいなくなっても解放しない。
+ *
+ * 表を引くのはポートがドメインに参加する時だけなので、1 つの mutex で
+ * 保護する。フレームの転送時には、コネクションやリングのフレームが
+ * 持っているドメインのポインタを使い、表は引かない。
+ *
+ *****************************************************************************/
+
+#ifndef STE_WINDOWS
+#include <syslog.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "sted.h"
+#include "stehub.h"
+
+struct dtab
+{
+    domain_t     *bucket[DTAB_BUCKETS]; /* ハッシュ表 */
+    int           count;     /* ドメインの数 */
+    int           nshards;   /* ワーカーの数 */
+    int           aging;     /* MAC アドレスのエージング時間（秒）。0 なら学習しない */
+    int           mdb_aging; /* マルチキャストグループのエージング時間（秒）。0 なら snooping しない */
+    pthread_mutex_t lock;    /* 表を保護するロック */
+};
+
+/*****************************************************************************
+ * dtab_create()
+ *
+ * ドメインの表を作成する。
+ *
+ *  引数：
+ *          nshards : ワーカーの数
+ *          aging   : ドメインの MAC アドレステーブルのエージング時間（秒）。
+ *                    0 なら MAC アドレスを学習しない
+ *          mdb_aging : ドメインのマルチキャストグループのエージング時間（秒）。
+ *                    0 なら IGMP/MLD snooping をしない
+ *  戻り値：
+ *          正常時 : dtab 構造体のポインタ
+ *          障害時 : NULL
+ *****************************************************************************/
+dtab_t *
+dtab_create(int nshards, int aging, int mdb_aging)
+{
+    dtab_t *dtab;
+
+    if ((dtab = (dtab_t *)malloc(sizeof(dtab_t))) == NULL)
+        return(NULL);
+    memset(dtab, 0x0, sizeof(dtab_t));
+    pthread_mutex_init(&dtab->lock, NULL);
+    dtab->nshards = nshards;
+    dtab->aging = aging;
+    dtab->mdb_aging = mdb_aging;
+    return(dtab);
+}
+
+/*****************************************************************************
+ * dtab_get()
+ *
+ * ネットワーク ID のドメインを引く。無ければ作成する。
+ *
+ *  引数：
+ *          dtab : ドメインの表
+ *          id   : ネットワーク ID
+ *          now  : 現在時刻（秒）
+ *  戻り値：
+ *          正常時 : ドメインのポインタ
+ *          障害時 : NULL
+ *****************************************************************************/
+domain_t *
+dtab_get(dtab_t *dtab, uint32_t id, uint32_t now)
+{
+    domain_t **bp = &dtab->bucket[(id * 2654435761U) >> 24 & (DTAB_BUCKETS - 1)];
+    domain_t  *dom;
+
+    pthread_mutex_lock(&dtab->lock);
+    for (dom = *bp ; dom != NULL ; dom = dom->next){
+        if (dom->id == id)
+            goto out;
+    }
+
+    if ((dom = (domain_t *)malloc(sizeof(domain_t))) == NULL)
+        goto out;
+    memset(dom, 0x0, sizeof(domain_t));
+    dom->id = id;
+    if ((dom->shard = (dshard_t *)calloc(dtab->nshards, sizeof(dshard_t))) == NULL ||
+        (dom->btab = btab_create()) == NULL ||
+        (dtab->aging > 0 && (dom->fdb = fdb_create(dtab->aging, now)) == NULL) ||
+        (dtab->mdb_aging > 0 && (dom->mdb = mdb_create(dtab->mdb_aging)) == NULL)){
+        print_err(LOG_ERR, "dtab_get: can't create network %u\n", id);
+        free(dom->shard);
+        free(dom->btab);
+        free(dom);
+        dom = NULL;
+        goto out;
+    }
+    dom->next = *bp;
+    *bp = dom;
+    dtab->count++;
+
+  out:
+    pthread_mutex_unlock(&dtab->lock);
+    return(dom);
+}
+
+/*****************************************************************************
+ * dtab_age()
+ *
+ * すべてのドメインの MAC アドレステーブルとマルチキャストグループの
+ * エージングを行う。
+ *
+ *  引数：
+ *          dtab : ドメインの表
+ *          now  : 現在時刻（秒）
+ *  戻り値：
+ *          削除した MAC アドレスのエントリの数
+ *****************************************************************************/
+int
+dtab_age(dtab_t *dtab, uint32_t now)
+{
+    domain_t *dom;
+    int       i, nremoved = 0;
+
+    if (dtab->aging == 0 && dtab->mdb_aging == 0)
+        return(0);
+    pthread_mutex_lock(&dtab->lock);
+    for (i = 0 ; i < DTAB_BUCKETS ; i++){
+        for (dom = dtab->bucket[i] ; dom != NULL ; dom = dom->next){
+            if (dom->fdb != NULL)
+                nremoved += fdb_age(dom->fdb, now);
+            if (dom->mdb != NULL)
+                mdb_age(dom->mdb, now);
+        }
+    }
+    pthread_mutex_unlock(&dtab->lock);
+    return(nremoved);
+}
+
+/*****************************************************************************
+ * dtab_count()
+ *
+ * ドメインの数を返す。
+ *****************************************************************************/
+int
+dtab_count(dtab_t *dtab)
+{
+    int count;
+
+    pthread_mutex_lock(&dtab->lock);
+    count = dtab->count;
+    pthread_mutex_unlock(&dtab->lock);
+    return(count);
+}
+
+/*****************************************************************************
+ * dtab_stats()
+ *
+ * すべてのドメインの統計情報を作る。ワーカー毎のカウンタは、ロックを
+ * 取らずに読んで合計する。
+ *
+ *  引数：
+ *          dtab   : ドメインの表
+ *          statsp : malloc() したドメインの統計情報の配列を返す
+ *  戻り値：
+ *          正常時 : ドメインの数
+ *          障害時 : -1
+ *****************************************************************************/
+int
+dtab_stats(dtab_t *dtab, dstat_t **statsp)
+{
+    domain_t *dom;
+    dshard_t *ds;
+    dstat_t  *st;
+    int       i, j, k, n = 0;
+
+    pthread_mutex_lock(&dtab->lock);
+    if ((*statsp = (dstat_t *)calloc(dtab->count + 1, sizeof(dstat_t))) == NULL){
+        pthread_mutex_unlock(&dtab->lock);
+        return(-1);
+    }
+    for (i = 0 ; i < DTAB_BUCKETS ; i++){
+        for (dom = dtab->bucket[i] ; dom != NULL ; dom = dom->next){
+            st = &(*statsp)[n++];
+            st->id = dom->id;
+            if (dom->fdb != NULL)
+                st->nmacs = fdb_count(dom->fdb);
+            for (j = 0 ; j < dtab->nshards ; j++){
+                ds = &dom->shard[j];
+                st->nports += LOAD_ACQUIRE(&ds->nports);
+                st->rx_frames += ds->rx_frames;
+                st->rx_bytes += ds->rx_bytes;
+                st->unicast_frames += ds->unicast_frames;
+                st->flood_frames += ds->flood_frames;
+                for (k = 0 ; k < STORM_KINDS ; k++)
+                    st->storm_drops += ds->storm_drops[k];
+            }
+        }
+    }
+    pthread_mutex_unlock(&dtab->lock);
+    return(n);
+}
@@ -0,0 +1,1288 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright (c) 1986, 2010, Oracle and/or its affiliates. All rights reserved.
+ */
+
+/*
+ * Copright (c) 2004-2010  Kazuyoshi Aizawa <admin2@whiteboard.ne.jp>
+ * All rights reserved.
+ */
+/****************************************************************************
+ * stehub_event.c
+ *
+ * 仮想ハブ（stehub）が使うイベントエンジン。
+ * 以下のバックエンドを持ち、起動時にどれか一つを選択する。
+ *
+ *   epoll   : Linux の epoll(7)。edge-triggered で登録する。
+ *   uring   : Linux 6.0 以降の io_uring。受信（multishot recv）と送信
+ *             （writev）もリングで行い、1 回の起床の受信、送信、登録の
+ *             変更を待ち合わせと同じシステムコールでまとめて行う。
+ *             -e uring を指定した場合だけ使い、使えなければ epoll を使う。
+ *             5.13 以降なら、multishot poll だけを使う。
+ *   port    : Solaris 10 以降の event port。
+ *   select  : select(3C)。どの環境でも使えるが FD_SETSIZE を超える
+ *             fd は扱えず、1 回の待ち合わせのコストは O(最大 fd)。
+ *
+ * epoll は edge-triggered なので、呼び出し側は EWOULDBLOCK になるまで
+ * 読み込むか、読み残したコネクションを自分で覚えておく必要がある。
+ * port、select は level-triggered 相当の動きになるが、呼び出し側の
+ * 処理は同じでよい。
+ *
+ *****************************************************************************/
+
+#ifdef STE_WINDOWS
+#define  FD_SETSIZE     1024
+#include <winsock2.h>   /* for windows */
+#include <Windows.h>    /* for windows */
+#else
+#include <unistd.h>
+#include <sys/time.h>
+#include <syslog.h>
+#include <sys/select.h>
+#endif
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define  HAVE_EPOLL
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#if defined(IORING_POLL_ADD_MULTI) && defined(IORING_ENTER_EXT_ARG) && \
+    defined(IORING_RECV_MULTISHOT)
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <endian.h>
+#ifndef  POLLRDHUP
+#define  POLLRDHUP  EPOLLRDHUP   /* _GNU_SOURCE 無しでは定義されない */
+#endif
+#define  HAVE_IO_URING
+#endif
+#endif
+#if defined(__sun) && defined(SOL10)
+#include <port.h>
+#include <poll.h>
+#define  HAVE_EVENT_PORT
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <inttypes.h>
+#include "sted.h"
+#include "stehub.h"
+
+/*
+ * port、select、uring バックエンドが fd ごとに保持する登録情報
+ */
+typedef struct ev_fdent
+{
+    int           events;   /* 登録されているイベント。0 なら未登録 */
+    void         *data;     /* ev_add() で渡されたポインタ */
+    uint32_t      gen;      /* 登録の世代番号（uring 用）*/
+} ev_fdent_t;
+
+/*
+ * バックエンドの操作関数
+ */
+typedef struct ev_ops
+{
+    char         *name;
+    int         (*init)(ev_stat_t *);
+    int         (*add)(ev_stat_t *, int, int, void *);
+    int         (*mod)(ev_stat_t *, int, int, void *);
+    int         (*del)(ev_stat_t *, int);
+    int         (*wait)(ev_stat_t *, ev_event_t *, int, int);
+    int         (*io_start)(ev_stat_t *, fpool_t *);  /* 受信と送信も行うなら NULL 以外 */
+    int         (*writev)(ev_stat_t *, int, struct iovec *, int *, int, void *);
+} ev_ops_t;
+
+/*
+ * イベントエンジンの管理構造体
+ */
+struct ev_stat
+{
+    ev_ops_t     *ops;
+    int           fd;         /* epoll、event port の fd */
+    ev_fdent_t   *fdtab;      /* fd をインデックスとした登録情報 */
+    int           fdtabsize;  /* fdtab の要素数 */
+    int           maxfd;      /* 登録されている最大の fd（select 用） */
+    void         *evbuf;      /* バックエンド固有のイベント受け取り用バッファ */
+    int           evbufsize;  /* evbuf の要素数 */
+};
+
+static int  ev_fdtab_grow(ev_stat_t *, int);
+
+#ifdef HAVE_EPOLL
+static int  ev_epoll_init(ev_stat_t *);
+static int  ev_epoll_add(ev_stat_t *, int, int, void *);
+static int  ev_epoll_mod(ev_stat_t *, int, int, void *);
+static int  ev_epoll_del(ev_stat_t *, int);
+static int  ev_epoll_wait(ev_stat_t *, ev_event_t *, int, int);
+
+static ev_ops_t ev_epoll_ops = {
+    "epoll", ev_epoll_init, ev_epoll_add, ev_epoll_mod, ev_epoll_del, ev_epoll_wait,
+    NULL, NULL
+};
+#endif
+
+#ifdef HAVE_IO_URING
+static int  ev_uring_init(ev_stat_t *);
+static int  ev_uring_add(ev_stat_t *, int, int, void *);
+static int  ev_uring_mod(ev_stat_t *, int, int, void *);
+static int  ev_uring_del(ev_stat_t *, int);
+static int  ev_uring_wait(ev_stat_t *, ev_event_t *, int, int);
+static int  ev_uring_io_start(ev_stat_t *, fpool_t *);
+static int  ev_uring_writev(ev_stat_t *, int, struct iovec *, int *, int, void *);
+
+static ev_ops_t ev_uring_ops = {
+    "uring", ev_uring_init, ev_uring_add, ev_uring_mod, ev_uring_del, ev_uring_wait,
+    ev_uring_io_start, ev_uring_writev
+};
+#endif
+
+#ifdef HAVE_EVENT_PORT
+static int  ev_port_init(ev_stat_t *);
+static int  ev_port_add(ev_stat_t *, int, int, void *);
+static int  ev_port_del(ev_stat_t *, int);
+static int  ev_port_wait(ev_stat_t *, ev_event_t *, int, int);
+
+static ev_ops_t ev_port_ops = {
+    "port", ev_port_init, ev_port_add, ev_port_add, ev_port_del, ev_port_wait,
+    NULL, NULL
+};
+#endif
+
+static int  ev_select_init(ev_stat_t *);
+static int  ev_select_add(ev_stat_t *, int, int, void *);
+static int  ev_select_del(ev_stat_t *, int);
+static int  ev_select_wait(ev_stat_t *, ev_event_t *, int, int);
+
+static ev_ops_t ev_select_ops = {
+    "select", ev_select_init, ev_select_add, ev_select_add, ev_select_del, ev_select_wait,
+    NULL, NULL
+};
+
+/*
+ * 優先順位の高い順に並べたバックエンドの一覧
+ */
+static ev_ops_t *ev_backends[] = {
+#ifdef HAVE_EPOLL
+    &ev_epoll_ops,
+#endif
+#ifdef HAVE_EVENT_PORT
+    &ev_port_ops,
+#endif
+    &ev_select_ops,
+    NULL
+};
+
+/*
+ * 名前を指定された場合だけ使うバックエンドの一覧
+ */
+static ev_ops_t *ev_optional[] = {
+#ifdef HAVE_IO_URING
+    &ev_uring_ops,
+#endif
+    NULL
+};
+
+/*****************************************************************************
+ * ev_try()
+ *
+ * 指定されたバックエンドでイベントエンジンを作成する。
+ *
+ *  引数：
+ *          ops       : バックエンド
+ *          maxevents : 1 回の ev_wait() で受け取る最大イベント数
+ *  戻り値：
+ *          正常時 : ev_stat 構造体のポインタ
+ *          障害時 : NULL
+ *****************************************************************************/
+static ev_stat_t *
+ev_try(ev_ops_t *ops, int maxevents)
+{
+    ev_stat_t *evp;
+
+    if ((evp = (ev_stat_t *)malloc(sizeof(ev_stat_t))) == NULL){
+        print_err(LOG_ERR, "ev_create: malloc failed\n");
+        return(NULL);
+    }
+    memset(evp, 0x0, sizeof(ev_stat_t));
+    evp->ops = ops;
+    evp->fd = -1;
+    evp->maxfd = -1;
+    evp->evbufsize = maxevents;
+
+    if (ops->init(evp) == 0)
+        return(evp);
+
+    /* このバックエンドは使えないようだ */
+    print_err(LOG_NOTICE, "ev_create: %s is not available\n", ops->name);
+    free(evp->evbuf);
+    free(evp);
+    return(NULL);
+}
+
+/*****************************************************************************
+ * ev_create()
+ *
+ * イベントエンジンを作成する。
+ * 名前を指定した uring などのバックエンドがこのカーネルで使えない場合は、
+ * 名前を指定しなかった時と同じように選び直す。
+ *
+ *  引数：
+ *          name      : バックエンド名。NULL なら利用可能な最良のものを選ぶ。
+ *          maxevents : 1 回の ev_wait() で受け取る最大イベント数
+ *  戻り値：
+ *          正常時 : ev_stat 構造体のポインタ
+ *          障害時 : NULL
+ *****************************************************************************/
+ev_stat_t *
+ev_create(char *name, int maxevents)
+{
+    ev_stat_t *evp;
+    ev_ops_t **opsp;
+
+    if (name != NULL){
+        for (opsp = ev_optional ; *opsp != NULL ; opsp++){
+            if (strcmp(name, (*opsp)->name) != 0)
+                continue;
+            if ((evp = ev_try(*opsp, maxevents)) != NULL)
+                return(evp);
+            print_err(LOG_NOTICE, "ev_create: falling back to the default event engine\n");
+            name = NULL;
+            break;
+        }
+    }
+
+    for (opsp = ev_backends ; *opsp != NULL ; opsp++){
+        if (name != NULL && strcmp(name, (*opsp)->name) != 0)
+            continue;
+        if ((evp = ev_try(*opsp, maxevents)) != NULL)
+            return(evp);
+        if (name != NULL)
+            break;
+    }
+    if (name != NULL)
+        print_err(LOG_ERR, "ev_create: unknown event engine \"%s\"\n", name);
+    return(NULL);
+}
+
+/*****************************************************************************
+ * ev_name()
+ *
+ * 選択されたバックエンドの名前を返す。
+ *****************************************************************************/
+char *
+ev_name(ev_stat_t *evp)
+{
+    return(evp->ops->name);
+}
+
+/*****************************************************************************
+ * ev_add() / ev_mod() / ev_del()
+ *
+ * fd の登録、登録イベントの変更、登録解除を行う。
+ *
+ *  引数：
+ *          evp    : イベントエンジン
+ *          fd     : 対象の fd
+ *          events : EV_READ、EV_WRITE の組み合わせ
+ *          data   : ev_wait() が返すポインタ
+ *  戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+int
+ev_add(ev_stat_t *evp, int fd, int events, void *data)
+{
+    return(evp->ops->add(evp, fd, events, data));
+}
+
+int
+ev_mod(ev_stat_t *evp, int fd, int events, void *data)
+{
+    return(evp->ops->mod(evp, fd, events, data));
+}
+
+int
+ev_del(ev_stat_t *evp, int fd)
+{
+    return(evp->ops->del(evp, fd));
+}
+
+/*****************************************************************************
+ * ev_wait()
+ *
+ * イベントの発生を待つ。
+ *
+ *  引数：
+ *          evp       : イベントエンジン
+ *          evs       : 発生したイベントを格納する配列
+ *          maxevents : evs の要素数
+ *          timeout   : タイムアウト（ミリ秒）。-1 なら無期限に待つ。
+ *  戻り値：
+ *          正常時 : 発生したイベントの数
+ *          障害時 : -1
+ *****************************************************************************/
+int
+ev_wait(ev_stat_t *evp, ev_event_t *evs, int maxevents, int timeout)
+{
+    if (maxevents > evp->evbufsize)
+        maxevents = evp->evbufsize;
+    return(evp->ops->wait(evp, evs, maxevents, timeout));
+}
+
+/*****************************************************************************
+ * ev_io_start()
+ *
+ * 受信と送信もイベントエンジンで行うようにする（uring だけ）。以後、
+ * EV_RECV で登録した fd の受信データは EV_RECV のイベントで返り、
+ * ev_writev() で送信できる。
+ *
+ *  引数：
+ *          evp  : イベントエンジン
+ *          pool : 受信バッファを取り出すプール
+ *  戻り値：
+ *          正常時 : 0
+ *          このエンジン、カーネルでは使えない : -1
+ *****************************************************************************/
+int
+ev_io_start(ev_stat_t *evp, fpool_t *pool)
+{
+    if (evp->ops->io_start == NULL)
+        return(-1);
+    return(evp->ops->io_start(evp, pool));
+}
+
+/*****************************************************************************
+ * ev_writev()
+ *
+ * iovec の配列を nbatch 個に分けて、順番に送信するよう依頼する。i 番目は
+ * niovs[i] 個の iovec で、iov の続きの位置から始まる。送信が終わると、
+ * 1 つずつ EV_SENT のイベントが返る。ev_io_start() が成功した場合だけ
+ * 使える。
+ *
+ *  引数：
+ *          evp    : イベントエンジン
+ *          fd     : 送信先の fd
+ *          iov    : iovec の配列。送信が終わるまで変更しない
+ *          niovs  : 各送信の iovec の数
+ *          nbatch : 送信の数
+ *          data   : EV_SENT のイベントで返すポインタ
+ *  戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+int
+ev_writev(ev_stat_t *evp, int fd, struct iovec *iov, int *niovs, int nbatch, void *data)
+{
+    return(evp->ops->writev(evp, fd, iov, niovs, nbatch, data));
+}
+
+/*****************************************************************************
+ * ev_fdtab_grow()
+ *
+ * fd をインデックスとした登録情報のテーブルを、fd が収まるまで拡張する。
+ *****************************************************************************/
+static int
+ev_fdtab_grow(ev_stat_t *evp, int fd)
+{
+    ev_fdent_t *newtab;
+    int         newsize;
+
+    if (fd < evp->fdtabsize)
+        return(0);
+
+    newsize = evp->fdtabsize ? evp->fdtabsize : 64;
+    while (newsize <= fd)
+        newsize *= 2;
+
+    if ((newtab = (ev_fdent_t *)realloc(evp->fdtab, newsize * sizeof(ev_fdent_t))) == NULL){
+        print_err(LOG_ERR, "ev_fdtab_grow: realloc failed\n");
+        return(-1);
+    }
+    memset(newtab + evp->fdtabsize, 0x0, (newsize - evp->fdtabsize) * sizeof(ev_fdent_t));
+    evp->fdtab = newtab;
+    evp->fdtabsize = newsize;
+    return(0);
+}
+
+#ifdef HAVE_EPOLL
+/*****************************************************************************
+ * epoll バックエンド
+ *
+ * fd は EPOLLET（edge-triggered）で登録する。ERR、HUP は EV_READ として
+ * も通知し、呼び出し側の recv() に切断を検出させる。
+ *****************************************************************************/
+static int
+ev_epoll_init(ev_stat_t *evp)
+{
+    if ((evp->fd = epoll_create(evp->evbufsize)) < 0){
+        print_err(LOG_ERR, "epoll_create: %s\n", strerror(errno));
+        return(-1);
+    }
+    evp->evbuf = malloc(evp->evbufsize * sizeof(struct epoll_event));
+    if (evp->evbuf == NULL){
+        close(evp->fd);
+        return(-1);
+    }
+    return(0);
+}
+
+static int
+ev_epoll_ctl(ev_stat_t *evp, int op, int fd, int events, void *data)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0x0, sizeof(ev));
+    ev.events = EPOLLET | EPOLLRDHUP;
+    if (events & EV_READ)
+        ev.events |= EPOLLIN;
+    if (events & EV_WRITE)
+        ev.events |= EPOLLOUT;
+    ev.data.ptr = data;
+
+    if (epoll_ctl(evp->fd, op, fd, &ev) < 0){
+        print_err(LOG_ERR, "fd%d: epoll_ctl: %s\n", fd, strerror(errno));
+        return(-1);
+    }
+    return(0);
+}
+
+static int
+ev_epoll_add(ev_stat_t *evp, int fd, int events, void *data)
+{
+    return(ev_epoll_ctl(evp, EPOLL_CTL_ADD, fd, events, data));
+}
+
+static int
+ev_epoll_mod(ev_stat_t *evp, int fd, int events, void *data)
+{
+    return(ev_epoll_ctl(evp, EPOLL_CTL_MOD, fd, events, data));
+}
+
+static int
+ev_epoll_del(ev_stat_t *evp, int fd)
+{
+    struct epoll_event ev; /* 2.6.9 より前のカーネルは NULL を受け付けない */
+
+    if (epoll_ctl(evp->fd, EPOLL_CTL_DEL, fd, &ev) < 0)
+        return(-1);
+    return(0);
+}
+
+static int
+ev_epoll_wait(ev_stat_t *evp, ev_event_t *evs, int maxevents, int timeout)
+{
+    struct epoll_event *eevs = (struct epoll_event *)evp->evbuf;
+    int nev, i;
+
+    if ((nev = epoll_wait(evp->fd, eevs, maxevents, timeout)) < 0)
+        return(-1);
+
+    for (i = 0 ; i < nev ; i++){
+        evs[i].data = eevs[i].data.ptr;
+        evs[i].events = 0;
+        if (eevs[i].events & EPOLLIN)
+            evs[i].events |= EV_READ;
+        if (eevs[i].events & EPOLLOUT)
+            evs[i].events |= EV_WRITE;
+        if (eevs[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+            evs[i].events |= EV_READ | EV_ERROR;
+    }
+    return(nev);
+}
+#endif /* HAVE_EPOLL */
+
+#ifdef HAVE_IO_URING
+/*****************************************************************************
+ * io_uring バックエンド
+ *
+ * fd は multishot の POLL_ADD で登録し、1 回の登録で何度でも通知を受ける。
+ * 登録、変更、解除は SQE を積んでおくだけで、次の ev_wait() の
+ * io_uring_enter() でまとめて投入するので、ev_mod() のたびにシステム
+ * コールを呼ぶことはない。
+ *
+ * ev_io_start() を呼ぶと、受信と送信もリングで行う。
+ *   o EV_RECV で登録した fd は、POLL_ADD の代わりに multishot の RECV で
+ *     登録する。カーネルは受信の度に、バッファリング（provided buffer
+ *     ring）から受信バッファを選んで読み込み、CQE を返す。バッファリング
+ *     にはワーカーのプールの受信バッファ（fbuf）をそのまま入れるので、
+ *     受信したバッファは recv() の場合と同じように参照カウントで送信
+ *     キューに共有され、使い終われば fbuf_put() でプールに戻る。
+ *     CQE で受け取ったバッファの代わりは、その場でプールから補充する。
+ *     補充は共有メモリのリングに書くだけで、システムコールは要らない。
+ *   o ev_writev() は、送信キューの iovec をそのまま WRITEV の SQE にする。
+ *     複数に分けた場合は IOSQE_IO_LINK で繋ぎ、順番に送信させる。途中で
+ *     一部しか送信できなければ、以降の SQE は -ECANCELED で終わる。
+ *     socket が一杯の時はカーネルが書き込めるようになるまで待つので、
+ *     呼び出し側は EV_WRITE を待たなくてよい。
+ * これで、1 回の起床の受信、送信、バッファの補充、登録の変更が 1 回の
+ * io_uring_enter() で済む。リングの fd も登録（REGISTER_RING_FDS）して、
+ * io_uring_enter() の度の fd の参照を省く。登録はスレッド毎なので、
+ * リングを作ったスレッドではなく、ev_wait() を呼ぶスレッドが最初の
+ * ev_wait() で登録する。
+ * fixed buffer（REGISTER_BUFFERS）は使わない。受信バッファはプールが
+ * 必要なだけ確保し、送信キューやワーカー間のリングを経て解放されるので、
+ * 起動時に登録した領域には収まらない。
+ *
+ * 解除した後も、既に CQ に入っている古い通知が届くことがある。fd は
+ * 再利用されるので、POLL_ADD と RECV の user_data には fd と登録毎の
+ * 世代番号を入れ、世代番号が一致しない通知は捨てる（受信バッファは
+ * プールに戻す）。WRITEV の user_data は ev_writev() に渡されたポインタで、
+ * 解除した後でも必ず EV_SENT を返す。呼び出し側は、依頼した送信がすべて
+ * 終わるまで、そのポインタと送信するデータを解放してはいけない。
+ *
+ * liburing は使わず、システムコールと共有メモリのリングを直接扱う。
+ * 起動時にカーネルが必要な機能（EXT_ARG、multishot poll）を持って
+ * いなければ、ev_create() は他のバックエンドを使う。multishot recv
+ * （6.0 以降）が使えなければ ev_io_start() が失敗し、受信と送信は
+ * 呼び出し側が recv()、writev() で行う。
+ *****************************************************************************/
+#define EV_URING_IGNORE   (~(uint64_t)0)      /* 結果を見ない SQE の user_data */
+#define EV_URING_PROBE    (~(uint64_t)1)      /* multishot recv の確認に使う SQE の user_data */
+#define EV_URING_SEND     ((uint64_t)1 << 63) /* WRITEV の SQE の user_data の印 */
+#define EV_URING_CQSIZE   8                   /* CQ の大きさ（maxevents の倍数）*/
+#define EV_URING_NBUFS    64                  /* バッファリングの受信バッファの数（2 のべき乗）*/
+#define EV_URING_BGID     0                   /* バッファリングの ID */
+
+/*
+ * io_uring のリングを操作するための情報
+ */
+typedef struct ev_uring
+{
+    unsigned     *sq_head;
+    unsigned     *sq_tail;
+    unsigned     *sq_mask;
+    unsigned     *sq_array;
+    unsigned      sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned     *cq_head;
+    unsigned     *cq_tail;
+    unsigned     *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned      to_submit;  /* 積んだがまだ投入していない SQE の数 */
+    uint32_t      gen;        /* 登録毎に増やす世代番号（31 bit）*/
+    int           ring_index; /* 登録したリングの fd の番号。-1 なら未登録 */
+    int           ring_tried; /* ev_wait() を呼ぶスレッドで登録を試みた */
+    fpool_t      *pool;       /* 受信バッファのプール。NULL なら受信を行わない */
+    struct io_uring_buf_ring *br;          /* バッファリング */
+    uint16_t      br_tail;                 /* バッファリングに次に入れる位置 */
+    fbuf_t       *bufs[EV_URING_NBUFS];    /* bufs[bid] はバッファリングに入れた受信バッファ */
+    uint16_t      missing[EV_URING_NBUFS]; /* 受信バッファを補充できなかった bid */
+    int           nmissing;
+} ev_uring_t;
+
+static int
+ev_uring_enter(ev_stat_t *evp, unsigned to_submit, unsigned min_complete, int timeout)
+{
+    ev_uring_t                   *u = (ev_uring_t *)evp->evbuf;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec      ts;
+    unsigned                      flags = IORING_ENTER_EXT_ARG;
+    int                           fd = evp->fd;
+
+    memset(&arg, 0x0, sizeof(arg));
+    if (min_complete > 0){
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeout >= 0){
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+    }
+    if (u != NULL && u->ring_index >= 0){
+        flags |= IORING_ENTER_REGISTERED_RING;
+        fd = u->ring_index;
+    }
+    return(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   &arg, sizeof(arg)));
+}
+
+static int
+ev_uring_init(ev_stat_t *evp)
+{
+    struct io_uring_params      p;
+    ev_uring_t                 *u;
+    size_t                      sqsize, cqsize;
+    char                       *sq, *cq;
+    unsigned                    i;
+
+    memset(&p, 0x0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = evp->evbufsize * EV_URING_CQSIZE;
+    if ((evp->fd = syscall(__NR_io_uring_setup, evp->evbufsize, &p)) < 0){
+        print_err(LOG_ERR, "io_uring_setup: %s\n", strerror(errno));
+        return(-1);
+    }
+    /*
+     * EXT_ARG（タイムアウト付きの待ち合わせ）は 5.11、multishot poll は
+     * 5.13 から。multishot poll の有無は直接分からないので、同じ版で
+     * 入った RSRC_TAGS で判断する。
+     */
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP) ||
+        !(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_RSRC_TAGS)){
+        print_err(LOG_ERR, "io_uring: kernel is too old (features = 0x%x)\n", p.features);
+        close(evp->fd);
+        return(-1);
+    }
+
+    sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cqsize > sqsize)
+        sqsize = cqsize;
+    sq = mmap(NULL, sqsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+              evp->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED){
+        print_err(LOG_ERR, "io_uring: mmap: %s\n", strerror(errno));
+        close(evp->fd);
+        return(-1);
+    }
+    cq = sq;
+    if ((u = (ev_uring_t *)malloc(sizeof(ev_uring_t))) == NULL){
+        close(evp->fd);
+        return(-1);
+    }
+    memset(u, 0x0, sizeof(ev_uring_t));
+    u->ring_index = -1;
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, evp->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED){
+        print_err(LOG_ERR, "io_uring: mmap: %s\n", strerror(errno));
+        free(u);
+        close(evp->fd);
+        return(-1);
+    }
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    /* SQE は積んだ順に使うので、SQ の配列は固定でよい */
+    for (i = 0 ; i < p.sq_entries ; i++)
+        u->sq_array[i] = i;
+
+    evp->evbuf = u;
+    return(0);
+}
+
+/*
+ * SQ に n 個の空きを作る。足りなければ、積んである SQE を先に投入する。
+ */
+static int
+ev_uring_reserve(ev_stat_t *evp, unsigned n)
+{
+    ev_uring_t *u = (ev_uring_t *)evp->evbuf;
+    int         ret;
+
+    while (*u->sq_tail - LOAD_ACQUIRE(u->sq_head) > u->sq_entries - n){
+        if ((ret = ev_uring_enter(evp, u->to_submit, 0, 0)) < 0){
+            if (errno == EINTR)
+                continue;
+            print_err(LOG_ERR, "io_uring_enter: %s\n", strerror(errno));
+            return(-1);
+        }
+        u->to_submit -= ret;
+    }
+    return(0);
+}
+
+/*
+ * 空いている SQE を 1 つ返す。
+ */
+static struct io_uring_sqe *
+ev_uring_get_sqe(ev_stat_t *evp)
+{
+    ev_uring_t          *u = (ev_uring_t *)evp->evbuf;
+    struct io_uring_sqe *sqe;
+
+    if (ev_uring_reserve(evp, 1) < 0)
+        return(NULL);
+    sqe = &u->sqes[*u->sq_tail & *u->sq_mask];
+    memset(sqe, 0x0, sizeof(*sqe));
+    return(sqe);
+}
+
+static void
+ev_uring_push_sqe(ev_stat_t *evp)
+{
+    ev_uring_t *u = (ev_uring_t *)evp->evbuf;
+
+    STORE_RELEASE(u->sq_tail, *u->sq_tail + 1);
+    u->to_submit++;
+}
+
+/*
+ * プールから受信バッファを取り出し、bid としてバッファリングに入れる。
+ * 取り出せなければ、次の ev_wait() で入れ直す。
+ */
+static void
+ev_uring_provide(ev_uring_t *u, uint16_t bid)
+{
+    struct io_uring_buf *b;
+    fbuf_t              *buf;
+
+    if ((buf = fbuf_get(u->pool)) == NULL){
+        u->missing[u->nmissing++] = bid;
+        return;
+    }
+    u->bufs[bid] = buf;
+    b = &u->br->bufs[u->br_tail & (EV_URING_NBUFS - 1)];
+    b->addr = (uint64_t)(uintptr_t)(buf->data + FRAME_MAX);
+    b->len = SOCKBUFSIZE;
+    b->bid = bid;
+    u->br_tail++;
+    STORE_RELEASE(&u->br->tail, u->br_tail);
+}
+
+/*
+ * CQE の受信バッファを取り出し、代わりのバッファをバッファリングに入れる。
+ * 受信バッファを使っていない CQE なら NULL を返す。
+ */
+static fbuf_t *
+ev_uring_take(ev_uring_t *u, struct io_uring_cqe *cqe)
+{
+    fbuf_t  *buf;
+    uint16_t bid;
+
+    if (!(cqe->flags & IORING_CQE_F_BUFFER))
+        return(NULL);
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    buf = u->bufs[bid];
+    u->bufs[bid] = NULL;
+    ev_uring_provide(u, bid);
+    return(buf);
+}
+
+/*
+ * multishot recv の SQE を作る。
+ */
+static void
+ev_uring_prep_recv(struct io_uring_sqe *sqe, int fd, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = EV_URING_BGID;
+    sqe->user_data = user_data;
+}
+
+static int
+ev_uring_arm(ev_stat_t *evp, int fd)
+{
+    ev_fdent_t          *ent = &evp->fdtab[fd];
+    struct io_uring_sqe *sqe;
+    uint32_t             pevents = POLLRDHUP;
+    uint64_t             key = ((uint64_t)ent->gen << 32) | (uint32_t)fd;
+
+    if ((sqe = ev_uring_get_sqe(evp)) == NULL)
+        return(-1);
+    if (ent->events & EV_RECV){
+        ev_uring_prep_recv(sqe, fd, key);
+        ev_uring_push_sqe(evp);
+        return(0);
+    }
+    if (ent->events & EV_READ)
+        pevents |= POLLIN;
+    if (ent->events & EV_WRITE)
+        pevents |= POLLOUT;
+#if __BYTE_ORDER == __BIG_ENDIAN
+    pevents = (pevents << 16) | (pevents >> 16);
+#endif
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = pevents;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = key;
+    ev_uring_push_sqe(evp);
+    return(0);
+}
+
+static int
+ev_uring_disarm(ev_stat_t *evp, int fd)
+{
+    ev_fdent_t          *ent = &evp->fdtab[fd];
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = ev_uring_get_sqe(evp)) == NULL)
+        return(-1);
+    sqe->opcode = (ent->events & EV_RECV) ? IORING_OP_ASYNC_CANCEL : IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = ((uint64_t)ent->gen << 32) | (uint32_t)fd;
+    sqe->user_data = EV_URING_IGNORE;
+    ev_uring_push_sqe(evp);
+    return(0);
+}
+
+static int
+ev_uring_add(ev_stat_t *evp, int fd, int events, void *data)
+{
+    ev_uring_t *u = (ev_uring_t *)evp->evbuf;
+
+    if ((events & EV_RECV) && u->pool == NULL)
+        return(-1);
+    if (ev_fdtab_grow(evp, fd) < 0)
+        return(-1);
+    evp->fdtab[fd].events = events;
+    evp->fdtab[fd].data = data;
+    evp->fdtab[fd].gen = u->gen = (u->gen + 1) & 0x7fffffff;
+    return(ev_uring_arm(evp, fd));
+}
+
+static int
+ev_uring_mod(ev_stat_t *evp, int fd, int events, void *data)
+{
+    if (fd >= evp->fdtabsize || evp->fdtab[fd].events == 0)
+        return(-1);
+    if (ev_uring_disarm(evp, fd) < 0)
+        return(-1);
+    return(ev_uring_add(evp, fd, events, data));
+}
+
+static int
+ev_uring_del(ev_stat_t *evp, int fd)
+{
+    ev_uring_t *u = (ev_uring_t *)evp->evbuf;
+
+    if (fd >= evp->fdtabsize || evp->fdtab[fd].events == 0)
+        return(-1);
+    ev_uring_disarm(evp, fd);
+    evp->fdtab[fd].events = 0;
+    evp->fdtab[fd].data = NULL;
+    evp->fdtab[fd].gen = u->gen = (u->gen + 1) & 0x7fffffff;
+    return(0);
+}
+
+/*
+ * multishot recv が使えるかどうかを、socketpair で実際に受信して確かめる。
+ * 古いカーネルは IORING_RECV_MULTISHOT を -EINVAL で返す。
+ */
+static int
+ev_uring_probe(ev_stat_t *evp)
+{
+    ev_uring_t          *u = (ev_uring_t *)evp->evbuf;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    fbuf_t              *buf;
+    unsigned             head;
+    int                  sv[2], ret, ok = 0;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        return(-1);
+    if ((sqe = ev_uring_get_sqe(evp)) == NULL){
+        close(sv[0]);
+        close(sv[1]);
+        return(-1);
+    }
+    ev_uring_prep_recv(sqe, sv[0], EV_URING_PROBE);
+    ev_uring_push_sqe(evp);
+    if (write(sv[1], "", 1) == 1 && (ret = ev_uring_enter(evp, u->to_submit, 1, 1000)) >= 0){
+        u->to_submit -= ret;
+        head = *u->cq_head;
+        if (head != LOAD_ACQUIRE(u->cq_tail)){
+            cqe = &u->cqes[head & *u->cq_mask];
+            ok = (cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE));
+            if ((buf = ev_uring_take(u, cqe)) != NULL)
+                fbuf_put(u->pool, buf);
+            STORE_RELEASE(u->cq_head, head + 1);
+        }
+    }
+    /* まだ登録されている受信を取り消す。その CQE は ev_wait() が捨てる */
+    if (ok && (sqe = ev_uring_get_sqe(evp)) != NULL){
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = EV_URING_PROBE;
+        sqe->user_data = EV_URING_IGNORE;
+        ev_uring_push_sqe(evp);
+    }
+    close(sv[0]);
+    close(sv[1]);
+    return(ok ? 0 : -1);
+}
+
+static int
+ev_uring_io_start(ev_stat_t *evp, fpool_t *pool)
+{
+    ev_uring_t             *u = (ev_uring_t *)evp->evbuf;
+    struct io_uring_buf_reg reg;
+    size_t                  size = EV_URING_NBUFS * sizeof(struct io_uring_buf);
+    int                     i;
+
+    u->br = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED){
+        print_err(LOG_ERR, "io_uring: mmap: %s\n", strerror(errno));
+        u->br = NULL;
+        return(-1);
+    }
+    memset(&reg, 0x0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->br;
+    reg.ring_entries = EV_URING_NBUFS;
+    reg.bgid = EV_URING_BGID;
+    if (syscall(__NR_io_uring_register, evp->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+        print_err(LOG_NOTICE, "io_uring: provided buffer ring is not available: %s\n",
+                  strerror(errno));
+        munmap(u->br, size);
+        u->br = NULL;
+        return(-1);
+    }
+    u->pool = pool;
+    for (i = 0 ; i < EV_URING_NBUFS ; i++)
+        ev_uring_provide(u, i);
+    if (ev_uring_probe(evp) == 0)
+        return(0);
+
+    /* 受信と送信は呼び出し側が行い、このエンジンは poll だけを使う */
+    print_err(LOG_NOTICE, "io_uring: multishot recv is not available\n");
+    syscall(__NR_io_uring_register, evp->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    for (i = 0 ; i < EV_URING_NBUFS ; i++){
+        if (u->bufs[i] != NULL)
+            fbuf_put(pool, u->bufs[i]);
+        u->bufs[i] = NULL;
+    }
+    u->nmissing = 0;
+    u->pool = NULL;
+    munmap(u->br, size);
+    u->br = NULL;
+    return(-1);
+}
+
+static int
+ev_uring_writev(ev_stat_t *evp, int fd, struct iovec *iov, int *niovs, int nbatch, void *data)
+{
+    struct io_uring_sqe *sqe;
+    int                  i;
+
+    /* 繋いだ SQE が別々の io_uring_enter() で投入されないよう、先に空きを作る */
+    if (ev_uring_reserve(evp, nbatch) < 0)
+        return(-1);
+    for (i = 0 ; i < nbatch ; i++){
+        sqe = ev_uring_get_sqe(evp);
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)iov;
+        sqe->len = niovs[i];
+        if (i < nbatch - 1)
+            sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = EV_URING_SEND | (uint64_t)(uintptr_t)data;
+        ev_uring_push_sqe(evp);
+        iov += niovs[i];
+    }
+    return(0);
+}
+
+static int
+ev_uring_wait(ev_stat_t *evp, ev_event_t *evs, int maxevents, int timeout)
+{
+    ev_uring_t          *u = (ev_uring_t *)evp->evbuf;
+    struct io_uring_cqe *cqe;
+    ev_fdent_t          *ent;
+    fbuf_t              *buf;
+    unsigned             head, tail;
+    int                  fd, ret, i, n, nev = 0;
+    struct io_uring_rsrc_update up;
+
+    /*
+     * リングの fd を、このスレッドに登録する（5.18 以降）。できなければ
+     * fd のまま使う。
+     */
+    if (!u->ring_tried){
+        u->ring_tried = 1;
+        memset(&up, 0x0, sizeof(up));
+        up.offset = -1U;
+        up.data = evp->fd;
+        if (syscall(__NR_io_uring_register, evp->fd, IORING_REGISTER_RING_FDS, &up, 1) == 1)
+            u->ring_index = up.offset;
+    }
+
+    /* 前回補充できなかった受信バッファを入れ直す */
+    n = u->nmissing;
+    u->nmissing = 0;
+    for (i = 0 ; i < n ; i++)
+        ev_uring_provide(u, u->missing[i]);
+
+    /*
+     * 積んである SQE を投入し、CQ が空ならイベントを待つ。
+     */
+    head = *u->cq_head;
+    tail = LOAD_ACQUIRE(u->cq_tail);
+    if (u->to_submit > 0 || (head == tail && timeout != 0)){
+        ret = ev_uring_enter(evp, u->to_submit, (head == tail && timeout != 0) ? 1 : 0, timeout);
+        if (ret < 0 && errno != ETIME && errno != EINTR)
+            return(-1);
+        if (ret > 0)
+            u->to_submit -= ret;
+        tail = LOAD_ACQUIRE(u->cq_tail);
+    }
+
+    for ( ; head != tail && nev < maxevents ; head++){
+        cqe = &u->cqes[head & *u->cq_mask];
+        if (cqe->user_data == EV_URING_IGNORE || cqe->user_data == EV_URING_PROBE)
+            continue;
+        if (cqe->user_data & EV_URING_SEND){
+            evs[nev].data = (void *)(uintptr_t)(cqe->user_data & ~EV_URING_SEND);
+            evs[nev].events = EV_SENT;
+            evs[nev].res = cqe->res;
+            evs[nev].buf = NULL;
+            nev++;
+            continue;
+        }
+        buf = ev_uring_take(u, cqe);
+        fd = (int)(uint32_t)cqe->user_data;
+        ent = fd < evp->fdtabsize ? &evp->fdtab[fd] : NULL;
+        if (ent == NULL || ent->events == 0 || ent->gen != (uint32_t)(cqe->user_data >> 32)){
+            /* 解除、または登録し直した後の古い通知 */
+            if (buf != NULL)
+                fbuf_put(u->pool, buf);
+            continue;
+        }
+
+        if (ent->events & EV_RECV){
+            if (cqe->res == -ENOBUFS){
+                /* バッファリングが空になり、multishot の登録が外れた */
+                ev_uring_arm(evp, fd);
+                continue;
+            }
+            evs[nev].data = ent->data;
+            evs[nev].events = EV_RECV;
+            evs[nev].res = cqe->res;
+            evs[nev].buf = buf;
+            nev++;
+            /* 切断やエラーでなければ、外れた登録をし直す */
+            if (!(cqe->flags & IORING_CQE_F_MORE) && cqe->res > 0)
+                ev_uring_arm(evp, fd);
+            continue;
+        }
+
+        evs[nev].data = ent->data;
+        evs[nev].events = 0;
+        if (cqe->res < 0){
+            evs[nev].events |= EV_READ | EV_ERROR;
+        } else {
+            if (cqe->res & POLLIN)
+                evs[nev].events |= EV_READ;
+            if (cqe->res & POLLOUT)
+                evs[nev].events |= EV_WRITE;
+            if (cqe->res & (POLLERR | POLLHUP | POLLRDHUP))
+                evs[nev].events |= EV_READ | EV_ERROR;
+        }
+        nev++;
+        /* multishot の登録が外れた（CQ があふれた場合など）ので登録し直す */
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            ev_uring_arm(evp, fd);
+    }
+    STORE_RELEASE(u->cq_head, head);
+    return(nev);
+}
+#endif /* HAVE_IO_URING */
+
+#ifdef HAVE_EVENT_PORT
+/*****************************************************************************
+ * event port バックエンド
+ *
+ * event port への関連付けはイベントが通知されると解除されるので、
+ * port_getn() で受け取った fd はその場で再度関連付けを行う。
+ *****************************************************************************/
+static int
+ev_port_init(ev_stat_t *evp)
+{
+    if ((evp->fd = port_create()) < 0){
+        print_err(LOG_ERR, "port_create: %s\n", strerror(errno));
+        return(-1);
+    }
+    evp->evbuf = malloc(evp->evbufsize * sizeof(port_event_t));
+    if (evp->evbuf == NULL){
+        close(evp->fd);
+        return(-1);
+    }
+    return(0);
+}
+
+static int
+ev_port_associate(ev_stat_t *evp, int fd)
+{
+    ev_fdent_t *ent = &evp->fdtab[fd];
+    int         pevents = 0;
+
+    if (ent->events & EV_READ)
+        pevents |= POLLIN;
+    if (ent->events & EV_WRITE)
+        pevents |= POLLOUT;
+
+    if (port_associate(evp->fd, PORT_SOURCE_FD, fd, pevents, ent->data) < 0){
+        print_err(LOG_ERR, "fd%d: port_associate: %s\n", fd, strerror(errno));
+        return(-1);
+    }
+    return(0);
+}
+
+static int
+ev_port_add(ev_stat_t *evp, int fd, int events, void *data)
+{
+    if (ev_fdtab_grow(evp, fd) < 0)
+        return(-1);
+    evp->fdtab[fd].events = events;
+    evp->fdtab[fd].data = data;
+    return(ev_port_associate(evp, fd));
+}
+
+static int
+ev_port_del(ev_stat_t *evp, int fd)
+{
+    if (fd >= evp->fdtabsize || evp->fdtab[fd].events == 0)
+        return(-1);
+    evp->fdtab[fd].events = 0;
+    evp->fdtab[fd].data = NULL;
+    /* 通知済みで関連付けが外れている場合もあるので、エラーは無視する */
+    port_dissociate(evp->fd, PORT_SOURCE_FD, fd);
+    return(0);
+}
+
+static int
+ev_port_wait(ev_stat_t *evp, ev_event_t *evs, int maxevents, int timeout)
+{
+    port_event_t   *pevs = (port_event_t *)evp->evbuf;
+    struct timespec ts, *tsp = NULL;
+    uint_t          nget = 1;
+    int             i, fd;
+
+    if (timeout >= 0){
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+        tsp = &ts;
+    }
+
+    if (port_getn(evp->fd, pevs, maxevents, &nget, tsp) < 0){
+        if (errno != ETIME)
+            return(-1);
+        /* タイムアウトでも、nget 個のイベントは取得できている */
+    }
+
+    for (i = 0 ; i < nget ; i++){
+        fd = (int)pevs[i].portev_object;
+        evs[i].data = pevs[i].portev_user;
+        evs[i].events = 0;
+        if (pevs[i].portev_events & POLLIN)
+            evs[i].events |= EV_READ;
+        if (pevs[i].portev_events & POLLOUT)
+            evs[i].events |= EV_WRITE;
+        if (pevs[i].portev_events & (POLLERR | POLLHUP | POLLNVAL))
+            evs[i].events |= EV_READ | EV_ERROR;
+        if (fd < evp->fdtabsize && evp->fdtab[fd].events != 0)
+            ev_port_associate(evp, fd);
+    }
+    return(nget);
+}
+#endif /* HAVE_EVENT_PORT */
+
+/*****************************************************************************
+ * select バックエンド
+ *
+ * 他のバックエンドが使えない環境のためのもの。FD_SETSIZE 以上の fd は
+ * 登録できない。
+ *****************************************************************************/
+static int
+ev_select_init(ev_stat_t *evp)
+{
+    return(0);
+}
+
+static int
+ev_select_add(ev_stat_t *evp, int fd, int events, void *data)
+{
+    if (fd >= FD_SETSIZE){
+        print_err(LOG_ERR, "fd%d: exceeds FD_SETSIZE(%d)\n", fd, FD_SETSIZE);
+        return(-1);
+    }
+    if (ev_fdtab_grow(evp, fd) < 0)
+        return(-1);
+    evp->fdtab[fd].events = events;
+    evp->fdtab[fd].data = data;
+    if (fd > evp->maxfd)
+        evp->maxfd = fd;
+    return(0);
+}
+
+static int
+ev_select_del(ev_stat_t *evp, int fd)
+{
+    if (fd >= evp->fdtabsize || evp->fdtab[fd].events == 0)
+        return(-1);
+    evp->fdtab[fd].events = 0;
+    evp->fdtab[fd].data = NULL;
+    while (evp->maxfd >= 0 && evp->fdtab[evp->maxfd].events == 0)
+        evp->maxfd--;
+    return(0);
+}
+
+static int
+ev_select_wait(ev_stat_t *evp, ev_event_t *evs, int maxevents, int timeout)
+{
+    fd_set          rset, wset;
+    struct timeval  tv, *tvp = NULL;
+    int             fd, nev = 0;
+
+    FD_ZERO(&rset);
+    FD_ZERO(&wset);
+    for (fd = 0 ; fd <= evp->maxfd ; fd++){
+        if (evp->fdtab[fd].events & EV_READ)
+            FD_SET(fd, &rset);
+        if (evp->fdtab[fd].events & EV_WRITE)
+            FD_SET(fd, &wset);
+    }
+
+    if (timeout >= 0){
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        tvp = &tv;
+    }
+
+    if (select(evp->maxfd + 1, &rset, &wset, NULL, tvp) < 0){
+        SET_ERRNO();
+        return(-1);
+    }
+
+    for (fd = 0 ; fd <= evp->maxfd && nev < maxevents ; fd++){
+        int events = 0;
+
+        if (FD_ISSET(fd, &rset))
+            events |= EV_READ;
+        if (FD_ISSET(fd, &wset))
+            events |= EV_WRITE;
+        if (events == 0)
+            continue;
+        evs[nev].data = evp->fdtab[fd].data;
+        evs[nev].events = events;
+        nev++;
+    }
+    return(nev);
+}
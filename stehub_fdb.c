@@ -0,0 +1,495 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright (c) 1986, 2010, Oracle and/or its affiliates. All rights reserved.
+ */
+
+/*
+ * Copright (c) 2004-2010  Kazuyoshi Aizawa <admin2@whiteboard.ne.jp>
+ * All rights reserved.
+ */
+/****************************************************************************
+ * stehub_fdb.c
+ *
+ * 仮想ハブ（stehub）の MAC アドレステーブル（FDB）。
+ * 送信元 MAC アドレスとそれを受信したポートを学習し、宛先 MAC アドレス
+ * からフレームを送るべきポートを引く。
+ *
+ * テーブルは 48bit の MAC アドレスをキーとしたオープンアドレス法の
+ * ハッシュ表（線形探索）で、エントリは配列に直接並べる。削除時は
+ * 後続のエントリを詰める（backward shift）ので、墓標は残らない。
+ *
+ * エージングはタイマーホイールで行う。エントリはタイムアウトする時刻の
+ * スロットに登録され、その時刻になった時にまだ新しいエントリは次の
+ * タイムアウト時刻のスロットに登録し直す。フレーム受信毎の更新は
+ * last_seen を書き換えるだけで済む。
+ *
+ * stehub の複数のワーカースレッドから共有されるので、テーブルは
+ * readers-writer ロックで保護する。参照はワーカーがフレームを受信する
+ * 度に行われるが、更新は新しい MAC アドレスを学習した時、ポートが
+ * 変わった時、last_seen が 1 秒進んだ時だけなので、ほとんどの場合は
+ * 読み込みロックだけで済む。
+ *
+ *****************************************************************************/
+
+#ifndef STE_WINDOWS
+#include <syslog.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "sted.h"
+#include "stehub.h"
+
+#define FDB_INIT_SIZE    1024  /* ハッシュ表の初期スロット数（2 のべき乗）*/
+#define FDB_KEY_VALID    ((uint64_t)1 << 48) /* 空きスロット(0)と区別するためのビット */
+#define FDB_HASH_MULT    0x9E3779B97F4A7C15ULL
+
+/*
+ * ハッシュ表のエントリ
+ */
+typedef struct fdb_ent
+{
+    uint64_t      key;       /* MAC アドレス | FDB_KEY_VALID。0 なら空き */
+    void         *port;      /* 学習したポート */
+    int           shard;     /* ポートを持っているワーカーの番号 */
+    uint32_t      bundle;    /* ポートが同じ sted からの接続の 1 つなら、その ID */
+    uint32_t      last_seen; /* 最後にこの MAC アドレスを見た時刻（秒）*/
+    uint32_t      slot;      /* 登録されているタイマーホイールのスロット */
+} fdb_ent_t;
+
+/*
+ * タイマーホイールのスロット。タイムアウトを確認するキーの配列。
+ */
+typedef struct fdb_wslot
+{
+    uint64_t     *keys;
+    int           nkeys;
+    int           size;
+} fdb_wslot_t;
+
+struct fdb
+{
+    fdb_ent_t    *tab;       /* ハッシュ表 */
+    uint32_t      mask;      /* スロット数 - 1 */
+    int           shift;     /* ハッシュ値からスロット番号を得るシフト数 */
+    int           count;     /* 登録されているエントリ数 */
+    int           aging;     /* エージング時間（秒）*/
+    fdb_wslot_t  *wheel;     /* タイマーホイール */
+    uint32_t      wmask;     /* タイマーホイールのスロット数 - 1 */
+    uint32_t      now;       /* 最後にエージングを行った時刻 */
+    pthread_rwlock_t lock;   /* テーブルを保護するロック */
+};
+
+static fdb_ent_t *fdb_find(fdb_t *, uint64_t);
+static int        fdb_insert(fdb_t *, uint64_t, void *, int, uint32_t);
+static int        fdb_grow(fdb_t *);
+static void       fdb_remove(fdb_t *, fdb_ent_t *);
+static void       fdb_schedule(fdb_t *, fdb_ent_t *);
+
+/*****************************************************************************
+ * fdb_create()
+ *
+ * MAC アドレステーブルを作成する。
+ *
+ *  引数：
+ *          aging : エージング時間（秒）
+ *          now   : 現在時刻（秒）
+ *  戻り値：
+ *          正常時 : fdb 構造体のポインタ
+ *          障害時 : NULL
+ *****************************************************************************/
+fdb_t *
+fdb_create(int aging, uint32_t now)
+{
+    fdb_t    *fdb;
+    uint32_t  wsize;
+
+    if ((fdb = (fdb_t *)malloc(sizeof(fdb_t))) == NULL)
+        return(NULL);
+    memset(fdb, 0x0, sizeof(fdb_t));
+
+    /* ホイールはエージング時間より長くなるよう 2 のべき乗に切り上げる */
+    for (wsize = 1 ; wsize <= aging ; wsize <<= 1)
+        ;
+    fdb->tab = (fdb_ent_t *)calloc(FDB_INIT_SIZE, sizeof(fdb_ent_t));
+    fdb->wheel = (fdb_wslot_t *)calloc(wsize, sizeof(fdb_wslot_t));
+    if (fdb->tab == NULL || fdb->wheel == NULL){
+        free(fdb->tab);
+        free(fdb->wheel);
+        free(fdb);
+        return(NULL);
+    }
+    pthread_rwlock_init(&fdb->lock, NULL);
+    fdb->mask = FDB_INIT_SIZE - 1;
+    for (fdb->shift = 64 ; (1U << (64 - fdb->shift)) < FDB_INIT_SIZE ; fdb->shift--)
+        ;
+    fdb->wmask = wsize - 1;
+    fdb->aging = aging;
+    fdb->now = now;
+    return(fdb);
+}
+
+/*****************************************************************************
+ * fdb_mac2key()
+ *
+ * 6 byte の MAC アドレスをハッシュ表のキーに変換する。
+ *****************************************************************************/
+static uint64_t
+fdb_mac2key(unsigned char *mac)
+{
+    return(FDB_KEY_VALID |
+           ((uint64_t)mac[0] << 40) | ((uint64_t)mac[1] << 32) |
+           ((uint64_t)mac[2] << 24) | ((uint64_t)mac[3] << 16) |
+           ((uint64_t)mac[4] << 8)  |  (uint64_t)mac[5]);
+}
+
+/*****************************************************************************
+ * fdb_find()
+ *
+ * キーに一致するエントリを探す。
+ *
+ *  戻り値：
+ *          見つかった   : エントリのポインタ
+ *          見つからない : NULL
+ *****************************************************************************/
+static fdb_ent_t *
+fdb_find(fdb_t *fdb, uint64_t key)
+{
+    uint32_t   i;
+    fdb_ent_t *ent;
+
+    for (i = (uint32_t)((key * FDB_HASH_MULT) >> fdb->shift) ; ; i = (i + 1) & fdb->mask){
+        ent = &fdb->tab[i];
+        if (ent->key == key)
+            return(ent);
+        if (ent->key == 0)
+            return(NULL);
+    }
+}
+
+/*****************************************************************************
+ * fdb_lookup()
+ *
+ * 宛先 MAC アドレスからポートを引く。
+ * ポートは別のワーカーのものである可能性があるので、呼び出し側は
+ * *shardp が自分の番号と一致する場合にだけ、ポートを参照してよい。
+ * 同じ sted からの接続で学習したものは、*bundlep にその ID を返す。
+ * ポートはそのうちの 1 つなので、呼び出し側は ID から接続を選び直す。
+ *
+ *  引数：
+ *          fdb     : MAC アドレステーブル
+ *          mac     : 宛先 MAC アドレス
+ *          shardp  : ポートを持っているワーカーの番号を返す。未学習なら -1
+ *          bundlep : 同じ sted からの接続の ID を返す。まとめられていなければ 0
+ *  戻り値：
+ *          学習済み : ポート
+ *          未学習   : NULL
+ *****************************************************************************/
+void *
+fdb_lookup(fdb_t *fdb, unsigned char *mac, int *shardp, uint32_t *bundlep)
+{
+    fdb_ent_t *ent;
+    void      *port = NULL;
+
+    *shardp = -1;
+    *bundlep = 0;
+    pthread_rwlock_rdlock(&fdb->lock);
+    if ((ent = fdb_find(fdb, fdb_mac2key(mac))) != NULL){
+        port = ent->port;
+        *shardp = ent->shard;
+        *bundlep = ent->bundle;
+    }
+    pthread_rwlock_unlock(&fdb->lock);
+    return(port);
+}
+
+/*****************************************************************************
+ * fdb_learn()
+ *
+ * 送信元 MAC アドレスとそれを受信したポートを学習する。
+ *
+ *  引数：
+ *          fdb   : MAC アドレステーブル
+ *          mac   : 送信元 MAC アドレス
+ *          port  : 受信したポート
+ *          shard : 受信したポートを持っているワーカーの番号
+ *          bundle: 受信したポートが同じ sted からの接続の 1 つなら、その ID。
+ *                  それ以外は 0
+ *  戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+int
+fdb_learn(fdb_t *fdb, unsigned char *mac, void *port, int shard, uint32_t bundle)
+{
+    uint64_t   key = fdb_mac2key(mac);
+    int        ret;
+    fdb_ent_t *ent;
+
+    /*
+     * 学習済みで何も変わらなければ、書き込みロックは取らない。
+     * 同じ sted の接続なら、どの接続から受信しても変わらない。
+     */
+    pthread_rwlock_rdlock(&fdb->lock);
+    ent = fdb_find(fdb, key);
+    ret = (ent != NULL && (ent->port == port || (bundle != 0 && ent->bundle == bundle)) &&
+           ent->last_seen == fdb->now);
+    pthread_rwlock_unlock(&fdb->lock);
+    if (ret)
+        return(0);
+
+    pthread_rwlock_wrlock(&fdb->lock);
+    ret = fdb_insert(fdb, key, port, shard, bundle);
+    pthread_rwlock_unlock(&fdb->lock);
+    return(ret);
+}
+
+/*****************************************************************************
+ * fdb_insert()
+ *
+ * エントリを登録、または更新する。書き込みロックを取ってから呼ぶ。
+ *****************************************************************************/
+static int
+fdb_insert(fdb_t *fdb, uint64_t key, void *port, int shard, uint32_t bundle)
+{
+    uint32_t   i;
+    fdb_ent_t *ent;
+
+    for (i = (uint32_t)((key * FDB_HASH_MULT) >> fdb->shift) ; ; i = (i + 1) & fdb->mask){
+        ent = &fdb->tab[i];
+        if (ent->key == key){
+            /*
+             * 学習済み。ポートが変わっていれば付け替える。同じ sted の
+             * 別の接続なら付け替えない
+             */
+            if (bundle == 0 || ent->bundle != bundle){
+                ent->port = port;
+                ent->shard = shard;
+                ent->bundle = bundle;
+            }
+            ent->last_seen = fdb->now;
+            return(0);
+        }
+        if (ent->key == 0)
+            break;
+    }
+
+    /* 負荷率が 1/2 を超えないようにテーブルを拡張する */
+    if ((fdb->count + 1) * 2 > fdb->mask + 1){
+        if (fdb_grow(fdb) < 0)
+            return(-1);
+        for (i = (uint32_t)((key * FDB_HASH_MULT) >> fdb->shift) ;
+             fdb->tab[i].key != 0 ; i = (i + 1) & fdb->mask)
+            ;
+        ent = &fdb->tab[i];
+    }
+    ent->key = key;
+    ent->port = port;
+    ent->shard = shard;
+    ent->bundle = bundle;
+    ent->last_seen = fdb->now;
+    fdb->count++;
+    fdb_schedule(fdb, ent);
+    return(0);
+}
+
+/*****************************************************************************
+ * fdb_grow()
+ *
+ * ハッシュ表のスロット数を 2 倍にし、エントリを再配置する。
+ *****************************************************************************/
+static int
+fdb_grow(fdb_t *fdb)
+{
+    fdb_ent_t *oldtab = fdb->tab;
+    uint32_t   oldsize = fdb->mask + 1;
+    uint32_t   i, j;
+
+    if ((fdb->tab = (fdb_ent_t *)calloc(oldsize * 2, sizeof(fdb_ent_t))) == NULL){
+        fdb->tab = oldtab;
+        print_err(LOG_ERR, "fdb_grow: calloc failed\n");
+        return(-1);
+    }
+    fdb->mask = oldsize * 2 - 1;
+    fdb->shift--;
+
+    for (i = 0 ; i < oldsize ; i++){
+        if (oldtab[i].key == 0)
+            continue;
+        for (j = (uint32_t)((oldtab[i].key * FDB_HASH_MULT) >> fdb->shift) ;
+             fdb->tab[j].key != 0 ; j = (j + 1) & fdb->mask)
+            ;
+        fdb->tab[j] = oldtab[i];
+    }
+    free(oldtab);
+    return(0);
+}
+
+/*****************************************************************************
+ * fdb_remove()
+ *
+ * エントリを削除し、同じクラスタ内の後続のエントリを本来の位置に
+ * 近づくよう詰める。
+ *****************************************************************************/
+static void
+fdb_remove(fdb_t *fdb, fdb_ent_t *ent)
+{
+    uint32_t i = ent - fdb->tab;
+    uint32_t j, home;
+
+    for (j = (i + 1) & fdb->mask ; fdb->tab[j].key != 0 ; j = (j + 1) & fdb->mask){
+        home = (uint32_t)((fdb->tab[j].key * FDB_HASH_MULT) >> fdb->shift);
+        /* home が (i, j] の範囲にあるエントリは動かせない */
+        if (((j - home) & fdb->mask) < ((j - i) & fdb->mask))
+            continue;
+        fdb->tab[i] = fdb->tab[j];
+        i = j;
+    }
+    memset(&fdb->tab[i], 0x0, sizeof(fdb_ent_t));
+    fdb->count--;
+}
+
+/*****************************************************************************
+ * fdb_schedule()
+ *
+ * エントリをタイムアウトする時刻のタイマーホイールのスロットに登録する。
+ *****************************************************************************/
+static void
+fdb_schedule(fdb_t *fdb, fdb_ent_t *ent)
+{
+    fdb_wslot_t *ws;
+    uint64_t    *newkeys;
+    int          newsize;
+
+    ent->slot = (ent->last_seen + fdb->aging) & fdb->wmask;
+    ws = &fdb->wheel[ent->slot];
+    if (ws->nkeys == ws->size){
+        newsize = ws->size ? ws->size * 2 : 16;
+        if ((newkeys = (uint64_t *)realloc(ws->keys, newsize * sizeof(uint64_t))) == NULL){
+            /* 登録できなければ、このエントリはエージングされない */
+            print_err(LOG_ERR, "fdb_schedule: realloc failed\n");
+            return;
+        }
+        ws->keys = newkeys;
+        ws->size = newsize;
+    }
+    ws->keys[ws->nkeys++] = ent->key;
+}
+
+/*****************************************************************************
+ * fdb_age()
+ *
+ * 前回呼ばれてから now までのタイマーホイールのスロットを処理し、
+ * エージング時間を過ぎたエントリを削除する。
+ *
+ *  引数：
+ *          fdb : MAC アドレステーブル
+ *          now : 現在時刻（秒）
+ *  戻り値：
+ *          削除したエントリの数
+ *****************************************************************************/
+int
+fdb_age(fdb_t *fdb, uint32_t now)
+{
+    fdb_wslot_t  ws;
+    fdb_ent_t   *ent;
+    uint32_t     t, slot;
+    int          i, nremoved = 0;
+
+    pthread_rwlock_wrlock(&fdb->lock);
+    /* 長時間止まっていた場合でも、ホイールを一周すれば十分 */
+    if (now - fdb->now > fdb->wmask + 1)
+        fdb->now = now - (fdb->wmask + 1);
+
+    for (t = fdb->now + 1 ; (int32_t)(now - t) >= 0 ; t++){
+        fdb->now = t;
+        slot = t & fdb->wmask;
+        /* 処理中に同じスロットに登録し直すことがあるので、切り離してから処理する */
+        ws = fdb->wheel[slot];
+        memset(&fdb->wheel[slot], 0x0, sizeof(fdb_wslot_t));
+
+        for (i = 0 ; i < ws.nkeys ; i++){
+            if ((ent = fdb_find(fdb, ws.keys[i])) == NULL || ent->slot != slot)
+                continue;  /* 削除済み、または別のスロットに登録し直されている */
+            if ((int32_t)(t - ent->last_seen) >= fdb->aging){
+                fdb_remove(fdb, ent);
+                nremoved++;
+            } else {
+                fdb_schedule(fdb, ent);
+            }
+        }
+        free(ws.keys);
+    }
+    fdb->now = now;
+    pthread_rwlock_unlock(&fdb->lock);
+    return(nremoved);
+}
+
+/*****************************************************************************
+ * fdb_flush_port()
+ *
+ * 指定されたポートで学習したエントリをすべて削除する。
+ * ポートが切断された時に呼ばれる。
+ *
+ *  引数：
+ *          fdb  : MAC アドレステーブル
+ *          port : 切断されたポート
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+fdb_flush_port(fdb_t *fdb, void *port)
+{
+    uint32_t i;
+
+    pthread_rwlock_wrlock(&fdb->lock);
+    for (i = 0 ; i <= fdb->mask ; ){
+        /*
+         * 削除すると後続のエントリが i に詰められるので、
+         * 削除した場合は i を進めずにもう一度確認する。
+         */
+        if (fdb->tab[i].key != 0 && fdb->tab[i].port == port)
+            fdb_remove(fdb, &fdb->tab[i]);
+        else
+            i++;
+    }
+    pthread_rwlock_unlock(&fdb->lock);
+}
+
+/*****************************************************************************
+ * fdb_count()
+ *
+ * 登録されているエントリの数を返す。
+ *****************************************************************************/
+int
+fdb_count(fdb_t *fdb)
+{
+    int count;
+
+    pthread_rwlock_rdlock(&fdb->lock);
+    count = fdb->count;
+    pthread_rwlock_unlock(&fdb->lock);
+    return(count);
+}
@@ -0,0 +1,162 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright (c) 1986, 2010, Oracle and/or its affiliates. All rights reserved.
+ */
+
+/*
+ * Copright (c) 2004-2010  Kazuyoshi Aizawa <admin2@whiteboard.ne.jp>
+ * All rights reserved.
+ */
+/****************************************************************************
+ * stehub_hist.c
+ *
+ * 仮想ハブ（stehub）の遅延のヒストグラム。
+ * フレームを受信してから送信するまでの時間（ナノ秒）を、HDR Histogram と
+ * 同じ対数のバケットで数える。2 のべき乗毎の区間をそれぞれ HIST_SUB 個の
+ * バケットに分けるので、どの値も相対誤差 1/HIST_SUB 以内で記録でき、
+ * 1 ナノ秒から 2^HIST_MAX_BITS ナノ秒（約 18 分）までを固定の大きさの
+ * 配列で扱える。記録はバケットの番号を求めて 1 を足すだけなので、常に
+ * 有効にしておける。
+ *
+ * ヒストグラムは 1 つのスレッドだけが書き換える。他のスレッドが読む場合
+ * は、書き換えるスレッドにコピーさせる。
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <inttypes.h>
+#include "sted.h"
+#include "stehub.h"
+
+static int hist_index(uint64_t);
+static uint64_t hist_upper(int);
+
+/*****************************************************************************
+ * hist_index()
+ *
+ * 値を記録するバケットの番号を返す。
+ *****************************************************************************/
+static int
+hist_index(uint64_t v)
+{
+    int msb;
+
+    if (v < HIST_SUB)
+        return((int)v);
+#ifdef __GNUC__
+    msb = 63 - __builtin_clzll(v);
+#else
+    for (msb = HIST_SUB_BITS ; msb < 63 && (v >> (msb + 1)) != 0 ; msb++)
+        ;
+#endif
+    if (msb >= HIST_MAX_BITS)
+        return(HIST_BUCKETS - 1);
+    return((msb - HIST_SUB_BITS + 1) * HIST_SUB + (int)((v >> (msb - HIST_SUB_BITS)) - HIST_SUB));
+}
+
+/*****************************************************************************
+ * hist_upper()
+ *
+ * バケットに入る最大の値を返す。
+ *****************************************************************************/
+static uint64_t
+hist_upper(int idx)
+{
+    int o = idx / HIST_SUB, sub = idx % HIST_SUB;
+
+    if (o == 0)
+        return((uint64_t)idx);
+    return((((uint64_t)(HIST_SUB + sub + 1)) << (o - 1)) - 1);
+}
+
+/*****************************************************************************
+ * hist_record()
+ *
+ * 値を 1 つ記録する。
+ *
+ *  引数：
+ *          h : ヒストグラム
+ *          v : 値（ナノ秒）
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+hist_record(hist_t *h, uint64_t v)
+{
+    h->count[hist_index(v)]++;
+    h->total++;
+    if (v > h->max)
+        h->max = v;
+}
+
+/*****************************************************************************
+ * hist_merge()
+ *
+ * ヒストグラム src の記録を dst に足す。
+ *****************************************************************************/
+void
+hist_merge(hist_t *dst, hist_t *src)
+{
+    int i;
+
+    for (i = 0 ; i < HIST_BUCKETS ; i++)
+        dst->count[i] += src->count[i];
+    dst->total += src->total;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+/*****************************************************************************
+ * hist_value()
+ *
+ * 記録した値のパーセンタイルを返す。値はバケットの上限なので、実際の
+ * 値より最大 1/HIST_SUB 大きい（最大値を超えることは無い）。
+ *
+ *  引数：
+ *          h : ヒストグラム
+ *          q : 求める割合（0.5、0.99、0.999 など）
+ *  戻り値：
+ *          パーセンタイルの値（ナノ秒）。記録が無ければ 0
+ *****************************************************************************/
+uint64_t
+hist_value(hist_t *h, double q)
+{
+    uint64_t target, sum = 0, v;
+    int      i;
+
+    if (h->total == 0)
+        return(0);
+    target = (uint64_t)(q * h->total + 0.999999);
+    if (target < 1)
+        target = 1;
+    for (i = 0 ; i < HIST_BUCKETS ; i++){
+        sum += h->count[i];
+        if (sum >= target){
+            v = hist_upper(i);
+            return(v < h->max ? v : h->max);
+        }
+    }
+    return(h->max);
+}
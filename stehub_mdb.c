@@ -0,0 +1,694 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright (c) 1986, 2010, Oracle and/or its affiliates. All rights reserved.
+ */
+
+/*
+ * Copright (c) 2004-2010  Kazuyoshi Aizawa <admin2@whiteboard.ne.jp>
+ * All rights reserved.
+ */
+/****************************************************************************
+ * stehub_mdb.c
+ *
+ * 仮想ハブ（stehub）のマルチキャストグループの表（IGMP/MLD snooping）。
+ * ポートから受信した IGMP（v1/v2/v3）、MLD（v1/v2）の Report と Leave
+ * (Done) を見て、グループ毎にメンバーのポートを覚える。また、Query を
+ * 送ってきたポートをマルチキャストルータのポートとして覚える。
+ * メンバーのいるグループ宛のフレームは、メンバーとルータのポートにだけ
+ * 送信すればよい。Report と Leave はルータのポートにだけ送信する。
+ * IGMPv1/v2、MLDv1 の Report はグループ宛なので、メンバーに届くと
+ * そのホストが Report を止めてしまい（report suppression）、まだ参加
+ * しているホストのポートが削除されてしまう。
+ *
+ * グループは宛先 MAC アドレスで区別する。複数の IP マルチキャスト
+ * アドレスが同じ MAC アドレスになる場合は 1 つのグループとして扱う
+ * ので、余分なポートに送信することはあっても、メンバーに届かないことは
+ * 無い。224.0.0.0/24 のグループは Report が送られないので、常に全ポートに
+ * 送信する。メンバーとルータは、Report や Query を aging 秒見なければ
+ * 削除する。メンバーのいなくなったグループ宛のフレームは、また全ポートに
+ * 送信される。
+ * 1 つのポートの先には、トランクや sted の先の複数のホストがいることが
+ * あるので、Leave を受けてもポートをすぐには削除しない（fast leave を
+ * しない）。ルータがいればグループ毎の Query を送るので、MDB_LEAVE_WAIT
+ * 秒以内に Report が来なければ削除する。ルータがいなければ、他のホストも
+ * Report を送り直さないので、通常のエージングに任せる。トランクから
+ * 受けた Leave は、向こうのハブのメンバーがまだいるかもしれないので無視する。
+ *
+ * 表は stehub の複数のワーカースレッドから共有されるので、
+ * readers-writer ロックで保護する。
+ *
+ *****************************************************************************/
+
+#ifndef STE_WINDOWS
+#include <syslog.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "sted.h"
+#include "stehub.h"
+
+#define MDB_BUCKETS      256    /* ハッシュ表のバケット数（2 のべき乗）*/
+#define MDB_LEAVE_WAIT   3      /* Leave を受けてから Query への Report を待つ時間（秒）*/
+
+/*
+ * グループのメンバー、またはルータのポート
+ */
+typedef struct mdb_port
+{
+    void         *port;
+    int           shard;     /* ポートを持っているワーカーの番号 */
+    uint32_t      expire;    /* 削除する時刻 */
+} mdb_port_t;
+
+/*
+ * ポートの集合
+ */
+typedef struct mdb_set
+{
+    mdb_port_t   *ports;
+    int           nports;
+    int           size;
+} mdb_set_t;
+
+/*
+ * グループ
+ */
+typedef struct mdb_group
+{
+    unsigned char mac[ETHERADDRL]; /* グループの MAC アドレス */
+    mdb_set_t     members;
+    struct mdb_group *next;        /* 同じバケットのグループ */
+} mdb_group_t;
+
+struct mdb
+{
+    mdb_group_t  *bucket[MDB_BUCKETS];
+    mdb_set_t     routers;   /* マルチキャストルータのポート */
+    int           aging;     /* メンバーとルータのエージング時間（秒）*/
+    pthread_rwlock_t lock;   /* 表を保護するロック */
+};
+
+static int          mdb_hash(unsigned char *);
+static mdb_group_t *mdb_find(mdb_t *, unsigned char *);
+static void         mdb_join(mdb_t *, unsigned char *, void *, int, uint32_t);
+static void         mdb_leave(mdb_t *, unsigned char *, void *, int, uint32_t);
+static int          mdb_set_add(mdb_set_t *, void *, int, uint32_t);
+static void         mdb_set_del(mdb_set_t *, void *);
+static unsigned char *mdb_igmp(unsigned char *, int, int *);
+static unsigned char *mdb_mld(unsigned char *, int, int *);
+static void         mdb_snoop_igmp(mdb_t *, unsigned char *, int, void *, int, int, uint32_t);
+static void         mdb_snoop_mld(mdb_t *, unsigned char *, int, void *, int, int, uint32_t);
+static void         mdb_ip2mac(unsigned char *, unsigned char *);
+static void         mdb_ip62mac(unsigned char *, unsigned char *);
+
+/*****************************************************************************
+ * mdb_create()
+ *
+ * マルチキャストグループの表を作成する。
+ *
+ *  引数：
+ *          aging : メンバーとルータのエージング時間（秒）
+ *  戻り値：
+ *          正常時 : mdb 構造体のポインタ
+ *          障害時 : NULL
+ *****************************************************************************/
+mdb_t *
+mdb_create(int aging)
+{
+    mdb_t *mdb;
+
+    if ((mdb = (mdb_t *)malloc(sizeof(mdb_t))) == NULL)
+        return(NULL);
+    memset(mdb, 0x0, sizeof(mdb_t));
+    pthread_rwlock_init(&mdb->lock, NULL);
+    mdb->aging = aging;
+    return(mdb);
+}
+
+/*****************************************************************************
+ * mdb_snoopable()
+ *
+ * 宛先 MAC アドレスが、メンバーにだけ送信する IP マルチキャストの
+ * グループのものかどうか。224.0.0.0/24 のグループは含めない。
+ *****************************************************************************/
+int
+mdb_snoopable(unsigned char *mac)
+{
+    if (mac[0] == 0x33 && mac[1] == 0x33)
+        return(1);
+    if (mac[0] == 0x01 && mac[1] == 0x00 && mac[2] == 0x5e && (mac[3] & 0x80) == 0)
+        return(mac[3] != 0 || mac[4] != 0);
+    return(0);
+}
+
+/*****************************************************************************
+ * mdb_report()
+ *
+ * フレームが IGMP か MLD の Report か Leave（Done）かどうか。
+ * これらはルータのポートにだけ送信する。
+ *
+ *  引数：
+ *          etherp : Ethernet フレーム
+ *          len    : Ethernet フレームのサイズ
+ *  戻り値：
+ *          Report か Leave : 1
+ *          それ以外 : 0
+ *****************************************************************************/
+int
+mdb_report(unsigned char *etherp, int len)
+{
+    unsigned char *msg;
+    int            type;
+
+    if (len < ETHERHEADERL)
+        return(0);
+    type = (etherp[12] << 8) | etherp[13];
+    len -= ETHERHEADERL;
+    if (type == 0x0800 && (msg = mdb_igmp(etherp + ETHERHEADERL, len, &len)) != NULL)
+        return(msg[0] == 0x12 || msg[0] == 0x16 || msg[0] == 0x17 || msg[0] == 0x22);
+    if (type == 0x86dd && (msg = mdb_mld(etherp + ETHERHEADERL, len, &len)) != NULL)
+        return(msg[0] == 131 || msg[0] == 132 || msg[0] == 143);
+    return(0);
+}
+
+/*****************************************************************************
+ * mdb_hash()
+ *****************************************************************************/
+static int
+mdb_hash(unsigned char *mac)
+{
+    return((mac[2] * 31 + mac[3] * 7 + mac[4] * 3 + mac[5]) & (MDB_BUCKETS - 1));
+}
+
+/*****************************************************************************
+ * mdb_find()
+ *
+ * MAC アドレスのグループを探す。ロックを取ってから呼ぶ。
+ *****************************************************************************/
+static mdb_group_t *
+mdb_find(mdb_t *mdb, unsigned char *mac)
+{
+    mdb_group_t *grp;
+
+    for (grp = mdb->bucket[mdb_hash(mac)] ; grp != NULL ; grp = grp->next){
+        if (memcmp(grp->mac, mac, ETHERADDRL) == 0)
+            return(grp);
+    }
+    return(NULL);
+}
+
+/*****************************************************************************
+ * mdb_lookup()
+ *
+ * グループ宛のフレームを送信するポートを引く。呼び出したワーカーの
+ * ポートは *portsp に入れ、他のワーカーのポートは、そのワーカーの番号の
+ * ビットを *maskp に立てる。*portsp は必要なら広げる。
+ * Report と Leave は、メンバーには送信せず、ルータのポートにだけ送信する。
+ *
+ *  引数：
+ *          mdb    : マルチキャストグループの表
+ *          mac    : 宛先 MAC アドレス
+ *          report : フレームが Report か Leave なら 1
+ *          shard  : 呼び出したワーカーの番号
+ *          portsp : ポートを入れる配列
+ *          sizep  : *portsp の要素数
+ *          maskp  : ポートを持っている他のワーカーのビットマスクを返す
+ *  戻り値：
+ *          メンバーのいるグループ : *portsp に入れたポートの数
+ *          メンバーのいないグループ、ルータのいない Report
+ *          （全ポートに送信する）: -1
+ *****************************************************************************/
+int
+mdb_lookup(mdb_t *mdb, unsigned char *mac, int report, int shard, void ***portsp,
+           int *sizep, uint64_t *maskp)
+{
+    mdb_group_t *grp;
+    mdb_set_t   *set, *sets[2];
+    void       **ports;
+    int          i, j, k, nsets, n = 0, size;
+
+    *maskp = 0;
+    pthread_rwlock_rdlock(&mdb->lock);
+    if (report){
+        if (mdb->routers.nports == 0){
+            pthread_rwlock_unlock(&mdb->lock);
+            return(-1);
+        }
+        sets[0] = &mdb->routers;
+        nsets = 1;
+    } else {
+        if ((grp = mdb_find(mdb, mac)) == NULL || grp->members.nports == 0){
+            pthread_rwlock_unlock(&mdb->lock);
+            return(-1);
+        }
+        sets[0] = &grp->members;
+        sets[1] = &mdb->routers;
+        nsets = 2;
+    }
+
+    for (size = 0, k = 0 ; k < nsets ; k++)
+        size += sets[k]->nports;
+    if (size > *sizep){
+        if ((ports = (void **)realloc(*portsp, size * sizeof(void *))) == NULL){
+            pthread_rwlock_unlock(&mdb->lock);
+            return(-1);
+        }
+        *portsp = ports;
+        *sizep = size;
+    }
+    ports = *portsp;
+
+    for (k = 0 ; k < nsets ; k++){
+        set = sets[k];
+        for (i = 0 ; i < set->nports ; i++){
+            if (set->ports[i].shard != shard){
+                *maskp |= (uint64_t)1 << set->ports[i].shard;
+                continue;
+            }
+            /* メンバーでもあるルータには、二重に送信しない */
+            for (j = 0 ; j < n && ports[j] != set->ports[i].port ; j++)
+                ;
+            if (j == n)
+                ports[n++] = set->ports[i].port;
+        }
+    }
+    pthread_rwlock_unlock(&mdb->lock);
+    return(n);
+}
+
+/*****************************************************************************
+ * mdb_snoop()
+ *
+ * ポートから受信したマルチキャストのフレームが IGMP か MLD のメッセージ
+ * なら、グループのメンバーやルータを更新する。
+ *
+ *  引数：
+ *          mdb    : マルチキャストグループの表
+ *          etherp : Ethernet フレーム
+ *          len    : Ethernet フレームのサイズ
+ *          port   : 受信したポート
+ *          shard  : 受信したポートを持っているワーカーの番号
+ *          trunk  : 受信したポートがトランクなら 1
+ *          now    : 現在時刻（秒）
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+mdb_snoop(mdb_t *mdb, unsigned char *etherp, int len, void *port, int shard, int trunk,
+          uint32_t now)
+{
+    int type;
+
+    if (len < ETHERHEADERL)
+        return;
+    type = (etherp[12] << 8) | etherp[13];
+    if (type == 0x0800)
+        mdb_snoop_igmp(mdb, etherp + ETHERHEADERL, len - ETHERHEADERL, port, shard, trunk, now);
+    else if (type == 0x86dd)
+        mdb_snoop_mld(mdb, etherp + ETHERHEADERL, len - ETHERHEADERL, port, shard, trunk, now);
+}
+
+/*****************************************************************************
+ * mdb_igmp()
+ *
+ * IPv4 のパケットが IGMP なら、IGMP のメッセージの先頭を返す。
+ * *lenp にはメッセージのサイズを返す。IGMP でなければ NULL。
+ *****************************************************************************/
+static unsigned char *
+mdb_igmp(unsigned char *ip, int len, int *lenp)
+{
+    int hlen;
+
+    if (len < 20 || (ip[0] >> 4) != 4 || ip[9] != 2)
+        return(NULL);
+    hlen = (ip[0] & 0x0f) * 4;
+    if (hlen < 20 || len < hlen + 8)
+        return(NULL);
+    *lenp = len - hlen;
+    return(ip + hlen);
+}
+
+/*****************************************************************************
+ * mdb_mld()
+ *
+ * IPv6 のパケットが MLD なら、ICMPv6 のメッセージの先頭を返す。
+ * *lenp にはメッセージのサイズを返す。MLD でなければ NULL。
+ * MLD のメッセージには Hop-by-Hop オプションヘッダ（Router Alert）が
+ * 付いているので、拡張ヘッダをたどって ICMPv6 を探す。
+ *****************************************************************************/
+static unsigned char *
+mdb_mld(unsigned char *ip6, int len, int *lenp)
+{
+    unsigned char *p;
+    int            nh, hlen;
+
+    if (len < 40 || (ip6[0] >> 4) != 6)
+        return(NULL);
+    nh = ip6[6];
+    p = ip6 + 40;
+    len -= 40;
+    /* Hop-by-Hop、Routing、Destination オプションヘッダを飛ばす */
+    while (nh == 0 || nh == 43 || nh == 60){
+        if (len < 8)
+            return(NULL);
+        hlen = (p[1] + 1) * 8;
+        if (len < hlen)
+            return(NULL);
+        nh = p[0];
+        p += hlen;
+        len -= hlen;
+    }
+    if (nh != 58 || len < 24)
+        return(NULL);
+    *lenp = len;
+    return(p);
+}
+
+/*****************************************************************************
+ * mdb_snoop_igmp()
+ *
+ * IPv4 のパケットが IGMP なら処理する。
+ *****************************************************************************/
+static void
+mdb_snoop_igmp(mdb_t *mdb, unsigned char *ip, int len, void *port, int shard, int trunk,
+               uint32_t now)
+{
+    unsigned char *igmp, *rec, mac[ETHERADDRL];
+    int            nrec, nsrc, rtype;
+
+    if ((igmp = mdb_igmp(ip, len, &len)) == NULL)
+        return;
+
+    switch (igmp[0]){
+        case 0x11:  /* Membership Query */
+            pthread_rwlock_wrlock(&mdb->lock);
+            mdb_set_add(&mdb->routers, port, shard, now + mdb->aging);
+            pthread_rwlock_unlock(&mdb->lock);
+            break;
+        case 0x12:  /* IGMPv1 Membership Report */
+        case 0x16:  /* IGMPv2 Membership Report */
+            mdb_ip2mac(igmp + 4, mac);
+            mdb_join(mdb, mac, port, shard, now);
+            break;
+        case 0x17:  /* IGMPv2 Leave Group */
+            mdb_ip2mac(igmp + 4, mac);
+            mdb_leave(mdb, mac, port, trunk, now);
+            break;
+        case 0x22:  /* IGMPv3 Membership Report */
+            nrec = (igmp[6] << 8) | igmp[7];
+            rec = igmp + 8;
+            len -= 8;
+            for ( ; nrec > 0 && len >= 8 ; nrec--){
+                rtype = rec[0];
+                nsrc = (rec[2] << 8) | rec[3];
+                mdb_ip2mac(rec + 4, mac);
+                /* ソースを指定しない INCLUDE は Leave と同じ */
+                if ((rtype == 1 || rtype == 3) && nsrc == 0)
+                    mdb_leave(mdb, mac, port, trunk, now);
+                else if (rtype != 6)
+                    mdb_join(mdb, mac, port, shard, now);
+                len -= 8 + nsrc * 4 + rec[1] * 4;
+                rec += 8 + nsrc * 4 + rec[1] * 4;
+            }
+            break;
+    }
+}
+
+/*****************************************************************************
+ * mdb_snoop_mld()
+ *
+ * IPv6 のパケットが MLD なら処理する。
+ *****************************************************************************/
+static void
+mdb_snoop_mld(mdb_t *mdb, unsigned char *ip6, int len, void *port, int shard, int trunk,
+              uint32_t now)
+{
+    unsigned char *p, *rec, mac[ETHERADDRL];
+    int            nrec, nsrc, rtype;
+
+    if ((p = mdb_mld(ip6, len, &len)) == NULL)
+        return;
+
+    switch (p[0]){
+        case 130:  /* Multicast Listener Query */
+            pthread_rwlock_wrlock(&mdb->lock);
+            mdb_set_add(&mdb->routers, port, shard, now + mdb->aging);
+            pthread_rwlock_unlock(&mdb->lock);
+            break;
+        case 131:  /* MLDv1 Report */
+            mdb_ip62mac(p + 8, mac);
+            mdb_join(mdb, mac, port, shard, now);
+            break;
+        case 132:  /* MLDv1 Done */
+            mdb_ip62mac(p + 8, mac);
+            mdb_leave(mdb, mac, port, trunk, now);
+            break;
+        case 143:  /* MLDv2 Report */
+            nrec = (p[6] << 8) | p[7];
+            rec = p + 8;
+            len -= 8;
+            for ( ; nrec > 0 && len >= 20 ; nrec--){
+                rtype = rec[0];
+                nsrc = (rec[2] << 8) | rec[3];
+                mdb_ip62mac(rec + 4, mac);
+                if ((rtype == 1 || rtype == 3) && nsrc == 0)
+                    mdb_leave(mdb, mac, port, trunk, now);
+                else if (rtype != 6)
+                    mdb_join(mdb, mac, port, shard, now);
+                len -= 20 + nsrc * 16 + rec[1] * 4;
+                rec += 20 + nsrc * 16 + rec[1] * 4;
+            }
+            break;
+    }
+}
+
+/*****************************************************************************
+ * mdb_ip2mac()
+ *
+ * IPv4 マルチキャストアドレスを MAC アドレスに変換する。
+ *****************************************************************************/
+static void
+mdb_ip2mac(unsigned char *addr, unsigned char *mac)
+{
+    mac[0] = 0x01;
+    mac[1] = 0x00;
+    mac[2] = 0x5e;
+    mac[3] = addr[1] & 0x7f;
+    mac[4] = addr[2];
+    mac[5] = addr[3];
+}
+
+/*****************************************************************************
+ * mdb_ip62mac()
+ *
+ * IPv6 マルチキャストアドレスを MAC アドレスに変換する。
+ *****************************************************************************/
+static void
+mdb_ip62mac(unsigned char *addr, unsigned char *mac)
+{
+    mac[0] = 0x33;
+    mac[1] = 0x33;
+    memcpy(mac + 2, addr + 12, 4);
+}
+
+/*****************************************************************************
+ * mdb_join()
+ *
+ * ポートをグループのメンバーにする。メンバーなら削除する時刻を延ばす。
+ * Report の宛先になる 224.0.0.0/24 のグループなどは覚えない。
+ *****************************************************************************/
+static void
+mdb_join(mdb_t *mdb, unsigned char *mac, void *port, int shard, uint32_t now)
+{
+    mdb_group_t *grp;
+    int          h;
+
+    if (!mdb_snoopable(mac))
+        return;
+    pthread_rwlock_wrlock(&mdb->lock);
+    if ((grp = mdb_find(mdb, mac)) == NULL){
+        if ((grp = (mdb_group_t *)malloc(sizeof(mdb_group_t))) == NULL){
+            pthread_rwlock_unlock(&mdb->lock);
+            print_err(LOG_ERR, "mdb_join: malloc failed\n");
+            return;
+        }
+        memset(grp, 0x0, sizeof(mdb_group_t));
+        memcpy(grp->mac, mac, ETHERADDRL);
+        h = mdb_hash(mac);
+        grp->next = mdb->bucket[h];
+        mdb->bucket[h] = grp;
+    }
+    mdb_set_add(&grp->members, port, shard, now + mdb->aging);
+    pthread_rwlock_unlock(&mdb->lock);
+}
+
+/*****************************************************************************
+ * mdb_leave()
+ *
+ * ポートの先の他のホストがまだメンバーかもしれないので、すぐには外さない。
+ * ルータがいれば、ルータのグループ毎の Query に誰も答えなければ外れる
+ * ように、削除する時刻を MDB_LEAVE_WAIT 秒後に早める。ルータがいなければ
+ * 通常のエージングに任せる。トランクのポートでは何もしない。
+ *****************************************************************************/
+static void
+mdb_leave(mdb_t *mdb, unsigned char *mac, void *port, int trunk, uint32_t now)
+{
+    mdb_group_t *grp;
+    mdb_port_t  *mp;
+    int          i;
+
+    if (trunk)
+        return;
+    pthread_rwlock_wrlock(&mdb->lock);
+    if (mdb->routers.nports > 0 && (grp = mdb_find(mdb, mac)) != NULL){
+        for (i = 0 ; i < grp->members.nports ; i++){
+            mp = &grp->members.ports[i];
+            if (mp->port == port &&
+                (int32_t)(mp->expire - (now + MDB_LEAVE_WAIT)) > 0)
+                mp->expire = now + MDB_LEAVE_WAIT;
+        }
+    }
+    pthread_rwlock_unlock(&mdb->lock);
+}
+
+/*****************************************************************************
+ * mdb_set_add()
+ *
+ * ポートを集合に加える。既にあれば削除する時刻だけを更新する。
+ *****************************************************************************/
+static int
+mdb_set_add(mdb_set_t *set, void *port, int shard, uint32_t expire)
+{
+    mdb_port_t *ports;
+    int         i, size;
+
+    for (i = 0 ; i < set->nports ; i++){
+        if (set->ports[i].port == port){
+            set->ports[i].expire = expire;
+            return(0);
+        }
+    }
+    if (set->nports == set->size){
+        size = set->size ? set->size * 2 : 4;
+        if ((ports = (mdb_port_t *)realloc(set->ports, size * sizeof(mdb_port_t))) == NULL){
+            print_err(LOG_ERR, "mdb_set_add: realloc failed\n");
+            return(-1);
+        }
+        set->ports = ports;
+        set->size = size;
+    }
+    set->ports[set->nports].port = port;
+    set->ports[set->nports].shard = shard;
+    set->ports[set->nports].expire = expire;
+    set->nports++;
+    return(0);
+}
+
+/*****************************************************************************
+ * mdb_set_del()
+ *
+ * ポートを集合から外す。空いた位置には末尾のポートを移す。
+ *****************************************************************************/
+static void
+mdb_set_del(mdb_set_t *set, void *port)
+{
+    int i;
+
+    for (i = 0 ; i < set->nports ; i++){
+        if (set->ports[i].port == port){
+            set->ports[i] = set->ports[--set->nports];
+            return;
+        }
+    }
+}
+
+/*****************************************************************************
+ * mdb_age()
+ *
+ * 削除する時刻を過ぎたメンバーとルータを削除する。メンバーのいなくなった
+ * グループは解放する。
+ *
+ *  引数：
+ *          mdb : マルチキャストグループの表
+ *          now : 現在時刻（秒）
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+mdb_age(mdb_t *mdb, uint32_t now)
+{
+    mdb_group_t **gpp, *grp;
+    mdb_set_t    *set;
+    int           h, i;
+
+    pthread_rwlock_wrlock(&mdb->lock);
+    for (i = 0 ; i < mdb->routers.nports ; ){
+        if ((int32_t)(now - mdb->routers.ports[i].expire) >= 0)
+            mdb->routers.ports[i] = mdb->routers.ports[--mdb->routers.nports];
+        else
+            i++;
+    }
+    for (h = 0 ; h < MDB_BUCKETS ; h++){
+        for (gpp = &mdb->bucket[h] ; (grp = *gpp) != NULL ; ){
+            set = &grp->members;
+            for (i = 0 ; i < set->nports ; ){
+                if ((int32_t)(now - set->ports[i].expire) >= 0)
+                    set->ports[i] = set->ports[--set->nports];
+                else
+                    i++;
+            }
+            if (set->nports == 0){
+                *gpp = grp->next;
+                free(set->ports);
+                free(grp);
+            } else {
+                gpp = &grp->next;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&mdb->lock);
+}
+
+/*****************************************************************************
+ * mdb_flush_port()
+ *
+ * 指定されたポートを、すべてのグループのメンバーとルータから外す。
+ * ポートが切断された時に呼ばれる。
+ *****************************************************************************/
+void
+mdb_flush_port(mdb_t *mdb, void *port)
+{
+    mdb_group_t *grp;
+    int          h;
+
+    pthread_rwlock_wrlock(&mdb->lock);
+    mdb_set_del(&mdb->routers, port);
+    for (h = 0 ; h < MDB_BUCKETS ; h++){
+        for (grp = mdb->bucket[h] ; grp != NULL ; grp = grp->next)
+            mdb_set_del(&grp->members, port);
+    }
+    pthread_rwlock_unlock(&mdb->lock);
+}
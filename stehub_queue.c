@@ -0,0 +1,490 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright (c) 1986, 2010, Oracle and/or its affiliates. All rights reserved.
+ */
+
+/*
+ * Copright (c) 2004-2010  Kazuyoshi Aizawa <admin2@whiteboard.ne.jp>
+ * All rights reserved.
+ */
+/****************************************************************************
+ * stehub_queue.c
+ *
+ * 仮想ハブ（stehub）の受信バッファとポート毎の送信キュー。
+ *
+ * 受信バッファは参照カウントを持ち、recv() したデータを送信キューや
+ * ワーカー間のリングがコピーせずに共有する。ブロードキャストを多数の
+ * ポートに送る場合でも、各ポートの送信キューは同じバッファを参照する
+ * だけで、最後の参照が外れた時にプールに戻る。
+ *
+ * 送信キューは、すぐに送信できなかったフレームを、フレーム数と
+ * バイト数の上限の範囲で保持する。上限を超える場合は、ポリシーに従って新しいフレーム
+ * （drop-tail）か、古いフレーム（drop-head）をフレーム単位で破棄する。
+ * 送信途中のフレームはキューとは別に保持し、決して破棄しない。io_uring で
+ * 送信を依頼済みのフレーム（busy）も、送信が終わるまで破棄しない。
+ * キューのフレームは受信バッファ全体を解放させないので、上限の判断には
+ * フレームのサイズだけでなく、キューが参照している受信バッファの大きさ
+ * も使う。参照している受信バッファが上限の半分を超えたら、新しいバッファ
+ * のフレームはコピーして、キュー専用のバッファ（pack）に詰める。
+ * 送信時は、キューのフレームを iovec の配列にまとめて 1 回の writev() で
+ * 送る。同じ受信バッファ中で連続しているフレームは 1 つの iovec にする。
+ *
+ * また、ワーカースレッド間でフレームを渡すためのロックを使わない
+ * リング（spsc）もここにある。
+ *
+ *****************************************************************************/
+
+#ifndef STE_WINDOWS
+#include <syslog.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <inttypes.h>
+#include "sted.h"
+#include "stehub.h"
+
+/*****************************************************************************
+ * fbuf_get()
+ *
+ * プールから受信バッファを取り出す。プールが空なら新しく確保する。
+ *
+ *  引数：
+ *          pool : プール
+ *  戻り値：
+ *          正常時 : 参照カウントが 1 の受信バッファ
+ *          障害時 : NULL
+ *****************************************************************************/
+fbuf_t *
+fbuf_get(fpool_t *pool)
+{
+    fbuf_t *buf;
+
+    if ((buf = pool->free) != NULL){
+        pool->free = buf->next;
+        pool->nfree--;
+    } else if ((buf = (fbuf_t *)malloc(sizeof(fbuf_t))) == NULL){
+        return(NULL);
+    }
+    buf->refcnt = 1;
+    buf->next = NULL;
+    return(buf);
+}
+
+/*****************************************************************************
+ * fbuf_hold()
+ *
+ * 受信バッファの参照を 1 つ増やす。
+ *****************************************************************************/
+void
+fbuf_hold(fbuf_t *buf)
+{
+    ATOMIC_INC(&buf->refcnt);
+}
+
+/*****************************************************************************
+ * fbuf_put()
+ *
+ * 受信バッファの参照を 1 つ外す。最後の参照だった場合は、プールに戻す。
+ * プールに FPOOL_MAX 個の空きがあれば解放する。
+ *
+ *  引数：
+ *          pool : 呼び出したワーカーのプール
+ *          buf  : 受信バッファ
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+fbuf_put(fpool_t *pool, fbuf_t *buf)
+{
+    if (ATOMIC_DEC_NV(&buf->refcnt) != 0)
+        return;
+    if (pool->nfree >= FPOOL_MAX){
+        free(buf);
+        return;
+    }
+    buf->next = pool->free;
+    pool->free = buf;
+    pool->nfree++;
+}
+
+/*****************************************************************************
+ * txq_init()
+ *
+ * 送信キューを初期化する。
+ *
+ *  引数：
+ *          txq       : 送信キュー
+ *          maxframes : 保持する最大フレーム数
+ *          maxbytes  : 保持する最大バイト数
+ *          policy    : 上限を超えた時の破棄のポリシー（TXQ_DROP_TAIL, TXQ_DROP_HEAD）
+ *          pool      : 破棄したフレームのバッファを戻すプール
+ *  戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+int
+txq_init(txq_t *txq, int maxframes, int maxbytes, int policy, fpool_t *pool)
+{
+    memset(txq, 0x0, sizeof(txq_t));
+    if ((txq->ring = (frame_t *)malloc(maxframes * sizeof(frame_t))) == NULL)
+        return(-1);
+    txq->size = maxframes;
+    txq->maxbytes = maxbytes;
+    txq->policy = policy;
+    txq->pool = pool;
+    return(0);
+}
+
+/*****************************************************************************
+ * txq_destroy()
+ *
+ * 送信キューに残っているフレームの参照をすべて外す。
+ *****************************************************************************/
+void
+txq_destroy(txq_t *txq)
+{
+    frame_t frame;
+
+    if (txq->cur.buf != NULL)
+        fbuf_put(txq->pool, txq->cur.buf);
+    txq->cur.buf = NULL;
+    while (txq_dequeue(txq, &frame) == 0)
+        fbuf_put(txq->pool, frame.buf);
+    if (txq->pack != NULL)
+        fbuf_put(txq->pool, txq->pack);
+    txq->pack = NULL;
+    free(txq->ring);
+    txq->ring = NULL;
+}
+
+/*****************************************************************************
+ * txq_pack()
+ *
+ * フレームをキュー専用のバッファ（pack）の末尾にコピーし、frame が pack を
+ * 参照するように書き換える。元の受信バッファの参照は外す。pack に空きが
+ * 無ければ新しいバッファに替えるが、参照している受信バッファがキューの
+ * 上限を超える場合は替えない。
+ *
+ *  引数：
+ *          txq   : 送信キュー
+ *          frame : コピーするフレーム
+ *  戻り値：
+ *          正常時 : 0
+ *          障害時 : -1（frame は変更しない）
+ *****************************************************************************/
+static int
+txq_pack(txq_t *txq, frame_t *frame)
+{
+    if (txq->pack == NULL || txq->packlen + frame->len > sizeof(txq->pack->data)){
+        if ((txq->runs + 1) * (int)sizeof(fbuf_t) > txq->maxbytes)
+            return(-1);
+        if (txq->pack != NULL)
+            fbuf_put(txq->pool, txq->pack);
+        if ((txq->pack = fbuf_get(txq->pool)) == NULL)
+            return(-1);
+        txq->packlen = 0;
+    }
+    memcpy(txq->pack->data + txq->packlen, frame->data, frame->len);
+    fbuf_put(txq->pool, frame->buf);
+    fbuf_hold(txq->pack);
+    frame->buf = txq->pack;
+    frame->data = txq->pack->data + txq->packlen;
+    txq->packlen += frame->len;
+    return(0);
+}
+
+/*****************************************************************************
+ * txq_enqueue()
+ *
+ * フレームを送信キューの末尾に入れる。上限を超える場合はポリシーに従って
+ * フレームを破棄する。送信途中のフレーム（cur）は上限に含めず、破棄も
+ * しない。
+ * 上限はフレームのサイズで数えるが、キューが参照している受信バッファが
+ * 上限の半分を超えたら、別の受信バッファのフレームは pack にコピーして
+ * から入れる。pack も上限まで使い切っていれば破棄する。
+ * 送信を依頼済みのフレーム（busy）がある間は、drop-head でも新しい
+ * フレームを破棄する。
+ *
+ *  引数：
+ *          txq   : 送信キュー
+ *          frame : キューに入れるフレーム。受信バッファの参照はキューに移る
+ *  戻り値：
+ *          キューに入れた   : 0
+ *          frame を破棄した : -1
+ *****************************************************************************/
+int
+txq_enqueue(txq_t *txq, frame_t *frame)
+{
+    frame_t  old;
+    fbuf_t  *tail;
+
+    if (txq->policy == TXQ_DROP_HEAD){
+        /* 古いフレームを捨てて空きを作る。送信を依頼済みのフレームは捨てない */
+        while (txq->busy == 0 && txq->count > 0 &&
+               (txq->count >= txq->size || txq->bytes + frame->len > txq->maxbytes)){
+            txq_dequeue(txq, &old);
+            txq->drop_frames++;
+            txq->drop_bytes += old.len;
+            fbuf_put(txq->pool, old.buf);
+        }
+    }
+    if (txq->count >= txq->size || txq->bytes + frame->len > txq->maxbytes)
+        goto drop;
+
+    tail = txq->count > 0 ? txq->ring[(txq->head + txq->count - 1) % txq->size].buf : NULL;
+    if (tail != NULL && tail != frame->buf &&
+        (txq->runs + 1) * (int)sizeof(fbuf_t) > txq->maxbytes / 2){
+        /* 受信バッファをこれ以上キューに留めず、コピーする */
+        if (txq_pack(txq, frame) < 0)
+            goto drop;
+    }
+
+    if (tail != frame->buf)
+        txq->runs++;
+    txq->ring[(txq->head + txq->count) % txq->size] = *frame;
+    txq->count++;
+    txq->bytes += frame->len;
+    return(0);
+
+drop:
+    txq->drop_frames++;
+    txq->drop_bytes += frame->len;
+    fbuf_put(txq->pool, frame->buf);
+    return(-1);
+}
+
+/*****************************************************************************
+ * txq_dequeue()
+ *
+ * 送信キューの先頭のフレームを取り出す。受信バッファの参照は呼び出し側に
+ * 移る。キューが空になったら pack の参照を外す。
+ *
+ *  戻り値：
+ *          取り出した : 0
+ *          キューが空 : -1
+ *****************************************************************************/
+int
+txq_dequeue(txq_t *txq, frame_t *frame)
+{
+    if (txq->count == 0)
+        return(-1);
+    *frame = txq->ring[txq->head];
+    txq->bytes -= frame->len;
+    txq->head = (txq->head + 1) % txq->size;
+    txq->count--;
+    if (txq->count == 0 || txq->ring[txq->head].buf != frame->buf)
+        txq->runs--;
+    if (txq->count == 0 && txq->pack != NULL){
+        /* キューが空になれば、次に詰まるまで pack は要らない */
+        fbuf_put(txq->pool, txq->pack);
+        txq->pack = NULL;
+    }
+    return(0);
+}
+
+/*****************************************************************************
+ * txq_full()
+ *
+ * len バイトのフレームを入れると、送信キューが上限を超えるかどうか。
+ *****************************************************************************/
+int
+txq_full(txq_t *txq, int len)
+{
+    return(txq->count >= txq->size || txq->bytes + len > txq->maxbytes);
+}
+
+/*****************************************************************************
+ * txq_iov()
+ *
+ * 送信途中のフレームと送信キューの先頭からのフレームを、writev() に渡す
+ * iovec の配列にまとめる。フレームは取り出さない。送信した分は
+ * txq_consume() で取り除く。
+ * *pos が -1 なら送信途中のフレームと ring の先頭から、0 以上なら ring の
+ * *pos 番目のフレームからまとめ、次にまとめるフレームの位置を *pos に返す。
+ * 続けて呼べば、続きのフレームを別の iovec の配列にまとめられる。
+ *
+ *  引数：
+ *          txq      : 送信キュー
+ *          pos      : まとめ始める位置。次の位置が返る
+ *          iov      : iovec の配列
+ *          maxiov   : iov の要素数
+ *          maxbytes : まとめる最大バイト数（少なくとも 1 フレームはまとめる）
+ *  戻り値：
+ *          iov に入れた要素数。送信するものが無ければ 0
+ *****************************************************************************/
+int
+txq_iov(txq_t *txq, int *pos, struct iovec *iov, int maxiov, int maxbytes)
+{
+    frame_t *frame;
+    int      i, niov = 0, bytes = 0;
+
+    if (*pos < 0){
+        *pos = 0;
+        if (txq->cur.buf != NULL){
+            iov[0].iov_base = (char *)txq->cur.data + txq->off;
+            iov[0].iov_len = txq->cur.len - txq->off;
+            bytes = iov[0].iov_len;
+            niov = 1;
+        }
+    }
+    for (i = *pos ; i < txq->count && bytes < maxbytes ; i++){
+        frame = &txq->ring[(txq->head + i) % txq->size];
+        if (niov > 0 &&
+            (unsigned char *)iov[niov - 1].iov_base + iov[niov - 1].iov_len == frame->data){
+            /* 直前のフレームに続いているので、同じ iovec に含める */
+            iov[niov - 1].iov_len += frame->len;
+        } else {
+            if (niov == maxiov)
+                break;
+            iov[niov].iov_base = (char *)frame->data;
+            iov[niov].iov_len = frame->len;
+            niov++;
+        }
+        bytes += frame->len;
+    }
+    *pos = i;
+    return(niov);
+}
+
+/*****************************************************************************
+ * txq_consume()
+ *
+ * 送信できた len バイト分のフレームを送信キューから取り除き、受信バッファ
+ * の参照を外す。途中まで送信できたフレームは送信途中のフレーム（cur）に
+ * する。hist が NULL でなければ、最後まで送信できたフレームの受信から
+ * 送信までの時間を記録する。
+ *
+ *  引数：
+ *          txq : 送信キュー
+ *          len : 送信できたバイト数
+ *          hist: 遅延のヒストグラム、または NULL
+ *          now : 送信した時刻（ナノ秒）
+ *  戻り値：
+ *          最後まで送信できたフレーム数
+ *****************************************************************************/
+int
+txq_consume(txq_t *txq, int len, hist_t *hist, uint64_t now)
+{
+    int remain, nframes = 0;
+
+    while (len > 0){
+        if (txq->cur.buf == NULL){
+            if (txq_dequeue(txq, &txq->cur) < 0)
+                break;
+            txq->off = 0;
+            if (txq->busy > 0)
+                txq->busy--;
+        }
+        remain = txq->cur.len - txq->off;
+        if (len < remain){
+            txq->off += len;
+            break;
+        }
+        len -= remain;
+        if (hist != NULL && txq->cur.ts != 0)
+            hist_record(hist, now > txq->cur.ts ? now - txq->cur.ts : 0);
+        fbuf_put(txq->pool, txq->cur.buf);
+        txq->cur.buf = NULL;
+        nframes++;
+    }
+    return(nframes);
+}
+
+/*****************************************************************************
+ * spsc_create()
+ *
+ * ワーカー間でフレームを渡すリングを作成する。
+ *
+ *  引数：
+ *          size : 要素数（2 のべき乗）
+ *  戻り値：
+ *          正常時 : spsc 構造体のポインタ
+ *          障害時 : NULL
+ *****************************************************************************/
+spsc_t *
+spsc_create(int size)
+{
+    spsc_t *ring;
+
+    if ((ring = (spsc_t *)malloc(sizeof(spsc_t))) == NULL)
+        return(NULL);
+    memset(ring, 0x0, sizeof(spsc_t));
+    if ((ring->slot = (frame_t *)malloc(size * sizeof(frame_t))) == NULL){
+        free(ring);
+        return(NULL);
+    }
+    ring->mask = size - 1;
+    return(ring);
+}
+
+/*****************************************************************************
+ * spsc_push()
+ *
+ * フレームをリングに入れる。生産側のスレッドだけが呼ぶ。
+ *
+ *  引数：
+ *          ring  : リング
+ *          frame : 入れるフレーム。受信バッファの参照はリングに移る
+ *  戻り値：
+ *          正常時         : 0
+ *          リングが一杯   : -1（参照は呼び出し側に残る）
+ *****************************************************************************/
+int
+spsc_push(spsc_t *ring, frame_t *frame)
+{
+    uint32_t tail = ring->tail;
+
+    /* 消費側が slot を読み終えたのを確かめてから書き込む */
+    if (tail - LOAD_ACQUIRE(&ring->head) > ring->mask)
+        return(-1);
+    ring->slot[tail & ring->mask] = *frame;
+    /* slot への書き込みが tail の更新より先に見えるようにする */
+    STORE_RELEASE(&ring->tail, tail + 1);
+    return(0);
+}
+
+/*****************************************************************************
+ * spsc_pop()
+ *
+ * リングの先頭のフレームを取り出す。消費側のスレッドだけが呼ぶ。
+ * 受信バッファの参照は呼び出し側に移る。
+ *
+ *  戻り値：
+ *          取り出した : 0
+ *          リングが空 : -1
+ *****************************************************************************/
+int
+spsc_pop(spsc_t *ring, frame_t *frame)
+{
+    uint32_t head = ring->head;
+
+    /* tail を読んでから slot を読む */
+    if (head == LOAD_ACQUIRE(&ring->tail))
+        return(-1);
+    *frame = ring->slot[head & ring->mask];
+    /* slot を読み終えてから空きとして見せる */
+    STORE_RELEASE(&ring->head, head + 1);
+    return(0);
+}
@@ -0,0 +1,463 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright (c) 1986, 2010, Oracle and/or its affiliates. All rights reserved.
+ */
+
+/*
+ * Copright (c) 2004-2010  Kazuyoshi Aizawa <admin2@whiteboard.ne.jp>
+ * All rights reserved.
+ */
+/****************************************************************************
+ * stehub_stats.c
+ *
+ * 仮想ハブ（stehub）の統計情報の出力。
+ * -A で指定された UNIX ドメインソケットで接続を待ち、ワーカー毎、
+ * ドメイン毎、ポート毎のカウンタと、受信から送信までの遅延の
+ * パーセンタイルをテキストか JSON で返す。
+ * 接続してきたクライアントが最初の 1 行で "json" を送れば JSON、
+ * それ以外（"text" や、何も送らずに STATS_TIMEOUT 秒経った場合）は
+ * テキストで返し、切断する。
+ *
+ *   echo json | nc -U /var/run/stehub.sock
+ *
+ * 接続は専用のスレッドで 1 つずつ処理する。カウンタはそれぞれのワーカー
+ * だけが書き換え、ポートの conn_stat は受け持つワーカーが解放するので、
+ * ポートのカウンタは hub_stats() でワーカー自身にコピーさせる。転送の
+ * 処理でロックを取ることは無い。
+ *
+ *****************************************************************************/
+
+#ifdef STE_WINDOWS
+#include <winsock2.h>   /* for windows */
+#include <Windows.h>    /* for windows */
+#else
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "sted.h"
+#include "stehub.h"
+
+/*
+ * 出力を組み立てるバッファ
+ */
+typedef struct sbuf
+{
+    char         *buf;
+    int           len;
+    int           size;
+} sbuf_t;
+
+/*
+ * 統計情報を返すスレッドの引数
+ */
+typedef struct stats_arg
+{
+    int           fd;        /* listen している socket */
+    dtab_t       *dtab;      /* ドメインの表 */
+} stats_arg_t;
+
+static void *stats_main(void *);
+static void  stats_serve(int, dtab_t *);
+static int   stats_request(int, char *, int);
+static void  stats_text(sbuf_t *, wstat_t *, int, dstat_t *, int, pstat_t *, int, hist_t *);
+static void  stats_json(sbuf_t *, wstat_t *, int, dstat_t *, int, pstat_t *, int, hist_t *);
+static void  sbuf_printf(sbuf_t *, char *, ...);
+
+/*****************************************************************************
+ * stats_open()
+ *
+ * 統計情報の要求を待ち受ける UNIX ドメインソケットを作成する。
+ * 同じパスのファイルが残っていれば削除する。
+ *
+ *  引数：
+ *          path : ソケットのパス
+ *  戻り値：
+ *          正常時 : listen している socket 番号
+ *          障害時 : -1
+ *****************************************************************************/
+int
+stats_open(char *path)
+{
+#ifdef STE_WINDOWS
+    print_err(LOG_ERR, "stats_open: UNIX domain socket is not supported\n");
+    return(-1);
+#else
+    struct sockaddr_un addr;
+    int                fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)){
+        print_err(LOG_ERR, "stats_open: %s: path too long\n", path);
+        return(-1);
+    }
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0){
+        print_err(LOG_ERR, "stats_open: socket: %s\n", strerror(errno));
+        return(-1);
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+        print_err(LOG_ERR, "stats_open: bind: %s: %s\n", path, strerror(errno));
+        close(fd);
+        return(-1);
+    }
+    if (listen(fd, 5) < 0){
+        print_err(LOG_ERR, "stats_open: listen: %s\n", strerror(errno));
+        close(fd);
+        return(-1);
+    }
+    return(fd);
+#endif
+}
+
+/*****************************************************************************
+ * stats_start()
+ *
+ * 統計情報を返すスレッドを起動する。スレッドは fork() 後の子プロセスに
+ * 引き継がれないので、バックグラウンドに移行した後で呼ぶ。
+ *
+ *  引数：
+ *          fd   : stats_open() で作成した socket
+ *          dtab : ドメインの表
+ *  戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+int
+stats_start(int fd, dtab_t *dtab)
+{
+    stats_arg_t *arg;
+    pthread_t    thread;
+
+    if ((arg = (stats_arg_t *)malloc(sizeof(stats_arg_t))) == NULL)
+        return(-1);
+    arg->fd = fd;
+    arg->dtab = dtab;
+    if (pthread_create(&thread, NULL, stats_main, (void *)arg) != 0){
+        print_err(LOG_ERR, "stats_start: can't create thread\n");
+        free(arg);
+        return(-1);
+    }
+    pthread_detach(thread);
+    return(0);
+}
+
+/*****************************************************************************
+ * stats_main()
+ *
+ * 統計情報を返すスレッドのメインループ。
+ *****************************************************************************/
+static void *
+stats_main(void *p)
+{
+    stats_arg_t *arg = (stats_arg_t *)p;
+    int          fd;
+
+    for (;;){
+        if ((fd = accept(arg->fd, NULL, NULL)) < 0){
+            SET_ERRNO();
+            if (errno != EINTR && errno != ECONNABORTED)
+                print_err(LOG_ERR, "stats_main: accept: %s\n", strerror(errno));
+            continue;
+        }
+        stats_serve(fd, arg->dtab);
+        CLOSE(fd);
+    }
+    return(NULL);
+}
+
+/*****************************************************************************
+ * stats_serve()
+ *
+ * 1 つの要求に統計情報を返す。
+ *****************************************************************************/
+static void
+stats_serve(int fd, dtab_t *dtab)
+{
+    char      req[64];
+    sbuf_t    sb;
+    wstat_t  *wstats;
+    dstat_t  *dstats = NULL;
+    pstat_t  *pstats = NULL;
+    hist_t    lat;
+    int       nw, nd, np, off, n;
+
+    memset(&sb, 0x0, sizeof(sb));
+    stats_request(fd, req, sizeof(req));
+    if (req[0] != '\0' && strcmp(req, "json") != 0 && strcmp(req, "text") != 0){
+        sbuf_printf(&sb, "unknown request: %s (json or text)\n", req);
+    } else if ((nd = dtab_stats(dtab, &dstats)) < 0 ||
+               (np = hub_stats(&pstats, &wstats, &nw, &lat)) < 0){
+        sbuf_printf(&sb, "can't get statistics\n");
+    } else if (strcmp(req, "json") == 0){
+        stats_json(&sb, wstats, nw, dstats, nd, pstats, np, &lat);
+    } else {
+        stats_text(&sb, wstats, nw, dstats, nd, pstats, np, &lat);
+    }
+    free(dstats);
+    free(pstats);
+
+    for (off = 0 ; off < sb.len ; off += n){
+        if ((n = send(fd, sb.buf + off, sb.len - off, 0)) <= 0){
+            SET_ERRNO();
+            if (n < 0 && errno == EINTR){
+                n = 0;
+                continue;
+            }
+            break;
+        }
+    }
+    free(sb.buf);
+}
+
+/*****************************************************************************
+ * stats_request()
+ *
+ * 要求の 1 行目を読む。前後の空白と改行は取り除く。STATS_TIMEOUT 秒
+ * 待っても 1 行揃わなければ、そこまでに読んだものを要求とする。
+ *
+ *  引数：
+ *          fd   : クライアントとの socket
+ *          req  : 要求を入れるバッファ
+ *          size : req のサイズ
+ *  戻り値：
+ *          要求の長さ
+ *****************************************************************************/
+static int
+stats_request(int fd, char *req, int size)
+{
+    struct timeval tv;
+    fd_set         fds;
+    char          *p;
+    int            len = 0, n;
+
+    while (len < size - 1 && memchr(req, '\n', len) == NULL){
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        tv.tv_sec = STATS_TIMEOUT;
+        tv.tv_usec = 0;
+        if (select(fd + 1, &fds, NULL, NULL, &tv) <= 0)
+            break;
+        if ((n = recv(fd, req + len, size - 1 - len, 0)) <= 0)
+            break;
+        len += n;
+    }
+    req[len] = '\0';
+    if ((p = strpbrk(req, "\r\n")) != NULL)
+        *p = '\0';
+    for (p = req ; *p == ' ' || *p == '\t' ; p++)
+        ;
+    memmove(req, p, strlen(p) + 1);
+    for (len = strlen(req) ; len > 0 && (req[len - 1] == ' ' || req[len - 1] == '\t') ; len--)
+        req[len - 1] = '\0';
+    return(len);
+}
+
+/*****************************************************************************
+ * stats_text()
+ *
+ * 統計情報をテキストの表にする。
+ *****************************************************************************/
+static void
+stats_text(sbuf_t *sb, wstat_t *wstats, int nw, dstat_t *dstats, int nd,
+           pstat_t *pstats, int np, hist_t *lat)
+{
+    pstat_t *ps;
+    char     net[16];
+    int      i;
+
+    sbuf_printf(sb, "%-6s %12s %12s %12s\n", "WORKER", "MALFORMED", "RING_DROPS", "CLOSED");
+    for (i = 0 ; i < nw ; i++){
+        sbuf_printf(sb, "%-6d %12llu %12llu %12llu\n", i,
+                    (unsigned long long)wstats[i].rx_malformed,
+                    (unsigned long long)wstats[i].ring_drops,
+                    (unsigned long long)wstats[i].closed);
+    }
+
+    sbuf_printf(sb, "\n%-8s %12s %10s %10s %10s %10s\n", "LATENCY", "FRAMES",
+                "P50_US", "P99_US", "P999_US", "MAX_US");
+    sbuf_printf(sb, "%-8s %12llu %10.1f %10.1f %10.1f %10.1f\n", "all",
+                (unsigned long long)lat->total,
+                hist_value(lat, 0.5) / 1000.0, hist_value(lat, 0.99) / 1000.0,
+                hist_value(lat, 0.999) / 1000.0, lat->max / 1000.0);
+
+    sbuf_printf(sb, "\n%-10s %6s %6s %12s %14s %12s %12s %12s\n", "NETWORK", "PORTS", "MACS",
+                "RX_FRAMES", "RX_BYTES", "UNICAST", "FLOOD", "STORM_DROPS");
+    for (i = 0 ; i < nd ; i++){
+        sbuf_printf(sb, "%-10u %6d %6d %12llu %14llu %12llu %12llu %12llu\n",
+                    dstats[i].id, dstats[i].nports, dstats[i].nmacs,
+                    (unsigned long long)dstats[i].rx_frames,
+                    (unsigned long long)dstats[i].rx_bytes,
+                    (unsigned long long)dstats[i].unicast_frames,
+                    (unsigned long long)dstats[i].flood_frames,
+                    (unsigned long long)dstats[i].storm_drops);
+    }
+
+    sbuf_printf(sb, "\n%-6s %-6s %-16s %-10s %12s %14s %12s %14s %12s %12s %10s %10s %10s %8s %10s"
+                " %10s %10s %10s %10s\n",
+                "PORT", "WORKER", "ADDRESS", "NETWORK", "RX_FRAMES", "RX_BYTES", "TX_FRAMES",
+                "TX_BYTES", "UNICAST", "FLOOD", "Q_DROPS", "S_DROPS", "BLOCKED",
+                "TXQ", "TXQ_BYTES", "P50_US", "P99_US", "P999_US", "MAX_US");
+    for (i = 0 ; i < np ; i++){
+        ps = &pstats[i];
+        if (ps->joined)
+            sprintf(net, "%u%s", ps->network, ps->trunk ? "(t)" : "");
+        else
+            sprintf(net, "-%s", ps->trunk ? "(t)" : "");
+        sbuf_printf(sb, "%-6d %-6d %-16s %-10s %12llu %14llu %12llu %14llu %12llu %12llu %10llu %10llu %10llu %8d %10d"
+                    " %10.1f %10.1f %10.1f %10.1f\n",
+                    ps->fd, ps->worker, ps->addr, net,
+                    (unsigned long long)ps->rx_frames,
+                    (unsigned long long)ps->rx_bytes,
+                    (unsigned long long)ps->tx_frames,
+                    (unsigned long long)ps->tx_bytes,
+                    (unsigned long long)ps->rx_unicast,
+                    (unsigned long long)ps->rx_flood,
+                    (unsigned long long)ps->drop_queue,
+                    (unsigned long long)ps->drop_storm,
+                    (unsigned long long)ps->tx_blocked,
+                    ps->txq_frames, ps->txq_bytes,
+                    ps->lat_p50 / 1000.0, ps->lat_p99 / 1000.0,
+                    ps->lat_p999 / 1000.0, ps->lat_max / 1000.0);
+    }
+}
+
+/*****************************************************************************
+ * stats_json()
+ *
+ * 統計情報を JSON にする。
+ *****************************************************************************/
+static void
+stats_json(sbuf_t *sb, wstat_t *wstats, int nw, dstat_t *dstats, int nd,
+           pstat_t *pstats, int np, hist_t *lat)
+{
+    pstat_t *ps;
+    int      i;
+
+    sbuf_printf(sb, "{\"workers\":[");
+    for (i = 0 ; i < nw ; i++){
+        sbuf_printf(sb, "%s{\"id\":%d,\"rx_malformed\":%llu,\"ring_drops\":%llu,\"closed\":%llu}",
+                    i > 0 ? "," : "", i,
+                    (unsigned long long)wstats[i].rx_malformed,
+                    (unsigned long long)wstats[i].ring_drops,
+                    (unsigned long long)wstats[i].closed);
+    }
+
+    sbuf_printf(sb, "],\n\"latency_ns\":{\"count\":%llu,\"p50\":%llu,\"p99\":%llu,"
+                "\"p999\":%llu,\"max\":%llu}",
+                (unsigned long long)lat->total,
+                (unsigned long long)hist_value(lat, 0.5),
+                (unsigned long long)hist_value(lat, 0.99),
+                (unsigned long long)hist_value(lat, 0.999),
+                (unsigned long long)lat->max);
+
+    sbuf_printf(sb, ",\n\"networks\":[");
+    for (i = 0 ; i < nd ; i++){
+        sbuf_printf(sb, "%s{\"id\":%u,\"ports\":%d,\"macs\":%d,\"rx_frames\":%llu,"
+                    "\"rx_bytes\":%llu,\"unicast_frames\":%llu,\"flood_frames\":%llu,"
+                    "\"storm_drops\":%llu}",
+                    i > 0 ? ",\n" : "", dstats[i].id, dstats[i].nports, dstats[i].nmacs,
+                    (unsigned long long)dstats[i].rx_frames,
+                    (unsigned long long)dstats[i].rx_bytes,
+                    (unsigned long long)dstats[i].unicast_frames,
+                    (unsigned long long)dstats[i].flood_frames,
+                    (unsigned long long)dstats[i].storm_drops);
+    }
+
+    sbuf_printf(sb, "],\n\"ports\":[");
+    for (i = 0 ; i < np ; i++){
+        ps = &pstats[i];
+        sbuf_printf(sb, "%s{\"fd\":%d,\"worker\":%d,\"addr\":\"%s\",\"trunk\":%s,",
+                    i > 0 ? ",\n" : "", ps->fd, ps->worker, ps->addr,
+                    ps->trunk ? "true" : "false");
+        if (ps->joined)
+            sbuf_printf(sb, "\"network\":%u,", ps->network);
+        else
+            sbuf_printf(sb, "\"network\":null,");
+        sbuf_printf(sb, "\"rx_frames\":%llu,\"rx_bytes\":%llu,\"tx_frames\":%llu,"
+                    "\"tx_bytes\":%llu,\"unicast_frames\":%llu,\"flood_frames\":%llu,"
+                    "\"drops\":{\"queue_full\":%llu,\"storm\":%llu},\"tx_blocked\":%llu,"
+                    "\"txq_frames\":%d,\"txq_bytes\":%d,\"latency_ns\":{\"count\":%llu,"
+                    "\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}}",
+                    (unsigned long long)ps->rx_frames,
+                    (unsigned long long)ps->rx_bytes,
+                    (unsigned long long)ps->tx_frames,
+                    (unsigned long long)ps->tx_bytes,
+                    (unsigned long long)ps->rx_unicast,
+                    (unsigned long long)ps->rx_flood,
+                    (unsigned long long)ps->drop_queue,
+                    (unsigned long long)ps->drop_storm,
+                    (unsigned long long)ps->tx_blocked,
+                    ps->txq_frames, ps->txq_bytes,
+                    (unsigned long long)ps->lat_count,
+                    (unsigned long long)ps->lat_p50,
+                    (unsigned long long)ps->lat_p99,
+                    (unsigned long long)ps->lat_p999,
+                    (unsigned long long)ps->lat_max);
+    }
+    sbuf_printf(sb, "]}\n");
+}
+
+/*****************************************************************************
+ * sbuf_printf()
+ *
+ * バッファの末尾に書式付きで文字列を追加する。バッファは必要なら広げる。
+ * 広げられなければ、追加しない。
+ *****************************************************************************/
+static void
+sbuf_printf(sbuf_t *sb, char *format, ...)
+{
+    va_list  ap;
+    char    *buf;
+    int      n, size;
+
+    for (;;){
+        if (sb->size - sb->len > 1){
+            va_start(ap, format);
+            n = vsnprintf(sb->buf + sb->len, sb->size - sb->len, format, ap);
+            va_end(ap);
+            if (n >= 0 && n < sb->size - sb->len){
+                sb->len += n;
+                return;
+            }
+        }
+        size = sb->size > 0 ? sb->size * 2 : 4096;
+        if ((buf = (char *)realloc(sb->buf, size)) == NULL)
+            return;
+        sb->buf = buf;
+        sb->size = size;
+    }
+}
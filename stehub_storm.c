@@ -0,0 +1,190 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright (c) 1986, 2010, Oracle and/or its affiliates. All rights reserved.
+ */
+
+/*
+ * Copright (c) 2004-2010  Kazuyoshi Aizawa <admin2@whiteboard.ne.jp>
+ * All rights reserved.
+ */
+/****************************************************************************
+ * stehub_storm.c
+ *
+ * 仮想ハブ（stehub）のストーム制御。
+ * 全ポートに送信されるフレーム（ブロードキャスト、マルチキャスト、
+ * 未学習のユニキャスト）の量を、種類毎に 1 秒あたりのフレーム数と
+ * バイト数で制限する。1 つのポートが大量のブロードキャストを送って
+ * きても、仮想ハブが全ポートに送信する量は上限の範囲に収まる。
+ *
+ * レートの制限には GCRA（Generic Cell Rate Algorithm）を使う。状態は
+ * 「上限ちょうどのレートで受け付けてきた場合に、次のフレームが来るはず
+ * の時刻」（TAT）1 つだけで、フレームを受け付ける度にフレームのコストの
+ * 分だけ TAT を進める。TAT が現在時刻より STORM_BURST 以上先になる
+ * フレームは破棄する。トークンバケツと同じ動きになるが、補充の処理が
+ * 要らず、状態が 64bit 1 つなので複数のワーカーが共有する場合も
+ * compare-and-swap だけで更新できる。
+ *
+ *****************************************************************************/
+
+#ifndef STE_WINDOWS
+#include <syslog.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <inttypes.h>
+#include "sted.h"
+#include "stehub.h"
+
+static char *storm_names[STORM_KINDS] = { "bcast", "mcast", "unknown" };
+
+static int storm_take(uint64_t *, uint64_t, uint64_t, int);
+
+/*****************************************************************************
+ * storm_parse()
+ *
+ * "kind=frames[:bytes]" の形式の指定を読み取り、上限を設定する。
+ * kind は bcast、mcast、unknown のいづれか。
+ *
+ *  引数：
+ *          storm : 設定する上限
+ *          arg   : 指定された文字列
+ *  戻り値：
+ *          正常時 : 0
+ *          不正な指定 : -1
+ *****************************************************************************/
+int
+storm_parse(storm_t *storm, char *arg)
+{
+    char *p;
+    int   kind;
+
+    if ((p = strchr(arg, '=')) == NULL)
+        return(-1);
+    for (kind = 0 ; kind < STORM_KINDS ; kind++){
+        if (strncmp(arg, storm_names[kind], p - arg) == 0 &&
+            storm_names[kind][p - arg] == '\0')
+            break;
+    }
+    if (kind == STORM_KINDS)
+        return(-1);
+    storm->frames[kind] = strtoul(p + 1, NULL, 10);
+    storm->bytes[kind] = 0;
+    if ((p = strchr(p + 1, ':')) != NULL)
+        storm->bytes[kind] = strtoul(p + 1, NULL, 10);
+    return(0);
+}
+
+/*****************************************************************************
+ * storm_enabled()
+ *
+ * 上限が 1 つでも設定されているかどうか。
+ *****************************************************************************/
+int
+storm_enabled(storm_t *storm)
+{
+    int kind;
+
+    for (kind = 0 ; kind < STORM_KINDS ; kind++){
+        if (storm->frames[kind] != 0 || storm->bytes[kind] != 0)
+            return(1);
+    }
+    return(0);
+}
+
+/*****************************************************************************
+ * storm_kind()
+ *
+ * 全ポートに送信するフレームの種類を宛先 MAC アドレスから決める。
+ *****************************************************************************/
+int
+storm_kind(unsigned char *dst)
+{
+    static unsigned char bcast[ETHERADDRL] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+    if ((dst[0] & 0x01) == 0)
+        return(STORM_UNKNOWN);
+    if (memcmp(dst, bcast, ETHERADDRL) == 0)
+        return(STORM_BCAST);
+    return(STORM_MCAST);
+}
+
+/*****************************************************************************
+ * storm_allow()
+ *
+ * フレームを受け付けてよいかを、フレーム数とバイト数の両方の上限で
+ * 確かめる。受け付ける場合は、その分だけ状態を進める。
+ *
+ *  引数：
+ *          storm  : 上限
+ *          kind   : フレームの種類
+ *          tat    : 種類毎の状態（フレーム数とバイト数の 2 つ）
+ *          now    : 現在時刻（ナノ秒）
+ *          len    : フレームのサイズ
+ *          shared : 1 なら tat を複数のスレッドが共有している
+ *  戻り値：
+ *          受け付ける : 1
+ *          破棄する   : 0
+ *****************************************************************************/
+int
+storm_allow(storm_t *storm, int kind, uint64_t *tat, uint64_t now, int len, int shared)
+{
+    /*
+     * フレーム数が上限を超えていれば、バイト数の状態は進めない。
+     * バイト数で破棄した場合は、フレーム数の状態は進めたままになる。
+     */
+    if (storm->frames[kind] != 0 &&
+        !storm_take(&tat[0], now, 1000000000ULL / storm->frames[kind], shared))
+        return(0);
+    if (storm->bytes[kind] != 0 &&
+        !storm_take(&tat[1], now, (uint64_t)len * 1000000000ULL / storm->bytes[kind], shared))
+        return(0);
+    return(1);
+}
+
+/*****************************************************************************
+ * storm_take()
+ *
+ * GCRA で cost ナノ秒分を受け付ける。TAT が過去なら現在時刻から数える。
+ *
+ *  戻り値：
+ *          受け付けた : 1
+ *          上限を超える : 0
+ *****************************************************************************/
+static int
+storm_take(uint64_t *tatp, uint64_t now, uint64_t cost, int shared)
+{
+    uint64_t tat, newtat;
+
+    do {
+        tat = *(volatile uint64_t *)tatp;
+        newtat = (tat > now ? tat : now) + cost;
+        if (newtat - now > STORM_BURST)
+            return(0);
+        if (!shared){
+            *tatp = newtat;
+            return(1);
+        }
+    } while (!ATOMIC_CAS64(tatp, tat, newtat));
+    return(1);
+}